@@ -40,11 +40,13 @@ void ArgsParser::ParseArgs(int argc, char** argv) {
                         m_parsed_options[opt.short_name] = argv[i + 1];
                         i++;
                     }
+                    break; // the value must not be matched against the other options
                 } else if (argv[i][1] == '-' && strcmp(opt.option, &argv[i][2]) == 0) {
                     if (i + 1 < argc) {
                         m_parsed_options[opt.short_name] = argv[i + 1];
                         i++;
                     }
+                    break;
                 }
             }
         }
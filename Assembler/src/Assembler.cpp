@@ -22,7 +22,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 #include <util.h>
 
+#include <libarch/Executable.hpp>
 #include <libarch/Instruction.hpp>
+#include <string>
+#include <vector>
 
 Section::Section(char* name, uint64_t name_size, uint64_t offset)
     : m_name(name), m_name_size(name_size), m_offset(offset) {
@@ -44,7 +47,7 @@ uint64_t Section::GetOffset() const {
 }
 
 Assembler::Assembler()
-    : m_current_offset(0), m_buffer() {
+    : m_current_offset(0), m_buffer_offset(0), m_buffer() {
 }
 
 Assembler::~Assembler() {
@@ -54,10 +57,14 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
     using namespace InsEncoding;
     labels.Enumerate([&](Label* label) {
         label->blocks.Enumerate([&](Block* block) {
-            size_t name_size = label->name_size + block->name_size;
+            // sublabels are named "label.sublabel"
+            size_t name_size = label->name_size + (block->name_size > 0 ? block->name_size + 1 : 0);
             char* name = new char[name_size + 1];
             memcpy(name, label->name, label->name_size);
-            memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(name) + label->name_size), block->name, block->name_size);
+            if (block->name_size > 0) {
+                name[label->name_size] = '.';
+                memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(name) + label->name_size + 1), block->name, block->name_size);
+            }
             name[name_size] = '\0';
             Section* section = new Section(name, name_size, m_current_offset);
             m_sections.insert(section);
@@ -67,13 +74,18 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
                     Instruction* instruction = static_cast<Instruction*>(data->data);
                     uint8_t i_data[64] = {};
                     size_t bytes_written = EncodeInstruction(instruction, i_data, 64, m_current_offset);
-                    m_buffer.Write(m_current_offset, i_data, bytes_written);
+                    AddContentRange(m_code, m_current_offset, bytes_written);
+                    m_buffer.Write(m_buffer_offset, i_data, bytes_written);
                     m_current_offset += bytes_written;
+                    m_buffer_offset += bytes_written;
                 } else { // raw data
-                    switch (RawData* raw_data = static_cast<RawData*>(data->data); raw_data->type) {
+                    RawData* raw_data = static_cast<RawData*>(data->data);
+                    uint64_t start_offset = m_current_offset;
+                    switch (raw_data->type) {
                     case RawDataType::RAW:
-                        m_buffer.Write(m_current_offset, static_cast<uint8_t*>(raw_data->data), raw_data->data_size);
+                        m_buffer.Write(m_buffer_offset, static_cast<uint8_t*>(raw_data->data), raw_data->data_size);
                         m_current_offset += raw_data->data_size;
+                        m_buffer_offset += raw_data->data_size;
                         break;
                     case RawDataType::LABEL: {
                         Label* i_label = static_cast<Label*>(raw_data->data);
@@ -82,8 +94,9 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
                         *offset = m_current_offset;
                         i_block->jumps_to_here.insert(offset);
                         uint64_t temp_offset = 0xDEAD'BEEF'DEAD'BEEF;
-                        m_buffer.Write(m_current_offset, reinterpret_cast<uint8_t*>(&temp_offset), 8);
+                        m_buffer.Write(m_buffer_offset, reinterpret_cast<uint8_t*>(&temp_offset), 8);
                         m_current_offset += 8;
+                        m_buffer_offset += 8;
                         break;
                     }
                     case RawDataType::SUBLABEL: {
@@ -92,14 +105,16 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
                         *offset = m_current_offset;
                         i_block->jumps_to_here.insert(offset);
                         uint64_t temp_offset = 0xDEAD'BEEF'DEAD'BEEF;
-                        m_buffer.Write(m_current_offset, reinterpret_cast<uint8_t*>(&temp_offset), 8);
+                        m_buffer.Write(m_buffer_offset, reinterpret_cast<uint8_t*>(&temp_offset), 8);
                         m_current_offset += 8;
+                        m_buffer_offset += 8;
                         break;
                     }
                     case RawDataType::ASCII:
                     case RawDataType::ASCIIZ: // null terminator is already handled by the parser
-                        m_buffer.Write(m_current_offset, static_cast<uint8_t*>(raw_data->data), raw_data->data_size);
+                        m_buffer.Write(m_buffer_offset, static_cast<uint8_t*>(raw_data->data), raw_data->data_size);
                         m_current_offset += raw_data->data_size;
+                        m_buffer_offset += raw_data->data_size;
                         break;
                     case RawDataType::ALIGNMENT: {
                         uint64_t align = *static_cast<uint64_t*>(raw_data->data);
@@ -110,12 +125,23 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
                         uint8_t* i_data = new uint8_t[bytes_to_add];
                         uint8_t nop = static_cast<uint8_t>(Opcode::NOP);
                         memset(i_data, nop, bytes_to_add);
-                        m_buffer.Write(m_current_offset, i_data, bytes_to_add);
+                        m_buffer.Write(m_buffer_offset, i_data, bytes_to_add);
                         m_current_offset += bytes_to_add;
+                        m_buffer_offset += bytes_to_add;
                         delete[] i_data;
                         break;
                     }
+                    case RawDataType::RESERVE: {
+                        Reservation* reservation = new Reservation;
+                        reservation->offset = m_current_offset;
+                        reservation->size = *static_cast<uint64_t*>(raw_data->data);
+                        m_reservations.insert(reservation);
+                        m_current_offset += reservation->size;
+                        break;
+                    }
                     }
+                    if (raw_data->type != RawDataType::ALIGNMENT)
+                        AddContentRange(m_data, start_offset, m_current_offset - start_offset);
                 }
             });
         });
@@ -127,7 +153,7 @@ void Assembler::assemble(const LinkedList::RearInsertLinkedList<InsEncoding::Lab
             Section* section = m_sections.get(section_index);
             uint64_t real_offset = section->GetOffset() + base_address;
             block->jumps_to_here.Enumerate([&](uint64_t* offset) {
-                m_buffer.Write(*offset, reinterpret_cast<uint8_t*>(&real_offset), 8);
+                m_buffer.Write(GetBufferOffset(*offset), reinterpret_cast<uint8_t*>(&real_offset), 8);
             });
             section_index++;
         });
@@ -138,6 +164,176 @@ const Buffer& Assembler::GetBuffer() const {
     return m_buffer;
 }
 
+static bool WriteBufferRange(FILE* file, const Buffer& buffer, uint64_t offset, uint64_t size) {
+    if (size == 0)
+        return true;
+    uint8_t* data = new uint8_t[size];
+    buffer.Read(offset, data, size);
+    bool success = fwrite(data, 1, size, file) == size;
+    delete[] data;
+    return success;
+}
+
+static bool WriteZeros(FILE* file, uint64_t size) {
+    uint8_t zeros[4096] = {};
+    while (size > 0) {
+        uint64_t count = size > sizeof(zeros) ? sizeof(zeros) : size;
+        if (fwrite(zeros, 1, count, file) != count)
+            return false;
+        size -= count;
+    }
+    return true;
+}
+
+bool Assembler::WriteFlat(FILE* file) const {
+    uint64_t buffer_offset = 0;
+    bool success = true;
+    m_reservations.Enumerate([&](Reservation* reservation, uint64_t) -> bool {
+        uint64_t data_end = GetBufferOffset(reservation->offset);
+        if (!WriteBufferRange(file, m_buffer, buffer_offset, data_end - buffer_offset) || !WriteZeros(file, reservation->size)) {
+            success = false;
+            return false;
+        }
+        buffer_offset = data_end;
+        return true;
+    });
+    // the rest of the buffer, including any padding at the end of the last block, the same as before reservations existed
+    return success && WriteBufferRange(file, m_buffer, buffer_offset, m_buffer.GetSize() - buffer_offset);
+}
+
+bool Assembler::WriteExecutable(FILE* file, uint64_t base_address, uint64_t entry_point, bool include_symbols) const {
+    using namespace Executable;
+
+    // Split the output into segments. Data followed by reservations becomes a single segment with a zero filled tail.
+    std::vector<SegmentHeader> segments;
+    std::vector<uint64_t> buffer_offsets;
+    uint64_t offset = 0;
+    uint64_t buffer_offset = 0;
+    auto AddSegment = [&](uint64_t size) {
+        SegmentHeader segment = {};
+        segment.address = base_address + offset;
+        segment.fileSize = size;
+        segment.memorySize = size;
+        segments.push_back(segment);
+        buffer_offsets.push_back(buffer_offset);
+        offset += size;
+        buffer_offset += size;
+    };
+    m_reservations.Enumerate([&](Reservation* reservation, uint64_t) -> bool {
+        if (reservation->offset > offset || segments.empty())
+            AddSegment(reservation->offset - offset);
+        segments.back().memorySize += reservation->size;
+        offset += reservation->size;
+        return true;
+    });
+    if (m_current_offset > offset)
+        AddSegment(m_current_offset - offset);
+
+    // a segment mixing instructions and data gets both flags
+    for (SegmentHeader& segment : segments) {
+        uint64_t start = segment.address - base_address;
+        segment.flags = SF_READ;
+        if (Overlaps(m_code, start, start + segment.memorySize))
+            segment.flags |= SF_EXECUTE;
+        if (Overlaps(m_data, start, start + segment.memorySize))
+            segment.flags |= SF_WRITE;
+    }
+
+    std::vector<Symbol> symbols;
+    std::string strings;
+    if (include_symbols) {
+        m_sections.Enumerate([&](Section* section) {
+            Symbol symbol = {};
+            symbol.address = base_address + section->GetOffset();
+            symbol.nameOffset = strings.size();
+            symbol.nameSize = section->GetNameSize();
+            symbols.push_back(symbol);
+            strings.append(section->GetName(), section->GetNameSize());
+        });
+    }
+
+    Header header = {};
+    memcpy(header.magic, EXECUTABLE_MAGIC, EXECUTABLE_MAGIC_SIZE);
+    header.version = EXECUTABLE_VERSION;
+    header.headerSize = sizeof(Header);
+    header.segmentCount = segments.size();
+    header.entryPoint = entry_point;
+    header.segmentTableOffset = sizeof(Header);
+    header.symbolTableOffset = header.segmentTableOffset + segments.size() * sizeof(SegmentHeader);
+    header.stringTableOffset = header.symbolTableOffset + symbols.size() * sizeof(Symbol);
+    header.symbolCount = symbols.size();
+    header.stringTableSize = strings.size();
+
+    uint64_t file_offset = header.stringTableOffset + strings.size();
+    for (SegmentHeader& segment : segments) {
+        if (segment.fileSize == 0)
+            continue;
+        file_offset = ALIGN_UP_BASE2(file_offset, EXECUTABLE_SEGMENT_ALIGNMENT);
+        segment.fileOffset = file_offset;
+        file_offset += segment.fileSize;
+    }
+
+    if (fwrite(&header, sizeof(Header), 1, file) != 1)
+        return false;
+    if (!segments.empty() && fwrite(segments.data(), sizeof(SegmentHeader), segments.size(), file) != segments.size())
+        return false;
+    if (!symbols.empty() && fwrite(symbols.data(), sizeof(Symbol), symbols.size(), file) != symbols.size())
+        return false;
+    if (!strings.empty() && fwrite(strings.data(), 1, strings.size(), file) != strings.size())
+        return false;
+
+    uint64_t current_offset = header.stringTableOffset + strings.size();
+    for (uint64_t i = 0; i < segments.size(); i++) {
+        if (segments[i].fileSize == 0)
+            continue;
+        if (!WriteZeros(file, segments[i].fileOffset - current_offset) || !WriteBufferRange(file, m_buffer, buffer_offsets[i], segments[i].fileSize))
+            return false;
+        current_offset = segments[i].fileOffset + segments[i].fileSize;
+    }
+    return true;
+}
+
+bool Assembler::GetSymbolAddress(std::string_view name, uint64_t base_address, uint64_t& address) const {
+    bool found = false;
+    m_sections.Enumerate([&](Section* section, uint64_t) -> bool {
+        if (std::string_view(section->GetName(), section->GetNameSize()) == name) {
+            address = base_address + section->GetOffset();
+            found = true;
+            return false;
+        }
+        return true;
+    });
+    return found;
+}
+
+uint64_t Assembler::GetBufferOffset(uint64_t offset) const {
+    uint64_t reserved = 0;
+    m_reservations.Enumerate([&](Reservation* reservation, uint64_t) -> bool {
+        if (reservation->offset >= offset)
+            return false;
+        reserved += reservation->size;
+        return true;
+    });
+    return offset - reserved;
+}
+
+void Assembler::AddContentRange(std::vector<ContentRange>& ranges, uint64_t offset, uint64_t size) {
+    if (size == 0)
+        return;
+    if (!ranges.empty() && ranges.back().offset + ranges.back().size == offset)
+        ranges.back().size += size;
+    else
+        ranges.push_back({offset, size});
+}
+
+bool Assembler::Overlaps(const std::vector<ContentRange>& ranges, uint64_t start, uint64_t end) {
+    for (const ContentRange& range : ranges) {
+        if (range.offset < end && range.offset + range.size > start)
+            return true;
+    }
+    return false;
+}
+
 void Assembler::Clear() {
     m_buffer.Clear();
     m_sections.Enumerate([&](Section* section) {
@@ -145,7 +341,14 @@ void Assembler::Clear() {
         delete section;
     });
     m_sections.clear();
+    m_reservations.Enumerate([&](Reservation* reservation) {
+        delete reservation;
+    });
+    m_reservations.clear();
+    m_code.clear();
+    m_data.clear();
     m_current_offset = 0;
+    m_buffer_offset = 0;
 }
 
 [[noreturn]] void Assembler::error(const char* message, const std::string& file_name, size_t line) const {
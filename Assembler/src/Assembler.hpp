@@ -22,6 +22,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "LinkedList.hpp"
 
 #include <stdint.h>
+#include <stdio.h>
+
+#include <string_view>
+#include <vector>
 
 #include <libarch/Instruction.hpp>
 
@@ -42,6 +46,18 @@ private:
     uint64_t m_offset;
 };
 
+// Zero filled space from `resb`, which takes up no space in the buffer
+struct Reservation {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// A run of instructions or of data, used to pick the segment flags. Alignment padding is neither.
+struct ContentRange {
+    uint64_t offset;
+    uint64_t size;
+};
+
 class Assembler {
 public:
     Assembler();
@@ -51,15 +67,33 @@ public:
 
     const Buffer& GetBuffer() const;
 
+    // Write a flat image, with reservations filled with zeros
+    bool WriteFlat(FILE* file) const;
+
+    // Write an executable with one segment per run of data, reservations become zero filled segment space. Segments
+    // holding instructions are executable, and segments holding data or reservations are writable.
+    bool WriteExecutable(FILE* file, uint64_t base_address, uint64_t entry_point, bool include_symbols) const;
+
+    // name is either "label" or "label.sublabel"
+    bool GetSymbolAddress(std::string_view name, uint64_t base_address, uint64_t& address) const;
+
     void Clear();
 
 private:
+    uint64_t GetBufferOffset(uint64_t offset) const;
+
+    static void AddContentRange(std::vector<ContentRange>& ranges, uint64_t offset, uint64_t size);
+    static bool Overlaps(const std::vector<ContentRange>& ranges, uint64_t start, uint64_t end);
 
     [[noreturn]] void error(const char* message, const std::string& file_name, size_t line) const;
 
     uint64_t m_current_offset;
+    uint64_t m_buffer_offset;
     Buffer m_buffer;
     LinkedList::RearInsertLinkedList<Section> m_sections;
+    LinkedList::RearInsertLinkedList<Reservation> m_reservations;
+    std::vector<ContentRange> m_code;
+    std::vector<ContentRange> m_data; // including reservations
 };
 
 #endif /* _ASSEMBLER_HPP */
\ No newline at end of file
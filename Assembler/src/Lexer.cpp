@@ -297,7 +297,7 @@ void Lexer::AddToken(const std::string& str_token, const std::string& file_name,
         new_token->type = TokenType::RBRACKET;
     else if (lower_token == ",")
         new_token->type = TokenType::COMMA;
-    else if (lower_token == "db" || lower_token == "dw" || lower_token == "dd" || lower_token == "dq" || lower_token == "org" || lower_token == "ascii" || lower_token == "asciiz" || lower_token == "align")
+    else if (lower_token == "db" || lower_token == "dw" || lower_token == "dd" || lower_token == "dq" || lower_token == "org" || lower_token == "ascii" || lower_token == "asciiz" || lower_token == "align" || lower_token == "resb")
         new_token->type = TokenType::DIRECTIVE;
     else if (lower_token == "byte" || lower_token == "word" || lower_token == "dword" || lower_token == "qword")
         new_token->type = TokenType::SIZE;
@@ -32,6 +32,9 @@ int main(int argc, char** argv) {
 
     g_args->AddOption('p', "program", "Input program to assemble", true);
     g_args->AddOption('o', "output", "Output file", true);
+    g_args->AddOption('f', "format", "Output format. Valid values are \"flat\" (default) or \"executable\".", false);
+    g_args->AddOption('e', "entry", "Entry point label for executables. Defaults to the base address.", false);
+    g_args->AddOption('s', "symbols", "Include a symbol table in executables. Valid values are \"on\" (default) or \"off\".", false);
     g_args->AddOption('h', "help", "Print this help message", false);
 
     g_args->ParseArgs(argc, argv);
@@ -49,6 +52,26 @@ int main(int argc, char** argv) {
     std::string_view program = g_args->GetOption('p');
     std::string_view output = g_args->GetOption('o');
 
+    bool executable = false;
+    if (g_args->HasOption('f')) {
+        if (std::string_view format = g_args->GetOption('f'); format == "executable")
+            executable = true;
+        else if (format != "flat") {
+            printf("Error: invalid output format %s\n", format.data());
+            return 1;
+        }
+    }
+
+    bool include_symbols = true;
+    if (g_args->HasOption('s')) {
+        if (std::string_view symbols = g_args->GetOption('s'); symbols == "off")
+            include_symbols = false;
+        else if (symbols != "on") {
+            printf("Error: invalid symbols value %s\n", symbols.data());
+            return 1;
+        }
+    }
+
     FILE* file = fopen(program.data(), "r");
     if (file == nullptr) {
         printf("Error: could not open file %s\n", program.data());
@@ -87,10 +110,11 @@ int main(int argc, char** argv) {
     Assembler assembler;
     assembler.assemble(parser.GetLabels(), parser.GetBaseAddress());
 
-    const Buffer& buffer = assembler.GetBuffer();
-    size_t buffer_size = buffer.GetSize();
-    uint8_t* buffer_data = new uint8_t[buffer_size];
-    buffer.Read(0, buffer_data, buffer_size);
+    uint64_t entry_point = parser.GetBaseAddress();
+    if (g_args->HasOption('e') && !assembler.GetSymbolAddress(g_args->GetOption('e'), parser.GetBaseAddress(), entry_point)) {
+        printf("Error: could not find entry point %s\n", g_args->GetOption('e').data());
+        return 1;
+    }
 
     FILE* output_file = fopen(output.data(), "w");
     if (output_file == nullptr) {
@@ -98,7 +122,7 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    if (buffer_size != fwrite(buffer_data, 1, buffer_size, output_file)) {
+    if (!(executable ? assembler.WriteExecutable(output_file, parser.GetBaseAddress(), entry_point, include_symbols) : assembler.WriteFlat(output_file))) {
         perror("Error: could not write to output file");
         return 1;
     }
@@ -106,7 +130,6 @@ int main(int argc, char** argv) {
 
     delete[] file_contents;
     delete[] processed_buffer_data;
-    delete[] buffer_data;
 
     assembler.Clear();
 
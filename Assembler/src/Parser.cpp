@@ -184,7 +184,7 @@ void Parser::parse(const LinkedList::RearInsertLinkedList<Token>& tokens) {
                     error("Invalid data size for directive", token);
                     break;
                 }
-                if (static_cast<RawData*>(current_data->data)->type != RawDataType::ALIGNMENT)
+                if (static_cast<RawData*>(current_data->data)->type != RawDataType::ALIGNMENT && static_cast<RawData*>(current_data->data)->type != RawDataType::RESERVE)
                     static_cast<RawData*>(current_data->data)->type = RawDataType::RAW;
                 break;
             case TokenType::LABEL: {
@@ -280,6 +280,10 @@ void Parser::parse(const LinkedList::RearInsertLinkedList<Token>& tokens) {
                 static_cast<RawData*>(data->data)->data_size = 8;
                 static_cast<RawData*>(data->data)->type = RawDataType::ALIGNMENT;
             }
+            else if (strncmp(static_cast<char*>(token->data), "resb", token->data_size) == 0) {
+                static_cast<RawData*>(data->data)->data_size = 8;
+                static_cast<RawData*>(data->data)->type = RawDataType::RESERVE;
+            }
             else if (strncmp(static_cast<char*>(token->data), "ascii", token->data_size) == 0)
                 static_cast<RawData*>(data->data)->type = RawDataType::ASCII;
             else if (strncmp(static_cast<char*>(token->data), "asciiz", token->data_size) == 0)
@@ -1222,6 +1226,9 @@ void Parser::PrintSections(FILE* fd) const {
                     case RawDataType::ALIGNMENT:
                         fprintf(fd, "Alignment: %lu\n", *static_cast<uint64_t*>(raw_data->data));
                         break;
+                    case RawDataType::RESERVE:
+                        fprintf(fd, "Reserve: %lu\n", *static_cast<uint64_t*>(raw_data->data));
+                        break;
                     }
                     fputc('\n', fd);
                 }
@@ -34,17 +34,19 @@ void ArgsParser::ParseArgs(int argc, char** argv) {
             for (Option& opt : m_options) {
                 if (opt.short_name == argv[i][1]) {
                     if (argv[i][2] != '\0')
-                        m_parsed_options[opt.short_name] = &argv[i][2];
+                        m_parsed_options[opt.short_name].push_back(&argv[i][2]);
                     else if (i + 1 < argc) {
-                        m_parsed_options[opt.short_name] = argv[i + 1];
+                        m_parsed_options[opt.short_name].push_back(argv[i + 1]);
                         i++;
                     }
+                    break; // the value must not be matched against the other options
                 }
                 else if (argv[i][1] == '-' && strcmp(opt.option, &argv[i][2]) == 0) {
                     if (i + 1 < argc) {
-                        m_parsed_options[opt.short_name] = argv[i + 1];
+                        m_parsed_options[opt.short_name].push_back(argv[i + 1]);
                         i++;
                     }
+                    break;
                 }
             }
         }
@@ -57,6 +59,11 @@ void ArgsParser::AddOption(char short_name, const char* option, const char* desc
 }
 
 std::string_view ArgsParser::GetOption(char short_name) {
+    std::vector<std::string_view>& values = m_parsed_options[short_name];
+    return values.empty() ? std::string_view() : values.back();
+}
+
+const std::vector<std::string_view>& ArgsParser::GetOptions(char short_name) {
     return m_parsed_options[short_name];
 }
 
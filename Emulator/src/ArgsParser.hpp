@@ -32,8 +32,12 @@ public:
 
     void AddOption(char short_name, const char* option, const char* description, bool required = false);
 
+    // The last value given for the option
     std::string_view GetOption(char short_name);
 
+    // Every value given for the option, in order
+    const std::vector<std::string_view>& GetOptions(char short_name);
+
     bool HasOption(char short_name) const;
 
     const std::string& GetHelpMessage() const;
@@ -47,7 +51,7 @@ private:
     };
 
     std::vector<Option> m_options;
-    std::map<char, std::string_view> m_parsed_options;
+    std::map<char, std::vector<std::string_view>> m_parsed_options;
 
     mutable std::string m_helpMessage;
     bool m_helpMessageInitialised;
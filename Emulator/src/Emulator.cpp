@@ -17,11 +17,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "Emulator.hpp"
 
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <util.h>
 
 #include <Exceptions.hpp>
+#include <Fuzzing.hpp>
 #include <Instruction/Instruction.hpp>
 #include <Instruction/Operand.hpp>
 #include <Interrupts.hpp>
@@ -29,12 +32,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <IO/devices/Storage/StorageDevice.hpp>
 #include <IO/IOBus.hpp>
 #include <IO/IOMemoryRegion.hpp>
+#include <Loader.hpp>
 #include <MMU/BIOSMemoryRegion.hpp>
+#include <MMU/MMIOWindowRegion.hpp>
 #include <MMU/MMU.hpp>
 #include <MMU/StandardMemoryRegion.hpp>
 #include <Register.hpp>
 #include <Stack.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <csetjmp>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "IO/devices/Video/VideoDevice.hpp"
 #include "MMU/VirtualMMU.hpp"
@@ -54,7 +65,7 @@ namespace Emulator {
 
     ConsoleDevice* g_ConsoleDevice;
     VideoDevice* g_VideoDevice;
-    StorageDevice* g_StorageDevice;
+    std::vector<StorageDevice*> g_StorageDevices; // the index is the instance
 
     uint64_t g_NextIP;
 
@@ -84,9 +95,51 @@ namespace Emulator {
     std::thread* ExecutionThread;
     std::thread* EmulatorThread;
 
+    // set by the execution thread itself, as it can crash before ExecutionThread is assigned
+    thread_local bool g_IsExecutionThread = false;
+    thread_local std::jmp_buf g_ExecutionRestart; // start of the execution loop, see RestartExecution
+
     IOMemoryRegion* g_IOMemoryRegion;
     BIOSMemoryRegion* g_BIOSMemoryRegion;
 
+    struct CPUSnapshot {
+        uint64_t GPR[16];
+        uint64_t control[8];
+        uint64_t STS;
+        uint64_t IP;
+        uint64_t stackBase;
+        uint64_t stackTop;
+        uint64_t stackPointer;
+        bool isInProtectedMode;
+        bool isInUserMode;
+        InterruptHandler* interruptHandler; // copy of the interrupt handler state, including the cached IDT
+    };
+
+    CPUSnapshot* g_Snapshot = nullptr;
+
+    const char* g_ProgramPath = nullptr;
+    size_t g_ProgramSize = 0;
+
+    std::vector<std::string> g_RunList;
+    size_t g_CurrentRun = 0;
+    uint64_t g_TotalResetTime = 0; // in nanoseconds
+    bool g_ResetInProgress = false;
+
+    FILE* g_MemoryStatsFile = nullptr;
+    FILE* g_DriveStatsFile = nullptr;
+    FILE* g_VideoStatsFile = nullptr;
+    std::atomic_bool g_StatsRequested = false; // set by SIGUSR1
+    StorageCacheConfig g_DriveCache = {0, false, false};
+    VideoStreamConfig g_VideoStream = {nullptr, 0};
+    ConsoleEndpointConfig g_ConsoleEndpoint = {ConsoleEndpointType::STDIO, nullptr};
+
+    static void RunExecutionLoop(MMU* mmu, InstructionState& CurrentState, char const*& last_error) {
+        g_IsExecutionThread = true;
+        if (setjmp(g_ExecutionRestart) != 0)
+            mmu = g_CurrentMMU; // restarted, the MMU may have been switched by the reset
+        ExecutionLoop(mmu, CurrentState, last_error);
+    }
+
     void HandleMemoryOperation(uint64_t address, void* data, uint64_t size, uint64_t count, bool write) {
         if (write) {
             for (uint64_t i = 0; i < count; i++) {
@@ -139,12 +192,17 @@ namespace Emulator {
     }
 
 
+    static void PrintRequestedStats();
+
     // what the EmulatorThread will run. just loops waiting for events.
     void WaitForOperation() {
         while (true) {
             g_events.lock();
             if (g_events.getCount() == 0) {
                 g_events.unlock();
+                if (g_StatsRequested.exchange(false))
+                    PrintRequestedStats();
+                std::this_thread::yield(); // let the instruction thread take the lock on small hosts
                 continue;
             }
             for (uint64_t i = 0; i < g_events.getCount(); i++) {
@@ -155,20 +213,35 @@ namespace Emulator {
                     ExecutionThread->detach();
                     delete ExecutionThread;
                     SetCPU_IP(event->data);
-                    ExecutionThread = new std::thread(ExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
+                    ExecutionThread = new std::thread(RunExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
                     break;
                 case EventType::NewMMU: // assuming that the execution thread has joined this thread
                     g_InterruptHandler->ChangeMMU(g_CurrentMMU);
                     assert(ExecutionThread != nullptr);
                     ExecutionThread->detach();
                     delete ExecutionThread;
-                    ExecutionThread = new std::thread(ExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
+                    ExecutionThread = new std::thread(RunExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
                     break;
                 case EventType::StorageTransfer: {
                     StorageDevice* device = reinterpret_cast<StorageDevice*>(event->data);
                     device->StartTransfer();
                     break;
                 }
+                case EventType::StorageInterrupt: {
+                    StorageDevice* device = reinterpret_cast<StorageDevice*>(event->data);
+                    device->RaiseQueueInterrupt();
+                    break;
+                }
+                case EventType::ConsoleInterrupt: {
+                    ConsoleDevice* device = reinterpret_cast<ConsoleDevice*>(event->data);
+                    device->RaiseRXInterrupt();
+                    break;
+                }
+                case EventType::VideoInterrupt: {
+                    VideoDevice* device = reinterpret_cast<VideoDevice*>(event->data);
+                    device->RaiseFrameInterrupt();
+                    break;
+                }
                 default:
                     break;
                 }
@@ -179,11 +252,20 @@ namespace Emulator {
         }
     }
 
-    int Start(uint8_t* program, size_t size, const size_t RAMSize, bool has_display, VideoBackendType displayType, bool has_drive, const char* drivePath) {
+    static void AttachDrive(const StorageDriveConfig& drive) {
+        StorageDevice* device = new StorageDevice(&g_PhysicalMMU, g_StorageDevices.size(), drive, g_DriveCache);
+        device->Initialise();
+        assert(g_IOBus->AddDevice(device));
+        g_StorageDevices.push_back(device);
+    }
+
+    int Start(const char* program, size_t size, const std::vector<MemoryMap::Entry>& memoryMap, bool has_display, VideoBackendType displayType, const std::vector<StorageDriveConfig>& drives) {
         if (size > 0x1000'0000)
             return 1; // program too large
 
-        g_RAMSize = RAMSize;
+        g_RAMSize = MemoryMap::GetRAMSize(memoryMap);
+        g_ProgramPath = program;
+        g_ProgramSize = size;
 
         // Configure the exception handler
         g_ExceptionHandler = new ExceptionHandler();
@@ -203,35 +285,38 @@ namespace Emulator {
         g_BIOSMemoryRegion = new BIOSMemoryRegion(0xF000'0000, 0xFFFF'FF00, size);
         g_PhysicalMMU.AddMemoryRegion(g_BIOSMemoryRegion);
 
-        // Split the RAM into two regions
-        g_PhysicalMMU.AddMemoryRegion(new StandardMemoryRegion(0, MAX(RAMSize, 0xF000'0000)));
-        if (RAMSize > 0xF000'0000)
-            g_PhysicalMMU.AddMemoryRegion(new StandardMemoryRegion(0x1'0000'0000, RAMSize + 0x1000'0000));
+        // Add the RAM banks and MMIO windows, anything else is left unmapped
+        for (const MemoryMap::Entry& entry : memoryMap) {
+            if (entry.type == MemoryMap::EntryType::RAM)
+                g_PhysicalMMU.AddMemoryRegion(new StandardMemoryRegion(entry.start, entry.end));
+            else
+                g_PhysicalMMU.AddMemoryRegion(new MMIOWindowRegion(entry.start, entry.end));
+        }
+
+        // Load the program
+        uint64_t entryPoint = 0;
+        if (!Loader::LoadProgram(program, size, &g_PhysicalMMU, g_BIOSMemoryRegion, g_IOMemoryRegion, entryPoint))
+            return SE_INVALID_PROGRAM;
 
         // Configure the console device
-        g_ConsoleDevice = new ConsoleDevice(16);
+        g_ConsoleDevice = new ConsoleDevice(16, &g_PhysicalMMU, g_ConsoleEndpoint);
         g_IOBus->AddDevice(g_ConsoleDevice);
+        atexit(FlushConsole); // runs before the stats are printed, as they were registered earlier
 
         // Configure the video device
         if (has_display) {
-            g_VideoDevice = new VideoDevice(displayType, g_PhysicalMMU);
+            g_VideoDevice = new VideoDevice(displayType, g_PhysicalMMU, g_VideoStream);
             assert(g_IOBus->AddDevice(g_VideoDevice));
         }
 
-        // Configure the storage device
-        if (has_drive) {
-            g_StorageDevice = new StorageDevice(&g_PhysicalMMU, drivePath);
-            g_StorageDevice->Initialise();
-            assert(g_IOBus->AddDevice(g_StorageDevice));
-        }
+        // Configure the storage devices
+        for (const StorageDriveConfig& drive : drives)
+            AttachDrive(drive);
 
         // Configure the stack
         g_stack = new Stack(&g_PhysicalMMU, 0, 0, 0);
 
-        // Load program into RAM
-        g_PhysicalMMU.WriteBuffer(0xF000'0000, program, size);
-
-        g_IP = new Register(RegisterType::Instruction, 0, false, 0xF000'0000); // explicitly initialise instruction pointer to start of BIOS region
+        g_IP = new Register(RegisterType::Instruction, 0, false, entryPoint); // explicitly initialise instruction pointer to the program entry point
         g_NextIP = 0;
 
         g_EmulatorRunning = true;
@@ -344,8 +429,11 @@ namespace Emulator {
         // setup instruction stuff
         g_InstructionInProgress = false;
 
-        // begin instruction loop.
-        ExecutionThread = new std::thread(ExecutionLoop, &g_PhysicalMMU, std::ref(g_CurrentState), std::ref(last_error));
+        // begin instruction loop. the events lock is held until ExecutionThread is set, as the first instruction can
+        // already raise an event that replaces it.
+        g_events.lock();
+        ExecutionThread = new std::thread(RunExecutionLoop, &g_PhysicalMMU, std::ref(g_CurrentState), std::ref(last_error));
+        g_events.unlock();
 
         // join with the emulator thread
         EmulatorThread->join();
@@ -387,9 +475,16 @@ namespace Emulator {
         Crash("Emulator thread exited unexpectedly"); // should be unreachable
     }
 
+    [[noreturn]] void RestartExecution(uint64_t value) {
+        if (!g_IsExecutionThread)
+            Crash("Cannot restart execution from outside the execution thread");
+        SetCPU_IP(value);
+        std::longjmp(g_ExecutionRestart, 1);
+    }
+
     void JumpToIPExternal(uint64_t value) {
         SetCPU_IP(value);
-        ExecutionThread = new std::thread(ExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
+        ExecutionThread = new std::thread(RunExecutionLoop, g_CurrentMMU, std::ref(g_CurrentState), std::ref(last_error));
     }
 
 
@@ -457,8 +552,23 @@ namespace Emulator {
         }
     }
 
+    static void StartNextRun();
+    static void FlushDrives();
+
     [[noreturn]] void Crash(const char* message) {
+        if (g_IsExecutionThread) {
+            if (Fuzzing::IsEnabled())
+                Fuzzing::HandleCrash(message); // only returns if the fuzzing marker hasn't been reached yet
+            if (!g_RunList.empty() && !g_ResetInProgress) {
+                FlushConsole();
+                printf("Run %zu (%s) crashed: %s\n", g_CurrentRun + 1, g_RunList[g_CurrentRun].c_str(), message);
+                DumpRegisters(stdout);
+                StartNextRun();
+                JumpToIP(GetCPU_IP());
+            }
+        }
         g_EmulatorRunning = false;
+        FlushConsole();
         printf("Crash: %s\n", message);
         DumpRegisters(stdout);
         // DumpRAM(stdout);
@@ -468,7 +578,18 @@ namespace Emulator {
     void HandleHalt() {
         // DumpRAM(stdout);
         // DumpRegisters(stdout);
+        FlushConsole();
+        if (Fuzzing::IsEnabled()) {
+            Fuzzing::HandleHalt(); // only returns if the next input is ready to run
+            return;
+        }
+        if (!g_RunList.empty()) {
+            printf("Run %zu (%s) halted\n", g_CurrentRun + 1, g_RunList[g_CurrentRun].c_str());
+            StartNextRun(); // only returns if the next run is ready to start
+            return;
+        }
         g_EmulatorRunning = false;
+        FlushDrives();
         exit(0);
     }
 
@@ -505,16 +626,13 @@ namespace Emulator {
         g_GPR[15]->SetValue(g_SCP->GetValue());
     }
 
-    void WriteCharToConsole(char c) {
-        fputc(c, stdout);
-    }
-
-    char ReadCharFromConsole() {
-        return fgetc(stdin);
+    void FlushConsole() {
+        if (g_ConsoleDevice != nullptr)
+            g_ConsoleDevice->Flush();
     }
 
     void KillCurrentInstruction() {
-        if (std::this_thread::get_id() == ExecutionThread->get_id())
+        if (g_IsExecutionThread)
             Crash("Cannot kill current instruction from the instruction thread");
 
         StopExecution(); // wait for current instruction to finish executing
@@ -525,5 +643,254 @@ namespace Emulator {
         AllowExecution();
     }
 
+    MMU* GetPhysicalMMU() {
+        return &g_PhysicalMMU;
+    }
+
+    // Drop every queued event without handling it
+    static void DropEvents() {
+        g_events.lock();
+        while (g_events.getCount() > 0) {
+            Event* event = g_events.getHead();
+            g_events.remove(event);
+            delete event;
+        }
+        g_events.unlock();
+    }
+
+    // Put every device back in its power-on state. Events are dropped first so none of them runs against a device that
+    // is being reset, and again afterwards for any that were raised while the devices finished their in-flight work.
+    static void ResetDevices() {
+        DropEvents();
+        g_IOBus->Reset();
+        DropEvents();
+    }
+
+    void TakeSnapshot() {
+        if (g_isPagingEnabled)
+            Crash("Cannot take a snapshot with paging enabled");
+
+        if (g_Snapshot == nullptr)
+            g_Snapshot = new CPUSnapshot;
+        else
+            delete g_Snapshot->interruptHandler;
+
+        for (int i = 0; i < 16; i++)
+            g_Snapshot->GPR[i] = g_GPR[i]->GetValue();
+        for (int i = 0; i < 8; i++)
+            g_Snapshot->control[i] = g_Control[i]->GetValue();
+        g_Snapshot->STS = g_STS->GetValue();
+        g_Snapshot->IP = g_IP->GetValue();
+        g_Snapshot->stackBase = g_stack->getStackBase();
+        g_Snapshot->stackTop = g_stack->getStackTop();
+        g_Snapshot->stackPointer = g_stack->getStackPointer();
+        g_Snapshot->isInProtectedMode = g_isInProtectedMode;
+        g_Snapshot->isInUserMode = g_isInUserMode;
+        g_Snapshot->interruptHandler = new InterruptHandler(*g_InterruptHandler);
+
+        // devices aren't part of the snapshot, so every run from it, the first included, starts with them reset
+        ResetDevices();
+        g_PhysicalMMU.TakeSnapshot();
+    }
+
+    // Load the CPU registers, stack and mode flags from a snapshot. Does not touch the interrupt handler or the MMU.
+    static void LoadCPUState(const CPUSnapshot& state) {
+        // leave user mode first so the control registers can be written
+        g_isInUserMode = false;
+        g_isInProtectedMode = false;
+
+        for (int i = 0; i < 16; i++) {
+            g_GPR[i]->SetValue(state.GPR[i], true);
+            g_GPR[i]->SetDirty(false);
+        }
+        for (int i = 0; i < 8; i++) {
+            g_Control[i]->SetValue(state.control[i], true);
+            g_Control[i]->SetDirty(false);
+        }
+        g_STS->SetValue(state.STS, true);
+        g_STS->SetDirty(false);
+
+        g_stack->setStackBase(state.stackBase);
+        g_stack->setStackTop(state.stackTop);
+        g_stack->setStackPointer(state.stackPointer);
+        g_SBP->SetValue(state.stackBase, true);
+        g_STP->SetValue(state.stackTop, true);
+        g_SCP->SetValue(state.stackPointer, true);
+        g_SBP->SetDirty(false);
+        g_STP->SetDirty(false);
+        g_SCP->SetDirty(false);
+
+        g_isInProtectedMode = state.isInProtectedMode;
+        g_isInUserMode = state.isInUserMode;
+
+        SetCPU_IP(state.IP);
+        g_NextIP = state.IP;
+    }
+
+    // Returns true if paging was enabled, in which case the execution thread needs to be restarted with JumpToIP
+    static bool SwitchToPhysicalMMU() {
+        if (!g_isPagingEnabled)
+            return false;
+
+        g_isPagingEnabled = false;
+        g_CurrentMMU = &g_PhysicalMMU;
+        delete g_VirtualMMU;
+        g_VirtualMMU = nullptr;
+        g_InterruptHandler->ChangeMMU(g_CurrentMMU);
+        return true;
+    }
+
+    bool RestoreSnapshot() {
+        if (g_Snapshot == nullptr)
+            Crash("No snapshot to restore");
+
+        // the devices are stopped before memory is restored, so no transfer from the last run can land in it afterwards
+        ResetDevices();
+        g_PhysicalMMU.RestoreSnapshot();
+
+        LoadCPUState(*g_Snapshot);
+        *g_InterruptHandler = *g_Snapshot->interruptHandler;
+
+        // snapshots are always taken with paging disabled
+        return SwitchToPhysicalMMU();
+    }
+
+    bool Reset(const char* drivePath) {
+        g_ResetInProgress = true;
+
+        ResetDevices();
+
+        if (drivePath != nullptr) {
+            if (g_StorageDevices.empty())
+                AttachDrive({drivePath, nullptr, STORAGE_BLOCK_SIZE_SMALL});
+            else
+                g_StorageDevices[0]->ChangeDrive(drivePath);
+        }
+
+        bool MMUChanged = SwitchToPhysicalMMU();
+
+        // drop the RAM contents and reload the program
+        g_PhysicalMMU.Reset();
+        uint64_t entryPoint = 0;
+        if (!Loader::LoadProgram(g_ProgramPath, g_ProgramSize, &g_PhysicalMMU, g_BIOSMemoryRegion, g_IOMemoryRegion, entryPoint))
+            Crash("Failed to reload the program");
+
+        *g_InterruptHandler = InterruptHandler(&g_PhysicalMMU, g_ExceptionHandler);
+
+        CPUSnapshot state = {};
+        state.IP = entryPoint;
+        LoadCPUState(state);
+
+        g_ResetInProgress = false;
+        return MMUChanged;
+    }
+
+    void SetRunList(const std::vector<std::string>& runs) {
+        g_RunList = runs;
+        g_CurrentRun = 0;
+        g_TotalResetTime = 0;
+    }
+
+    static void PrintMemoryStats() {
+        g_PhysicalMMU.PrintMemoryStats(g_MemoryStatsFile);
+        fflush(g_MemoryStatsFile);
+    }
+
+    void EnableMemoryStats(FILE* fp) {
+        if (g_MemoryStatsFile == nullptr)
+            atexit(PrintMemoryStats);
+        g_MemoryStatsFile = fp;
+    }
+
+    void SetDriveCache(const StorageCacheConfig& config) {
+        g_DriveCache = config;
+    }
+
+    void SetVideoStream(const VideoStreamConfig& config) {
+        g_VideoStream = config;
+    }
+
+    void SetConsoleEndpoint(const ConsoleEndpointConfig& config) {
+        g_ConsoleEndpoint = config;
+    }
+
+    static void PrintDriveStats() {
+        for (StorageDevice* device : g_StorageDevices)
+            device->PrintStats(g_DriveStatsFile);
+        fflush(g_DriveStatsFile);
+    }
+
+    static void PrintVideoStats() {
+        if (g_VideoDevice == nullptr)
+            return;
+        g_VideoDevice->PrintStats(g_VideoStatsFile);
+        fflush(g_VideoStatsFile);
+    }
+
+    static void PrintRequestedStats() {
+        if (g_DriveStatsFile != nullptr)
+            PrintDriveStats();
+        if (g_VideoStatsFile != nullptr)
+            PrintVideoStats();
+    }
+
+    static void HandleStatsSignal(int) {
+        g_StatsRequested = true; // printing isn't async-signal-safe, so the event thread does it
+    }
+
+    static void InstallStatsSignal() {
+        struct sigaction action = {};
+        action.sa_handler = HandleStatsSignal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, nullptr);
+    }
+
+    void EnableDriveStats(FILE* fp) {
+        if (g_DriveStatsFile == nullptr) {
+            atexit(PrintDriveStats);
+            InstallStatsSignal();
+        }
+        g_DriveStatsFile = fp;
+    }
+
+    void EnableVideoStats(FILE* fp) {
+        if (g_VideoStatsFile == nullptr) {
+            atexit(PrintVideoStats);
+            InstallStatsSignal();
+        }
+        g_VideoStatsFile = fp;
+    }
+
+    // Write back anything a write-back cache is still holding. This isn't done on a crash, as the crash could have
+    // happened part way through a transfer.
+    static void FlushDrives() {
+        for (StorageDevice* device : g_StorageDevices) {
+            if (!device->Flush())
+                printf("Failed to flush drive %lu\n", device->GetInstance());
+        }
+    }
+
+    // Reset the machine for the next entry in the run list. Exits once the list is finished.
+    static void StartNextRun() {
+        g_CurrentRun++;
+        if (g_CurrentRun >= g_RunList.size()) {
+            printf("Runs: %zu, average reset time: %.1f us\n", g_RunList.size(), g_RunList.size() > 1 ? static_cast<double>(g_TotalResetTime) / 1000.0 / static_cast<double>(g_RunList.size() - 1) : 0.0);
+            g_EmulatorRunning = false;
+            FlushDrives();
+            exit(0);
+        }
+
+        if (g_DriveStatsFile != nullptr)
+            PrintDriveStats();
+
+        auto start = std::chrono::steady_clock::now();
+        bool MMUChanged = Reset(g_RunList[g_CurrentRun].c_str());
+        g_TotalResetTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        if (MMUChanged)
+            JumpToIP(GetCPU_IP());
+    }
+
 
 } // namespace Emulator
@@ -20,9 +20,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
+#include <MemoryMap.hpp>
+#include <OSSpecific/ConsoleEndpoint.hpp>
 #include <Register.hpp>
 
+#include <string>
+#include <vector>
+
+#include "IO/devices/Storage/StorageBackend.hpp"
 #include "IO/devices/Video/VideoBackend.hpp"
 
 namespace Emulator {
@@ -30,13 +37,17 @@ namespace Emulator {
     enum StartErrors {
         SE_SUCCESS = 0,
         SE_MALLOC_FAIL = 1,
-        SE_TOO_LITTLE_RAM = 2
+        SE_TOO_LITTLE_RAM = 2,
+        SE_INVALID_PROGRAM = 3
     };
 
     enum class EventType {
         SwitchToIP,
         NewMMU,
-        StorageTransfer
+        StorageTransfer,
+        StorageInterrupt,
+        VideoInterrupt,
+        ConsoleInterrupt
     };
 
     struct Event {
@@ -48,7 +59,8 @@ namespace Emulator {
 
     void HandleMemoryOperation(uint64_t address, void* data, uint64_t size, uint64_t count, bool write);
 
-    int Start(uint8_t* data, size_t size, size_t RAM, bool has_display = false, VideoBackendType displayType = VideoBackendType::NONE, bool has_drive = false, const char* drivePath = nullptr);
+    // The storage device instances follow the order of drives
+    int Start(const char* program, size_t size, const std::vector<MemoryMap::Entry>& memoryMap, bool has_display = false, VideoBackendType displayType = VideoBackendType::NONE, const std::vector<StorageDriveConfig>& drives = {});
     int RequestEmulatorStop();
     int SendInstruction(uint64_t instruction);
 
@@ -65,6 +77,11 @@ namespace Emulator {
     [[noreturn]] void JumpToIP(uint64_t value);
     void JumpToIPExternal(uint64_t value); // assumes the execution thread is dead
 
+    // Unwind the execution thread back to the start of its loop and continue from value, instead of replacing the
+    // thread like JumpToIP. Nothing on the way is cleaned up, so it is only for resets that discard that state anyway.
+    // MUST only be called from the instruction thread.
+    [[noreturn]] void RestartExecution(uint64_t value);
+
 
     void SyncRegisters();
 
@@ -80,10 +97,47 @@ namespace Emulator {
     void EnterUserMode(uint64_t address);
     void ExitUserMode();
 
-    void WriteCharToConsole(char c);
-    char ReadCharFromConsole();
+    // Wait until all console output has been written to its endpoint, so anything printed next comes after it
+    void FlushConsole();
 
     void KillCurrentInstruction(); // MUST NOT be called from the instruction thread
+
+    MMU* GetPhysicalMMU();
+
+    // Reset the devices, then snapshot the CPU and physical memory. MUST only be called from the instruction thread.
+    void TakeSnapshot();
+    // Reset the devices and restore the snapshot.
+    // Returns true if the current MMU was changed, in which case the execution thread needs to be restarted with JumpToIP
+    bool RestoreSnapshot();
+
+    // Warm reset: reset the devices, drop the RAM contents, reload the program and reinitialise the CPU.
+    // If drivePath is not null, the first storage device is switched to that file. MUST only be called from the instruction thread.
+    // Returns true if the current MMU was changed, in which case the execution thread needs to be restarted with JumpToIP
+    bool Reset(const char* drivePath = nullptr);
+
+    // Run the program once per drive path, with a warm reset between runs. The path replaces the first drive, and the
+    // first run uses the first drive passed to Start.
+    void SetRunList(const std::vector<std::string>& runs);
+
+    // Print the host memory used by each physical memory region to fp when the emulator exits
+    void EnableMemoryStats(FILE* fp);
+
+    // Put a host block cache in front of every drive. MUST be called before Start.
+    void SetDriveCache(const StorageCacheConfig& config);
+
+    // Stream frames from a headless display. MUST be called before Start.
+    void SetVideoStream(const VideoStreamConfig& config);
+
+    // Attach the console to something other than stdin and stdout. MUST be called before Start.
+    void SetConsoleEndpoint(const ConsoleEndpointConfig& config);
+
+    // Print the I/O and cache stats of every drive to fp when the emulator exits, after every run in the run list and
+    // whenever the process receives SIGUSR1
+    void EnableDriveStats(FILE* fp);
+
+    // Print the present stats of the video device to fp when the emulator exits and whenever the process receives
+    // SIGUSR1
+    void EnableVideoStats(FILE* fp);
 } // namespace Emulator
 
 #endif /* _EMULATOR_HPP */
\ No newline at end of file
@@ -18,6 +18,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "Exceptions.hpp"
 
 #include <stdarg.h>
+#include <string.h>
 
 #include <Instruction/Instruction.hpp>
 #include <Stack.hpp>
@@ -61,15 +62,17 @@ ExceptionHandler::~ExceptionHandler() {
             break;
         case Exception::STACK_VIOLATION: {
             StackViolationErrorCode code = va_arg(args, StackViolationErrorCode);
-            uint64_t* temp = reinterpret_cast<uint64_t*>(&code);
-            g_stack->push(*temp); // error code
+            uint64_t temp;
+            memcpy(&temp, &code, sizeof(temp));
+            g_stack->push(temp); // error code
             break;
         }
         case Exception::PAGING_VIOLATION: {
             g_stack->push(va_arg(args, uint64_t)); // address
             PagingViolationErrorCode code = va_arg(args, PagingViolationErrorCode);
-            uint64_t* temp = reinterpret_cast<uint64_t*>(&code);
-            g_stack->push(*temp); // error code
+            uint64_t temp;
+            memcpy(&temp, &code, sizeof(temp));
+            g_stack->push(temp); // error code
             break;
         }
         default:
@@ -0,0 +1,258 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Fuzzing.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <Emulator.hpp>
+#include <MMU/MMU.hpp>
+#include <Register.hpp>
+
+namespace Fuzzing {
+
+    enum class Result {
+        Halt,
+        Crash,
+        Timeout
+    };
+
+    struct Input {
+        std::string name;
+        std::vector<uint8_t> data;
+    };
+
+    bool g_enabled = false;
+
+    Config g_config;
+    std::vector<Input> g_inputs;
+    size_t g_currentInput = 0;
+    bool g_snapshotTaken = false;
+    uint64_t g_instructionCount = 0;
+
+    uint8_t g_traceMap[FUZZING_MAP_SIZE];  // hit counts for the current input
+    uint8_t g_virginMap[FUZZING_MAP_SIZE]; // every hit count bucket seen so far, one bit per bucket
+
+    uint64_t g_halts = 0;
+    uint64_t g_crashes = 0;
+    uint64_t g_timeouts = 0;
+    uint64_t g_newCoverage = 0;
+    std::chrono::steady_clock::time_point g_startTime;
+
+    bool LoadInput(const std::filesystem::path& path) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (fp == nullptr) {
+            perror("fopen");
+            return false;
+        }
+
+        Input input;
+        input.name = path.string();
+
+        uint8_t buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+            input.data.insert(input.data.end(), buffer, buffer + count);
+
+        fclose(fp);
+        g_inputs.push_back(std::move(input));
+        return true;
+    }
+
+    bool Initialise(const Config& config) {
+        g_config = config;
+
+        std::error_code ec;
+        if (std::filesystem::is_directory(config.corpusPath, ec)) {
+            std::vector<std::filesystem::path> paths;
+            for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(config.corpusPath, ec)) {
+                if (entry.is_regular_file())
+                    paths.push_back(entry.path());
+            }
+            std::sort(paths.begin(), paths.end()); // keep runs reproducible
+            for (const std::filesystem::path& path : paths) {
+                if (!LoadInput(path))
+                    return false;
+            }
+        } else if (!LoadInput(config.corpusPath))
+            return false;
+
+        if (g_inputs.empty()) {
+            printf("Fuzzing corpus is empty.\n");
+            return false;
+        }
+
+        memset(g_virginMap, 0, FUZZING_MAP_SIZE);
+        g_enabled = true;
+        return true;
+    }
+
+    void InjectInput() {
+        const Input& input = g_inputs[g_currentInput];
+        memset(g_traceMap, 0, FUZZING_MAP_SIZE);
+        g_instructionCount = 0;
+
+        Emulator::GetPhysicalMMU()->WriteBuffer(g_config.inputAddress, input.data.data(), input.data.size());
+        Emulator::GetRegisterPointer(RegisterID_R0)->SetValue(input.data.size(), true);
+        Emulator::GetRegisterPointer(RegisterID_R1)->SetValue(g_config.inputAddress, true);
+    }
+
+    // Same bucketing as AFL, so that loop counts only matter when they change by a meaningful amount
+    uint8_t ClassifyCount(uint8_t count) {
+        if (count <= 2)
+            return count;
+        if (count == 3)
+            return 4;
+        if (count < 8)
+            return 8;
+        if (count < 16)
+            return 16;
+        if (count < 32)
+            return 32;
+        if (count < 128)
+            return 64;
+        return 128;
+    }
+
+    bool MergeCoverage() {
+        bool newCoverage = false;
+        for (uint64_t i = 0; i < FUZZING_MAP_SIZE; i++) {
+            if (g_traceMap[i] == 0)
+                continue;
+            uint8_t bucket = ClassifyCount(g_traceMap[i]);
+            if ((g_virginMap[i] & bucket) == 0) {
+                g_virginMap[i] |= bucket;
+                newCoverage = true;
+            }
+        }
+        return newCoverage;
+    }
+
+    [[noreturn]] void Finish() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - g_startTime).count();
+        uint64_t edges = 0;
+        for (uint64_t i = 0; i < FUZZING_MAP_SIZE; i++) {
+            if (g_virginMap[i] != 0)
+                edges++;
+        }
+
+        printf("Fuzzing finished: %zu executions in %.3fs (%.1f/s)\n", g_inputs.size(), seconds, seconds > 0 ? g_inputs.size() / seconds : 0.0);
+        printf("  halts: %lu, crashes: %lu, timeouts: %lu\n", g_halts, g_crashes, g_timeouts);
+        printf("  inputs with new coverage: %lu, edges: %lu\n", g_newCoverage, edges);
+
+        if (g_config.coveragePath != nullptr) {
+            FILE* fp = fopen(g_config.coveragePath, "wb");
+            if (fp == nullptr || fwrite(g_virginMap, 1, FUZZING_MAP_SIZE, fp) != FUZZING_MAP_SIZE)
+                perror("Failed to write coverage map");
+            if (fp != nullptr)
+                fclose(fp);
+        }
+
+        exit(0);
+    }
+
+    // Returns true if the current MMU was changed by the reset, in which case the execution thread must be restarted.
+    bool FinishInput(Result result) {
+        switch (result) {
+        case Result::Halt:
+            g_halts++;
+            break;
+        case Result::Crash:
+            g_crashes++;
+            break;
+        case Result::Timeout:
+            g_timeouts++;
+            printf("Input %s timed out\n", g_inputs[g_currentInput].name.c_str());
+            break;
+        }
+
+        if (MergeCoverage())
+            g_newCoverage++;
+
+        g_currentInput++;
+        if (g_currentInput >= g_inputs.size())
+            Finish();
+
+        bool MMUChanged = Emulator::RestoreSnapshot();
+        InjectInput();
+        return MMUChanged;
+    }
+
+    bool OnInstruction(uint64_t IP) {
+        if (!g_snapshotTaken) {
+            if (IP != g_config.markerAddress)
+                return false;
+            Emulator::TakeSnapshot();
+            g_snapshotTaken = true;
+            g_startTime = std::chrono::steady_clock::now();
+            InjectInput();
+            return false;
+        }
+
+        if (++g_instructionCount <= g_config.timeout)
+            return false;
+
+        if (FinishInput(Result::Timeout))
+            Emulator::RestartExecution(Emulator::GetCPU_IP());
+        return true;
+    }
+
+    uint64_t HashLocation(uint64_t address) {
+        address ^= address >> 33;
+        address *= 0xff51afd7ed558ccd;
+        address ^= address >> 33;
+        return address;
+    }
+
+    void RecordEdge(uint64_t from, uint64_t to) {
+        if (!g_snapshotTaken)
+            return;
+        uint64_t index = (HashLocation(to) ^ (HashLocation(from) >> 1)) & (FUZZING_MAP_SIZE - 1);
+        if (g_traceMap[index] != 0xFF)
+            g_traceMap[index]++;
+    }
+
+    void HandleHalt() {
+        if (!g_snapshotTaken) {
+            printf("Halted before reaching the fuzzing marker at %#lx\n", g_config.markerAddress);
+            exit(1);
+        }
+
+        if (FinishInput(Result::Halt))
+            Emulator::RestartExecution(Emulator::GetCPU_IP());
+    }
+
+    void HandleCrash(const char* message) {
+        if (!g_snapshotTaken)
+            return;
+
+        printf("Input %s crashed: %s\n", g_inputs[g_currentInput].name.c_str(), message);
+        FinishInput(Result::Crash);
+
+        // the crash can happen part way through an instruction, so always unwind back to the start of the execution loop
+        Emulator::RestartExecution(Emulator::GetCPU_IP());
+    }
+
+}
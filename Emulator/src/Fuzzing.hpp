@@ -0,0 +1,57 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FUZZING_HPP
+#define _FUZZING_HPP
+
+#include <stdint.h>
+
+#define FUZZING_MAP_SIZE 0x10000 // 64KiB, same as AFL
+#define FUZZING_DEFAULT_TIMEOUT 1'000'000 // in instructions
+
+namespace Fuzzing {
+
+    struct Config {
+        const char* corpusPath;   // a single input file, or a directory of input files
+        uint64_t markerAddress;   // the snapshot is taken when execution reaches this address
+        uint64_t inputAddress;    // each input is written to this physical address
+        uint64_t timeout;         // maximum instructions per input
+        const char* coveragePath; // optional, where the coverage map is written at the end
+    };
+
+    extern bool g_enabled;
+
+    // Loads the corpus. Returns false on failure.
+    bool Initialise(const Config& config);
+
+    inline bool IsEnabled() {
+        return g_enabled;
+    }
+
+    // Called before every instruction. Returns true if the instruction must not be executed because the state was reset.
+    bool OnInstruction(uint64_t IP);
+
+    // Called after every control flow instruction.
+    void RecordEdge(uint64_t from, uint64_t to);
+
+    // Both of these finish the current input and load the next one.
+    void HandleHalt();
+    void HandleCrash(const char* message); // only returns if the marker hasn't been reached yet
+
+}
+
+#endif /* _FUZZING_HPP */
@@ -24,11 +24,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdio.h>
 #endif
 
+#include <string.h>
+
 #include <Emulator.hpp>
 #include <Exceptions.hpp>
 #include <Interrupts.hpp>
 
-void IOBus_HandleDeviceInterrupt(IODeviceID device, uint64_t index, void* data) {
+void IOBus_HandleDeviceInterrupt(uint64_t device, uint64_t index, void* data) {
     if (IOBus* bus = static_cast<IOBus*>(data); bus != nullptr)
         bus->HandleDeviceInterrupt(device, index);
 }
@@ -104,11 +106,30 @@ void IOBus::RemoveDevice(IODevice* device) {
     device->SetInterruptCallback(nullptr, nullptr);
 }
 
-void IOBus::HandleDeviceInterrupt(IODeviceID device, uint64_t index) {
+void IOBus::HandleDeviceInterrupt(uint64_t device, uint64_t index) {
     if (uint8_t SINT = m_interruptMapping[{device, index}]; SINT != 0)
         g_InterruptHandler->RaiseInterruptExternal(SINT);
 }
 
+void IOBus::Reset() {
+    for (uint64_t i = 0; i < m_devices.getCount(); i++) {
+        IODevice* device = m_devices.get(i);
+        if (IOMemoryRegion* region = device->GetMemoryRegion(); region != nullptr) {
+            uint64_t start = region->getStart();
+            uint64_t end = region->getEnd();
+            m_MMU->RemoveMemoryRegion(region);
+            delete region;
+            m_MMU->ReaddRegionSegment(start, end);
+            device->SetMemoryRegion(nullptr);
+        }
+        device->SetBaseAddress(0);
+        for (uint64_t j = 0; j < device->GetInterruptCount(); j++)
+            m_interruptMapping[{device->GetID(), j}] = 0;
+        device->Reset();
+    }
+    m_interruptMap.ClearAll();
+    m_registers = {0, {true, false, 0}, {0, 0, 0, 0}, {0, 0}};
+}
 
 void IOBus::Validate() const {
     if (Emulator::isInProtectedMode() && Emulator::isInUserMode())
@@ -138,17 +159,18 @@ void IOBus::RunCommand(uint64_t command) {
             break;
         }
         IOBus_GetDeviceInfoResponse response;
-        response.ID = static_cast<uint64_t>(device->GetID());
+        response.ID = device->GetID();
         response.baseAddress = device->GetBaseAddress();
         response.size = device->GetSize();
         response.INTCount = device->GetInterruptCount();
-        m_registers.data[0] = *reinterpret_cast<uint64_t*>(&response);
+        // the response fills all 4 data registers
+        memcpy(m_registers.data, &response, sizeof(IOBus_GetDeviceInfoResponse));
         break;
     }
     case IOBusCommands::SET_DEVICE_INFO: {
         // data[0] = ID
         // data[1] = baseAddress
-        IODeviceID ID = static_cast<IODeviceID>(m_registers.data[0]);
+        uint64_t ID = m_registers.data[0];
         uint64_t baseAddress = m_registers.data[1];
         IODevice* device = FindDevice(ID);
         if (device == nullptr) {
@@ -185,7 +207,7 @@ void IOBus::RunCommand(uint64_t command) {
         IOBus_GetInterruptMappingRequest request;
         request.deviceID = m_registers.data[0];
         request.interrupt = m_registers.data[1];
-        IODevice* device = FindDevice(static_cast<IODeviceID>(request.deviceID));
+        IODevice* device = FindDevice(request.deviceID);
         if (device == nullptr) {
             m_registers.status.error = true;
             break;
@@ -194,7 +216,7 @@ void IOBus::RunCommand(uint64_t command) {
             m_registers.status.error = true;
             break;
         }
-        m_registers.data[0] = m_interruptMapping[{static_cast<IODeviceID>(request.deviceID), request.interrupt}];
+        m_registers.data[0] = m_interruptMapping[{request.deviceID, request.interrupt}];
         break;
     }
     case IOBusCommands::SET_INTERRUPT_MAPPING: {
@@ -205,7 +227,7 @@ void IOBus::RunCommand(uint64_t command) {
         request.deviceID = m_registers.data[0];
         request.interrupt = m_registers.data[1];
         request.SINT = m_registers.data[2];
-        IODevice* device = FindDevice(static_cast<IODeviceID>(request.deviceID));
+        IODevice* device = FindDevice(request.deviceID);
         if (device == nullptr) {
             m_registers.status.error = true;
             break;
@@ -226,14 +248,14 @@ void IOBus::RunCommand(uint64_t command) {
             m_interruptMap.Set(request.SINT);
         } else
             m_interruptMap.Clear(request.SINT);
-        m_interruptMapping[{static_cast<IODeviceID>(request.deviceID), request.interrupt}] = request.SINT;
+        m_interruptMapping[{request.deviceID, request.interrupt}] = request.SINT;
         break;
     }
     }
     m_registers.status.commandComplete = true;
 }
 
-IODevice* IOBus::FindDevice(IODeviceID ID) {
+IODevice* IOBus::FindDevice(uint64_t ID) {
     for (uint64_t i = 0; i < m_devices.getCount(); i++) {
         if (IODevice* device = m_devices.get(i); device->GetID() == ID)
             return device;
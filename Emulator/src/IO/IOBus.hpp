@@ -53,6 +53,15 @@ enum class IODeviceID {
     STORAGE = 2
 };
 
+// The ID of a device on the bus is its type in bits 0-15 and its instance in bits 16-31, so the first device of each
+// type has the type as its ID
+#define IO_DEVICE_INSTANCE_SHIFT 16
+#define IO_DEVICE_MAX_INSTANCES 0x10000
+
+inline uint64_t MakeIODeviceID(IODeviceID type, uint64_t instance) {
+    return static_cast<uint64_t>(type) | (instance << IO_DEVICE_INSTANCE_SHIFT);
+}
+
 struct [[gnu::packed]] IOBus_GetBusInfoResponse {
     uint64_t deviceCount;
 };
@@ -104,18 +113,21 @@ class IOBus {
     bool AddDevice(IODevice* device);
     void RemoveDevice(IODevice* device);
 
-    void HandleDeviceInterrupt(IODeviceID device, uint64_t index);
+    void HandleDeviceInterrupt(uint64_t device, uint64_t index);
+
+    // Unmap every device, clear the interrupt mappings and reset the devices
+    void Reset();
 
    private:
     void Validate() const;
 
     void RunCommand(uint64_t command);
 
-    IODevice* FindDevice(IODeviceID ID);
+    IODevice* FindDevice(uint64_t ID);
 
    private:
     struct IODeviceInterruptInfo {
-        IODeviceInterruptInfo(IODeviceID device, uint64_t index)
+        IODeviceInterruptInfo(uint64_t device, uint64_t index)
             : device(device), index(index) {}
         bool operator==(const IODeviceInterruptInfo& other) const {
             return device == other.device && index == other.index;
@@ -125,14 +137,14 @@ class IOBus {
         //     index = other.index;
         //     return *this;
         // }
-        IODeviceID device;
+        uint64_t device;
         uint64_t index;
     };
 
     struct IODeviceInterruptInfoHash {
         size_t operator()(const IODeviceInterruptInfo info) const {
             size_t seed = 0;
-            Math::hash_combine(seed, static_cast<uint64_t>(info.device));
+            Math::hash_combine(seed, info.device);
             Math::hash_combine(seed, info.index);
             return seed;
         }
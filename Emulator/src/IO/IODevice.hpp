@@ -20,33 +20,77 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 
+#include <span>
+
 #include "IOBus.hpp"
 
 class IOMemoryRegion;
 
-typedef void (*IOInterruptCallback)(IODeviceID device, uint64_t index, void* data);
+typedef void (*IOInterruptCallback)(uint64_t device, uint64_t index, void* data);
+
+// object is the device, or the bus for the bus region. The port is passed so one handler can serve several ports.
+typedef uint64_t (*IOReadHandler)(void* object, uint64_t port);
+typedef void (*IOWriteHandler)(void* object, uint64_t port, uint64_t data);
+
+// Access widths, which are also their sizes in bytes
+#define IO_WIDTH_BYTE 1
+#define IO_WIDTH_WORD 2
+#define IO_WIDTH_DWORD 4
+#define IO_WIDTH_QWORD 8
+#define IO_WIDTH_ALL (IO_WIDTH_BYTE | IO_WIDTH_WORD | IO_WIDTH_DWORD | IO_WIDTH_QWORD)
+
+// One entry in a device's register table. The table is bound to the device's memory region when it is mapped, so an
+// access is a single call to the handler. Narrower reads get the low bits of the handler's result and narrower writes
+// are zero extended. Accesses that no entry covers go to ReadByte, ReadWord and so on.
+struct IORegister {
+    uint64_t port;
+    uint8_t widths;       // IO_WIDTH_* flags of the accesses that use the handlers
+    IOReadHandler read;   // nullptr reads as 0
+    IOWriteHandler write; // nullptr ignores the write
+};
+
+// Turn a member function into a handler, so register tables can be built at compile time
+template <typename Device, uint64_t (Device::*Handler)()>
+uint64_t IORegisterRead(void* object, uint64_t) {
+    return (static_cast<Device*>(static_cast<IODevice*>(object))->*Handler)();
+}
+
+template <typename Device, void (Device::*Handler)(uint64_t)>
+void IORegisterWrite(void* object, uint64_t, uint64_t data) {
+    (static_cast<Device*>(static_cast<IODevice*>(object))->*Handler)(data);
+}
 
 class IODevice {
    public:
-    explicit IODevice(IODeviceID ID, uint64_t size, uint64_t interruptCount = 0)
-        : m_base_address(0), m_size(size), m_ID(ID), m_memoryRegion(nullptr), m_interruptCount(interruptCount), m_interruptCallback(nullptr), m_interruptData(nullptr) {}
+    // instance tells apart devices of the same type, and must be unique for each type
+    explicit IODevice(IODeviceID type, uint64_t size, uint64_t interruptCount = 0, uint64_t instance = 0)
+        : m_base_address(0), m_size(size), m_type(type), m_instance(instance), m_memoryRegion(nullptr), m_interruptCount(interruptCount), m_interruptCallback(nullptr), m_interruptData(nullptr) {}
     virtual ~IODevice() = default;
 
-    virtual uint8_t ReadByte(uint64_t address) = 0;
-    virtual uint16_t ReadWord(uint64_t address) = 0;
-    virtual uint32_t ReadDWord(uint64_t address) = 0;
-    virtual uint64_t ReadQWord(uint64_t address) = 0;
+    // Only used for accesses that the register table doesn't cover
+    virtual uint8_t ReadByte(uint64_t) { return 0; }
+    virtual uint16_t ReadWord(uint64_t) { return 0; }
+    virtual uint32_t ReadDWord(uint64_t) { return 0; }
+    virtual uint64_t ReadQWord(uint64_t) { return 0; }
+
+    virtual void WriteByte(uint64_t, uint8_t) {}
+    virtual void WriteWord(uint64_t, uint16_t) {}
+    virtual void WriteDWord(uint64_t, uint32_t) {}
+    virtual void WriteQWord(uint64_t, uint64_t) {}
 
-    virtual void WriteByte(uint64_t address, uint8_t data) = 0;
-    virtual void WriteWord(uint64_t address, uint16_t data) = 0;
-    virtual void WriteDWord(uint64_t address, uint32_t data) = 0;
-    virtual void WriteQWord(uint64_t address, uint64_t data) = 0;
+    // MUST stay the same for the life of the device
+    virtual std::span<const IORegister> GetRegisters() const { return {}; }
 
     virtual void RaiseInterrupt(uint64_t index) { Internal_HandleInterrupt(index); }
 
+    // Return the device registers to their power on state. The bus resets the base address and interrupt mappings.
+    virtual void Reset() {}
+
     uint64_t GetBaseAddress() const { return m_base_address; }
     uint64_t GetSize() const { return m_size; }
-    IODeviceID GetID() const { return m_ID; }
+    IODeviceID GetType() const { return m_type; }
+    uint64_t GetInstance() const { return m_instance; }
+    uint64_t GetID() const { return MakeIODeviceID(m_type, m_instance); }
     IOMemoryRegion* GetMemoryRegion() const { return m_memoryRegion; }
     uint64_t GetInterruptCount() const { return m_interruptCount; }
     IOInterruptCallback GetInterruptCallback() const { return m_interruptCallback; }
@@ -62,13 +106,14 @@ class IODevice {
    protected:
     void Internal_HandleInterrupt(uint64_t index) {
         if (m_interruptCallback != nullptr)
-            m_interruptCallback(m_ID, index, m_interruptData);
+            m_interruptCallback(GetID(), index, m_interruptData);
     }
 
    private:
     uint64_t m_base_address;
     uint64_t m_size;
-    IODeviceID m_ID;
+    IODeviceID m_type;
+    uint64_t m_instance;
     IOMemoryRegion* m_memoryRegion;
     uint64_t m_interruptCount;
     IOInterruptCallback m_interruptCallback;
@@ -17,93 +17,173 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "IOMemoryRegion.hpp"
 
+#include <string.h>
+
 #include "IODevice.hpp"
 
+static uint64_t ReadBusRegister(void* object, uint64_t port) {
+    return static_cast<IOBus*>(object)->ReadRegister(port);
+}
+
+static void WriteBusRegister(void* object, uint64_t port, uint64_t data) {
+    static_cast<IOBus*>(object)->WriteRegister(port, data);
+}
+
+static uint64_t ReadDeviceByte(void* object, uint64_t port) {
+    return static_cast<IODevice*>(object)->ReadByte(port);
+}
+
+static uint64_t ReadDeviceWord(void* object, uint64_t port) {
+    return static_cast<IODevice*>(object)->ReadWord(port);
+}
+
+static uint64_t ReadDeviceDWord(void* object, uint64_t port) {
+    return static_cast<IODevice*>(object)->ReadDWord(port);
+}
+
+static uint64_t ReadDeviceQWord(void* object, uint64_t port) {
+    return static_cast<IODevice*>(object)->ReadQWord(port);
+}
+
+static void WriteDeviceByte(void* object, uint64_t port, uint64_t data) {
+    static_cast<IODevice*>(object)->WriteByte(port, static_cast<uint8_t>(data));
+}
+
+static void WriteDeviceWord(void* object, uint64_t port, uint64_t data) {
+    static_cast<IODevice*>(object)->WriteWord(port, static_cast<uint16_t>(data));
+}
+
+static void WriteDeviceDWord(void* object, uint64_t port, uint64_t data) {
+    static_cast<IODevice*>(object)->WriteDWord(port, static_cast<uint32_t>(data));
+}
+
+static void WriteDeviceQWord(void* object, uint64_t port, uint64_t data) {
+    static_cast<IODevice*>(object)->WriteQWord(port, data);
+}
+
+static uint64_t ReadZero(void*, uint64_t) {
+    return 0;
+}
+
+static void WriteIgnored(void*, uint64_t, uint64_t) {
+}
+
 IOMemoryRegion::IOMemoryRegion(uint64_t start, uint64_t end, IOBus* bus)
-    : MemoryRegion(start, end), m_data(bus), m_isBus(true) {
+    : MemoryRegion(start, end), m_object(bus), m_portCount((end - start + 7) >> 3) {
+    m_ports = new Port[m_portCount];
+    for (uint64_t port = 0; port < m_portCount; port++) {
+        for (int i = 0; i < 4; i++) {
+            m_ports[port].read[i] = ReadBusRegister;
+            m_ports[port].write[i] = WriteBusRegister;
+        }
+    }
 }
 
 IOMemoryRegion::IOMemoryRegion(uint64_t start, uint64_t end, IODevice* device)
-    : MemoryRegion(start, end), m_data(reinterpret_cast<IOBus*>(device)), m_isBus(false) {
+    : MemoryRegion(start, end), m_object(device), m_portCount((end - start + 7) >> 3) {
+    m_ports = new Port[m_portCount];
+    BindDevice(device);
 }
 
 IOMemoryRegion::~IOMemoryRegion() {
+    delete[] m_ports;
 }
 
 void IOMemoryRegion::read(uint64_t address, uint8_t* buffer, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        if (m_isBus)
-            buffer[i] = m_data.bus->ReadRegister((address - getStart() + i) / 8) & 0xFF;
-        else
-            buffer[i] = m_data.device->ReadByte((address - getStart() + i) / 8);
+    while (size > 0) {
+        uint8_t width = GetChunkWidth(address - getStart(), size);
+        uint64_t port = GetPort(address);
+        uint64_t value = m_ports[port].read[__builtin_ctz(width)](m_object, port);
+        memcpy(buffer, &value, width);
+        address += width;
+        buffer += width;
+        size -= width;
     }
 }
 
 void IOMemoryRegion::write(uint64_t address, const uint8_t* buffer, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-        if (m_isBus)
-            m_data.bus->WriteRegister((address - getStart() + i) / 8, buffer[i]);
-        else
-            m_data.device->WriteByte((address - getStart() + i) / 8, buffer[i]);
+    while (size > 0) {
+        uint8_t width = GetChunkWidth(address - getStart(), size);
+        uint64_t port = GetPort(address);
+        uint64_t value = 0;
+        memcpy(&value, buffer, width);
+        m_ports[port].write[__builtin_ctz(width)](m_object, port, value);
+        address += width;
+        buffer += width;
+        size -= width;
     }
 }
 
 void IOMemoryRegion::read8(uint64_t address, uint8_t* buffer) {
-    if (m_isBus)
-        *buffer = m_data.bus->ReadRegister((address - getStart()) / 8) & 0xFF;
-    else
-        *buffer = m_data.device->ReadByte((address - getStart()) / 8);
+    uint64_t port = GetPort(address);
+    *buffer = static_cast<uint8_t>(m_ports[port].read[0](m_object, port));
 }
 
 void IOMemoryRegion::read16(uint64_t address, uint16_t* buffer) {
-    if (m_isBus)
-        *buffer = m_data.bus->ReadRegister((address - getStart()) / 8) & 0xFFFF;
-    else
-        *buffer = m_data.device->ReadWord((address - getStart()) / 8);
+    uint64_t port = GetPort(address);
+    *buffer = static_cast<uint16_t>(m_ports[port].read[1](m_object, port));
 }
 
 void IOMemoryRegion::read32(uint64_t address, uint32_t* buffer) {
-    if (m_isBus)
-        *buffer = m_data.bus->ReadRegister((address - getStart()) / 8) & 0xFFFF'FFFF;
-    else
-        *buffer = m_data.device->ReadDWord((address - getStart()) / 8);
+    uint64_t port = GetPort(address);
+    *buffer = static_cast<uint32_t>(m_ports[port].read[2](m_object, port));
 }
 
 void IOMemoryRegion::read64(uint64_t address, uint64_t* buffer) {
-    if (m_isBus)
-        *buffer = m_data.bus->ReadRegister((address - getStart()) / 8);
-    else
-        *buffer = m_data.device->ReadQWord((address - getStart()) / 8);
+    uint64_t port = GetPort(address);
+    *buffer = m_ports[port].read[3](m_object, port);
 }
 
 void IOMemoryRegion::write8(uint64_t address, const uint8_t* buffer) {
-    if (m_isBus)
-        m_data.bus->WriteRegister((address - getStart()) / 8, *buffer);
-    else
-        m_data.device->WriteByte((address - getStart()) / 8, *buffer);
+    uint64_t port = GetPort(address);
+    m_ports[port].write[0](m_object, port, *buffer);
 }
 
 void IOMemoryRegion::write16(uint64_t address, const uint16_t* buffer) {
-    if (m_isBus)
-        m_data.bus->WriteRegister((address - getStart()) / 8, *buffer);
-    else
-        m_data.device->WriteWord((address - getStart()) / 8, *buffer);
+    uint64_t port = GetPort(address);
+    m_ports[port].write[1](m_object, port, *buffer);
 }
 
 void IOMemoryRegion::write32(uint64_t address, const uint32_t* buffer) {
-    if (m_isBus)
-        m_data.bus->WriteRegister((address - getStart()) / 8, *buffer);
-    else
-        m_data.device->WriteDWord((address - getStart()) / 8, *buffer);
+    uint64_t port = GetPort(address);
+    m_ports[port].write[2](m_object, port, *buffer);
 }
 
 void IOMemoryRegion::write64(uint64_t address, const uint64_t* buffer) {
-    if (m_isBus)
-        m_data.bus->WriteRegister((address - getStart()) / 8, *buffer);
-    else
-        m_data.device->WriteQWord((address - getStart()) / 8, *buffer);
+    uint64_t port = GetPort(address);
+    m_ports[port].write[3](m_object, port, *buffer);
 }
 
 void IOMemoryRegion::dump() {
     printf("IOMemoryRegion: %lx - %lx\n", getStart(), getEnd());
 }
+
+void IOMemoryRegion::BindDevice(IODevice* device) {
+    static constexpr IOReadHandler deviceReads[4] = {ReadDeviceByte, ReadDeviceWord, ReadDeviceDWord, ReadDeviceQWord};
+    static constexpr IOWriteHandler deviceWrites[4] = {WriteDeviceByte, WriteDeviceWord, WriteDeviceDWord, WriteDeviceQWord};
+    for (uint64_t port = 0; port < m_portCount; port++) {
+        for (int i = 0; i < 4; i++) {
+            m_ports[port].read[i] = deviceReads[i];
+            m_ports[port].write[i] = deviceWrites[i];
+        }
+    }
+
+    for (const IORegister& reg : device->GetRegisters()) {
+        if (reg.port >= m_portCount)
+            continue;
+        for (int i = 0; i < 4; i++) {
+            if ((reg.widths & (1 << i)) == 0)
+                continue;
+            m_ports[reg.port].read[i] = reg.read != nullptr ? reg.read : ReadZero;
+            m_ports[reg.port].write[i] = reg.write != nullptr ? reg.write : WriteIgnored;
+        }
+    }
+}
+
+uint8_t IOMemoryRegion::GetChunkWidth(uint64_t offset, size_t size) {
+    for (uint8_t width = IO_WIDTH_QWORD; width > IO_WIDTH_BYTE; width >>= 1) {
+        if ((offset & (width - 1)) == 0 && size >= width)
+            return width;
+    }
+    return IO_WIDTH_BYTE;
+}
@@ -23,6 +23,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <MMU/MemoryRegion.hpp>
 
 #include "IOBus.hpp"
+#include "IODevice.hpp"
 
 class IOMemoryRegion : public MemoryRegion {
    public:
@@ -44,12 +45,25 @@ class IOMemoryRegion : public MemoryRegion {
 
     virtual void dump() override;
 
+    virtual MemoryRegionType getType() override { return MemoryRegionType::IO; }
+
    private:
-    union {
-        IOBus* bus;
-        IODevice* device;
-    } m_data;
-    bool m_isBus;
+    // The handlers for each access width, indexed by log2 of the width in bytes
+    struct Port {
+        IOReadHandler read[4];
+        IOWriteHandler write[4];
+    };
+
+    void BindDevice(IODevice* device);
+
+    uint64_t GetPort(uint64_t address) { return (address - getStart()) >> 3; }
+
+    // Split a buffer access into the widest aligned accesses that fit
+    static uint8_t GetChunkWidth(uint64_t address, size_t size);
+
+    void* m_object; // the bus or device passed to the handlers
+    Port* m_ports;
+    uint64_t m_portCount;
 };
 
 #endif /* _IO_MEMORY_REGION_HPP */
\ No newline at end of file
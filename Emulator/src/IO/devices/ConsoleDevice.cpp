@@ -19,15 +19,34 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <Emulator.hpp>
 
-#ifdef EMULATOR_DEBUG
+#include <MMU/MMU.hpp>
+
 #include <stdio.h>
-#endif
+#include <string.h>
+
+#include <util.h>
 
-ConsoleDevice::ConsoleDevice(uint64_t size)
-    : IODevice(IODeviceID::CONSOLE, size) {
+static thread_local bool g_IsConsoleIOThread = false;
+
+ConsoleDevice::ConsoleDevice(uint64_t size, MMU* PhysicalMMU, const ConsoleEndpointConfig& endpoint)
+    : IODevice(IODeviceID::CONSOLE, size, 1), m_PhysicalMMU(PhysicalMMU), m_data(0), m_status(0), m_outputHead(0), m_outputTail(0), m_outputSleeping(false), m_outputDropped(false), m_inputHead(0), m_inputTail(0), m_inputEnded(false), m_inputStarted(false), m_rxInterrupt(false), m_rxInterruptPending(false) {
+    m_endpoint = new ConsoleEndpoint(endpoint);
+    m_output = new uint8_t[CONSOLE_OUTPUT_BUFFER_SIZE];
+    m_input = new uint8_t[CONSOLE_INPUT_BUFFER_SIZE];
+    m_thread = std::thread(&ConsoleDevice::IOLoop, this);
 }
 
 ConsoleDevice::~ConsoleDevice() {
+    // the thread is never stopped, as the console lasts until the emulator exits
+    Flush();
+    m_thread.detach();
+}
+
+void ConsoleDevice::Reset() {
+    m_rxInterrupt = false;
+    m_rxInterruptPending = false;
+    m_data = 0;
+    m_status = 0;
 }
 
 uint8_t ConsoleDevice::ReadByte(uint64_t address) {
@@ -36,68 +55,262 @@ uint8_t ConsoleDevice::ReadByte(uint64_t address) {
 #else
     (void)address;
 #endif
-    return static_cast<uint8_t>(Emulator::ReadCharFromConsole());
+    // waits for input, and gives 0xFF once it has ended
+    return static_cast<uint8_t>(Read(true));
 }
 
-uint16_t ConsoleDevice::ReadWord(uint64_t address) {
+void ConsoleDevice::WriteByte(uint64_t address, uint8_t data) {
 #ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::ReadWord(%lu)\n", address);
+    printf("ConsoleDevice::WriteByte(%lu, %hhu)\n", address, data);
 #else
     (void)address;
 #endif
-    return 0;
+    Write(&data, 1);
 }
 
-uint32_t ConsoleDevice::ReadDWord(uint64_t address) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::ReadDWord(%lu)\n", address);
-#else
-    (void)address;
-#endif
-    return 0;
+std::span<const IORegister> ConsoleDevice::GetRegisters() const {
+    static constexpr IORegister registers[] = {
+        {static_cast<uint64_t>(ConsoleDeviceRegisters::COMMAND), IO_WIDTH_QWORD, nullptr, IORegisterWrite<ConsoleDevice, &ConsoleDevice::WriteCommand>},
+        {static_cast<uint64_t>(ConsoleDeviceRegisters::DATA), IO_WIDTH_QWORD, IORegisterRead<ConsoleDevice, &ConsoleDevice::ReadData>, IORegisterWrite<ConsoleDevice, &ConsoleDevice::WriteData>},
+        {static_cast<uint64_t>(ConsoleDeviceRegisters::STATUS), IO_WIDTH_QWORD, IORegisterRead<ConsoleDevice, &ConsoleDevice::ReadStatus>, nullptr},
+        {static_cast<uint64_t>(ConsoleDeviceRegisters::RX), IO_WIDTH_QWORD, IORegisterRead<ConsoleDevice, &ConsoleDevice::ReadRX>, nullptr},
+    };
+    return registers;
 }
 
-uint64_t ConsoleDevice::ReadQWord(uint64_t address) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::ReadQWord(%lu)\n", address);
-#else
-    (void)address;
-#endif
-    return 0;
+uint64_t ConsoleDevice::ReadData() {
+    return m_data;
 }
 
-void ConsoleDevice::WriteByte(uint64_t address, uint8_t data) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::WriteByte(%lu, %hhu)\n", address, data);
-#else
-    (void)address;
-#endif
-    Emulator::WriteCharToConsole(static_cast<char>(data));
+uint64_t ConsoleDevice::ReadStatus() {
+    uint64_t status = m_status;
+    if (m_rxInterrupt)
+        status |= CONSOLE_STATUS_RX_INTERRUPT;
+    std::lock_guard<std::mutex> guard(m_inputLock);
+    if (m_inputHead != m_inputTail)
+        status |= CONSOLE_STATUS_RX_AVAILABLE;
+    else if (m_inputEnded)
+        status |= CONSOLE_STATUS_RX_ENDED;
+    return status;
 }
 
-void ConsoleDevice::WriteWord(uint64_t address, uint16_t data) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::WriteWord(%lu, %hu)\n", address, data);
-#else
-    (void)address;
-#endif
-    (void)data;
+uint64_t ConsoleDevice::ReadRX() {
+    StartInput();
+    int c = Read(false);
+    return c < 0 ? CONSOLE_RX_EMPTY : static_cast<uint64_t>(c);
 }
 
-void ConsoleDevice::WriteDWord(uint64_t address, uint32_t data) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::WriteDWord(%lu, %u)\n", address, data);
-#else
-    (void)address;
-#endif
-    (void)data;
+void ConsoleDevice::WriteCommand(uint64_t data) {
+    HandleCommand(static_cast<ConsoleDeviceCommands>(data));
 }
 
-void ConsoleDevice::WriteQWord(uint64_t address, uint64_t data) {
-#ifdef EMULATOR_DEBUG
-    printf("ConsoleDevice::WriteQWord(%lu, %lu)\n", address, data);
-#else
-    (void)address;
-#endif
-    (void)data;
+void ConsoleDevice::WriteData(uint64_t data) {
+    m_data = data;
+}
+
+void ConsoleDevice::Flush() {
+    // the endpoint crashes the emulator from the I/O thread, which is the only thread that could drain the output
+    if (g_IsConsoleIOThread)
+        return;
+    std::unique_lock<std::mutex> lock(m_outputLock);
+    uint64_t tail = m_outputTail.load();
+    while (!m_outputDrained.wait_for(lock, std::chrono::milliseconds(CONSOLE_FLUSH_TIMEOUT), [this] { return m_outputTail.load() == m_outputHead.load() || m_outputDropped; })) {
+        // keep waiting as long as the endpoint is still taking output
+        uint64_t newTail = m_outputTail.load();
+        if (newTail == tail) {
+            m_outputDropped = true;
+            m_outputDrained.notify_all(); // a write waiting for space gives up as well
+            break;
+        }
+        tail = newTail;
+    }
+}
+
+void ConsoleDevice::RaiseRXInterrupt() {
+    m_rxInterruptPending = false;
+    if (m_rxInterrupt)
+        RaiseInterrupt(0);
+}
+
+void ConsoleDevice::HandleCommand(ConsoleDeviceCommands command) {
+    switch (command) {
+    case ConsoleDeviceCommands::WRITE: {
+        if (!m_PhysicalMMU->ValidateRead(m_data, sizeof(ConsoleDevice_WriteRequest))) {
+            m_status = CONSOLE_STATUS_ERROR;
+            return;
+        }
+        ConsoleDevice_WriteRequest request;
+        m_PhysicalMMU->ReadBuffer(m_data, reinterpret_cast<uint8_t*>(&request), sizeof(request));
+        if (request.address + request.count < request.address || !m_PhysicalMMU->ValidateRead(request.address, request.count)) {
+            m_status = CONSOLE_STATUS_ERROR;
+            return;
+        }
+
+        // the string is copied before the command completes, so the guest can reuse it straight away
+        uint8_t buffer[4096];
+        for (uint64_t offset = 0; offset < request.count; offset += sizeof(buffer)) {
+            uint64_t size = MIN(request.count - offset, sizeof(buffer));
+            m_PhysicalMMU->ReadBuffer(request.address + offset, buffer, size);
+            Write(buffer, size);
+        }
+        m_status = 0;
+        break;
+    }
+    case ConsoleDeviceCommands::SET_RX_INTERRUPT: {
+        m_rxInterrupt = (m_data & 1) != 0;
+        m_status = 0;
+        if (!m_rxInterrupt)
+            break;
+        StartInput();
+        // input that arrived, or an end that came, before the interrupt was enabled would otherwise never raise it
+        bool available = false;
+        {
+            std::lock_guard<std::mutex> guard(m_inputLock);
+            available = m_inputHead != m_inputTail || m_inputEnded;
+        }
+        if (available)
+            QueueRXInterrupt();
+        break;
+    }
+    default:
+        m_status = CONSOLE_STATUS_ERROR;
+        break;
+    }
+}
+
+void ConsoleDevice::Write(const uint8_t* data, size_t size) {
+    while (size > 0 && !m_outputDropped) {
+        uint64_t head = m_outputHead.load(std::memory_order_relaxed);
+        uint64_t tail = m_outputTail.load(std::memory_order_acquire);
+        if (head - tail == CONSOLE_OUTPUT_BUFFER_SIZE) {
+            std::unique_lock<std::mutex> lock(m_outputLock);
+            m_outputDrained.wait(lock, [this, head] { return head - m_outputTail.load() < CONSOLE_OUTPUT_BUFFER_SIZE || m_outputDropped; });
+            continue;
+        }
+        uint64_t start = head % CONSOLE_OUTPUT_BUFFER_SIZE;
+        uint64_t count = MIN(MIN(size, CONSOLE_OUTPUT_BUFFER_SIZE - (head - tail)), CONSOLE_OUTPUT_BUFFER_SIZE - start);
+        memcpy(m_output + start, data, count);
+        m_outputHead.store(head + count);
+        data += count;
+        size -= count;
+        // either the I/O thread sees the new head before it sleeps, or it is seen sleeping here
+        if (m_outputSleeping.exchange(false))
+            m_endpoint->Wake();
+    }
+}
+
+int ConsoleDevice::Read(bool wait) {
+    if (wait)
+        StartInput();
+    std::unique_lock<std::mutex> lock(m_inputLock);
+    if (wait)
+        m_inputAvailable.wait(lock, [this] { return m_inputHead != m_inputTail || m_inputEnded; });
+    if (m_inputHead == m_inputTail)
+        return -1;
+    bool wasFull = m_inputHead - m_inputTail == CONSOLE_INPUT_BUFFER_SIZE;
+    uint8_t c = m_input[m_inputTail % CONSOLE_INPUT_BUFFER_SIZE];
+    m_inputTail++;
+    if (wasFull)
+        m_endpoint->Wake(); // the I/O thread stops reading while the buffer is full
+    return c;
+}
+
+void ConsoleDevice::StartInput() {
+    {
+        std::lock_guard<std::mutex> guard(m_inputLock);
+        if (m_inputStarted)
+            return;
+        m_inputStarted = true;
+    }
+    m_endpoint->Wake();
+}
+
+void ConsoleDevice::IOLoop() {
+    g_IsConsoleIOThread = true;
+    uint8_t* buffer = new uint8_t[CONSOLE_INPUT_BUFFER_SIZE];
+    bool outputWaiting = false; // output has been given its time to build up, and is written as fast as it can be
+    std::chrono::steady_clock::time_point writeTime;
+    while (true) {
+        bool read;
+        {
+            std::lock_guard<std::mutex> guard(m_inputLock);
+            read = m_inputStarted && !m_inputEnded && m_inputHead - m_inputTail < CONSOLE_INPUT_BUFFER_SIZE;
+        }
+
+        int ready;
+        uint64_t tail = m_outputTail.load(std::memory_order_relaxed);
+        if (m_outputHead.load() == tail) {
+            outputWaiting = false;
+            m_outputSleeping.store(true);
+            if (m_outputHead.load() == tail)
+                ready = m_endpoint->Wait(read, false, -1);
+            else
+                ready = 0;
+            m_outputSleeping.store(false);
+        } else if (!outputWaiting) {
+            // guests often write a byte at a time, so give them a moment to write more before it is sent
+            outputWaiting = true;
+            writeTime = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONSOLE_OUTPUT_DELAY);
+            ready = m_endpoint->Wait(read, false, CONSOLE_OUTPUT_DELAY);
+        } else if (std::chrono::steady_clock::now() < writeTime) {
+            ready = m_endpoint->Wait(read, false, CONSOLE_OUTPUT_DELAY);
+        } else {
+            ready = m_endpoint->Wait(read, true, -1);
+        }
+
+        if (ready & CONSOLE_ENDPOINT_READABLE)
+            ReceiveInput(buffer);
+        if (ready & CONSOLE_ENDPOINT_WRITABLE)
+            SendOutput();
+    }
+}
+
+void ConsoleDevice::ReceiveInput(uint8_t* buffer) {
+    uint64_t space;
+    {
+        std::lock_guard<std::mutex> guard(m_inputLock);
+        space = CONSOLE_INPUT_BUFFER_SIZE - (m_inputHead - m_inputTail);
+    }
+    long count = m_endpoint->Read(buffer, space);
+    if (count == 0)
+        return;
+
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> guard(m_inputLock);
+        wasEmpty = m_inputHead == m_inputTail;
+        if (count < 0) {
+            m_inputEnded = true;
+        } else {
+            for (long i = 0; i < count; i++)
+                m_input[(m_inputHead + i) % CONSOLE_INPUT_BUFFER_SIZE] = buffer[i];
+            m_inputHead += count;
+        }
+        m_inputAvailable.notify_all();
+    }
+    // a guest that empties the buffer in its handler is interrupted again for anything that arrives after, and once
+    // more when the input ends
+    if (wasEmpty && m_rxInterrupt)
+        QueueRXInterrupt();
+}
+
+void ConsoleDevice::SendOutput() {
+    // everything up to the end of the buffer in one write, while the guest keeps adding to it
+    uint64_t tail = m_outputTail.load(std::memory_order_relaxed);
+    uint64_t head = m_outputHead.load(std::memory_order_acquire);
+    uint64_t start = tail % CONSOLE_OUTPUT_BUFFER_SIZE;
+    uint64_t count = m_endpoint->Write(m_output + start, MIN(head - tail, CONSOLE_OUTPUT_BUFFER_SIZE - start));
+    if (count == 0)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(m_outputLock);
+        m_outputTail.store(tail + count, std::memory_order_release);
+        m_outputDropped = false; // the endpoint is taking output again
+    }
+    m_outputDrained.notify_all();
+}
+
+void ConsoleDevice::QueueRXInterrupt() {
+    if (!m_rxInterruptPending.exchange(true))
+        Emulator::RaiseEvent({Emulator::EventType::ConsoleInterrupt, reinterpret_cast<uint64_t>(this)});
 }
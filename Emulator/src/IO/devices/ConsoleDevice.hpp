@@ -19,21 +19,123 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _CONSOLE_IO_DEVICE_HPP
 
 #include <IO/IODevice.hpp>
+#include <OSSpecific/ConsoleEndpoint.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class MMU;
+
+// Registers are only used by QWORD accesses. A byte read or write anywhere in the device is a character, like it
+// always was, and other accesses are ignored.
+enum class ConsoleDeviceRegisters {
+    COMMAND = 0,
+    DATA = 1,
+    STATUS = 2,
+    RX = 3
+};
+
+#define CONSOLE_STATUS_ERROR 1
+#define CONSOLE_STATUS_RX_AVAILABLE 2
+#define CONSOLE_STATUS_RX_INTERRUPT 4
+#define CONSOLE_STATUS_RX_ENDED 8 // the input has ended and everything before it has been read
+
+#define CONSOLE_RX_EMPTY 0xFFFF'FFFF'FFFF'FFFF
+
+#define CONSOLE_OUTPUT_BUFFER_SIZE 65536
+#define CONSOLE_OUTPUT_DELAY 1 // milliseconds the I/O thread waits after output first arrives, so more can build up
+#define CONSOLE_FLUSH_TIMEOUT 1000 // milliseconds a flush waits for the endpoint to take the output before dropping it
+#define CONSOLE_INPUT_BUFFER_SIZE 4096
+
+enum class ConsoleDeviceCommands {
+    WRITE = 0,
+    SET_RX_INTERRUPT = 1
+};
+
+struct [[gnu::packed]] ConsoleDevice_WriteRequest {
+    uint64_t address;
+    uint64_t count;
+};
 
 class ConsoleDevice : public IODevice {
 public:
-    ConsoleDevice(uint64_t size);
+    ConsoleDevice(uint64_t size, MMU* PhysicalMMU, const ConsoleEndpointConfig& endpoint);
     virtual ~ConsoleDevice();
 
-    virtual uint8_t ReadByte(uint64_t address) override;
-    virtual uint16_t ReadWord(uint64_t address) override;
-    virtual uint32_t ReadDWord(uint64_t address) override;
-    virtual uint64_t ReadQWord(uint64_t address) override;
+    // Output and input that hasn't been read yet are kept
+    virtual void Reset() override;
 
+    virtual uint8_t ReadByte(uint64_t address) override;
     virtual void WriteByte(uint64_t address, uint8_t data) override;
-    virtual void WriteWord(uint64_t address, uint16_t data) override;
-    virtual void WriteDWord(uint64_t address, uint32_t data) override;
-    virtual void WriteQWord(uint64_t address, uint64_t data) override;
+
+    virtual std::span<const IORegister> GetRegisters() const override;
+
+    // Wait until everything the guest wrote has reached the endpoint, or the endpoint has taken nothing for
+    // CONSOLE_FLUSH_TIMEOUT. Output is then dropped until the endpoint takes some again. Safe to call from any thread,
+    // and does nothing on the I/O thread, which would be waiting for itself.
+    void Flush();
+
+    // MUST only be called from the emulator thread
+    void RaiseRXInterrupt();
+
+private:
+    // QWORD register handlers
+    uint64_t ReadData();
+    uint64_t ReadStatus();
+    uint64_t ReadRX();
+    void WriteCommand(uint64_t data);
+    void WriteData(uint64_t data);
+
+    void HandleCommand(ConsoleDeviceCommands command);
+
+    // Add to the output buffer, waiting for space if it is full, unless output is being dropped. MUST only be called
+    // from the emulator thread.
+    void Write(const uint8_t* data, size_t size);
+
+    // Take the next input byte. Returns -1 if there is none, or if the input has ended when waiting.
+    int Read(bool wait);
+
+    void StartInput();
+
+    // Serves both directions of the endpoint
+    void IOLoop();
+    void ReceiveInput(uint8_t* buffer);
+    void SendOutput();
+
+    // Raise the RX interrupt from any thread. Only one is raised until the emulator thread gets to it.
+    void QueueRXInterrupt();
+
+private:
+    MMU* m_PhysicalMMU;
+    uint64_t m_data;
+    uint64_t m_status;
+
+    ConsoleEndpoint* m_endpoint;
+    std::thread m_thread;
+
+    // The output buffer has one writer and one reader, so adding to it doesn't need the lock. The lock is only for
+    // waiting for it to drain.
+    std::mutex m_outputLock;
+    std::condition_variable m_outputDrained; // notified whenever some output has been written out
+    uint8_t* m_output;
+    std::atomic<uint64_t> m_outputHead; // total bytes added
+    std::atomic<uint64_t> m_outputTail; // total bytes written out
+    std::atomic_bool m_outputSleeping; // the I/O thread needs waking for new output
+    std::atomic_bool m_outputDropped; // the endpoint stopped taking output, so new output is thrown away
+
+    std::mutex m_inputLock; // protects the input buffer
+    std::condition_variable m_inputAvailable;
+    uint8_t* m_input;
+    uint64_t m_inputHead; // total bytes read from the endpoint
+    uint64_t m_inputTail; // total bytes taken by the guest
+    bool m_inputEnded;
+    bool m_inputStarted; // the endpoint is only read once the guest asks for input
+
+    std::atomic_bool m_rxInterrupt;
+    std::atomic_bool m_rxInterruptPending;
 };
 
-#endif /* _CONSOLE_IO_DEVICE_HPP */
\ No newline at end of file
+#endif /* _CONSOLE_IO_DEVICE_HPP */
@@ -15,10 +15,15 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+
 #include "PhysicalRegionListBuffer.hpp"
 
+#include <util.h>
+
+#include <algorithm>
+
 PhysicalRegionListBuffer::PhysicalRegionListBuffer(StorageDevice* storageDevice, MMU* PhysicalMMU)
-    : m_storageDevice(storageDevice), m_PhysicalMMU(PhysicalMMU), m_listStart(0), m_listNodeCount(0), m_listParsed(false), m_size(0) {
+    : m_storageDevice(storageDevice), m_PhysicalMMU(PhysicalMMU), m_listStart(0), m_listNodeCount(0), m_listParsed(false), m_cacheValid(false), m_size(0) {
 }
 
 PhysicalRegionListBuffer::~PhysicalRegionListBuffer() {
@@ -28,57 +33,47 @@ bool PhysicalRegionListBuffer::ParseList() {
     if (m_listParsed)
         return true;
 
-    uint64_t nodeStart = m_listStart;
+    if (!ReadNodes(m_scratchNodes)) {
+        m_cacheValid = false;
+        return false;
+    }
 
-    if (m_items.getCount() > 0) {
-        const uint64_t itemCount = m_items.getCount();
-        for (uint64_t i = 0; i < itemCount; i++) {
-            Item* item = m_items.get(0);
-            m_items.remove(item); // item deletion is faster than indexed deletion
-            delete item;
-        }
+    // the guest can rewrite a list in place, so a cached list is only used if the nodes are unchanged
+    if (m_cacheValid && m_scratchNodes == m_nodes) {
+        m_listParsed = true;
+        return true;
     }
 
-    uint64_t currentSize = 0;
+    m_cacheValid = false;
+    m_items.clear();
+    m_nodes.swap(m_scratchNodes);
 
+    uint64_t currentSize = 0;
+    uint64_t index = 0;
     for (uint64_t i = 0; i < m_listNodeCount; i++) {
-        if (!m_PhysicalMMU->ValidateRead(nodeStart, 8))
-            return false;
-        uint64_t itemCount = m_PhysicalMMU->read64(nodeStart);
-        nodeStart += 8;
-        for (uint64_t j = 0; j < itemCount; j++) {
-            if (!m_PhysicalMMU->ValidateRead(nodeStart, 16))
-                return false;
-            Item* item = new Item();
-            item->start = m_PhysicalMMU->read64(nodeStart);
-            item->size = m_PhysicalMMU->read64(nodeStart + 8);
-            item->offset = currentSize;
-            m_items.insert(item);
-            currentSize += item->size << 9;
-            nodeStart += 16;
+        uint64_t itemCount = m_nodes[index++];
+        for (uint64_t j = 0; j < itemCount; j++, index += 2) {
+            uint64_t size = m_nodes[index + 1];
+            if (size > (m_size - currentSize) >> 9)
+                return false; // more data than the transfer
+            m_items.push_back({m_nodes[index], size << 9, currentSize});
+            currentSize += size << 9;
         }
-        if (!m_PhysicalMMU->ValidateRead(nodeStart, 8))
-            return false;
-        nodeStart = m_PhysicalMMU->read64(nodeStart);
+        index++; // next node
     }
 
     if (currentSize != m_size)
         return false;
 
     m_listParsed = true;
+    m_cacheValid = true;
 
     return true;
 }
 
 void PhysicalRegionListBuffer::ResetList(uint64_t listStart, uint64_t listNodeCount, uint64_t size) {
-    if (m_items.getCount() > 0) {
-        const uint64_t itemCount = m_items.getCount();
-        for (uint64_t i = 0; i < itemCount; i++) {
-            Item* item = m_items.get(0);
-            m_items.remove(item); // item deletion is faster than indexed deletion
-            delete item;
-        }
-    }
+    if (listStart != m_listStart || listNodeCount != m_listNodeCount || size != m_size)
+        m_cacheValid = false;
 
     m_listStart = listStart;
     m_listNodeCount = listNodeCount;
@@ -87,17 +82,12 @@ void PhysicalRegionListBuffer::ResetList(uint64_t listStart, uint64_t listNodeCo
 }
 
 void PhysicalRegionListBuffer::ClearList() {
-    if (m_items.getCount() > 0) {
-        const uint64_t itemCount = m_items.getCount();
-        for (uint64_t i = 0; i < itemCount; i++) {
-            Item* item = m_items.get(0);
-            m_items.remove(item); // item deletion is faster than indexed deletion
-            delete item;
-        }
-    }
+    m_items.clear();
+    m_nodes.clear();
     m_listStart = 0;
     m_listNodeCount = 0;
     m_listParsed = false;
+    m_cacheValid = false;
     m_size = 0;
 }
 
@@ -108,16 +98,13 @@ void PhysicalRegionListBuffer::Write(uint64_t offset, const uint8_t* data, size_
     if (!m_listParsed)
         return;
 
-    for (uint64_t i = 0; i < m_items.getCount(); i++) {
-        if (Item* item = m_items.get(i); offset >= item->offset && offset < item->offset + item->size * 512) {
-            uint64_t writeSize = size;
-            if (offset + size > item->offset + item->size * 512)
-                writeSize = item->offset + item->size * 512 - offset;
-            m_PhysicalMMU->WriteBuffer(item->start + offset - item->offset, data, writeSize);
-            data += writeSize;
-            size -= writeSize;
-            offset += writeSize;
-        }
+    for (uint64_t i = size > 0 ? FindItem(offset) : m_items.size(); i < m_items.size() && size > 0; i++) {
+        const Item& item = m_items[i];
+        uint64_t writeSize = MIN(size, item.offset + item.size - offset);
+        m_PhysicalMMU->WriteBuffer(item.start + offset - item.offset, data, writeSize);
+        data += writeSize;
+        size -= writeSize;
+        offset += writeSize;
     }
 }
 
@@ -128,19 +115,54 @@ void PhysicalRegionListBuffer::Read(uint64_t offset, uint8_t* data, size_t size)
     if (!m_listParsed)
         return;
 
-    for (uint64_t i = 0; i < m_items.getCount(); i++) {
-        if (Item* item = m_items.get(i); offset >= item->offset && offset < item->offset + item->size * 512) {
-            uint64_t readSize = size;
-            if (offset + size > item->offset + item->size * 512)
-                readSize = item->offset + item->size * 512 - offset;
-            m_PhysicalMMU->ReadBuffer(item->start + offset - item->offset, data, readSize);
-            data += readSize;
-            size -= readSize;
-            offset += readSize;
-        }
+    for (uint64_t i = size > 0 ? FindItem(offset) : m_items.size(); i < m_items.size() && size > 0; i++) {
+        const Item& item = m_items[i];
+        uint64_t readSize = MIN(size, item.offset + item.size - offset);
+        m_PhysicalMMU->ReadBuffer(item.start + offset - item.offset, data, readSize);
+        data += readSize;
+        size -= readSize;
+        offset += readSize;
     }
 }
 
+bool PhysicalRegionListBuffer::GetHostBuffers(bool write, std::vector<iovec>& buffers) const {
+    if (!m_listParsed)
+        return false;
+
+    buffers.clear();
+    for (const Item& item : m_items) {
+        if (!m_PhysicalMMU->GetHostBuffers(item.start, item.size, write, buffers))
+            return false;
+    }
+    return true;
+}
+
+bool PhysicalRegionListBuffer::ReadNodes(std::vector<uint64_t>& nodes) const {
+    nodes.clear();
+    uint64_t nodeStart = m_listStart;
+    for (uint64_t i = 0; i < m_listNodeCount; i++) {
+        uint64_t itemCount;
+        if (!m_PhysicalMMU->ReadRAM(nodeStart, reinterpret_cast<uint8_t*>(&itemCount), 8))
+            return false;
+        // the items and the next pointer are read in one go
+        if (itemCount > (UINT64_MAX - nodeStart) / 16 - 1)
+            return false;
+        size_t nodeSize = (itemCount * 2 + 1) * 8;
+        size_t index = nodes.size();
+        nodes.resize(index + 1 + itemCount * 2 + 1);
+        nodes[index] = itemCount;
+        if (!m_PhysicalMMU->ReadRAM(nodeStart + 8, reinterpret_cast<uint8_t*>(&nodes[index + 1]), nodeSize))
+            return false;
+        nodeStart = nodes.back();
+    }
+    return true;
+}
+
+uint64_t PhysicalRegionListBuffer::FindItem(uint64_t offset) const {
+    auto it = std::upper_bound(m_items.begin(), m_items.end(), offset, [](uint64_t value, const Item& item) { return value < item.offset; });
+    return static_cast<uint64_t>(it - m_items.begin()) - 1;
+}
+
 Buffer::Block* PhysicalRegionListBuffer::AddBlock(size_t) {
     return nullptr;
 }
@@ -19,8 +19,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _PHYSICAL_REGION_LIST_BUFFER_HPP
 
 #include <Data-structures/Buffer.hpp>
-#include <Data-structures/LinkedList.hpp>
 #include <MMU/MMU.hpp>
+#include <vector>
 
 class StorageDevice;
 
@@ -29,7 +29,9 @@ class PhysicalRegionListBuffer : public Buffer {
     PhysicalRegionListBuffer(StorageDevice* storageDevice, MMU* PhysicalMMU);
     ~PhysicalRegionListBuffer() override;
 
+    // Reads the list from RAM. The caller MUST hold the regions of the MMU shared until it is done with the host buffers.
     bool ParseList();
+    // If the list is the same as the last one, the parsed list is kept and only reused if the nodes haven't changed
     void ResetList(uint64_t listStart, uint64_t listNodeCount, uint64_t size);
     void ClearList();
 
@@ -39,23 +41,37 @@ class PhysicalRegionListBuffer : public Buffer {
     // Read size bytes from the buffer at offset to data
     void Read(uint64_t offset, uint8_t* data, size_t size) const override;
 
+    // Resolve the whole list to host memory, so a transfer can go straight to guest RAM.
+    // Returns false if the list isn't parsed or any item isn't RAM. If write is true, the device is about to write to guest memory.
+    bool GetHostBuffers(bool write, std::vector<iovec>& buffers) const;
+
    protected:
     struct Item {
         uint64_t start;
-        uint64_t size;
+        uint64_t size; // in bytes
         uint64_t offset;
     };
 
     Block* AddBlock(size_t size) override;
     void DeleteBlock(uint64_t index) override;
 
+   private:
+    // Read every node of the list into nodes, one bulk read per node. Returns false if any node isn't in RAM.
+    bool ReadNodes(std::vector<uint64_t>& nodes) const;
+
+    // Index of the item containing offset. offset must be less than m_size.
+    uint64_t FindItem(uint64_t offset) const;
+
    private:
     StorageDevice* m_storageDevice;
     MMU* m_PhysicalMMU;
     uint64_t m_listStart;
     uint64_t m_listNodeCount;
-    LinkedList::RearInsertLinkedList<Item> m_items;
+    std::vector<Item> m_items; // sorted by offset
+    std::vector<uint64_t> m_nodes; // raw contents of the nodes m_items was parsed from
+    std::vector<uint64_t> m_scratchNodes;
     bool m_listParsed;
+    bool m_cacheValid; // m_items and m_nodes are from a list at m_listStart
     uint64_t m_size;
 };
 
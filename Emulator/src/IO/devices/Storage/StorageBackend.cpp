@@ -0,0 +1,89 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageBackend.hpp"
+
+#include <string.h>
+#include <util.h>
+
+#include <libarch/DiskImage.hpp>
+
+#include "StorageBlockCache.hpp"
+#include "StorageFile.hpp"
+#include "StorageOverlay.hpp"
+#include "StorageSparseImage.hpp"
+
+StorageBackend* StorageBackend::Create(const char* path, const char* overlayPath, const StorageCacheConfig& cache) {
+    char magic[DISK_IMAGE_MAGIC_SIZE] = {};
+    FileHandle_t handle = OpenFile(path, true);
+    bool sparse = ReadFile(handle, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, DISK_IMAGE_MAGIC, DISK_IMAGE_MAGIC_SIZE) == 0;
+    CloseFile(handle);
+
+    StorageBackend* backend;
+    if (sparse)
+        backend = new StorageSparseImage(path);
+    else {
+        StorageFile* file = new StorageFile(path);
+        // direct transfers must be aligned, which only the cache guarantees, and the overlay splits them at any 512 byte block
+        file->SetDirect(cache.direct && cache.size > 0 && overlayPath == nullptr);
+        backend = file;
+    }
+
+    if (overlayPath != nullptr)
+        backend = new StorageOverlay(backend, overlayPath);
+    if (cache.size > 0)
+        backend = new StorageBlockCache(backend, cache.size, cache.writeBack);
+    return backend;
+}
+
+size_t StorageBackend::GetTotalSize(const std::vector<iovec>& buffers) {
+    size_t size = 0;
+    for (const iovec& buffer : buffers)
+        size += buffer.iov_len;
+    return size;
+}
+
+void StorageBackend::SliceBuffers(const std::vector<iovec>& buffers, uint64_t offset, uint64_t size, std::vector<iovec>& slice) {
+    slice.clear();
+    for (const iovec& buffer : buffers) {
+        if (size == 0)
+            break;
+        if (offset >= buffer.iov_len) {
+            offset -= buffer.iov_len;
+            continue;
+        }
+        size_t length = MIN(buffer.iov_len - offset, size);
+        slice.push_back({static_cast<uint8_t*>(buffer.iov_base) + offset, length});
+        offset = 0;
+        size -= length;
+    }
+}
+
+void StorageBackend::CopyToBuffers(const std::vector<iovec>& buffers, const uint8_t* data) {
+    for (const iovec& buffer : buffers) {
+        memcpy(buffer.iov_base, data, buffer.iov_len);
+        data += buffer.iov_len;
+    }
+}
+
+void StorageBackend::CopyFromBuffers(const std::vector<iovec>& buffers, uint8_t* data) {
+    for (const iovec& buffer : buffers) {
+        memcpy(data, buffer.iov_base, buffer.iov_len);
+        data += buffer.iov_len;
+    }
+}
@@ -0,0 +1,95 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_BACKEND_HPP
+#define _STORAGE_BACKEND_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <OSSpecific/File.hpp>
+#include <vector>
+
+// Host block cache settings for a drive. The cache is disabled if size is 0.
+struct StorageCacheConfig {
+    size_t size;    // in bytes
+    bool writeBack; // if false, writes reach the image before they complete
+    bool direct;    // bypass the host page cache for raw images without an overlay
+};
+
+// A drive to attach. If overlayPath is not null, the image is only read and writes go to the overlay.
+struct StorageDriveConfig {
+    const char* path;
+    const char* overlayPath;
+    uint64_t blockSize; // STORAGE_BLOCK_SIZE_SMALL or STORAGE_BLOCK_SIZE_LARGE
+};
+
+#define STORAGE_BLOCK_SIZE_SMALL 512
+#define STORAGE_BLOCK_SIZE_LARGE 4096
+
+#define STORAGE_MAX_DRIVES 16
+
+// Where the contents of a drive come from. Transfers can be called from several threads at once.
+class StorageBackend {
+public:
+    explicit StorageBackend(const char* path) : m_path(path), m_readOnly(false) {}
+    virtual ~StorageBackend() {}
+
+    // Pick the backend for the image at path. If overlayPath is not null, the image is only read and writes go to the overlay.
+    static StorageBackend* Create(const char* path, const char* overlayPath, const StorageCacheConfig& cache);
+
+    virtual void Initialise() = 0;
+    virtual void Destroy() = 0;
+
+    const char* GetPath() const { return m_path; }
+
+    // Only takes effect on the next Initialise
+    void SetReadOnly(bool readOnly) { m_readOnly = readOnly; }
+
+    virtual size_t GetSize() const = 0;
+
+    // Transfer between the drive at offset and host buffers. Returns false if the whole transfer could not be done.
+    virtual bool ReadVector(uint64_t offset, const std::vector<iovec>& buffers) = 0;
+    virtual bool WriteVector(uint64_t offset, const std::vector<iovec>& buffers) = 0;
+
+    // The range is no longer in use, so the backend can free the space it takes up. The range reads as undefined data
+    // until it is written again. Returns false if the range is invalid or the backend couldn't be updated.
+    virtual bool Discard(uint64_t offset, uint64_t size) = 0;
+
+    // Make every completed write durable. Returns false if that could not be done.
+    virtual bool Flush() = 0;
+
+    virtual void PrintStats(FILE*) {}
+
+   protected:
+    static size_t GetTotalSize(const std::vector<iovec>& buffers);
+
+    // Take size bytes of buffers, starting offset bytes in
+    static void SliceBuffers(const std::vector<iovec>& buffers, uint64_t offset, uint64_t size, std::vector<iovec>& slice);
+
+    // Copy between buffers and contiguous memory
+    static void CopyToBuffers(const std::vector<iovec>& buffers, const uint8_t* data);
+    static void CopyFromBuffers(const std::vector<iovec>& buffers, uint8_t* data);
+
+   protected:
+    const char* m_path;
+    bool m_readOnly;
+};
+
+#endif /* _STORAGE_BACKEND_HPP */
@@ -0,0 +1,531 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "StorageBlockCache.hpp"
+
+#include <util.h>
+
+#include <algorithm>
+#include <OSSpecific/Memory.hpp>
+
+StorageBlockCache::StorageBlockCache(StorageBackend* backend, size_t size, bool writeBack)
+    : StorageBackend(backend->GetPath()), m_backend(backend), m_writeBack(writeBack), m_capacity(MAX(size / STORAGE_CACHE_BLOCK_SIZE, STORAGE_CACHE_MIN_BLOCKS)), m_chunkBlocks(m_capacity / 2), m_maxReadAhead(MIN(STORAGE_CACHE_MAX_READ_AHEAD, m_capacity / 4)), m_memory(nullptr), m_open(false), m_head(nullptr), m_tail(nullptr), m_dirtyCount(0), m_writingCount(0), m_reserved(0), m_nextReadOffset(UINT64_MAX), m_readAheadSize(0), m_readAheadEnd(0), m_stats{0, 0, 0, 0, 0} {
+
+}
+
+StorageBlockCache::~StorageBlockCache() {
+    if (m_open)
+        Destroy();
+    delete m_backend;
+}
+
+void StorageBlockCache::Initialise() {
+    m_backend->Initialise();
+    m_memory = static_cast<uint8_t*>(OSSpecific::AllocateCOWMemory(m_capacity * STORAGE_CACHE_BLOCK_SIZE));
+    m_storage.resize(m_capacity);
+    m_free.clear();
+    for (uint64_t i = 0; i < m_capacity; i++) {
+        m_storage[i] = {0, m_memory + i * STORAGE_CACHE_BLOCK_SIZE, false, false, false, false, false, 0, nullptr, nullptr};
+        m_free.push_back(&m_storage[m_capacity - i - 1]); // hand out the lowest addresses first
+    }
+    m_blocks.clear();
+    m_head = nullptr;
+    m_tail = nullptr;
+    m_dirtyCount = 0;
+    m_writingCount = 0;
+    m_reserved = 0;
+    m_nextReadOffset = UINT64_MAX;
+    m_readAheadSize = 0;
+    m_readAheadEnd = 0;
+    m_stats = {0, 0, 0, 0, 0};
+    m_open = true;
+}
+
+void StorageBlockCache::Destroy() {
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_blockDone.wait(lock, [this] { return m_writingCount == 0; });
+        if (!WriteBackDirty(lock))
+            fprintf(stderr, "Failed to write the block cache back to %s\n", m_path);
+        m_blocks.clear();
+        m_free.clear();
+        m_storage.clear();
+        OSSpecific::FreeSizedCOWMemory(m_memory, m_capacity * STORAGE_CACHE_BLOCK_SIZE);
+        m_memory = nullptr;
+    }
+    m_backend->Destroy();
+    m_open = false;
+}
+
+bool StorageBlockCache::ReadVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (size == 0 || offset > GetSize() || size > GetSize() - offset)
+        return false;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (offset == m_nextReadOffset)
+        m_readAheadSize = m_readAheadSize == 0 ? MIN(4, m_maxReadAhead) : MIN(m_readAheadSize * 2, m_maxReadAhead);
+    else {
+        m_readAheadSize = 0;
+        m_readAheadEnd = 0;
+    }
+    m_nextReadOffset = offset + size;
+
+    uint64_t lastBlock = (offset + size - 1) / STORAGE_CACHE_BLOCK_SIZE;
+    std::vector<Block*> blocks;
+    std::vector<iovec> slice;
+    for (uint64_t first = offset / STORAGE_CACHE_BLOCK_SIZE; first <= lastBlock; first += m_chunkBlocks) {
+        uint64_t last = MIN(first + m_chunkBlocks - 1, lastBlock);
+
+        // start the next window once half of the current one has been used
+        uint64_t readAhead = 0;
+        if (last == lastBlock && m_readAheadSize > 0 && last + 1 + m_readAheadSize / 2 >= m_readAheadEnd) {
+            readAhead = m_readAheadSize;
+            m_readAheadEnd = last + 1 + readAhead;
+        }
+
+        uint64_t reserved = last - first + 1 + readAhead;
+        Reserve(lock, reserved);
+        bool success = Load(lock, first, last, readAhead, blocks);
+        for (Block* block : blocks) {
+            // blocks other transfers were loading are only waited for once our own are loaded
+            WaitForBlock(lock, block, false);
+            if (!block->valid)
+                success = false;
+            if (!success)
+                continue;
+            uint64_t blockStart = block->index * STORAGE_CACHE_BLOCK_SIZE;
+            uint64_t start = MAX(blockStart, offset);
+            uint64_t end = MIN(blockStart + GetBlockLength(block->index), offset + size);
+            SliceBuffers(buffers, start - offset, end - start, slice);
+            CopyToBuffers(slice, block->data + (start - blockStart));
+        }
+        for (Block* block : blocks)
+            Release(block);
+        Unreserve(reserved);
+        if (!success)
+            return false;
+    }
+    return true;
+}
+
+bool StorageBlockCache::WriteVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (m_readOnly || size == 0 || offset > GetSize() || size > GetSize() - offset)
+        return false;
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    uint64_t lastBlock = (offset + size - 1) / STORAGE_CACHE_BLOCK_SIZE;
+    std::vector<Block*> blocks;
+    std::vector<Block*> inserted;
+    std::vector<Block*> partial;
+    std::vector<iovec> slice;
+    for (uint64_t first = offset / STORAGE_CACHE_BLOCK_SIZE; first <= lastBlock; first += m_chunkBlocks) {
+        uint64_t last = MIN(first + m_chunkBlocks - 1, lastBlock);
+        Reserve(lock, last - first + 1);
+
+        blocks.clear();
+        inserted.clear();
+        partial.clear();
+        bool success = true;
+        for (uint64_t index = first; index <= last; index++) {
+            bool fresh = false;
+            Block* block = Acquire(lock, index, fresh);
+            if (block == nullptr) {
+                success = false;
+                break;
+            }
+            if (fresh) {
+                inserted.push_back(block);
+                // only blocks the write doesn't completely cover need their old contents
+                uint64_t blockStart = index * STORAGE_CACHE_BLOCK_SIZE;
+                if (blockStart < offset || blockStart + GetBlockLength(index) > offset + size)
+                    partial.push_back(block);
+            }
+            blocks.push_back(block);
+        }
+        if (success)
+            success = Fetch(lock, partial);
+        if (!success) {
+            FinishLoading(inserted, false);
+            for (Block* block : blocks)
+                Release(block);
+            Unreserve(last - first + 1);
+            return false;
+        }
+
+        // the inserted blocks are copied into first, as other transfers may be waiting for them
+        auto CopyIn = [&](Block* block) {
+            uint64_t blockStart = block->index * STORAGE_CACHE_BLOCK_SIZE;
+            uint64_t start = MAX(blockStart, offset);
+            uint64_t end = MIN(blockStart + GetBlockLength(block->index), offset + size);
+            SliceBuffers(buffers, start - offset, end - start, slice);
+            CopyFromBuffers(slice, block->data + (start - blockStart));
+            if (m_writeBack && !block->dirty && !block->dropped) {
+                block->dirty = true;
+                m_dirtyCount++;
+            }
+        };
+        for (Block* block : inserted)
+            CopyIn(block);
+        FinishLoading(inserted, true);
+        for (Block* block : blocks) {
+            // inserted is in index order
+            if (std::binary_search(inserted.begin(), inserted.end(), block, [](Block* a, Block* b) { return a->index < b->index; }))
+                continue;
+            WaitForBlock(lock, block, true);
+            if (!block->valid) {
+                success = false;
+                break;
+            }
+            CopyIn(block);
+        }
+
+        if (success && !m_writeBack) {
+            // waiting for one block can let another start being written back
+            m_blockDone.wait(lock, [&blocks] { return std::none_of(blocks.begin(), blocks.end(), [](Block* block) { return block->writing; }); });
+            if (!Store(lock, blocks)) {
+                // the image may only have part of the write, so the cached copies can't be trusted
+                for (Block* block : blocks)
+                    Drop(block);
+                success = false;
+            }
+        }
+
+        for (Block* block : blocks)
+            Release(block);
+        Unreserve(last - first + 1);
+        if (!success)
+            return false;
+    }
+
+    // a failure here leaves the blocks dirty, so it is reported by the next Flush
+    if (m_dirtyCount > m_capacity / 2)
+        WriteBackDirty(lock);
+    return true;
+}
+
+bool StorageBlockCache::Discard(uint64_t offset, uint64_t size) {
+    if (m_readOnly || offset > GetSize() || size > GetSize() - offset)
+        return false;
+
+    {
+        // blocks the range only partly covers still hold data outside of it, so they stay
+        std::unique_lock<std::mutex> lock(m_lock);
+        uint64_t first = DIV_ROUNDUP(offset, STORAGE_CACHE_BLOCK_SIZE);
+        uint64_t end = offset + size == GetSize() ? DIV_ROUNDUP(GetSize(), STORAGE_CACHE_BLOCK_SIZE) : (offset + size) / STORAGE_CACHE_BLOCK_SIZE;
+        std::vector<Block*> discarded;
+        if (end > first && end - first < m_blocks.size()) {
+            for (uint64_t index = first; index < end; index++) {
+                if (auto it = m_blocks.find(index); it != m_blocks.end())
+                    discarded.push_back(it->second);
+            }
+        } else {
+            // a large range, so it is quicker to go through the cache
+            for (auto& [index, block] : m_blocks) {
+                if (index >= first && index < end)
+                    discarded.push_back(block);
+            }
+        }
+        for (Block* block : discarded)
+            Drop(block);
+
+        // a write back that is still going would land after the discard
+        m_blockDone.wait(lock, [&discarded] { return std::none_of(discarded.begin(), discarded.end(), [](Block* block) { return block->writing; }); });
+    }
+    return m_backend->Discard(offset, size);
+}
+
+bool StorageBlockCache::Flush() {
+    {
+        // write backs that have already started have to finish first, as they may fail
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_blockDone.wait(lock, [this] { return m_writingCount == 0; });
+        if (!WriteBackDirty(lock))
+            return false;
+    }
+    return m_backend->Flush();
+}
+
+void StorageBlockCache::PrintStats(FILE* fp) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    uint64_t lookups = m_stats.hits + m_stats.misses;
+    fprintf(fp, "  Block cache: %lu KiB, write-%s\n", (m_capacity * STORAGE_CACHE_BLOCK_SIZE) >> 10, m_writeBack ? "back" : "through");
+    fprintf(fp, "    Read hits: %lu, misses: %lu, hit rate: %.1f%%\n", m_stats.hits, m_stats.misses, lookups > 0 ? static_cast<double>(m_stats.hits) * 100.0 / static_cast<double>(lookups) : 0.0);
+    fprintf(fp, "    Read-ahead blocks: %lu, written back: %lu, evictions: %lu\n", m_stats.readAhead, m_stats.writeBacks, m_stats.evictions);
+}
+
+uint64_t StorageBlockCache::GetBlockLength(uint64_t index) const {
+    return MIN(static_cast<uint64_t>(STORAGE_CACHE_BLOCK_SIZE), GetSize() - index * STORAGE_CACHE_BLOCK_SIZE);
+}
+
+void StorageBlockCache::Reserve(std::unique_lock<std::mutex>& lock, uint64_t count) {
+    m_blockDone.wait(lock, [&] { return m_reserved + count <= m_capacity; });
+    m_reserved += count;
+}
+
+void StorageBlockCache::Unreserve(uint64_t count) {
+    m_reserved -= count;
+    m_blockDone.notify_all();
+}
+
+StorageBlockCache::Block* StorageBlockCache::Lookup(uint64_t index) {
+    auto it = m_blocks.find(index);
+    if (it == m_blocks.end())
+        return nullptr;
+    Block* block = it->second;
+    Unlink(block);
+    PushFront(block);
+    return block;
+}
+
+StorageBlockCache::Block* StorageBlockCache::Acquire(std::unique_lock<std::mutex>& lock, uint64_t index, bool& fresh) {
+    while (true) {
+        if (Block* block = Lookup(index); block != nullptr) {
+            block->users++;
+            fresh = false;
+            return block;
+        }
+        Block* block = TakeFreeBlock(lock);
+        if (block == nullptr)
+            return nullptr;
+        if (m_blocks.contains(index)) {
+            // another transfer inserted it while a block was being written back
+            m_free.push_back(block);
+            continue;
+        }
+        block->index = index;
+        block->dirty = false;
+        block->loading = true;
+        block->valid = false;
+        block->users = 1;
+        PushFront(block);
+        m_blocks[index] = block;
+        fresh = true;
+        return block;
+    }
+}
+
+void StorageBlockCache::Release(Block* block) {
+    if (--block->users > 0)
+        return;
+    if (block->dropped && !block->writing) {
+        block->dropped = false;
+        m_free.push_back(block);
+    }
+    m_blockDone.notify_all();
+}
+
+StorageBlockCache::Block* StorageBlockCache::TakeFreeBlock(std::unique_lock<std::mutex>& lock) {
+    while (true) {
+        if (!m_free.empty()) {
+            Block* block = m_free.back();
+            m_free.pop_back();
+            return block;
+        }
+
+        // the reservations leave at least one block nothing is using, but it may still be being written back
+        Block* victim = m_tail;
+        while (victim != nullptr && (victim->users > 0 || victim->writing))
+            victim = victim->prev;
+        if (victim == nullptr) {
+            m_blockDone.wait(lock);
+            continue;
+        }
+        if (victim->dirty) {
+            if (!Store(lock, {victim}))
+                return nullptr;
+            continue; // it may have been used again while it was written back
+        }
+        Unlink(victim);
+        m_blocks.erase(victim->index);
+        m_stats.evictions++;
+        return victim;
+    }
+}
+
+void StorageBlockCache::FinishLoading(const std::vector<Block*>& blocks, bool success) {
+    for (Block* block : blocks) {
+        block->loading = false;
+        block->valid = success;
+        if (!success)
+            Drop(block);
+    }
+    m_blockDone.notify_all();
+}
+
+void StorageBlockCache::WaitForBlock(std::unique_lock<std::mutex>& lock, Block* block, bool modify) {
+    m_blockDone.wait(lock, [block, modify] { return !block->loading && !(modify && block->writing); });
+}
+
+void StorageBlockCache::Drop(Block* block) {
+    if (block->dropped)
+        return;
+    if (block->dirty) {
+        block->dirty = false;
+        m_dirtyCount--;
+    }
+    Unlink(block);
+    m_blocks.erase(block->index);
+    if (block->users == 0 && !block->writing)
+        m_free.push_back(block);
+    else
+        block->dropped = true; // freed by the last user, or once it is written back
+}
+
+void StorageBlockCache::Unlink(Block* block) {
+    if (block->prev != nullptr)
+        block->prev->next = block->next;
+    else
+        m_head = block->next;
+    if (block->next != nullptr)
+        block->next->prev = block->prev;
+    else
+        m_tail = block->prev;
+    block->prev = nullptr;
+    block->next = nullptr;
+}
+
+void StorageBlockCache::PushFront(Block* block) {
+    block->prev = nullptr;
+    block->next = m_head;
+    if (m_head != nullptr)
+        m_head->prev = block;
+    else
+        m_tail = block;
+    m_head = block;
+}
+
+bool StorageBlockCache::Fetch(std::unique_lock<std::mutex>& lock, const std::vector<Block*>& blocks) {
+    if (blocks.empty())
+        return true;
+
+    // the blocks are loading, so nothing else touches them until FinishLoading
+    lock.unlock();
+    bool success = true;
+    std::vector<iovec> run;
+    for (size_t i = 0; i < blocks.size() && success; i++) {
+        run.push_back({blocks[i]->data, GetBlockLength(blocks[i]->index)});
+        if (i + 1 < blocks.size() && blocks[i + 1]->index == blocks[i]->index + 1)
+            continue;
+        uint64_t firstIndex = blocks[i + 1 - run.size()]->index;
+        success = m_backend->ReadVector(firstIndex * STORAGE_CACHE_BLOCK_SIZE, run);
+        run.clear();
+    }
+    lock.lock();
+    return success;
+}
+
+bool StorageBlockCache::Store(std::unique_lock<std::mutex>& lock, const std::vector<Block*>& blocks) {
+    if (blocks.empty())
+        return true;
+
+    for (Block* block : blocks)
+        block->writing = true;
+    m_writingCount += blocks.size();
+
+    // the contents can't change while the blocks are being written, but they can still be read
+    lock.unlock();
+    size_t stored = 0; // blocks that reached the backend
+    std::vector<iovec> run;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        run.push_back({blocks[i]->data, GetBlockLength(blocks[i]->index)});
+        if (i + 1 < blocks.size() && blocks[i + 1]->index == blocks[i]->index + 1)
+            continue;
+        size_t firstBlock = i + 1 - run.size();
+        if (!m_backend->WriteVector(blocks[firstBlock]->index * STORAGE_CACHE_BLOCK_SIZE, run))
+            break;
+        stored = i + 1;
+        run.clear();
+    }
+    lock.lock();
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        Block* block = blocks[i];
+        block->writing = false;
+        if (i < stored && block->dirty) {
+            block->dirty = false;
+            m_dirtyCount--;
+            m_stats.writeBacks++;
+        }
+        if (block->dropped && block->users == 0) {
+            block->dropped = false;
+            m_free.push_back(block);
+        }
+    }
+    m_writingCount -= blocks.size();
+    m_blockDone.notify_all();
+    return stored == blocks.size();
+}
+
+bool StorageBlockCache::WriteBackDirty(std::unique_lock<std::mutex>& lock) {
+    if (m_dirtyCount == 0)
+        return true;
+    std::vector<Block*> dirty;
+    for (Block& block : m_storage) {
+        if (block.dirty && !block.writing)
+            dirty.push_back(&block);
+    }
+    std::sort(dirty.begin(), dirty.end(), [](Block* a, Block* b) { return a->index < b->index; });
+    return Store(lock, dirty);
+}
+
+bool StorageBlockCache::Load(std::unique_lock<std::mutex>& lock, uint64_t first, uint64_t last, uint64_t readAhead, std::vector<Block*>& blocks) {
+    std::vector<Block*> missing;
+    std::vector<Block*> extra; // the read-ahead blocks
+    blocks.clear();
+    bool success = true;
+    for (uint64_t index = first; index <= last; index++) {
+        bool fresh = false;
+        Block* block = Acquire(lock, index, fresh);
+        if (block == nullptr) {
+            success = false;
+            break;
+        }
+        if (fresh) {
+            m_stats.misses++;
+            missing.push_back(block);
+        } else
+            m_stats.hits++;
+        blocks.push_back(block);
+    }
+
+    if (success) {
+        // blocks that are already cached stay where they are in the LRU order
+        uint64_t blockCount = DIV_ROUNDUP(GetSize(), STORAGE_CACHE_BLOCK_SIZE);
+        for (uint64_t index = last + 1; index < MIN(last + 1 + readAhead, blockCount); index++) {
+            if (m_blocks.contains(index))
+                continue;
+            bool fresh = false;
+            Block* block = Acquire(lock, index, fresh);
+            if (block == nullptr)
+                break;
+            extra.push_back(block);
+            if (!fresh)
+                continue; // inserted by another transfer while a block was being written back
+            m_stats.readAhead++;
+            missing.push_back(block);
+        }
+    }
+
+    if (success)
+        success = Fetch(lock, missing);
+    FinishLoading(missing, success);
+    for (Block* block : extra)
+        Release(block);
+    return success;
+}
@@ -0,0 +1,145 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _STORAGE_BLOCK_CACHE_HPP
+#define _STORAGE_BLOCK_CACHE_HPP
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "StorageBackend.hpp"
+
+#define STORAGE_CACHE_BLOCK_SIZE 4096
+#define STORAGE_CACHE_MIN_BLOCKS 16
+#define STORAGE_CACHE_MAX_READ_AHEAD 64 // in blocks
+
+// An LRU cache of whole blocks in front of another backend. Every transfer to the backend is block aligned and uses
+// page aligned buffers, so the backend can bypass the host page cache. Sequential reads grow a read-ahead window.
+// With write-back, written blocks stay in the cache until Flush, eviction or Destroy, or until half of the cache is
+// dirty. Transfers can run concurrently. The lock is dropped around every transfer to the backend, and a transfer that
+// needs a block another one is loading or writing back waits for that block.
+class StorageBlockCache : public StorageBackend {
+public:
+    // Takes ownership of backend. size is in bytes and must be at least STORAGE_CACHE_MIN_BLOCKS blocks.
+    StorageBlockCache(StorageBackend* backend, size_t size, bool writeBack);
+    ~StorageBlockCache() override;
+
+    void Initialise() override;
+    void Destroy() override;
+
+    size_t GetSize() const override { return m_backend->GetSize(); }
+
+    // offset and the buffer sizes must add up to whole 512 byte blocks
+    bool ReadVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+    bool WriteVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+
+    bool Discard(uint64_t offset, uint64_t size) override;
+    bool Flush() override;
+
+    void PrintStats(FILE* fp) override;
+
+   private:
+    struct Block {
+        uint64_t index; // in STORAGE_CACHE_BLOCK_SIZE units
+        uint8_t* data;
+        bool dirty;
+        bool loading; // being filled by the transfer that inserted it
+        bool valid;   // the contents are the drive's, false if loading it failed
+        bool writing; // being written to the backend, so the contents must not change
+        bool dropped; // no longer in the cache, freed once nothing is using it
+        uint32_t users; // transfers using the block, which can't be evicted until they are done
+        Block* prev; // more recently used
+        Block* next; // less recently used
+    };
+
+    // Everything below must be called with m_lock held. Functions taking the lock release it while they wait or
+    // transfer to the backend.
+
+    // Number of bytes of the drive in block index. Only the last block can be short.
+    uint64_t GetBlockLength(uint64_t index) const;
+
+    // Wait until count more blocks can be used, so concurrent transfers can't use up the cache between them and
+    // wait for each other forever. Every block a transfer uses must be reserved first.
+    void Reserve(std::unique_lock<std::mutex>& lock, uint64_t count);
+    void Unreserve(uint64_t count);
+
+    Block* Lookup(uint64_t index); // nullptr on a miss, otherwise marks the block as most recently used
+    // Use the block for index, inserting it on a miss. fresh is set if it was inserted, in which case it is loading
+    // and the caller must fill it and call FinishLoading. nullptr if no block could be written back for it.
+    Block* Acquire(std::unique_lock<std::mutex>& lock, uint64_t index, bool& fresh);
+    void Release(Block* block);
+    // A free block, evicting the least recently used block nothing is using. nullptr if it couldn't be written back.
+    Block* TakeFreeBlock(std::unique_lock<std::mutex>& lock);
+    void FinishLoading(const std::vector<Block*>& blocks, bool success);
+    // Wait until block is loaded, and if modify is set, until it isn't being written back either
+    void WaitForBlock(std::unique_lock<std::mutex>& lock, Block* block, bool modify);
+    void Drop(Block* block);
+
+    void Unlink(Block* block);
+    void PushFront(Block* block);
+
+    // Fill blocks from the backend, one transfer per run of consecutive blocks. blocks must be in order.
+    bool Fetch(std::unique_lock<std::mutex>& lock, const std::vector<Block*>& blocks);
+    // Write blocks to the backend, one transfer per run of consecutive blocks. blocks must be in order and not
+    // already being written.
+    bool Store(std::unique_lock<std::mutex>& lock, const std::vector<Block*>& blocks);
+    bool WriteBackDirty(std::unique_lock<std::mutex>& lock);
+
+    // Use the blocks from first to last inclusive, and fill the ones that aren't cached, plus readAhead blocks after
+    // them. Only the first to last blocks are returned, and they must be released.
+    bool Load(std::unique_lock<std::mutex>& lock, uint64_t first, uint64_t last, uint64_t readAhead, std::vector<Block*>& blocks);
+
+   private:
+    StorageBackend* m_backend;
+    bool m_writeBack;
+    uint64_t m_capacity; // in blocks
+    // A step of a transfer plus its read-ahead is under the capacity, so a step never evicts its own blocks
+    uint64_t m_chunkBlocks; // most blocks a single step of a transfer can use
+    uint64_t m_maxReadAhead; // in blocks
+    uint8_t* m_memory;
+    bool m_open;
+
+    std::mutex m_lock; // protects everything below
+    std::condition_variable m_blockDone; // a block finished loading or writing back, or a reservation ended
+    std::vector<Block> m_storage;
+    std::vector<Block*> m_free;
+    std::unordered_map<uint64_t, Block*> m_blocks;
+    Block* m_head; // most recently used
+    Block* m_tail; // least recently used
+    uint64_t m_dirtyCount;
+    uint64_t m_writingCount;
+    uint64_t m_reserved; // in blocks
+
+    // sequential read detection
+    uint64_t m_nextReadOffset;
+    uint64_t m_readAheadSize; // in blocks, 0 if reads aren't sequential
+    uint64_t m_readAheadEnd;  // first block the read-ahead hasn't reached
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t readAhead;
+        uint64_t writeBacks;
+        uint64_t evictions;
+    } m_stats;
+};
+
+#endif /* _STORAGE_BLOCK_CACHE_HPP */
@@ -18,102 +18,290 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "StorageDevice.hpp"
 
 #include <Emulator.hpp>
+#include <util.h>
+
+#include <chrono>
 
 #include "PhysicalRegionListBuffer.hpp"
+#include "StorageInterruptCoalescer.hpp"
+#include "StorageQueueManager.hpp"
 
-StorageDevice::StorageDevice(MMU* PhysicalMMU, const char* path)
-    : IODevice(IODeviceID::STORAGE, 3, 1), m_PhysicalMMU(PhysicalMMU), m_command(0), m_status{0, 0, 0, 0, 0, 0, 0}, m_data(0), m_buffer(nullptr), m_file(path), m_transferCommandStatus{0, 0, false, false} {
+StorageDevice::StorageDevice(MMU* PhysicalMMU, uint64_t instance, const StorageDriveConfig& drive, const StorageCacheConfig& cache)
+    : IODevice(IODeviceID::STORAGE, STORAGE_DEVICE_PORT_COUNT, 1, instance), m_PhysicalMMU(PhysicalMMU), m_command(0), m_status{0, 0, 0, 0, 0, 0, 0}, m_data(0), m_buffer(nullptr), m_backend(StorageBackend::Create(drive.path, drive.overlayPath, cache)), m_path(drive.path), m_overlayPath(drive.overlayPath), m_cacheConfig(cache), m_blockShift(drive.blockSize == STORAGE_BLOCK_SIZE_LARGE ? 12 : 9), m_queues(nullptr), m_coalescer(nullptr), m_queueInterruptPending(false), m_transferCommandStatus{0, 0, false, StorageDeviceCommands::READ, 0, 0, {}} {
 }
 
 StorageDevice::~StorageDevice() {
+    delete m_backend;
 }
 
 void StorageDevice::Initialise() {
-    m_file.Initialise();
+    m_backend->Initialise();
     m_buffer = new PhysicalRegionListBuffer(this, m_PhysicalMMU);
+    m_coalescer = new StorageInterruptCoalescer(this);
+    m_queues = new StorageQueueManager(this, m_PhysicalMMU);
 }
 
 void StorageDevice::Destroy() {
-    m_file.Destroy();
+    delete m_queues; // waits for the workers to stop
+    m_queues = nullptr;
+    delete m_coalescer;
+    m_coalescer = nullptr;
+    m_backend->Destroy();
     m_buffer->ClearList();
     delete m_buffer;
 }
 
-uint8_t StorageDevice::ReadByte(uint64_t address) {
-    return ReadQWord(address) & 0xFF;
+void StorageDevice::Reset() {
+    m_command = 0;
+    m_status = {0, 0, 0, 0, 0, 0, 0};
+    m_data = 0;
+    m_transferCommandStatus = {0, 0, false, StorageDeviceCommands::READ, 0, 0, {}};
+    m_buffer->ClearList();
+    m_queues->Reset();
+    m_coalescer->Reset();
+    m_queueInterruptPending = false;
 }
 
-uint16_t StorageDevice::ReadWord(uint64_t address) {
-    return ReadQWord(address) & 0xFFFF;
+void StorageDevice::ChangeDrive(const char* path) {
+    m_queues->WaitForIdle();
+    m_backend->Destroy();
+    delete m_backend;
+    // the new image can be a different format
+    m_backend = StorageBackend::Create(path, m_overlayPath, m_cacheConfig);
+    m_backend->Initialise();
+    m_path = path;
+    m_stats.Clear();
 }
 
-uint32_t StorageDevice::ReadDWord(uint64_t address) {
-    return ReadQWord(address) & 0xFFFF'FFFF;
+std::span<const IORegister> StorageDevice::GetRegisters() const {
+    static constexpr IORegister registers[] = {
+        {static_cast<uint64_t>(StorageDeviceRegisters::COMMAND), IO_WIDTH_ALL, IORegisterRead<StorageDevice, &StorageDevice::ReadCommand>, IORegisterWrite<StorageDevice, &StorageDevice::WriteCommand>},
+        {static_cast<uint64_t>(StorageDeviceRegisters::STATUS), IO_WIDTH_ALL, IORegisterRead<StorageDevice, &StorageDevice::ReadStatus>, IORegisterWrite<StorageDevice, &StorageDevice::WriteStatus>},
+        {static_cast<uint64_t>(StorageDeviceRegisters::DATA), IO_WIDTH_ALL, IORegisterRead<StorageDevice, &StorageDevice::ReadData>, IORegisterWrite<StorageDevice, &StorageDevice::WriteData>},
+        {static_cast<uint64_t>(StorageDeviceRegisters::SQ_DOORBELL), IO_WIDTH_ALL, nullptr, IORegisterWrite<StorageDevice, &StorageDevice::WriteSQDoorbell>},
+        {static_cast<uint64_t>(StorageDeviceRegisters::CQ_DOORBELL), IO_WIDTH_ALL, nullptr, IORegisterWrite<StorageDevice, &StorageDevice::WriteCQDoorbell>},
+        {static_cast<uint64_t>(StorageDeviceRegisters::PENDING), IO_WIDTH_ALL, IORegisterRead<StorageDevice, &StorageDevice::ReadPending>, IORegisterWrite<StorageDevice, &StorageDevice::WritePending>},
+    };
+    return registers;
 }
 
-uint64_t StorageDevice::ReadQWord(uint64_t address) {
-    switch (static_cast<StorageDeviceRegisters>(address)) {
-    case StorageDeviceRegisters::COMMAND:
-        return m_command;
-    case StorageDeviceRegisters::STATUS:
-        return *reinterpret_cast<uint8_t*>(&m_status);
-    case StorageDeviceRegisters::DATA:
-        return m_data;
-    default:
-        return 0;
-    }
+uint64_t StorageDevice::ReadCommand() {
+    return m_command;
 }
 
-void StorageDevice::WriteByte(uint64_t address, uint8_t data) {
-    WriteQWord(address, data);
+uint64_t StorageDevice::ReadStatus() {
+    return *reinterpret_cast<uint8_t*>(&m_status);
 }
 
-void StorageDevice::WriteWord(uint64_t address, uint16_t data) {
-    WriteQWord(address, data);
+uint64_t StorageDevice::ReadData() {
+    return m_data;
 }
 
-void StorageDevice::WriteDWord(uint64_t address, uint32_t data) {
-    WriteQWord(address, data);
+uint64_t StorageDevice::ReadPending() {
+    return m_coalescer->GetPending();
 }
 
-void StorageDevice::WriteQWord(uint64_t address, uint64_t data) {
-    switch (static_cast<StorageDeviceRegisters>(address)) {
-    case StorageDeviceRegisters::COMMAND:
-        m_command = data;
-        HandleCommand(static_cast<StorageDeviceCommands>(m_command));
-        break;
-    case StorageDeviceRegisters::STATUS:
-        *reinterpret_cast<uint8_t*>(&m_status) = data;
-        break;
-    case StorageDeviceRegisters::DATA:
-        m_data = data;
-        break;
-    default:
-        break;
-    }
+void StorageDevice::WriteCommand(uint64_t data) {
+    m_command = data;
+    HandleCommand(static_cast<StorageDeviceCommands>(m_command));
+}
+
+void StorageDevice::WriteStatus(uint64_t data) {
+    *reinterpret_cast<uint8_t*>(&m_status) = data;
+}
+
+void StorageDevice::WriteData(uint64_t data) {
+    m_data = data;
+}
+
+void StorageDevice::WriteSQDoorbell(uint64_t data) {
+    if (m_status.EN)
+        m_queues->RingSubmissionDoorbell(data);
+}
+
+void StorageDevice::WriteCQDoorbell(uint64_t data) {
+    if (m_status.EN)
+        m_queues->RingCompletionDoorbell(data);
+}
+
+void StorageDevice::WritePending(uint64_t data) {
+    m_coalescer->Acknowledge(data);
 }
 
 void StorageDevice::StartTransfer() {
-    if (!m_buffer->ParseList()) {
-        m_status.ERR = 1;
+    // flushes and discards record their own stats, as they can also be queued
+    if (m_transferCommandStatus.command == StorageDeviceCommands::FLUSH || m_transferCommandStatus.command == StorageDeviceCommands::DISCARD) {
+        bool success;
+        if (m_transferCommandStatus.command == StorageDeviceCommands::FLUSH)
+            success = HandleFlush();
+        else
+            success = Discard(m_transferCommandStatus.LBA, m_transferCommandStatus.Count, m_transferCommandStatus.ranges, m_transferCommandStatus.rangeCount) == StorageCompletionStatus::SUCCESS;
         m_status.TRN = 0;
+        m_status.ERR = success ? 0 : 1;
         m_status.RDY = 1;
         return;
     }
 
-    if (m_transferCommandStatus.write)
-        m_buffer->Read(m_transferCommandStatus.LBA << 9, reinterpret_cast<uint8_t*>(reinterpret_cast<uint64_t>(m_file.GetData()) + (m_transferCommandStatus.LBA << 9)), m_transferCommandStatus.Count << 9);
-    else
-        m_buffer->Write(m_transferCommandStatus.LBA << 9, reinterpret_cast<const uint8_t*>(reinterpret_cast<uint64_t>(m_file.GetData()) + (m_transferCommandStatus.LBA << 9)), m_transferCommandStatus.Count << 9);
+    bool write = m_transferCommandStatus.command == StorageDeviceCommands::WRITE;
+    bool success;
+    {
+        // this runs on the emulator thread, alongside the CPU thread, so the regions are held until the transfer is done
+        SharedRegionGuard guard(m_PhysicalMMU);
+        success = m_buffer->ParseList();
+
+        // a device read writes guest memory and a device write reads it
+        std::vector<iovec> buffers;
+        if (success)
+            success = m_buffer->GetHostBuffers(!write, buffers);
+        if (success) {
+            if (write)
+                success = m_backend->WriteVector(m_transferCommandStatus.LBA << m_blockShift, buffers);
+            else
+                success = m_backend->ReadVector(m_transferCommandStatus.LBA << m_blockShift, buffers);
+        }
+    }
 
     m_status.TRN = 0;
-    m_status.ERR = 0;
+    m_status.ERR = success ? 0 : 1;
     m_status.RDY = 1;
 
-    if (m_transferCommandStatus.INT) {
-        m_status.INTP = 1;
-        RaiseInterrupt(0);
+    if (success && m_transferCommandStatus.INT) {
+        m_stats.RecordInterruptCompletion();
+        // the batch only ends here if no queued requests are in flight, otherwise the last of them ends it
+        if (m_coalescer->AddCompletion() || (m_queues->IsIdle() && m_coalescer->BatchDone()))
+            RaiseCompletionInterrupt();
     }
+
+    uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_transferCommandStatus.start).count();
+    m_stats.RecordTransfer(write, m_transferCommandStatus.Count << m_blockShift, latency, success);
+}
+
+StorageCompletionStatus StorageDevice::ExecuteQueuedRequest(const StorageDevice_SubmissionEntry& entry, PhysicalRegionListBuffer& buffer) {
+    StorageDeviceCommands command = static_cast<StorageDeviceCommands>(entry.COMMAND);
+    if (command == StorageDeviceCommands::FLUSH)
+        return HandleFlush() ? StorageCompletionStatus::SUCCESS : StorageCompletionStatus::DEVICE_ERROR;
+    if (command == StorageDeviceCommands::DISCARD)
+        return Discard(entry.LBA, entry.COUNT, entry.PRLS, entry.PRLNC);
+    if (command != StorageDeviceCommands::READ && command != StorageDeviceCommands::WRITE)
+        return StorageCompletionStatus::INVALID_COMMAND;
+    uint64_t blockCount = m_backend->GetSize() >> m_blockShift;
+    if (entry.COUNT == 0 || entry.LBA >= blockCount || entry.COUNT > blockCount - entry.LBA)
+        return StorageCompletionStatus::OUT_OF_RANGE;
+
+    // the regions stay put from reading the list until the transfer is done with the guest memory
+    SharedRegionGuard guard(m_PhysicalMMU);
+    buffer.ResetList(entry.PRLS, entry.PRLNC, entry.COUNT << m_blockShift);
+    if (!buffer.ParseList())
+        return StorageCompletionStatus::INVALID_PRL;
+
+    std::vector<iovec> buffers;
+    bool write = command == StorageDeviceCommands::WRITE;
+    if (!buffer.GetHostBuffers(!write, buffers))
+        return StorageCompletionStatus::INVALID_PRL;
+    bool success = write ? m_backend->WriteVector(entry.LBA << m_blockShift, buffers) : m_backend->ReadVector(entry.LBA << m_blockShift, buffers);
+    return success ? StorageCompletionStatus::SUCCESS : StorageCompletionStatus::DEVICE_ERROR;
+}
+
+bool StorageDevice::Flush() {
+    return m_backend->Flush();
+}
+
+void StorageDevice::PrintStats(FILE* fp) {
+    fprintf(fp, "Drive %lu: %s\n", GetInstance(), m_path);
+    m_stats.Print(fp);
+    m_backend->PrintStats(fp);
+}
+
+void StorageDevice::RecordQueuedSubmission(uint64_t depth) {
+    m_stats.RecordSubmission(depth);
+}
+
+void StorageDevice::RecordQueuedCompletion(const StorageDevice_SubmissionEntry& entry, StorageCompletionStatus status, std::chrono::steady_clock::time_point submitted) {
+    // flushes and discards record themselves, as they can also be legacy commands
+    StorageDeviceCommands command = static_cast<StorageDeviceCommands>(entry.COMMAND);
+    if (command != StorageDeviceCommands::READ && command != StorageDeviceCommands::WRITE)
+        return;
+    uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - submitted).count();
+    m_stats.RecordTransfer(command == StorageDeviceCommands::WRITE, entry.COUNT << m_blockShift, latency, status == StorageCompletionStatus::SUCCESS);
+}
+
+bool StorageDevice::HandleFlush() {
+    auto start = std::chrono::steady_clock::now();
+    bool success = Flush();
+    uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    m_stats.RecordFlush(time, success);
+    return success;
+}
+
+StorageCompletionStatus StorageDevice::Discard(uint64_t LBA, uint64_t count, uint64_t ranges, uint64_t rangeCount) {
+    std::vector<StorageDevice_DiscardRange> list;
+    if (rangeCount == 0)
+        list.push_back({LBA, count});
+    else {
+        if (rangeCount > STORAGE_DISCARD_MAX_RANGES) {
+            m_stats.RecordDiscard(0, false);
+            return StorageCompletionStatus::INVALID_PRL;
+        }
+        list.resize(rangeCount);
+        SharedRegionGuard guard(m_PhysicalMMU);
+        if (!m_PhysicalMMU->ReadRAM(ranges, reinterpret_cast<uint8_t*>(list.data()), rangeCount * sizeof(StorageDevice_DiscardRange))) {
+            m_stats.RecordDiscard(0, false);
+            return StorageCompletionStatus::INVALID_PRL;
+        }
+    }
+
+    uint64_t blockCount = m_backend->GetSize() >> m_blockShift;
+    uint64_t bytes = 0;
+    for (const StorageDevice_DiscardRange& range : list) {
+        if (range.COUNT == 0 || range.LBA >= blockCount || range.COUNT > blockCount - range.LBA) {
+            m_stats.RecordDiscard(0, false);
+            return StorageCompletionStatus::OUT_OF_RANGE;
+        }
+        bytes += range.COUNT << m_blockShift;
+    }
+    for (const StorageDevice_DiscardRange& range : list) {
+        if (!m_backend->Discard(range.LBA << m_blockShift, range.COUNT << m_blockShift)) {
+            m_stats.RecordDiscard(0, false);
+            return StorageCompletionStatus::DEVICE_ERROR;
+        }
+    }
+    m_stats.RecordDiscard(bytes, true);
+    return StorageCompletionStatus::SUCCESS;
+}
+
+void StorageDevice::CompletionPosted() {
+    m_stats.RecordInterruptCompletion();
+    if (m_coalescer->AddCompletion())
+        QueueInterrupt();
+}
+
+void StorageDevice::CompletionsIdle() {
+    if (m_coalescer->BatchDone())
+        QueueInterrupt();
+}
+
+void StorageDevice::CompletionRingFull() {
+    if (m_coalescer->Force())
+        QueueInterrupt();
+}
+
+void StorageDevice::QueueInterrupt() {
+    if (!m_queueInterruptPending.exchange(true))
+        Emulator::RaiseEvent({Emulator::EventType::StorageInterrupt, reinterpret_cast<uint64_t>(this)});
+}
+
+void StorageDevice::RaiseQueueInterrupt() {
+    m_queueInterruptPending = false;
+    RaiseCompletionInterrupt();
+}
+
+void StorageDevice::RaiseCompletionInterrupt() {
+    if (!m_status.INTE)
+        return;
+    m_status.INTP = 1;
+    m_stats.RecordInterrupt();
+    RaiseInterrupt(0);
 }
 
 void StorageDevice::HandleCommand(StorageDeviceCommands command) {
@@ -138,8 +326,8 @@ void StorageDevice::HandleCommand(StorageDeviceCommands command) {
             m_status.RDY = 1;
             return;
         }
-        size_t size = m_file.GetSize();
-        StorageDevice_GetDeviceInfoResponse response{size, size >> 9 /* 512 bytes per block */};
+        size_t size = m_backend->GetSize();
+        StorageDevice_GetDeviceInfoResponse response{size, size >> m_blockShift, 1ULL << m_blockShift};
         m_PhysicalMMU->WriteBuffer(addr, reinterpret_cast<uint8_t*>(&response), sizeof(StorageDevice_GetDeviceInfoResponse));
         m_status.ERR = 0;
         m_status.RDY = 1;
@@ -166,19 +354,21 @@ void StorageDevice::HandleCommand(StorageDeviceCommands command) {
             m_status.RDY = 1;
             return;
         }
-        if (request.LBA + request.COUNT > m_file.GetSize() >> 9) {
+        uint64_t blockCount = m_backend->GetSize() >> m_blockShift;
+        if (request.LBA >= blockCount || request.COUNT > blockCount - request.LBA) {
             m_status.ERR = 1;
             m_status.RDY = 1;
             return;
         }
-        m_buffer->ClearList();
-        m_buffer->ResetList(request.PRLS, request.PRLNC, request.COUNT << 9);
+        m_buffer->ResetList(request.PRLS, request.PRLNC, request.COUNT << m_blockShift);
         m_status.TRN = 1;
         m_status.ERR = 0;
         m_transferCommandStatus.LBA = request.LBA;
         m_transferCommandStatus.Count = request.COUNT;
         m_transferCommandStatus.INT = request.FLAGS.INT;
-        m_transferCommandStatus.write = false;
+        m_transferCommandStatus.command = StorageDeviceCommands::READ;
+        m_transferCommandStatus.start = std::chrono::steady_clock::now();
+        m_stats.RecordSubmission(1); // legacy transfers can't overlap
         Emulator::RaiseEvent({Emulator::EventType::StorageTransfer, reinterpret_cast<uint64_t>(this)});
         break;
     }
@@ -203,21 +393,91 @@ void StorageDevice::HandleCommand(StorageDeviceCommands command) {
             m_status.RDY = 1;
             return;
         }
-        if (request.LBA + request.COUNT > m_file.GetSize() >> 9) {
+        uint64_t blockCount = m_backend->GetSize() >> m_blockShift;
+        if (request.LBA >= blockCount || request.COUNT > blockCount - request.LBA) {
             m_status.ERR = 1;
             m_status.RDY = 1;
             return;
         }
-        m_buffer->ClearList();
-        m_buffer->ResetList(request.PRLS, request.PRLNC, request.COUNT << 9);
+        m_buffer->ResetList(request.PRLS, request.PRLNC, request.COUNT << m_blockShift);
         m_status.TRN = 1;
         m_status.ERR = 0;
         m_transferCommandStatus.LBA = request.LBA;
         m_transferCommandStatus.Count = request.COUNT;
         m_transferCommandStatus.INT = request.FLAGS.INT;
-        m_transferCommandStatus.write = true;
+        m_transferCommandStatus.command = StorageDeviceCommands::WRITE;
+        m_transferCommandStatus.start = std::chrono::steady_clock::now();
+        m_stats.RecordSubmission(1); // legacy transfers can't overlap
+        Emulator::RaiseEvent({Emulator::EventType::StorageTransfer, reinterpret_cast<uint64_t>(this)});
+        break;
+    }
+    case StorageDeviceCommands::CREATE_QUEUE: {
+        m_status.RDY = 0;
+        uint64_t addr = m_data;
+        if (!m_status.EN || !m_PhysicalMMU->ValidateRead(addr, sizeof(StorageDevice_CreateQueueRequest))) {
+            m_status.ERR = 1;
+            m_status.RDY = 1;
+            return;
+        }
+        StorageDevice_CreateQueueRequest request;
+        m_PhysicalMMU->ReadBuffer(addr, reinterpret_cast<uint8_t*>(&request), sizeof(StorageDevice_CreateQueueRequest));
+        if ((request.FLAGS.INT && !m_status.INTE) || !m_queues->CreateQueue(request)) {
+            m_status.ERR = 1;
+            m_status.RDY = 1;
+            return;
+        }
+        m_status.ERR = 0;
+        m_status.RDY = 1;
+        break;
+    }
+    case StorageDeviceCommands::DELETE_QUEUE:
+        m_status.RDY = 0;
+        m_status.ERR = m_queues->DeleteQueue(m_data) ? 0 : 1;
+        m_status.RDY = 1;
+        break;
+    case StorageDeviceCommands::FLUSH:
+        m_status.RDY = 0;
+        m_status.TRN = 1;
+        m_status.ERR = 0;
+        m_transferCommandStatus.INT = false;
+        m_transferCommandStatus.command = StorageDeviceCommands::FLUSH;
+        Emulator::RaiseEvent({Emulator::EventType::StorageTransfer, reinterpret_cast<uint64_t>(this)});
+        break;
+    case StorageDeviceCommands::DISCARD: {
+        m_status.RDY = 0;
+        uint64_t addr = m_data;
+        if (!m_PhysicalMMU->ValidateRead(addr, sizeof(StorageDevice_DiscardRequest))) {
+            m_status.ERR = 1;
+            m_status.RDY = 1;
+            return;
+        }
+        StorageDevice_DiscardRequest request;
+        m_PhysicalMMU->ReadBuffer(addr, reinterpret_cast<uint8_t*>(&request), sizeof(StorageDevice_DiscardRequest));
+        m_status.TRN = 1;
+        m_status.ERR = 0;
+        m_transferCommandStatus.LBA = request.LBA;
+        m_transferCommandStatus.Count = request.COUNT;
+        m_transferCommandStatus.INT = false;
+        m_transferCommandStatus.command = StorageDeviceCommands::DISCARD;
+        m_transferCommandStatus.ranges = request.RANGES;
+        m_transferCommandStatus.rangeCount = request.RANGEC;
         Emulator::RaiseEvent({Emulator::EventType::StorageTransfer, reinterpret_cast<uint64_t>(this)});
         break;
     }
+    case StorageDeviceCommands::SET_COALESCING: {
+        m_status.RDY = 0;
+        StorageDevice_CoalescingRequest* request = reinterpret_cast<StorageDevice_CoalescingRequest*>(&m_data);
+        if (!m_coalescer->Configure(request->COUNT, request->TIME)) {
+            m_status.ERR = 1;
+            m_status.RDY = 1;
+            return;
+        }
+        // completions held back under the old settings would otherwise wait for the next one
+        if (m_coalescer->Force())
+            QueueInterrupt();
+        m_status.ERR = 0;
+        m_status.RDY = 1;
+        break;
+    }
     }
 }
@@ -20,15 +20,25 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <IO/IODevice.hpp>
 
-#include "StorageFile.hpp"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+
+#include "StorageBackend.hpp"
+#include "StorageStats.hpp"
 
 class PhysicalRegionListBuffer;
 enum class StorageDeviceRegisters {
     COMMAND = 0,
     STATUS = 1,
-    DATA = 2
+    DATA = 2,
+    SQ_DOORBELL = 3,
+    CQ_DOORBELL = 4,
+    PENDING = 5
 };
 
+#define STORAGE_DEVICE_PORT_COUNT 6
+
 struct [[gnu::packed]] StorageDeviceStatus {
     uint8_t EN    : 1;
     uint8_t ERR   : 1;
@@ -43,7 +53,12 @@ enum class StorageDeviceCommands {
     CONFIGURE = 0,
     GET_DEVICE_INFO = 1,
     READ = 2,
-    WRITE = 3
+    WRITE = 3,
+    CREATE_QUEUE = 4,
+    DELETE_QUEUE = 5,
+    FLUSH = 6,
+    DISCARD = 7,
+    SET_COALESCING = 8
 };
 
 struct [[gnu::packed]] StorageDevice_ConfigureRequest {
@@ -52,9 +67,16 @@ struct [[gnu::packed]] StorageDevice_ConfigureRequest {
     uint64_t RSVD : 62;
 };
 
+struct [[gnu::packed]] StorageDevice_CoalescingRequest {
+    uint16_t COUNT; // completions per interrupt, 0 turns coalescing off
+    uint32_t TIME;  // microseconds from the first completion to the interrupt
+    uint16_t RSVD;
+};
+
 struct [[gnu::packed]] StorageDevice_GetDeviceInfoResponse {
     uint64_t size;
     uint64_t blocks;
+    uint64_t blockSize;
 };
 
 // Same for read and write
@@ -69,44 +91,150 @@ struct [[gnu::packed]] StorageDevice_TransferRequest {
     } FLAGS;
 };
 
+struct [[gnu::packed]] StorageDevice_DiscardRequest {
+    uint64_t LBA;
+    uint64_t COUNT;
+    uint64_t RANGES; // address of an array of ranges, used instead of LBA and COUNT if RANGEC isn't 0
+    uint64_t RANGEC;
+};
+
+struct [[gnu::packed]] StorageDevice_DiscardRange {
+    uint64_t LBA;
+    uint64_t COUNT;
+};
+
+#define STORAGE_DISCARD_MAX_RANGES 256
+
+struct [[gnu::packed]] StorageDevice_CreateQueueRequest {
+    uint64_t ID;
+    uint64_t SQ;    // submission ring address
+    uint64_t CQ;    // completion ring address
+    uint64_t DEPTH; // number of entries in each ring
+    struct [[gnu::packed]] SD_CQR_FLAGS {
+        uint8_t INT   : 1;
+        uint64_t RSVD : 63;
+    } FLAGS;
+};
+
+struct [[gnu::packed]] StorageDevice_SubmissionEntry {
+    uint64_t COMMAND; // READ, WRITE, FLUSH or DISCARD
+    uint64_t TAG;     // copied to the completion entry
+    uint64_t LBA;
+    uint64_t COUNT;
+    uint64_t PRLS;    // RANGES for DISCARD
+    uint64_t PRLNC;   // RANGEC for DISCARD
+};
+
+struct [[gnu::packed]] StorageDevice_CompletionEntry {
+    uint64_t TAG;
+    uint32_t SQHEAD;
+    uint16_t STATUS;
+    uint16_t PHASE : 1;
+    uint16_t RSVD  : 15;
+};
+
+enum class StorageCompletionStatus {
+    SUCCESS = 0,
+    INVALID_COMMAND = 1,
+    OUT_OF_RANGE = 2,
+    INVALID_PRL = 3,
+    DEVICE_ERROR = 4
+};
+
 class PhysicalRegionListBuffer;
+class StorageInterruptCoalescer;
+class StorageQueueManager;
 
 class StorageDevice : public IODevice {
    public:
-    explicit StorageDevice(MMU* PhysicalMMU, const char* path);
+    // instance must be unique for every storage device on the bus
+    StorageDevice(MMU* PhysicalMMU, uint64_t instance, const StorageDriveConfig& drive, const StorageCacheConfig& cache = {0, false, false});
     ~StorageDevice() override;
 
     void Initialise();
     void Destroy();
 
-    virtual uint8_t ReadByte(uint64_t address) override;
-    virtual uint16_t ReadWord(uint64_t address) override;
-    virtual uint32_t ReadDWord(uint64_t address) override;
-    virtual uint64_t ReadQWord(uint64_t address) override;
+    virtual void Reset() override;
+
+    // Switch to a different image. MUST NOT be called while a transfer is in progress.
+    void ChangeDrive(const char* path);
 
-    virtual void WriteByte(uint64_t address, uint8_t data) override;
-    virtual void WriteWord(uint64_t address, uint16_t data) override;
-    virtual void WriteDWord(uint64_t address, uint32_t data) override;
-    virtual void WriteQWord(uint64_t address, uint64_t data) override;
+    virtual std::span<const IORegister> GetRegisters() const override;
 
     void StartTransfer();
 
+    // Execute a request from a submission queue. Safe to call from any thread, as long as each thread has its own buffer.
+    StorageCompletionStatus ExecuteQueuedRequest(const StorageDevice_SubmissionEntry& entry, PhysicalRegionListBuffer& buffer);
+
+    // Make every completed write durable, without counting it in the stats. Returns false if that could not be done.
+    bool Flush();
+
+    void PrintStats(FILE* fp);
+
+    // Called by the queue manager. depth includes the new request.
+    void RecordQueuedSubmission(uint64_t depth);
+    void RecordQueuedCompletion(const StorageDevice_SubmissionEntry& entry, StorageCompletionStatus status, std::chrono::steady_clock::time_point submitted);
+
+    // Called by the queue manager, from any thread, without its lock held
+    void CompletionPosted(); // to a queue with interrupts enabled
+    void CompletionsIdle();  // nothing is left in flight
+    void CompletionRingFull();
+
+    // Raise the completion interrupt from any thread. Only one is raised until the emulator thread gets to it.
+    void QueueInterrupt();
+
+    // MUST only be called from the emulator thread
+    void RaiseQueueInterrupt();
+
    private:
+    // Register handlers. Every width accesses the whole register.
+    uint64_t ReadCommand();
+    uint64_t ReadStatus();
+    uint64_t ReadData();
+    uint64_t ReadPending();
+    void WriteCommand(uint64_t data);
+    void WriteStatus(uint64_t data);
+    void WriteData(uint64_t data);
+    void WriteSQDoorbell(uint64_t data);
+    void WriteCQDoorbell(uint64_t data);
+    void WritePending(uint64_t data);
+
     void HandleCommand(StorageDeviceCommands command);
 
+    // MUST only be called from the emulator thread
+    void RaiseCompletionInterrupt();
+
+    // A flush requested by the guest
+    bool HandleFlush();
+
+    // Nothing is discarded unless every range is valid. Safe to call from any thread.
+    StorageCompletionStatus Discard(uint64_t LBA, uint64_t count, uint64_t ranges, uint64_t rangeCount);
+
    private:
     MMU* m_PhysicalMMU;
     uint64_t m_command;
     StorageDeviceStatus m_status;
     uint64_t m_data;
     PhysicalRegionListBuffer* m_buffer;
-    StorageFile m_file;
+    StorageBackend* m_backend;
+    const char* m_path;
+    const char* m_overlayPath;
+    StorageCacheConfig m_cacheConfig;
+    uint64_t m_blockShift; // log2 of the logical block size
+    StorageQueueManager* m_queues;
+    StorageInterruptCoalescer* m_coalescer;
+    std::atomic_bool m_queueInterruptPending;
     struct TransferCommandStatus {
         uint64_t LBA;
         uint64_t Count;
         bool INT;
-        bool write;
+        StorageDeviceCommands command; // READ, WRITE, FLUSH or DISCARD
+        uint64_t ranges; // DISCARD only
+        uint64_t rangeCount; // DISCARD only
+        std::chrono::steady_clock::time_point start; // when the command was written
     } m_transferCommandStatus;
+
+    StorageStats m_stats;
 };
 
 #endif /* _STORAGE_IO_DEVICE_HPP */
\ No newline at end of file
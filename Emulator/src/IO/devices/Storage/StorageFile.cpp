@@ -17,25 +17,63 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "StorageFile.hpp"
 
-StorageFile::StorageFile(const char* path) : m_path(path), m_handle(0), m_size(0), m_data(nullptr) {
+StorageFile::StorageFile(const char* path) : StorageBackend(path), m_handle(0), m_bufferedHandle(0), m_size(0), m_open(false), m_direct(false) {
 
 }
 
 StorageFile::~StorageFile() {
-    if (m_data != nullptr)
+    if (m_open)
         Destroy();
 }
 
 void StorageFile::Initialise() {
-    m_handle = OpenFile(m_path);
+    m_handle = OpenFile(m_path, m_readOnly, m_direct);
+    if (m_direct)
+        m_bufferedHandle = OpenFile(m_path, m_readOnly);
     m_size = GetFileSize(m_handle);
-    m_data = MapFile(m_handle, m_size, 0);
+    m_open = true;
 }
 
 void StorageFile::Destroy() {
-    UnmapFile(m_data, m_size);
     CloseFile(m_handle);
-    m_data = nullptr;
+    if (m_direct)
+        CloseFile(m_bufferedHandle);
     m_size = 0;
     m_handle = 0;
+    m_bufferedHandle = 0;
+    m_open = false;
+}
+
+bool StorageFile::ReadVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    return ReadFileVector(GetHandle(offset, buffers), buffers.data(), buffers.size(), offset) == GetTotalSize(buffers);
+}
+
+bool StorageFile::WriteVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    if (m_readOnly)
+        return false;
+    return WriteFileVector(GetHandle(offset, buffers), buffers.data(), buffers.size(), offset) == GetTotalSize(buffers);
+}
+
+bool StorageFile::Discard(uint64_t offset, uint64_t size) {
+    if (m_readOnly || offset > m_size || size > m_size - offset)
+        return false;
+    return PunchHole(m_handle, offset, size);
+}
+
+bool StorageFile::Flush() {
+    if (m_readOnly)
+        return true;
+    return SyncFile(m_handle);
+}
+
+FileHandle_t StorageFile::GetHandle(uint64_t offset, const std::vector<iovec>& buffers) const {
+    if (!m_direct)
+        return m_handle;
+    if (offset % STORAGE_DIRECT_ALIGNMENT != 0)
+        return m_bufferedHandle;
+    for (const iovec& buffer : buffers) {
+        if (reinterpret_cast<uint64_t>(buffer.iov_base) % STORAGE_DIRECT_ALIGNMENT != 0 || buffer.iov_len % STORAGE_DIRECT_ALIGNMENT != 0)
+            return m_bufferedHandle;
+    }
+    return m_handle;
 }
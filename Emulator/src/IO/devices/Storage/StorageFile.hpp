@@ -18,24 +18,47 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef _STORAGE_DEVICE_FILE_HPP
 #define _STORAGE_DEVICE_FILE_HPP
 
+#include <stdint.h>
+
 #include <OSSpecific/File.hpp>
+#include <vector>
+
+#include "StorageBackend.hpp"
 
-class StorageFile {
+// Direct I/O needs the file offset, and the address and size of every buffer, to be a multiple of this
+#define STORAGE_DIRECT_ALIGNMENT 4096
+
+// A drive backed directly by a file. Writes go to the file.
+class StorageFile : public StorageBackend {
 public:
     explicit StorageFile(const char* path);
-    ~StorageFile();
+    ~StorageFile() override;
+
+    void Initialise() override;
+    void Destroy() override;
 
-    void Initialise();
-    void Destroy();
+    // Only takes effect on the next Initialise. Transfers that aren't aligned for direct I/O, like the short last
+    // block of a drive, go through the host page cache instead.
+    void SetDirect(bool direct) { m_direct = direct; }
 
-    void* GetData() const { return m_data; }
-    size_t GetSize() const { return m_size; }
+    size_t GetSize() const override { return m_size; }
+
+    bool ReadVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+    bool WriteVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+
+    bool Discard(uint64_t offset, uint64_t size) override;
+    bool Flush() override;
+
+   private:
+    // The handle to use for a transfer
+    FileHandle_t GetHandle(uint64_t offset, const std::vector<iovec>& buffers) const;
 
    private:
-    const char* m_path;
     FileHandle_t m_handle;
+    FileHandle_t m_bufferedHandle; // only opened with direct I/O
     size_t m_size;
-    void* m_data;
+    bool m_open;
+    bool m_direct;
 };
 
 #endif /* _STORAGE_DEVICE_FILE_HPP */
\ No newline at end of file
@@ -0,0 +1,120 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageInterruptCoalescer.hpp"
+
+#include <util.h>
+
+#include "StorageDevice.hpp"
+
+StorageInterruptCoalescer::StorageInterruptCoalescer(StorageDevice* device)
+    : m_device(device), m_count(0), m_time(0), m_unsignalled(0), m_pending(0), m_deadline(), m_stopping(false) {
+}
+
+StorageInterruptCoalescer::~StorageInterruptCoalescer() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    if (m_timer.joinable())
+        m_timer.join();
+}
+
+bool StorageInterruptCoalescer::Configure(uint64_t count, uint64_t time) {
+    if (count > STORAGE_COALESCE_MAX_COUNT || time > STORAGE_COALESCE_MAX_TIME || (count > 1 && time == 0))
+        return false;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_count = count;
+    m_time = std::chrono::microseconds(time);
+    if (count > 0 && !m_timer.joinable())
+        m_timer = std::thread(&StorageInterruptCoalescer::TimerLoop, this);
+    return true;
+}
+
+bool StorageInterruptCoalescer::AddCompletion() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pending++;
+    m_unsignalled++;
+    if (m_count == 0)
+        return false;
+    if (m_unsignalled >= m_count)
+        return TakeUnsignalled();
+    if (m_unsignalled == 1) {
+        m_deadline = std::chrono::steady_clock::now() + m_time;
+        m_wake.notify_all();
+    }
+    return false;
+}
+
+bool StorageInterruptCoalescer::BatchDone() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_count > 0)
+        return false;
+    return TakeUnsignalled();
+}
+
+bool StorageInterruptCoalescer::Force() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return TakeUnsignalled();
+}
+
+uint64_t StorageInterruptCoalescer::GetPending() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_pending;
+}
+
+void StorageInterruptCoalescer::Acknowledge(uint64_t count) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pending -= MIN(count, m_pending);
+}
+
+void StorageInterruptCoalescer::Reset() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_count = 0;
+    m_time = std::chrono::microseconds(0);
+    m_unsignalled = 0;
+    m_pending = 0;
+}
+
+void StorageInterruptCoalescer::TimerLoop() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (!m_stopping) {
+        if (m_count == 0 || m_unsignalled == 0) {
+            m_wake.wait(lock);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < m_deadline) {
+            m_wake.wait_until(lock, m_deadline);
+            continue;
+        }
+        m_unsignalled = 0;
+        // the emulator thread can hold the event lock while it waits for m_lock
+        lock.unlock();
+        m_device->QueueInterrupt();
+        lock.lock();
+    }
+}
+
+bool StorageInterruptCoalescer::TakeUnsignalled() {
+    if (m_unsignalled == 0)
+        return false;
+    m_unsignalled = 0;
+    return true;
+}
@@ -0,0 +1,82 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_INTERRUPT_COALESCER_HPP
+#define _STORAGE_INTERRUPT_COALESCER_HPP
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define STORAGE_COALESCE_MAX_COUNT 0xFFFF
+#define STORAGE_COALESCE_MAX_TIME 1'000'000 // in microseconds
+
+class StorageDevice;
+
+// Decides when completions that asked for an interrupt get one. Without coalescing, a legacy transfer is interrupted
+// as soon as it completes and queues once nothing is left in flight. With coalescing, the interrupt waits for a number
+// of completions or for a time after the first one, whichever comes first.
+// Methods returning true mean the caller must raise the interrupt. Every method is safe to call from any thread.
+class StorageInterruptCoalescer {
+public:
+    explicit StorageInterruptCoalescer(StorageDevice* device);
+    ~StorageInterruptCoalescer();
+
+    // count 0 turns coalescing off, time is in microseconds. Returns false if the settings are invalid.
+    // Anything held back under the old settings is still waiting, so call Force afterwards.
+    bool Configure(uint64_t count, uint64_t time);
+
+    bool AddCompletion();
+
+    // Nothing is left in flight
+    bool BatchDone();
+
+    // The guest can't see any more completions until it is interrupted
+    bool Force();
+
+    // Completions that asked for an interrupt and haven't been acknowledged by the guest
+    uint64_t GetPending();
+    void Acknowledge(uint64_t count);
+
+    // Back to no coalescing with nothing pending
+    void Reset();
+
+private:
+    void TimerLoop();
+
+    // m_lock must be held
+    bool TakeUnsignalled();
+
+private:
+    StorageDevice* m_device;
+
+    std::mutex m_lock; // protects everything below
+    std::condition_variable m_wake;
+    uint64_t m_count;
+    std::chrono::microseconds m_time;
+    uint64_t m_unsignalled; // completions since the last interrupt
+    uint64_t m_pending;
+    std::chrono::steady_clock::time_point m_deadline; // when the first unsignalled completion times out
+    bool m_stopping;
+    std::thread m_timer; // only started once coalescing is first turned on
+};
+
+#endif /* _STORAGE_INTERRUPT_COALESCER_HPP */
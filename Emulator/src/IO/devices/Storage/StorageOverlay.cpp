@@ -0,0 +1,123 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageOverlay.hpp"
+
+#include <util.h>
+
+StorageOverlay::StorageOverlay(StorageBackend* base, const char* overlayPath)
+    : StorageBackend(overlayPath), m_base(base), m_overlayPath(overlayPath), m_delta(0), m_size(0), m_open(false) {
+    m_base->SetReadOnly(true);
+}
+
+StorageOverlay::~StorageOverlay() {
+    if (m_open)
+        Destroy();
+    delete m_base;
+}
+
+void StorageOverlay::Initialise() {
+    m_base->Initialise();
+    m_size = m_base->GetSize();
+    // the delta is sparse, so emptying it doesn't depend on the size of the image
+    m_delta = CreateFile(m_overlayPath, m_size);
+    uint64_t blockCount = DIV_ROUNDUP(m_size, STORAGE_OVERLAY_BLOCK_SIZE);
+    m_written.Resize(ALIGN_UP(blockCount, 8));
+    m_written.ClearAll();
+    m_open = true;
+}
+
+void StorageOverlay::Destroy() {
+    CloseFile(m_delta);
+    m_base->Destroy();
+    m_written.Resize(0);
+    m_size = 0;
+    m_delta = 0;
+    m_open = false;
+}
+
+bool StorageOverlay::Discard(uint64_t offset, uint64_t size) {
+    if (offset % STORAGE_OVERLAY_BLOCK_SIZE != 0 || size % STORAGE_OVERLAY_BLOCK_SIZE != 0 || offset > m_size || size > m_size - offset)
+        return false;
+
+    // the blocks go back to reading from the base, so the delta doesn't need them any more
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        for (uint64_t block = offset / STORAGE_OVERLAY_BLOCK_SIZE; block < (offset + size) / STORAGE_OVERLAY_BLOCK_SIZE; block++)
+            m_written.Clear(block);
+    }
+    return PunchHole(m_delta, offset, size);
+}
+
+bool StorageOverlay::Flush() {
+    // the base is never written
+    return SyncFile(m_delta);
+}
+
+bool StorageOverlay::ReadVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (offset % STORAGE_OVERLAY_BLOCK_SIZE != 0 || size % STORAGE_OVERLAY_BLOCK_SIZE != 0 || offset > m_size || size > m_size - offset)
+        return false;
+
+    struct Run {
+        uint64_t block;
+        uint64_t count;
+        bool written;
+    };
+    std::vector<Run> runs;
+    uint64_t firstBlock = offset / STORAGE_OVERLAY_BLOCK_SIZE;
+    uint64_t blockCount = size / STORAGE_OVERLAY_BLOCK_SIZE;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        for (uint64_t block = firstBlock; block < firstBlock + blockCount; block++) {
+            bool written = m_written.Test(block);
+            if (!runs.empty() && runs.back().written == written)
+                runs.back().count++;
+            else
+                runs.push_back({block, 1, written});
+        }
+    }
+
+    // each run of blocks comes from one place, so it is still one read
+    std::vector<iovec> slice;
+    for (const Run& run : runs) {
+        SliceBuffers(buffers, (run.block - firstBlock) * STORAGE_OVERLAY_BLOCK_SIZE, run.count * STORAGE_OVERLAY_BLOCK_SIZE, slice);
+        if (!run.written) {
+            if (!m_base->ReadVector(run.block * STORAGE_OVERLAY_BLOCK_SIZE, slice))
+                return false;
+        } else if (ReadFileVector(m_delta, slice.data(), slice.size(), run.block * STORAGE_OVERLAY_BLOCK_SIZE) != run.count * STORAGE_OVERLAY_BLOCK_SIZE)
+            return false;
+    }
+    return true;
+}
+
+bool StorageOverlay::WriteVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (offset % STORAGE_OVERLAY_BLOCK_SIZE != 0 || size % STORAGE_OVERLAY_BLOCK_SIZE != 0 || offset > m_size || size > m_size - offset)
+        return false;
+
+    // whole blocks are written, so nothing needs copying from the base first
+    if (WriteFileVector(m_delta, buffers.data(), buffers.size(), offset) != size)
+        return false;
+
+    // only mark the blocks once the data is in the delta, so a concurrent read never sees an unwritten block
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (uint64_t block = offset / STORAGE_OVERLAY_BLOCK_SIZE; block < (offset + size) / STORAGE_OVERLAY_BLOCK_SIZE; block++)
+        m_written.Set(block);
+    return true;
+}
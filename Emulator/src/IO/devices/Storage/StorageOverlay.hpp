@@ -0,0 +1,64 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_OVERLAY_HPP
+#define _STORAGE_OVERLAY_HPP
+
+#include <stdint.h>
+
+#include <Data-structures/Bitmap.hpp>
+#include <OSSpecific/File.hpp>
+#include <mutex>
+#include <vector>
+
+#include "StorageBackend.hpp"
+
+#define STORAGE_OVERLAY_BLOCK_SIZE 512
+
+// A read-only base image with a copy-on-write delta file on top. Blocks that have been written are read from the
+// delta, everything else from the base. The delta is emptied on every Initialise, so each run starts from the base.
+class StorageOverlay : public StorageBackend {
+public:
+    // Takes ownership of base
+    StorageOverlay(StorageBackend* base, const char* overlayPath);
+    ~StorageOverlay() override;
+
+    void Initialise() override;
+    void Destroy() override;
+
+    size_t GetSize() const override { return m_size; }
+
+    // offset and the buffer sizes must add up to whole blocks
+    bool ReadVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+    bool WriteVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+
+    bool Discard(uint64_t offset, uint64_t size) override;
+    bool Flush() override;
+
+   private:
+    StorageBackend* m_base;
+    const char* m_overlayPath;
+    FileHandle_t m_delta;
+    size_t m_size;
+    bool m_open;
+
+    std::mutex m_lock; // protects m_written
+    Bitmap m_written; // one bit per block, set once the block is in the delta
+};
+
+#endif /* _STORAGE_OVERLAY_HPP */
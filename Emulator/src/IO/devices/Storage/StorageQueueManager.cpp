@@ -0,0 +1,237 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageQueueManager.hpp"
+
+#include <string.h>
+
+#include "PhysicalRegionListBuffer.hpp"
+
+StorageQueueManager::StorageQueueManager(StorageDevice* device, MMU* PhysicalMMU)
+    : m_device(device), m_PhysicalMMU(PhysicalMMU), m_inFlight(0), m_stopping(false) {
+    for (Queue& queue : m_queues)
+        queue = {false, false, 0, 0, 0, 0, 0, 0, false, 0};
+}
+
+StorageQueueManager::~StorageQueueManager() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_workAvailable.notify_all();
+    m_completionSpace.notify_all();
+    for (std::thread& worker : m_workers)
+        worker.join();
+}
+
+bool StorageQueueManager::CreateQueue(const StorageDevice_CreateQueueRequest& request) {
+    if (request.ID >= STORAGE_MAX_QUEUES || request.DEPTH < 2 || request.DEPTH > STORAGE_MAX_QUEUE_DEPTH)
+        return false;
+    if (!m_PhysicalMMU->ValidateRead(request.SQ, request.DEPTH * sizeof(StorageDevice_SubmissionEntry)) || !m_PhysicalMMU->ValidateWrite(request.CQ, request.DEPTH * sizeof(StorageDevice_CompletionEntry)))
+        return false;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    Queue& queue = m_queues[request.ID];
+    if (queue.active)
+        return false;
+
+    // clear the completion ring, so no entry has the phase bit set until it is written
+    StorageDevice_CompletionEntry empty;
+    memset(&empty, 0, sizeof(empty));
+    for (uint64_t i = 0; i < request.DEPTH; i++)
+        m_PhysicalMMU->WriteBuffer(request.CQ + i * sizeof(StorageDevice_CompletionEntry), reinterpret_cast<const uint8_t*>(&empty), sizeof(empty));
+
+    queue.active = true;
+    queue.INT = request.FLAGS.INT;
+    queue.SQ = request.SQ;
+    queue.CQ = request.CQ;
+    queue.depth = request.DEPTH;
+    queue.SQHead = 0;
+    queue.CQHead = 0;
+    queue.CQTail = 0;
+    queue.phase = true;
+
+    if (m_workers.empty())
+        StartWorkers();
+    return true;
+}
+
+bool StorageQueueManager::DeleteQueue(uint64_t ID) {
+    if (ID >= STORAGE_MAX_QUEUES)
+        return false;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    Queue& queue = m_queues[ID];
+    if (!queue.active)
+        return false;
+
+    queue.active = false;
+    queue.generation++;
+
+    // requests that haven't started are dropped, the ones executing finish but don't complete
+    for (auto it = m_jobs.begin(); it != m_jobs.end();) {
+        if (it->queue == ID) {
+            it = m_jobs.erase(it);
+            m_inFlight--;
+        } else
+            it++;
+    }
+    if (m_inFlight == 0)
+        m_idle.notify_all();
+    m_completionSpace.notify_all();
+    return true;
+}
+
+void StorageQueueManager::RingSubmissionDoorbell(uint64_t value) {
+    uint64_t ID = value & 0xFFFF;
+    uint32_t tail = (value >> 16) & 0xFFFF'FFFF;
+    if (ID >= STORAGE_MAX_QUEUES)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    Queue& queue = m_queues[ID];
+    if (!queue.active || tail >= queue.depth)
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    while (queue.SQHead != tail) {
+        Job job;
+        m_PhysicalMMU->ReadBuffer(queue.SQ + queue.SQHead * sizeof(StorageDevice_SubmissionEntry), reinterpret_cast<uint8_t*>(&job.entry), sizeof(StorageDevice_SubmissionEntry));
+        queue.SQHead = (queue.SQHead + 1) % queue.depth;
+        job.queue = ID;
+        job.generation = queue.generation;
+        job.SQHead = queue.SQHead;
+        job.submitted = now;
+        m_jobs.push_back(job);
+        m_inFlight++;
+        m_device->RecordQueuedSubmission(m_inFlight);
+    }
+    m_workAvailable.notify_all();
+}
+
+void StorageQueueManager::RingCompletionDoorbell(uint64_t value) {
+    uint64_t ID = value & 0xFFFF;
+    uint32_t head = (value >> 16) & 0xFFFF'FFFF;
+    if (ID >= STORAGE_MAX_QUEUES)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    Queue& queue = m_queues[ID];
+    if (!queue.active || head >= queue.depth)
+        return;
+    queue.CQHead = head;
+    m_completionSpace.notify_all();
+}
+
+void StorageQueueManager::WaitForIdle() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_idle.wait(lock, [this] { return m_inFlight == 0; });
+}
+
+bool StorageQueueManager::IsIdle() {
+    return m_inFlight == 0;
+}
+
+void StorageQueueManager::Reset() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (Queue& queue : m_queues) {
+        queue.active = false;
+        queue.generation++;
+    }
+    m_inFlight -= m_jobs.size();
+    m_jobs.clear();
+    m_completionSpace.notify_all();
+    m_idle.wait(lock, [this] { return m_inFlight == 0; });
+}
+
+void StorageQueueManager::StartWorkers() {
+    for (int i = 0; i < STORAGE_WORKER_COUNT; i++)
+        m_workers.emplace_back(&StorageQueueManager::WorkerLoop, this);
+}
+
+void StorageQueueManager::WorkerLoop() {
+    // each worker keeps its own list, so requests can run concurrently and a driver reusing a list skips parsing it
+    PhysicalRegionListBuffer buffer(m_device, m_PhysicalMMU);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (true) {
+        m_workAvailable.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+        if (m_stopping)
+            return;
+
+        Job job = m_jobs.front();
+        m_jobs.pop_front();
+
+        lock.unlock();
+        StorageCompletionStatus status = m_device->ExecuteQueuedRequest(job.entry, buffer);
+        lock.lock();
+
+        bool posted = PostCompletion(lock, job, status);
+
+        // the request stays in flight until the device knows about it, so the last one to finish ends the batch
+        lock.unlock();
+        if (posted)
+            m_device->CompletionPosted();
+        m_device->RecordQueuedCompletion(job.entry, status, job.submitted);
+        lock.lock();
+
+        if (--m_inFlight == 0) {
+            m_idle.notify_all();
+            lock.unlock();
+            m_device->CompletionsIdle();
+            lock.lock();
+        }
+    }
+}
+
+bool StorageQueueManager::PostCompletion(std::unique_lock<std::mutex>& lock, const Job& job, StorageCompletionStatus status) {
+    Queue& queue = m_queues[job.queue];
+    auto isFull = [&queue] { return (queue.CQTail + 1) % queue.depth == queue.CQHead; };
+    if (queue.generation == job.generation && isFull()) {
+        // the guest may be waiting for an interrupt before it frees any entries
+        lock.unlock();
+        m_device->CompletionRingFull();
+        lock.lock();
+    }
+    m_completionSpace.wait(lock, [&] { return m_stopping || queue.generation != job.generation || !isFull(); });
+    if (m_stopping || queue.generation != job.generation)
+        return false;
+
+    StorageDevice_CompletionEntry entry;
+    entry.TAG = job.entry.TAG;
+    entry.SQHEAD = job.SQHead;
+    entry.STATUS = static_cast<uint16_t>(status);
+    entry.PHASE = queue.phase;
+    entry.RSVD = 0;
+
+    // the phase bit is written last, so the guest never sees a partially written entry. The entry is lost if the guest
+    // has mapped something other than RAM over the ring.
+    uint64_t address = queue.CQ + queue.CQTail * sizeof(StorageDevice_CompletionEntry);
+    constexpr size_t flagsOffset = sizeof(StorageDevice_CompletionEntry) - sizeof(uint16_t);
+    {
+        SharedRegionGuard guard(m_PhysicalMMU);
+        if (m_PhysicalMMU->WriteRAM(address, reinterpret_cast<const uint8_t*>(&entry), flagsOffset))
+            m_PhysicalMMU->WriteRAM(address + flagsOffset, reinterpret_cast<const uint8_t*>(&entry) + flagsOffset, sizeof(uint16_t));
+    }
+
+    queue.CQTail = (queue.CQTail + 1) % queue.depth;
+    if (queue.CQTail == 0)
+        queue.phase = !queue.phase;
+
+    return queue.INT;
+}
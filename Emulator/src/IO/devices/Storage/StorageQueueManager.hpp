@@ -0,0 +1,111 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_QUEUE_MANAGER_HPP
+#define _STORAGE_QUEUE_MANAGER_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <MMU/MMU.hpp>
+
+#include "StorageDevice.hpp"
+
+#define STORAGE_MAX_QUEUES 8
+#define STORAGE_MAX_QUEUE_DEPTH 4096
+#define STORAGE_WORKER_COUNT 4
+
+// Submission and completion rings in guest memory. Requests are picked up when the submission doorbell is rung,
+// executed on a pool of host threads, and completed in whatever order they finish.
+class StorageQueueManager {
+public:
+    StorageQueueManager(StorageDevice* device, MMU* PhysicalMMU);
+    ~StorageQueueManager();
+
+    // Both return false if the request is invalid
+    bool CreateQueue(const StorageDevice_CreateQueueRequest& request);
+    bool DeleteQueue(uint64_t ID);
+
+    // The doorbell value is the queue ID in bits 0-15 and the new tail/head in bits 16-47
+    void RingSubmissionDoorbell(uint64_t value);
+    void RingCompletionDoorbell(uint64_t value);
+
+    // Wait for every submitted request to complete
+    void WaitForIdle();
+
+    // Returns true if no submitted request is queued or executing. Doesn't take the lock, as the emulator thread calls it
+    // while holding the event lock.
+    bool IsIdle();
+
+    // Drop every queue. Requests still executing complete, but their completions are discarded.
+    void Reset();
+
+private:
+    struct Queue {
+        bool active;
+        bool INT;
+        uint64_t SQ;
+        uint64_t CQ;
+        uint32_t depth;
+        uint32_t SQHead;
+        uint32_t CQHead;
+        uint32_t CQTail;
+        bool phase;
+        uint64_t generation; // changes when the queue is deleted, so completions for the old queue are dropped
+    };
+
+    struct Job {
+        uint64_t queue;
+        uint64_t generation;
+        uint32_t SQHead;
+        StorageDevice_SubmissionEntry entry;
+        std::chrono::steady_clock::time_point submitted; // when the doorbell was rung
+    };
+
+    void StartWorkers();
+    void WorkerLoop();
+
+    // Returns true if the device should be told about the completion. m_lock must be held, and is released while the
+    // device is told the ring is full, as the device raises interrupts through the event queue.
+    bool PostCompletion(std::unique_lock<std::mutex>& lock, const Job& job, StorageCompletionStatus status);
+
+private:
+    StorageDevice* m_device;
+    MMU* m_PhysicalMMU;
+
+    // protects everything below. The device is never called with it held, as the emulator thread can hold the event
+    // lock while it calls into the queues.
+    std::mutex m_lock;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_completionSpace;
+    std::condition_variable m_idle;
+    std::deque<Job> m_jobs;
+    std::atomic<uint64_t> m_inFlight; // queued, executing or being completed. Only changed with m_lock held
+    bool m_stopping;
+    Queue m_queues[STORAGE_MAX_QUEUES];
+    std::vector<std::thread> m_workers;
+};
+
+#endif /* _STORAGE_QUEUE_MANAGER_HPP */
@@ -0,0 +1,245 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageSparseImage.hpp"
+
+#include <string.h>
+#include <util.h>
+
+#include <Emulator.hpp>
+#include <string>
+
+static bool ReadAt(FileHandle_t handle, void* data, size_t size, uint64_t offset) {
+    iovec buffer = {data, size};
+    return ReadFileVector(handle, &buffer, 1, offset) == size;
+}
+
+static bool WriteAt(FileHandle_t handle, const void* data, size_t size, uint64_t offset) {
+    iovec buffer = {const_cast<void*>(data), size};
+    return WriteFileVector(handle, &buffer, 1, offset) == size;
+}
+
+StorageSparseImage::StorageSparseImage(const char* path)
+    : StorageBackend(path), m_handle(0), m_open(false), m_header(), m_clusterSize(0), m_entryCount(0), m_fileEnd(0) {
+}
+
+StorageSparseImage::~StorageSparseImage() {
+    if (m_open)
+        Destroy();
+}
+
+void StorageSparseImage::Initialise() {
+    m_handle = OpenFile(m_path, m_readOnly);
+    if (!ReadAt(m_handle, &m_header, sizeof(m_header), 0) || !DiskImage::ValidateHeader(m_header)) {
+        std::string str = "Invalid disk image: ";
+        str += m_path;
+        Emulator::Crash(str.c_str());
+    }
+    m_clusterSize = 1ULL << m_header.clusterShift;
+    m_entryCount = DiskImage::GetL2EntryCount(m_header.clusterShift);
+
+    m_l1.resize(m_header.l1Count);
+    if (!ReadAt(m_handle, m_l1.data(), m_l1.size() * sizeof(uint64_t), m_header.l1Offset)) {
+        std::string str = "Failed to read the L1 table of disk image: ";
+        str += m_path;
+        Emulator::Crash(str.c_str());
+    }
+    m_l2.assign(m_header.l1Count, nullptr);
+    m_fileEnd = ALIGN_UP(GetFileSize(m_handle), DISK_IMAGE_ALIGNMENT);
+    m_open = true;
+}
+
+void StorageSparseImage::Destroy() {
+    for (DiskImage::L2Entry* table : m_l2)
+        delete[] table;
+    m_l2.clear();
+    m_l1.clear();
+    CloseFile(m_handle);
+    m_handle = 0;
+    m_header = {};
+    m_open = false;
+}
+
+bool StorageSparseImage::ReadVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (offset % 512 != 0 || size % 512 != 0 || offset > m_header.size || size > m_header.size - offset)
+        return false;
+
+    std::vector<iovec> slice;
+    std::vector<uint8_t> cluster;
+    for (uint64_t position = offset; position < offset + size;) {
+        uint64_t index = position >> m_header.clusterShift;
+        uint64_t inner = position & (m_clusterSize - 1);
+        uint64_t length = MIN(m_clusterSize - inner, offset + size - position);
+        SliceBuffers(buffers, position - offset, length, slice);
+
+        DiskImage::L2Entry entry = {0, 0, 0};
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            DiskImage::L2Entry* current;
+            if (!GetEntry(index, false, current))
+                return false;
+            if (current != nullptr)
+                entry = *current;
+        }
+
+        if (entry.offset == 0) {
+            for (const iovec& buffer : slice)
+                memset(buffer.iov_base, 0, buffer.iov_len);
+        } else if (entry.flags & DiskImage::L2F_COMPRESSED) {
+            cluster.resize(m_clusterSize);
+            if (!ReadCluster(entry, cluster.data()))
+                return false;
+            CopyToBuffers(slice, cluster.data() + inner);
+        } else if (ReadFileVector(m_handle, slice.data(), slice.size(), entry.offset + inner) != length)
+            return false;
+
+        position += length;
+    }
+    return true;
+}
+
+bool StorageSparseImage::WriteVector(uint64_t offset, const std::vector<iovec>& buffers) {
+    size_t size = GetTotalSize(buffers);
+    if (m_readOnly || offset % 512 != 0 || size % 512 != 0 || offset > m_header.size || size > m_header.size - offset)
+        return false;
+
+    std::vector<iovec> slice;
+    std::vector<uint8_t> cluster;
+    for (uint64_t position = offset; position < offset + size;) {
+        uint64_t index = position >> m_header.clusterShift;
+        uint64_t inner = position & (m_clusterSize - 1);
+        uint64_t length = MIN(m_clusterSize - inner, offset + size - position);
+        SliceBuffers(buffers, position - offset, length, slice);
+
+        std::unique_lock<std::mutex> lock(m_lock);
+        DiskImage::L2Entry* entry;
+        if (!GetEntry(index, false, entry))
+            return false;
+
+        if (entry != nullptr && entry->offset != 0 && !(entry->flags & DiskImage::L2F_COMPRESSED)) {
+            // already allocated, so it can be written in place
+            uint64_t clusterOffset = entry->offset;
+            lock.unlock();
+            if (WriteFileVector(m_handle, slice.data(), slice.size(), clusterOffset + inner) != length)
+                return false;
+        } else {
+            // build the whole new cluster, keeping whatever this write doesn't cover
+            cluster.resize(m_clusterSize);
+            if (entry != nullptr && entry->offset != 0) {
+                if (!ReadCluster(*entry, cluster.data()))
+                    return false;
+            } else
+                memset(cluster.data(), 0, m_clusterSize);
+            CopyFromBuffers(slice, cluster.data() + inner);
+
+            // the data goes in before the entry points at it
+            uint64_t clusterOffset = Allocate(m_clusterSize);
+            if (!WriteAt(m_handle, cluster.data(), m_clusterSize, clusterOffset) || !GetEntry(index, true, entry))
+                return false;
+            *entry = {clusterOffset, static_cast<uint32_t>(m_clusterSize), 0};
+            uint64_t l1Index = index / m_entryCount;
+            if (!WriteAt(m_handle, entry, sizeof(DiskImage::L2Entry), m_l1[l1Index] + (index % m_entryCount) * sizeof(DiskImage::L2Entry)))
+                return false;
+        }
+
+        position += length;
+    }
+    return true;
+}
+
+bool StorageSparseImage::Discard(uint64_t offset, uint64_t size) {
+    if (m_readOnly || offset % 512 != 0 || size % 512 != 0 || offset > m_header.size || size > m_header.size - offset)
+        return false;
+
+    // only whole clusters can be freed. The rest of the range keeps its data.
+    uint64_t end = offset + size == m_header.size ? DIV_ROUNDUP(m_header.size, m_clusterSize) : (offset + size) >> m_header.clusterShift;
+    for (uint64_t index = DIV_ROUNDUP(offset, m_clusterSize); index < end; index++) {
+        std::lock_guard<std::mutex> guard(m_lock);
+        DiskImage::L2Entry* entry;
+        if (!GetEntry(index, false, entry))
+            return false;
+        if (entry == nullptr || entry->offset == 0)
+            continue;
+
+        // the entry is cleared before the space is freed, so it never points at a hole
+        DiskImage::L2Entry old = *entry;
+        *entry = {0, 0, 0};
+        uint64_t l1Index = index / m_entryCount;
+        if (!WriteAt(m_handle, entry, sizeof(DiskImage::L2Entry), m_l1[l1Index] + (index % m_entryCount) * sizeof(DiskImage::L2Entry))) {
+            *entry = old;
+            return false;
+        }
+        if (!PunchHole(m_handle, old.offset, old.storedSize))
+            return false;
+    }
+    return true;
+}
+
+bool StorageSparseImage::Flush() {
+    // tables are written as soon as they change, so the file is always complete
+    if (m_readOnly)
+        return true;
+    return SyncFile(m_handle);
+}
+
+bool StorageSparseImage::GetEntry(uint64_t cluster, bool create, DiskImage::L2Entry*& entry) {
+    uint64_t l1Index = cluster / m_entryCount;
+    entry = nullptr;
+    if (m_l2[l1Index] == nullptr) {
+        if (m_l1[l1Index] != 0) {
+            DiskImage::L2Entry* table = new DiskImage::L2Entry[m_entryCount];
+            if (!ReadAt(m_handle, table, m_clusterSize, m_l1[l1Index])) {
+                delete[] table;
+                return false;
+            }
+            m_l2[l1Index] = table;
+        } else if (create) {
+            DiskImage::L2Entry* table = new DiskImage::L2Entry[m_entryCount]();
+            uint64_t tableOffset = Allocate(m_clusterSize);
+            // the table goes in before the L1 entry points at it
+            if (!WriteAt(m_handle, table, m_clusterSize, tableOffset) || !WriteAt(m_handle, &tableOffset, sizeof(uint64_t), m_header.l1Offset + l1Index * sizeof(uint64_t))) {
+                delete[] table;
+                return false;
+            }
+            m_l1[l1Index] = tableOffset;
+            m_l2[l1Index] = table;
+        } else
+            return true;
+    }
+    entry = &m_l2[l1Index][cluster % m_entryCount];
+    return true;
+}
+
+bool StorageSparseImage::ReadCluster(const DiskImage::L2Entry& entry, uint8_t* data) {
+    if (entry.storedSize > m_clusterSize)
+        return false;
+    if (!(entry.flags & DiskImage::L2F_COMPRESSED))
+        return ReadAt(m_handle, data, m_clusterSize, entry.offset);
+
+    std::vector<uint8_t> compressed(entry.storedSize);
+    if (!ReadAt(m_handle, compressed.data(), compressed.size(), entry.offset))
+        return false;
+    return DiskImage::Decompress(compressed.data(), compressed.size(), data, m_clusterSize);
+}
+
+uint64_t StorageSparseImage::Allocate(uint64_t size) {
+    uint64_t offset = m_fileEnd;
+    m_fileEnd += ALIGN_UP(size, DISK_IMAGE_ALIGNMENT);
+    return offset;
+}
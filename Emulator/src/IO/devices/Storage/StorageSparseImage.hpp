@@ -0,0 +1,75 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_SPARSE_IMAGE_HPP
+#define _STORAGE_SPARSE_IMAGE_HPP
+
+#include <stdint.h>
+
+#include <libarch/DiskImage.hpp>
+#include <mutex>
+#include <OSSpecific/File.hpp>
+#include <vector>
+
+#include "StorageBackend.hpp"
+
+// A drive in the sparse disk image format. Unallocated clusters read as zero. Writing to one, or to a compressed
+// cluster, allocates a new uncompressed cluster at the end of the file. The space a compressed cluster used is only
+// reclaimed by converting the image again.
+class StorageSparseImage : public StorageBackend {
+public:
+    explicit StorageSparseImage(const char* path);
+    ~StorageSparseImage() override;
+
+    void Initialise() override;
+    void Destroy() override;
+
+    size_t GetSize() const override { return m_header.size; }
+
+    // offset and the buffer sizes must add up to whole 512 byte blocks
+    bool ReadVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+    bool WriteVector(uint64_t offset, const std::vector<iovec>& buffers) override;
+
+    bool Discard(uint64_t offset, uint64_t size) override;
+    bool Flush() override;
+
+   private:
+    // Find the L2 entry for cluster, loading its table if needed. entry is nullptr if the table doesn't exist and
+    // create is false. Returns false if the image couldn't be read or written. m_lock must be held.
+    bool GetEntry(uint64_t cluster, bool create, DiskImage::L2Entry*& entry);
+
+    // Read a whole allocated cluster into data
+    bool ReadCluster(const DiskImage::L2Entry& entry, uint8_t* data);
+
+    // Space for size bytes at the end of the file. m_lock must be held.
+    uint64_t Allocate(uint64_t size);
+
+   private:
+    FileHandle_t m_handle;
+    bool m_open;
+    DiskImage::Header m_header;
+    uint64_t m_clusterSize;
+    uint64_t m_entryCount; // entries per L2 table
+
+    std::mutex m_lock; // protects everything below
+    uint64_t m_fileEnd;
+    std::vector<uint64_t> m_l1;
+    std::vector<DiskImage::L2Entry*> m_l2; // loaded on first use
+};
+
+#endif /* _STORAGE_SPARSE_IMAGE_HPP */
@@ -0,0 +1,176 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "StorageStats.hpp"
+
+#include <util.h>
+
+#include <bit>
+#include <string.h>
+
+// largest value that goes in the bucket
+static uint64_t GetBucketLimit(uint64_t bucket) {
+    return bucket == 64 ? UINT64_MAX : (1ULL << bucket) - 1;
+}
+
+StorageHistogram::StorageHistogram() {
+    Clear();
+}
+
+void StorageHistogram::Add(uint64_t value) {
+    m_buckets[std::bit_width(value)]++;
+    m_count++;
+    m_total += value;
+    m_max = MAX(m_max, value);
+}
+
+void StorageHistogram::Clear() {
+    memset(m_buckets, 0, sizeof(m_buckets));
+    m_count = 0;
+    m_total = 0;
+    m_max = 0;
+}
+
+uint64_t StorageHistogram::GetCount() const {
+    return m_count;
+}
+
+uint64_t StorageHistogram::GetMax() const {
+    return m_max;
+}
+
+double StorageHistogram::GetAverage() const {
+    return m_count > 0 ? static_cast<double>(m_total) / static_cast<double>(m_count) : 0.0;
+}
+
+uint64_t StorageHistogram::GetPercentile(double fraction) const {
+    uint64_t target = static_cast<uint64_t>(fraction * static_cast<double>(m_count) + 0.5);
+    uint64_t seen = 0;
+    for (uint64_t i = 0; i < STORAGE_HISTOGRAM_BUCKETS; i++) {
+        seen += m_buckets[i];
+        if (seen >= target && seen > 0)
+            return MIN(GetBucketLimit(i), m_max);
+    }
+    return m_max;
+}
+
+void StorageHistogram::Print(FILE* fp, const char* indent, const char* unit) const {
+    if (m_count == 0)
+        return;
+    uint64_t first = 0;
+    while (m_buckets[first] == 0)
+        first++;
+    uint64_t last = std::bit_width(m_max);
+    for (uint64_t i = first; i <= last; i++) {
+        double percent = static_cast<double>(m_buckets[i]) * 100.0 / static_cast<double>(m_count);
+        if (i <= 1)
+            fprintf(fp, "%s%lu %s: %lu (%.1f%%)\n", indent, i, unit, m_buckets[i], percent);
+        else
+            fprintf(fp, "%s%lu-%lu %s: %lu (%.1f%%)\n", indent, GetBucketLimit(i - 1) + 1, GetBucketLimit(i), unit, m_buckets[i], percent);
+    }
+}
+
+StorageStats::StorageStats() {
+    Clear();
+}
+
+void StorageStats::Clear() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    for (TransferStats* stats : {&m_reads, &m_writes}) {
+        stats->count = 0;
+        stats->bytes = 0;
+        stats->errors = 0;
+        stats->latency.Clear();
+    }
+    m_flushes = {0, 0, 0, 0};
+    m_discards = {0, 0, 0};
+    m_interruptCompletions = 0;
+    m_interrupts = 0;
+    m_queueDepth.Clear();
+    m_requestSize.Clear();
+}
+
+void StorageStats::RecordSubmission(uint64_t depth) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_queueDepth.Add(depth);
+}
+
+void StorageStats::RecordTransfer(bool write, uint64_t bytes, uint64_t latency, bool success) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    TransferStats& stats = write ? m_writes : m_reads;
+    stats.count++;
+    if (success) {
+        stats.bytes += bytes;
+        m_requestSize.Add(bytes);
+    } else
+        stats.errors++;
+    stats.latency.Add(latency / 1000);
+}
+
+void StorageStats::RecordFlush(uint64_t latency, bool success) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_flushes.count++;
+    if (!success)
+        m_flushes.errors++;
+    m_flushes.totalTime += latency;
+    m_flushes.maxTime = MAX(m_flushes.maxTime, latency);
+}
+
+void StorageStats::RecordDiscard(uint64_t bytes, bool success) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_discards.count++;
+    if (success)
+        m_discards.bytes += bytes;
+    else
+        m_discards.errors++;
+}
+
+void StorageStats::RecordInterruptCompletion() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_interruptCompletions++;
+}
+
+void StorageStats::RecordInterrupt() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_interrupts++;
+}
+
+void StorageStats::Print(FILE* fp) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    PrintTransfers(fp, "Reads", m_reads);
+    PrintTransfers(fp, "Writes", m_writes);
+    fprintf(fp, "  Flushes: %lu, errors: %lu, average latency: %.1f us, max latency: %.1f us\n", m_flushes.count, m_flushes.errors, m_flushes.count > 0 ? static_cast<double>(m_flushes.totalTime) / 1000.0 / static_cast<double>(m_flushes.count) : 0.0, static_cast<double>(m_flushes.maxTime) / 1000.0);
+    fprintf(fp, "  Discards: %lu, %.1f KiB, errors: %lu\n", m_discards.count, static_cast<double>(m_discards.bytes) / 1024.0, m_discards.errors);
+    fprintf(fp, "  Interrupts: %lu, for %lu completions\n", m_interrupts, m_interruptCompletions);
+    if (m_queueDepth.GetCount() > 0) {
+        fprintf(fp, "  Queue depth: average %.1f, max %lu\n", m_queueDepth.GetAverage(), m_queueDepth.GetMax());
+        m_queueDepth.Print(fp, "    ", "requests");
+    }
+    if (m_requestSize.GetCount() > 0) {
+        fprintf(fp, "  Request size: average %.1f KiB, max %.1f KiB\n", m_requestSize.GetAverage() / 1024.0, static_cast<double>(m_requestSize.GetMax()) / 1024.0);
+        m_requestSize.Print(fp, "    ", "bytes");
+    }
+}
+
+void StorageStats::PrintTransfers(FILE* fp, const char* name, const TransferStats& stats) const {
+    fprintf(fp, "  %s: %lu, %.1f KiB, errors: %lu\n", name, stats.count, static_cast<double>(stats.bytes) / 1024.0, stats.errors);
+    if (stats.count == 0)
+        return;
+    fprintf(fp, "    Latency: average %.1f us, p50 <= %lu us, p99 <= %lu us, max %lu us\n", stats.latency.GetAverage(), stats.latency.GetPercentile(0.5), stats.latency.GetPercentile(0.99), stats.latency.GetMax());
+    stats.latency.Print(fp, "      ", "us");
+}
@@ -0,0 +1,106 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _STORAGE_STATS_HPP
+#define _STORAGE_STATS_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <mutex>
+
+#define STORAGE_HISTOGRAM_BUCKETS 65
+
+// Power of two buckets. Bucket 0 holds 0, and bucket n holds values from 2^(n-1) up to 2^n - 1.
+class StorageHistogram {
+public:
+    StorageHistogram();
+
+    void Add(uint64_t value);
+    void Clear();
+
+    uint64_t GetCount() const;
+    uint64_t GetMax() const;
+    double GetAverage() const;
+
+    // Upper bound of the bucket that the given fraction of the values fall in or below
+    uint64_t GetPercentile(double fraction) const;
+
+    // One line per bucket, from the first to the last one in use
+    void Print(FILE* fp, const char* indent, const char* unit) const;
+
+private:
+    uint64_t m_buckets[STORAGE_HISTOGRAM_BUCKETS];
+    uint64_t m_count;
+    uint64_t m_total;
+    uint64_t m_max;
+};
+
+// Per-drive counters. Every method is safe to call from any thread.
+class StorageStats {
+public:
+    StorageStats();
+
+    void Clear();
+
+    // depth is the number of requests queued or executing on the device, including this one
+    void RecordSubmission(uint64_t depth);
+
+    // latency is from the command or doorbell write to the completion, in nanoseconds
+    void RecordTransfer(bool write, uint64_t bytes, uint64_t latency, bool success);
+    void RecordFlush(uint64_t latency, bool success);
+    void RecordDiscard(uint64_t bytes, bool success);
+
+    // A completion that asked for an interrupt, and an interrupt raised for one or more of them
+    void RecordInterruptCompletion();
+    void RecordInterrupt();
+
+    void Print(FILE* fp);
+
+private:
+    struct TransferStats {
+        uint64_t count;
+        uint64_t bytes; // only successful transfers
+        uint64_t errors;
+        StorageHistogram latency; // in microseconds
+    };
+
+    void PrintTransfers(FILE* fp, const char* name, const TransferStats& stats) const;
+
+private:
+    std::mutex m_lock; // protects everything below
+    TransferStats m_reads;
+    TransferStats m_writes;
+    struct FlushStats {
+        uint64_t count;
+        uint64_t errors;
+        uint64_t totalTime; // in nanoseconds
+        uint64_t maxTime;
+    } m_flushes;
+    struct DiscardStats {
+        uint64_t count;
+        uint64_t bytes;
+        uint64_t errors;
+    } m_discards;
+    uint64_t m_interruptCompletions;
+    uint64_t m_interrupts;
+    StorageHistogram m_queueDepth;
+    StorageHistogram m_requestSize; // in bytes
+};
+
+#endif /* _STORAGE_STATS_HPP */
@@ -0,0 +1,132 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "VideoAccelerator.hpp"
+
+#include <string.h>
+#include <util.h>
+
+VideoAccelerator::VideoAccelerator()
+    : m_operation(), m_pending(false), m_stopping(false), m_busy(false) {
+}
+
+VideoAccelerator::~VideoAccelerator() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    if (m_worker.joinable())
+        m_worker.join();
+}
+
+void VideoAccelerator::Submit(VideoOperation operation) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_idle.wait(lock, [this] { return !m_busy.load(std::memory_order_relaxed); });
+    m_operation = std::move(operation);
+    m_pending = true;
+    m_busy.store(true, std::memory_order_release);
+    if (!m_worker.joinable())
+        m_worker = std::thread(&VideoAccelerator::WorkerLoop, this);
+    lock.unlock();
+    m_wake.notify_all();
+}
+
+void VideoAccelerator::Wait() {
+    if (!IsBusy())
+        return;
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_idle.wait(lock, [this] { return !m_busy.load(std::memory_order_relaxed); });
+}
+
+void VideoAccelerator::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (!m_stopping) {
+        if (!m_pending) {
+            m_wake.wait(lock);
+            continue;
+        }
+        VideoOperation operation = std::move(m_operation);
+        m_pending = false;
+        lock.unlock();
+
+        switch (operation.type) {
+        case VideoOperationType::FILL:
+            Fill(operation);
+            break;
+        case VideoOperationType::COPY:
+            Copy(operation);
+            break;
+        case VideoOperationType::BLIT:
+            Blit(operation);
+            break;
+        }
+
+        lock.lock();
+        m_busy.store(false, std::memory_order_release);
+        m_idle.notify_all();
+    }
+}
+
+void VideoAccelerator::Fill(const VideoOperation& operation) {
+    uint64_t rowSize = operation.rect.width * operation.bytesPerPixel;
+    uint8_t* data = operation.target->GetData();
+    uint64_t offset = operation.rect.y * operation.pitch + operation.rect.x * operation.bytesPerPixel;
+    uint8_t* first = data + offset;
+
+    // build the first row by doubling what is already there, then copy it to the rest, so it is all memcpy
+    memcpy(first, &operation.colour, operation.bytesPerPixel);
+    for (uint64_t filled = operation.bytesPerPixel; filled < rowSize; filled *= 2)
+        memcpy(first + filled, first, MIN(filled, rowSize - filled));
+    operation.target->MarkDirty(offset, rowSize);
+
+    for (uint64_t row = 1; row < operation.rect.height; row++) {
+        uint64_t rowOffset = offset + row * operation.pitch;
+        memcpy(data + rowOffset, first, rowSize);
+        operation.target->MarkDirty(rowOffset, rowSize);
+    }
+}
+
+void VideoAccelerator::Copy(const VideoOperation& operation) {
+    uint64_t rowSize = operation.rect.width * operation.bytesPerPixel;
+    uint8_t* data = operation.target->GetData();
+    uint64_t sourceOffset = operation.sourceY * operation.pitch + operation.sourceX * operation.bytesPerPixel;
+    uint64_t offset = operation.rect.y * operation.pitch + operation.rect.x * operation.bytesPerPixel;
+
+    // when moving down, start from the bottom so no source row is overwritten before it is copied. memmove takes care
+    // of rows overlapping themselves.
+    bool backwards = operation.rect.y > operation.sourceY;
+    for (uint64_t i = 0; i < operation.rect.height; i++) {
+        uint64_t row = backwards ? operation.rect.height - 1 - i : i;
+        uint64_t rowOffset = offset + row * operation.pitch;
+        memmove(data + rowOffset, data + sourceOffset + row * operation.pitch, rowSize);
+        operation.target->MarkDirty(rowOffset, rowSize);
+    }
+}
+
+void VideoAccelerator::Blit(const VideoOperation& operation) {
+    uint64_t rowSize = operation.rect.width * operation.bytesPerPixel;
+    uint8_t* data = operation.target->GetData();
+    uint64_t offset = operation.rect.y * operation.pitch + operation.rect.x * operation.bytesPerPixel;
+
+    for (uint64_t row = 0; row < operation.rect.height; row++) {
+        uint64_t rowOffset = offset + row * operation.pitch;
+        memcpy(data + rowOffset, operation.source.data() + row * rowSize, rowSize);
+        operation.target->MarkDirty(rowOffset, rowSize);
+    }
+}
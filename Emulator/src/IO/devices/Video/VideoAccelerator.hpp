@@ -0,0 +1,85 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _VIDEO_ACCELERATOR_HPP
+#define _VIDEO_ACCELERATOR_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "VideoBackend.hpp"
+#include "VideoFramebuffer.hpp"
+
+enum class VideoOperationType {
+    FILL,
+    COPY,
+    BLIT
+};
+
+// A rectangle operation on a framebuffer. Everything MUST be validated by the device before it is submitted.
+struct VideoOperation {
+    VideoOperationType type;
+    VideoFramebuffer* target;
+    uint64_t pitch;         // of the target, in bytes
+    uint64_t bytesPerPixel;
+    VideoRect rect;         // written in the target
+    uint32_t colour;        // FILL, only the low bytesPerPixel bytes are used
+    uint64_t sourceX;       // COPY, in the target
+    uint64_t sourceY;
+    std::vector<uint8_t> source; // BLIT, the source rows back to back, copied from guest memory when it is submitted
+};
+
+// Runs 2D operations for the video device on its own thread, one at a time, so the guest can carry on while a large
+// rectangle is drawn.
+class VideoAccelerator {
+public:
+    VideoAccelerator();
+    ~VideoAccelerator();
+
+    // Waits for the operation in progress to finish first. The target must not be freed until it is no longer busy.
+    void Submit(VideoOperation operation);
+
+    // Safe to call from any thread without waiting
+    bool IsBusy() const { return m_busy.load(std::memory_order_acquire); }
+
+    void Wait();
+
+private:
+    void WorkerLoop();
+
+    void Fill(const VideoOperation& operation);
+    void Copy(const VideoOperation& operation);
+    void Blit(const VideoOperation& operation);
+
+private:
+    std::mutex m_lock; // protects everything below
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    VideoOperation m_operation;
+    bool m_pending;
+    bool m_stopping;
+    std::atomic_bool m_busy; // from Submit until the operation is finished
+    std::thread m_worker; // only started with the first operation
+};
+
+#endif /* _VIDEO_ACCELERATOR_HPP */
@@ -17,8 +17,12 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "VideoBackend.hpp"
 
+#include <algorithm>
+#include <string.h>
+
 VideoBackend::VideoBackend(const VideoMode& mode)
-    : m_mode(mode) {
+    : m_mode(mode), m_framebuffer(nullptr), m_frameCallback(nullptr), m_frameCallbackData(nullptr), m_paletteLock(), m_palette(), m_framePalette(), m_converted(), m_statsLock(), m_frames(0), m_rects(0), m_bytesUploaded(0), m_bytesFull(0), m_presentTime(0), m_maxPresentTime(0) {
+    VideoPixelFormat::GetDefaultPalette(m_palette);
 }
 
 VideoBackend::~VideoBackend() {
@@ -29,5 +33,108 @@ VideoMode VideoBackend::GetRawMode() {
 }
 
 void VideoBackend::SetRawMode(const VideoMode& mode) {
+    std::lock_guard<std::mutex> guard(m_statsLock); // PrintStats reads the mode
     m_mode = mode;
-}
\ No newline at end of file
+}
+
+VideoFramebuffer* VideoBackend::GetFramebuffer() {
+    return m_framebuffer;
+}
+
+void VideoBackend::SetFramebuffer(VideoFramebuffer* framebuffer) {
+    m_framebuffer = framebuffer;
+}
+
+void VideoBackend::SetFrameCallback(VideoFrameCallback callback, void* data) {
+    m_frameCallback = callback;
+    m_frameCallbackData = data;
+}
+
+void VideoBackend::SetPalette(uint64_t start, uint64_t count, const uint32_t* colours) {
+    std::lock_guard<std::mutex> guard(m_paletteLock);
+    for (uint64_t i = 0; i < count && start + i < VIDEO_PALETTE_SIZE; i++)
+        m_palette[start + i] = colours[i] & 0xFF'FFFF;
+}
+
+void VideoBackend::PrintStats(FILE* fp) {
+    std::lock_guard<std::mutex> guard(m_statsLock);
+    fprintf(fp, "Video: %lux%lu, %u bpp\n", m_mode.width, m_mode.height, m_mode.bpp);
+    fprintf(fp, "  Frames presented: %lu, average time: %.1f us, max: %.1f us\n", m_frames, m_frames > 0 ? static_cast<double>(m_presentTime) / 1000.0 / static_cast<double>(m_frames) : 0.0, static_cast<double>(m_maxPresentTime) / 1000.0);
+    fprintf(fp, "  Uploaded: %.1f KiB in %lu rectangles, %.1f%% of full frames\n", static_cast<double>(m_bytesUploaded) / 1024.0, m_rects, m_bytesFull > 0 ? static_cast<double>(m_bytesUploaded) * 100.0 / static_cast<double>(m_bytesFull) : 0.0);
+}
+
+void VideoBackend::GetDamage(const std::vector<VideoDirtyRange>& ranges, const VideoMode& mode, std::vector<VideoRect>& rects) {
+    rects.clear();
+    uint64_t bytesPerPixel = mode.bpp / 8;
+    uint64_t rowBytes = mode.width * bytesPerPixel;
+    for (const VideoDirtyRange& range : ranges) {
+        uint64_t end = range.offset + range.size; // exclusive
+        uint64_t firstRow = range.offset / mode.pitch;
+        uint64_t lastRow = (end - 1) / mode.pitch;
+        if (firstRow >= mode.height)
+            break; // the ranges are in order, so everything else is past the screen too
+        lastRow = std::min(lastRow, mode.height - 1);
+
+        VideoRect rect = {0, firstRow, mode.width, lastRow - firstRow + 1};
+        if (firstRow == lastRow) {
+            // within one row, so only the pixels that were touched are needed
+            uint64_t start = range.offset - firstRow * mode.pitch;
+            uint64_t stop = std::min(end - firstRow * mode.pitch, rowBytes);
+            if (start >= rowBytes)
+                continue; // only the padding at the end of the row
+            rect.x = start / bytesPerPixel;
+            rect.width = (stop + bytesPerPixel - 1) / bytesPerPixel - rect.x;
+        }
+
+        if (!rects.empty()) {
+            VideoRect& last = rects.back();
+            if (last.y + last.height >= rect.y) {
+                uint64_t left = std::min(last.x, rect.x);
+                uint64_t right = std::max(last.x + last.width, rect.x + rect.width);
+                uint64_t bottom = std::max(last.y + last.height, rect.y + rect.height);
+                last.x = left;
+                last.width = right - left;
+                last.height = bottom - last.y;
+                continue;
+            }
+        }
+        rects.push_back(rect);
+    }
+}
+
+const uint8_t* VideoBackend::ConvertRect(const VideoRect& rect, uint64_t& pitch) {
+    const uint8_t* data = m_framebuffer->GetData();
+    uint64_t bytesPerPixel = m_mode.bpp / 8;
+    if (m_mode.bpp == 32) {
+        pitch = m_mode.pitch;
+        return data + rect.y * m_mode.pitch + rect.x * bytesPerPixel;
+    }
+
+    if (m_mode.bpp == 8) {
+        std::lock_guard<std::mutex> guard(m_paletteLock);
+        memcpy(m_framePalette, m_palette, sizeof(m_palette));
+    }
+
+    m_converted.resize(rect.width * rect.height);
+    for (uint64_t row = 0; row < rect.height; row++) {
+        const uint8_t* source = data + (rect.y + row) * m_mode.pitch + rect.x * bytesPerPixel;
+        VideoPixelFormat::ConvertRow(source, m_converted.data() + row * rect.width, rect.width, m_mode.bpp, m_framePalette);
+    }
+    pitch = rect.width * 4;
+    return reinterpret_cast<const uint8_t*>(m_converted.data());
+}
+
+void VideoBackend::RecordPresent(uint64_t rects, uint64_t bytes, uint64_t time) {
+    std::lock_guard<std::mutex> guard(m_statsLock);
+    m_frames++;
+    m_rects += rects;
+    m_bytesUploaded += bytes;
+    m_bytesFull += m_mode.width * m_mode.height * (m_mode.bpp / 8);
+    m_presentTime += time;
+    m_maxPresentTime = std::max(m_maxPresentTime, time);
+}
+
+void VideoBackend::FramePresented(VideoFramebuffer* framebuffer) {
+    if (m_frameCallback != nullptr)
+        m_frameCallback(m_frameCallbackData, framebuffer);
+}
@@ -18,12 +18,29 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef _VIDEO_DEVICE_BACKEND_HPP
 #define _VIDEO_DEVICE_BACKEND_HPP
 
+#include <mutex>
 #include <stdint.h>
+#include <stdio.h>
+#include <vector>
 
 #include "VideoDevice.hpp"
+#include "VideoFramebuffer.hpp"
+#include "VideoPixelFormat.hpp"
+
+// A damaged area of the screen, in pixels
+struct VideoRect {
+    uint64_t x;
+    uint64_t y;
+    uint64_t width;
+    uint64_t height;
+};
+
+// Run by the backend after it presents a frame showing framebuffer, from its own thread
+typedef void (*VideoFrameCallback)(void* data, VideoFramebuffer* framebuffer);
 
 enum class VideoBackendType {
     NONE,
+    HEADLESS,
     SDL
 };
 
@@ -34,18 +51,69 @@ class VideoBackend {
     virtual ~VideoBackend();
 
     virtual void Init() = 0;
-    virtual void SetMode(VideoMode mode) = 0;
+
+    // Show framebuffer in mode from now on. framebuffer can be nullptr, in which case nothing new is shown.
+    // The old framebuffer MUST NOT be used once this returns, so it can be freed.
+    virtual void SetMode(VideoMode mode, VideoFramebuffer* framebuffer) = 0;
     virtual VideoMode GetMode() = 0;
 
-    virtual void Write(uint64_t offset, uint8_t* data, uint64_t size) = 0;
-    virtual void Read(uint64_t offset, uint8_t* data, uint64_t size) = 0;
+    // Show framebuffer in the current mode from the next frame on. Returns straight away, so the old framebuffer can
+    // still be read until a frame showing the new one is presented, and MUST NOT be freed before the next SetMode.
+    virtual void Flip(VideoFramebuffer* framebuffer) = 0;
+
+    // Only frames where something changed are presented. MUST be called before Init.
+    void SetFrameCallback(VideoFrameCallback callback, void* data);
+
+    // Set count palette entries from start, used by 8 bpp modes from the next frame on. Frames are only presented when
+    // something changed, so the caller should mark the framebuffer dirty. Safe to call from any thread.
+    void SetPalette(uint64_t start, uint64_t count, const uint32_t* colours);
+
+    // Safe to call from any thread
+    void PrintStats(FILE* fp);
 
    protected:
     VideoMode GetRawMode();
     void SetRawMode(const VideoMode& mode);
 
+    VideoFramebuffer* GetFramebuffer();
+    void SetFramebuffer(VideoFramebuffer* framebuffer);
+
+    // Turn the dirty byte ranges of a framebuffer in mode into the rectangles of the screen they cover. Rectangles
+    // that touch vertically are merged into their bounding box, so a few large uploads are done instead of many small
+    // ones.
+    static void GetDamage(const std::vector<VideoDirtyRange>& ranges, const VideoMode& mode, std::vector<VideoRect>& rects);
+
+    // Get the pixels of rect in the current framebuffer as 32 bpp, 0x00RRGGBB, with pitch set to the bytes between
+    // rows. 32 bpp modes are read in place, anything else is converted into a buffer that is only valid until the
+    // next call.
+    const uint8_t* ConvertRect(const VideoRect& rect, uint64_t& pitch);
+
+    // Record a presented frame. bytes is how much was uploaded, time is how long the frame took in nanoseconds, not
+    // counting any wait for vsync.
+    void RecordPresent(uint64_t rects, uint64_t bytes, uint64_t time);
+
+    // Run the frame callback
+    void FramePresented(VideoFramebuffer* framebuffer);
+
    private:
     VideoMode m_mode;
+    VideoFramebuffer* m_framebuffer;
+
+    VideoFrameCallback m_frameCallback;
+    void* m_frameCallbackData;
+
+    std::mutex m_paletteLock;
+    uint32_t m_palette[VIDEO_PALETTE_SIZE];
+    uint32_t m_framePalette[VIDEO_PALETTE_SIZE]; // copied for each conversion, so the guest can't change it midway
+    std::vector<uint32_t> m_converted;
+
+    std::mutex m_statsLock;
+    uint64_t m_frames;
+    uint64_t m_rects;
+    uint64_t m_bytesUploaded;
+    uint64_t m_bytesFull; // what uploading every frame in full would have cost
+    uint64_t m_presentTime;
+    uint64_t m_maxPresentTime;
 };
 
 #endif /* _VIDEO_DEVICE_BACKEND_HPP */
\ No newline at end of file
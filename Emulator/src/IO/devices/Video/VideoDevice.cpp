@@ -18,136 +18,220 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "VideoDevice.hpp"
 
 #include <stdint.h>
+#include <string.h>
+
+#include <Emulator.hpp>
+
+#include "VideoAccelerator.hpp"
+#include "VideoBackend.hpp"
+#include "VideoPixelFormat.hpp"
+
+#include "backends/Headless/HeadlessVideoBackend.hpp"
 
 #ifdef ENABLE_SDL
 #include "backends/SDL/SDLVideoBackend.hpp"
 #endif
 
-void HandleVideoMemoryOperation(bool write, uint64_t address, uint8_t* buffer, size_t size, void* data) {
-    VideoDevice* device = static_cast<VideoDevice*>(data);
-    device->HandleMemoryOperation(write, address, buffer, size);
+static void FramePresentedCallback(void* data, VideoFramebuffer* framebuffer) {
+    static_cast<VideoDevice*>(data)->FramePresented(framebuffer);
 }
 
-VideoDevice::VideoDevice(VideoBackendType backendType, MMU& mmu)
-    : IODevice(IODeviceID::VIDEO, 3), m_memoryRegion(nullptr), m_backendType(backendType), m_backend(nullptr), m_mmu(mmu), m_command(0), m_data(0), m_status(0), m_initialised(false), m_currentMode({0, 0, 0, 0, 0}), m_currentModeIndex(0), m_modes({}) {
+VideoDevice::VideoDevice(VideoBackendType backendType, MMU& mmu, const VideoStreamConfig& stream)
+    : IODevice(IODeviceID::VIDEO, VIDEO_DEVICE_PORT_COUNT, 1), m_memoryRegion(nullptr), m_framebuffer(nullptr), m_backMemoryRegion(nullptr), m_backFramebuffer(nullptr), m_backendType(backendType), m_streamConfig(stream), m_backend(nullptr), m_accelerator(new VideoAccelerator()), m_mmu(mmu), m_command(0), m_data(0), m_status(0), m_initialised(false), m_frameInterrupt(false), m_frameInterruptPending(false), m_frames(0), m_currentMode({0, 0, 0, 0, 0}), m_currentModeIndex(0), m_modes({}) {
 }
 
 VideoDevice::~VideoDevice() {
+    delete m_accelerator;
 }
 
 void VideoDevice::Init() {
 }
 
-uint8_t VideoDevice::ReadByte(uint64_t address) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        return m_data & 0xFF;
-    if (address == static_cast<uint64_t>(VideoDevicePorts::STATUS))
-        return m_status & 0xFF;
-    return 0;
+void VideoDevice::Reset() {
+    m_accelerator->Wait();
+
+    RemoveMemoryRegion(m_memoryRegion);
+    RemoveMemoryRegion(m_backMemoryRegion);
+
+    VideoFramebuffer* framebuffer = m_framebuffer.exchange(nullptr);
+    if (m_initialised && (m_currentModeIndex != 0 || framebuffer != nullptr)) {
+        m_currentMode = m_modes[0];
+        m_currentModeIndex = 0;
+        m_backend->SetMode(m_currentMode, nullptr);
+    }
+    if (m_initialised) {
+        uint32_t palette[VIDEO_PALETTE_SIZE];
+        VideoPixelFormat::GetDefaultPalette(palette);
+        m_backend->SetPalette(0, VIDEO_PALETTE_SIZE, palette);
+    }
+    delete framebuffer;
+    delete m_backFramebuffer;
+    m_backFramebuffer = nullptr;
+
+    m_frameInterrupt = false;
+    m_frameInterruptPending = false;
+    m_frames = 0;
+
+    m_command = 0;
+    m_data = 0;
+    m_status = 0;
+}
+
+void VideoDevice::PrintStats(FILE* fp) {
+    if (m_backend == nullptr) {
+        fprintf(fp, "Video: not initialised\n");
+        return;
+    }
+    m_backend->PrintStats(fp);
+}
+
+void VideoDevice::FramePresented(VideoFramebuffer* framebuffer) {
+    // a frame still showing the other buffer doesn't count, so once a frame is counted after a flip the old buffer is
+    // no longer being read
+    if (framebuffer != m_framebuffer.load())
+        return;
+    m_frames++;
+    if (m_frameInterrupt && !m_frameInterruptPending.exchange(true))
+        Emulator::RaiseEvent({Emulator::EventType::VideoInterrupt, reinterpret_cast<uint64_t>(this)});
+}
+
+void VideoDevice::RaiseFrameInterrupt() {
+    m_frameInterruptPending = false;
+    if (m_frameInterrupt)
+        RaiseInterrupt(0);
+}
+
+std::span<const IORegister> VideoDevice::GetRegisters() const {
+    static constexpr IORegister registers[] = {
+        {static_cast<uint64_t>(VideoDevicePorts::COMMAND), IO_WIDTH_ALL, nullptr, IORegisterWrite<VideoDevice, &VideoDevice::WriteCommand>},
+        {static_cast<uint64_t>(VideoDevicePorts::DATA), IO_WIDTH_ALL, IORegisterRead<VideoDevice, &VideoDevice::ReadData>, IORegisterWrite<VideoDevice, &VideoDevice::WriteData>},
+        {static_cast<uint64_t>(VideoDevicePorts::STATUS), IO_WIDTH_ALL, IORegisterRead<VideoDevice, &VideoDevice::ReadStatus>, nullptr},
+        {static_cast<uint64_t>(VideoDevicePorts::FRAME), IO_WIDTH_ALL, IORegisterRead<VideoDevice, &VideoDevice::ReadFrame>, nullptr},
+    };
+    return registers;
+}
+
+uint64_t VideoDevice::ReadData() {
+    return m_data;
+}
+
+uint64_t VideoDevice::ReadStatus() {
+    return GetStatus();
 }
 
-uint16_t VideoDevice::ReadWord(uint64_t address) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        return m_data & 0xFFFF;
-    if (address == static_cast<uint64_t>(VideoDevicePorts::STATUS))
-        return m_status & 0xFFFF;
-    return 0;
+uint64_t VideoDevice::ReadFrame() {
+    return m_frames;
 }
 
-uint32_t VideoDevice::ReadDWord(uint64_t address) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        return m_data & 0xFFFF'FFFF;
-    else if (address == static_cast<uint64_t>(VideoDevicePorts::STATUS))
-        return m_status & 0xFFFF'FFFF;
-    else
-        return 0;
+void VideoDevice::WriteCommand(uint64_t data) {
+    m_command = data;
+    HandleCommand();
 }
 
-uint64_t VideoDevice::ReadQWord(uint64_t address) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        return m_data;
-    else if (address == static_cast<uint64_t>(VideoDevicePorts::STATUS))
-        return m_status;
-    else
-        return 0;
+void VideoDevice::WriteData(uint64_t data) {
+    m_data = data;
 }
 
-void VideoDevice::WriteByte(uint64_t address, uint8_t data) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::COMMAND)) {
-        m_command = data;
-        HandleCommand();
-    } else if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        m_data = data;
+uint64_t VideoDevice::GetStatus() const {
+    return m_status | (m_accelerator->IsBusy() ? VIDEO_STATUS_BUSY : 0);
 }
 
-void VideoDevice::WriteWord(uint64_t address, uint16_t data) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::COMMAND)) {
-        m_command = data;
-        HandleCommand();
-    } else if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        m_data = data;
+VideoFramebuffer* VideoDevice::GetTarget(uint8_t target) {
+    switch (static_cast<VideoTarget>(target)) {
+    case VideoTarget::FRAMEBUFFER:
+        return m_framebuffer;
+    case VideoTarget::BACK_BUFFER:
+        return m_backFramebuffer;
+    default:
+        return nullptr;
+    }
 }
 
-void VideoDevice::WriteDWord(uint64_t address, uint32_t data) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::COMMAND)) {
-        m_command = data;
-        HandleCommand();
-    } else if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        m_data = data;
+bool VideoDevice::IsInScreen(uint64_t x, uint64_t y, uint64_t width, uint64_t height) const {
+    return x + width <= m_currentMode.width && y + height <= m_currentMode.height;
 }
 
-void VideoDevice::WriteQWord(uint64_t address, uint64_t data) {
-    if (address == static_cast<uint64_t>(VideoDevicePorts::COMMAND)) {
-        m_command = data;
-        HandleCommand();
-    } else if (address == static_cast<uint64_t>(VideoDevicePorts::DATA))
-        m_data = data;
+// the requests are packed, so they are copied a QWORD at a time instead of being accessed through a uint64_t pointer
+void VideoDevice::ReadRequest(void* request, size_t size) {
+    for (size_t i = 0; i < size / 8; i++) {
+        uint64_t value = m_mmu.read64(m_data + i * 8);
+        memcpy(static_cast<uint8_t*>(request) + i * 8, &value, 8);
+    }
 }
 
-void VideoDevice::HandleMemoryOperation(bool write, uint64_t address, uint8_t* buffer, uint64_t size) {
-    if (!m_initialised)
+void VideoDevice::WriteResponse(uint64_t address, const void* response, size_t size) {
+    for (size_t i = 0; i < size / 8; i++) {
+        uint64_t value;
+        memcpy(&value, static_cast<const uint8_t*>(response) + i * 8, 8);
+        m_mmu.write64(address + i * 8, value);
+    }
+}
+
+bool VideoDevice::AddMemoryRegion(VideoMemoryRegion*& region, uint64_t start, uint64_t end, VideoFramebuffer* framebuffer) {
+    if (!m_mmu.RemoveRegionSegment(start, end))
+        return false;
+    region = new VideoMemoryRegion(start, end, framebuffer);
+    m_mmu.AddMemoryRegion(region);
+    return true;
+}
+
+void VideoDevice::RemoveMemoryRegion(VideoMemoryRegion*& region) {
+    if (region == nullptr)
         return;
-#ifdef ENABLE_SDL
-    if (write)
-        m_backend->Write(address, buffer, size);
-    else
-        m_backend->Read(address, buffer, size);
-#endif
+    uint64_t start = region->getStart();
+    uint64_t end = region->getEnd();
+    m_mmu.RemoveMemoryRegion(region);
+    delete region;
+    m_mmu.ReaddRegionSegment(start, end);
+    region = nullptr;
 }
 
 void VideoDevice::HandleCommand() {
-#ifdef ENABLE_SDL
+    // every command can change the buffers an operation is drawing to, or start another one
+    m_accelerator->Wait();
+
     switch (static_cast<VideoDeviceCommands>(m_command)) {
     case VideoDeviceCommands::INITIALISE: {
         if (m_initialised)
             return;
         switch (m_backendType) {
-        case VideoBackendType::SDL: {
-            // bring the backend online
-            SDLVideoBackend* backend = new SDLVideoBackend(NATIVE_VIDEO_MODE);
-            backend->Init();
-            m_backend = backend;
-
-            // fill the modes list
-            m_modes.push_back(NATIVE_VIDEO_MODE);
-            m_modes.push_back({640, 480, 60, 32, 640 * 4});
-            m_modes.push_back({800, 600, 60, 32, 800 * 4});
-            m_modes.push_back({1'280, 720, 60, 32, 1'280 * 4});
-            m_modes.push_back({1'920, 1'080, 60, 32, 1'920 * 4});
-
-            // set the current mode. no need to set the backend mode as it's already set
-            m_currentMode = NATIVE_VIDEO_MODE;
-            m_currentModeIndex = 0;
-
-            m_initialised = true;
-
-            m_status = 0;
+        case VideoBackendType::HEADLESS:
+            m_backend = new HeadlessVideoBackend(m_streamConfig, NATIVE_VIDEO_MODE);
             break;
-        }
+#ifdef ENABLE_SDL
+        case VideoBackendType::SDL:
+            m_backend = new SDLVideoBackend(NATIVE_VIDEO_MODE);
+            break;
+#endif
         default:
             m_status = 1;
-            break;
+            return;
+        }
+
+        // bring the backend online
+        m_backend->SetFrameCallback(FramePresentedCallback, this);
+        m_backend->Init();
+
+        // fill the modes list
+        m_modes.push_back(NATIVE_VIDEO_MODE);
+        m_modes.push_back({640, 480, 60, 32, 640 * 4});
+        m_modes.push_back({800, 600, 60, 32, 800 * 4});
+        m_modes.push_back({1'280, 720, 60, 32, 1'280 * 4});
+        m_modes.push_back({1'920, 1'080, 60, 32, 1'920 * 4});
+        // then the same sizes with fewer bits per pixel, which the backend converts when it presents a frame
+        for (uint64_t i = 0; i < 5; i++) {
+            VideoMode mode = m_modes[i];
+            for (uint8_t bpp : {8, 16, 24})
+                m_modes.push_back({mode.width, mode.height, mode.refreshRate, bpp, mode.width * (bpp / 8)});
         }
+
+        // set the current mode. no need to set the backend mode as it's already set
+        m_currentMode = NATIVE_VIDEO_MODE;
+        m_currentModeIndex = 0;
+
+        m_initialised = true;
+
+        m_status = 0;
         break;
     }
     case VideoDeviceCommands::GET_SCREEN_INFO: {
@@ -160,10 +244,7 @@ void VideoDevice::HandleCommand() {
 
         VideoCommand::GetScreenInfoResponse response = {static_cast<uint32_t>(mode.width), static_cast<uint32_t>(mode.height), static_cast<uint16_t>(mode.refreshRate), static_cast<uint16_t>(mode.bpp), static_cast<uint16_t>(m_modes.size()), static_cast<uint16_t>(m_currentModeIndex)};
 
-        uint64_t* ptr = reinterpret_cast<uint64_t*>(&response);
-
-        m_mmu.write64(m_data, ptr[0]);
-        m_mmu.write64(m_data + 8, ptr[1]);
+        WriteResponse(m_data, &response, sizeof(response));
 
         m_status = 0;
         break;
@@ -175,20 +256,18 @@ void VideoDevice::HandleCommand() {
         }
 
         VideoCommand::GetModeRequest request;
+        ReadRequest(&request, sizeof(request));
 
-        uint64_t* ptr = reinterpret_cast<uint64_t*>(&request);
-
-        ptr[0] = m_mmu.read64(m_data);
-        ptr[1] = m_mmu.read64(m_data + 8);
+        if (request.index >= m_modes.size()) {
+            m_status = 1;
+            return;
+        }
 
         VideoMode mode = m_modes[request.index];
 
         VideoCommand::GetModeResponse response = {static_cast<uint32_t>(mode.width), static_cast<uint32_t>(mode.height), static_cast<uint16_t>(mode.bpp), static_cast<uint32_t>(mode.pitch), static_cast<uint16_t>(mode.refreshRate)};
 
-        ptr = reinterpret_cast<uint64_t*>(&response);
-
-        m_mmu.write64(request.address, ptr[0]);
-        m_mmu.write64(request.address + 8, ptr[1]);
+        WriteResponse(request.address, &response, sizeof(response));
 
         m_status = 0;
         break;
@@ -200,39 +279,40 @@ void VideoDevice::HandleCommand() {
         }
 
         VideoCommand::SetModeRequest request;
-
-        uint64_t* ptr = reinterpret_cast<uint64_t*>(&request);
-
-        ptr[0] = m_mmu.read64(m_data);
-        ptr[1] = m_mmu.read64(m_data + 8);
+        ReadRequest(&request, sizeof(request));
 
         if (request.mode >= m_modes.size()) {
             m_status = 1;
             return;
         }
 
-        if (m_memoryRegion != nullptr) {
-            // remove the old region
-            uint64_t start = m_memoryRegion->getStart();
-            uint64_t end = m_memoryRegion->getEnd();
-            m_mmu.RemoveMemoryRegion(m_memoryRegion);
-            delete m_memoryRegion;
-            m_mmu.ReaddRegionSegment(start, end);
-        }
+        // the new framebuffer can reuse the range of the old ones, so they are unmapped first
+        uint64_t oldStart = m_memoryRegion == nullptr ? 0 : m_memoryRegion->getStart();
+        uint64_t oldBackStart = m_backMemoryRegion == nullptr ? 0 : m_backMemoryRegion->getStart();
+        size_t oldSize = m_currentMode.pitch * m_currentMode.height;
+        RemoveMemoryRegion(m_memoryRegion);
+        RemoveMemoryRegion(m_backMemoryRegion); // it is the size of the old mode
 
         VideoMode mode = m_modes[request.mode];
 
         size_t size = mode.pitch * mode.height;
 
-        if (!m_mmu.RemoveRegionSegment(request.address, request.address + size)) {
+        // the guest writes straight into the framebuffer, and the backend reads it when it presents a frame
+        VideoFramebuffer* framebuffer = new VideoFramebuffer(size);
+        if (!AddMemoryRegion(m_memoryRegion, request.address, request.address + size, framebuffer)) {
+            delete framebuffer;
+            // put the old buffers back where they were, so the old mode carries on as if nothing happened. Their ranges were only just given back, so this can't fail
+            if ((m_framebuffer != nullptr && !AddMemoryRegion(m_memoryRegion, oldStart, oldStart + oldSize, m_framebuffer)) || (m_backFramebuffer != nullptr && !AddMemoryRegion(m_backMemoryRegion, oldBackStart, oldBackStart + oldSize, m_backFramebuffer)))
+                Emulator::Crash("VideoDevice: failed to map the old framebuffer again");
             m_status = 1;
             return;
         }
 
-        m_memoryRegion = new VideoMemoryRegion(request.address, request.address + size, HandleVideoMemoryOperation, this);
-        m_mmu.AddMemoryRegion(m_memoryRegion);
-
-        m_backend->SetMode(mode);
+        VideoFramebuffer* oldFramebuffer = m_framebuffer.exchange(framebuffer);
+        m_backend->SetMode(mode, framebuffer);
+        delete oldFramebuffer;
+        delete m_backFramebuffer;
+        m_backFramebuffer = nullptr;
 
         m_currentMode = mode;
         m_currentModeIndex = request.mode;
@@ -241,8 +321,176 @@ void VideoDevice::HandleCommand() {
 
         break;
     }
+    case VideoDeviceCommands::SET_BACK_BUFFER: {
+        // the old back buffer could still be on screen, so it can only be replaced by setting the mode again
+        if (m_framebuffer == nullptr || m_backFramebuffer != nullptr) {
+            m_status = 1;
+            return;
+        }
+
+        size_t size = m_currentMode.pitch * m_currentMode.height;
+        VideoFramebuffer* backFramebuffer = new VideoFramebuffer(size);
+        if (!AddMemoryRegion(m_backMemoryRegion, m_data, m_data + size, backFramebuffer)) {
+            delete backFramebuffer;
+            m_status = 1;
+            return;
+        }
+        m_backFramebuffer = backFramebuffer;
+
+        m_status = 0;
+        break;
+    }
+    case VideoDeviceCommands::FLIP: {
+        if (m_backFramebuffer == nullptr) {
+            m_status = 1;
+            return;
+        }
+
+        // nothing is copied, the buffers just swap places
+        std::swap(m_memoryRegion, m_backMemoryRegion);
+        m_backFramebuffer = m_framebuffer.exchange(m_backFramebuffer);
+        m_backend->Flip(m_framebuffer);
+
+        m_status = 0;
+        break;
+    }
+    case VideoDeviceCommands::SET_FRAME_INTERRUPT: {
+        if (!m_initialised) {
+            m_status = 1;
+            return;
+        }
+
+        m_frameInterrupt = (m_data & 1) != 0;
+
+        m_status = 0;
+        break;
+    }
+    case VideoDeviceCommands::SET_PALETTE: {
+        if (!m_initialised) {
+            m_status = 1;
+            return;
+        }
+
+        VideoCommand::SetPaletteRequest request;
+        ReadRequest(&request, sizeof(request));
+
+        if (request.start + request.count > VIDEO_PALETTE_SIZE || !m_mmu.ValidateRead(request.address, request.count * sizeof(uint32_t))) {
+            m_status = 1;
+            return;
+        }
+
+        uint32_t colours[VIDEO_PALETTE_SIZE];
+        m_mmu.ReadBuffer(request.address, reinterpret_cast<uint8_t*>(colours), request.count * sizeof(uint32_t));
+        m_backend->SetPalette(request.start, request.count, colours);
+
+        // every pixel using a changed entry looks different now, and frames are only presented when something changed
+        VideoFramebuffer* framebuffer = m_framebuffer;
+        if (framebuffer != nullptr && m_currentMode.bpp == 8)
+            framebuffer->MarkAllDirty();
+
+        m_status = 0;
+        break;
+    }
+    case VideoDeviceCommands::FILL: {
+        if (!m_initialised) {
+            m_status = 1;
+            return;
+        }
+
+        VideoCommand::FillRequest request;
+        ReadRequest(&request, sizeof(request));
+
+        VideoFramebuffer* target = GetTarget(request.target);
+        if (target == nullptr || !IsInScreen(request.x, request.y, request.width, request.height)) {
+            m_status = 1;
+            return;
+        }
+
+        m_status = 0;
+        if (request.width == 0 || request.height == 0)
+            break;
+
+        VideoOperation operation = {};
+        operation.type = VideoOperationType::FILL;
+        operation.target = target;
+        operation.pitch = m_currentMode.pitch;
+        operation.bytesPerPixel = m_currentMode.bpp / 8;
+        operation.rect = {request.x, request.y, request.width, request.height};
+        operation.colour = request.colour;
+        m_accelerator->Submit(std::move(operation));
+        break;
+    }
+    case VideoDeviceCommands::COPY: {
+        if (!m_initialised) {
+            m_status = 1;
+            return;
+        }
+
+        VideoCommand::CopyRequest request;
+        ReadRequest(&request, sizeof(request));
+
+        VideoFramebuffer* target = GetTarget(request.target);
+        if (target == nullptr || !IsInScreen(request.x, request.y, request.width, request.height) || !IsInScreen(request.sourceX, request.sourceY, request.width, request.height)) {
+            m_status = 1;
+            return;
+        }
+
+        m_status = 0;
+        if (request.width == 0 || request.height == 0)
+            break;
+
+        VideoOperation operation = {};
+        operation.type = VideoOperationType::COPY;
+        operation.target = target;
+        operation.pitch = m_currentMode.pitch;
+        operation.bytesPerPixel = m_currentMode.bpp / 8;
+        operation.rect = {request.x, request.y, request.width, request.height};
+        operation.sourceX = request.sourceX;
+        operation.sourceY = request.sourceY;
+        m_accelerator->Submit(std::move(operation));
+        break;
+    }
+    case VideoDeviceCommands::BLIT: {
+        if (!m_initialised) {
+            m_status = 1;
+            return;
+        }
+
+        VideoCommand::BlitRequest request;
+        ReadRequest(&request, sizeof(request));
+
+        VideoFramebuffer* target = GetTarget(request.target);
+        if (target == nullptr || !IsInScreen(request.x, request.y, request.width, request.height)) {
+            m_status = 1;
+            return;
+        }
+
+        m_status = 0;
+        if (request.width == 0 || request.height == 0)
+            break;
+
+        uint64_t bytesPerPixel = m_currentMode.bpp / 8;
+        uint64_t rowSize = request.width * bytesPerPixel;
+        uint64_t sourceSize = static_cast<uint64_t>(request.pitch) * (request.height - 1) + rowSize;
+        if (request.pitch < rowSize || request.source + sourceSize < request.source || !m_mmu.ValidateRead(request.source, sourceSize)) {
+            m_status = 1;
+            return;
+        }
+
+        VideoOperation operation = {};
+        operation.type = VideoOperationType::BLIT;
+        operation.target = target;
+        operation.pitch = m_currentMode.pitch;
+        operation.bytesPerPixel = bytesPerPixel;
+        operation.rect = {request.x, request.y, request.width, request.height};
+        // the source is copied now, on the CPU thread, as the guest can remap it before the accelerator gets to it
+        operation.source.resize(rowSize * request.height);
+        for (uint64_t row = 0; row < request.height; row++)
+            m_mmu.ReadBuffer(request.source + row * request.pitch, operation.source.data() + row * rowSize, rowSize);
+        m_accelerator->Submit(std::move(operation));
+        break;
+    }
     default:
         break;
     }
-#endif
 }
@@ -19,12 +19,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _VIDEO_IO_DEVICE_HPP
 
 #include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
 #include <vector>
 
 #include <MMU/MMU.hpp>
 
 #include <IO/IODevice.hpp>
 
+#include "VideoFramebuffer.hpp"
 #include "VideoMemoryRegion.hpp"
 
 struct VideoMode {
@@ -37,6 +41,13 @@ struct VideoMode {
 
 #define NATIVE_VIDEO_MODE {1024, 768, 60, 32, 4096}
 
+// Where the headless backend streams frames to. Nothing is streamed if path is null.
+struct VideoStreamConfig {
+    const char* path; // PPM, or Y4M if it ends with ".y4m"
+    uint64_t rate;    // frames per second
+};
+
+class VideoAccelerator;
 class VideoBackend;
 enum class VideoBackendType;
 
@@ -44,13 +55,31 @@ enum class VideoDeviceCommands {
     INITIALISE = 0,
     GET_SCREEN_INFO = 1,
     GET_MODE = 2,
-    SET_MODE = 3
+    SET_MODE = 3,
+    SET_BACK_BUFFER = 4,
+    FLIP = 5,
+    SET_FRAME_INTERRUPT = 6,
+    FILL = 7,
+    COPY = 8,
+    BLIT = 9,
+    SET_PALETTE = 10
 };
 
 enum class VideoDevicePorts {
     COMMAND = 0,
     DATA = 1,
-    STATUS = 2
+    STATUS = 2,
+    FRAME = 3
+};
+
+#define VIDEO_DEVICE_PORT_COUNT 4
+
+#define VIDEO_STATUS_ERROR 1
+#define VIDEO_STATUS_BUSY 2 // a FILL, COPY or BLIT is in progress
+
+enum class VideoTarget {
+    FRAMEBUFFER = 0,
+    BACK_BUFFER = 1
 };
 
 namespace VideoCommand {
@@ -66,6 +95,7 @@ namespace VideoCommand {
     struct [[gnu::packed]] GetModeRequest {
         uint64_t address;
         uint16_t index;
+        uint8_t reserved[6];
     };
 
     struct [[gnu::packed]] GetModeResponse {
@@ -79,36 +109,110 @@ namespace VideoCommand {
     struct [[gnu::packed]] SetModeRequest {
         uint64_t address;
         uint16_t mode;
+        uint8_t reserved[6];
+    };
+
+    struct [[gnu::packed]] SetPaletteRequest {
+        uint64_t address; // of count 32-bit colours, 0x00RRGGBB
+        uint16_t start;
+        uint16_t count;
+        uint8_t reserved[4];
+    };
+
+    struct [[gnu::packed]] FillRequest {
+        uint8_t target;
+        uint8_t reserved[3];
+        uint32_t colour;
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    struct [[gnu::packed]] CopyRequest {
+        uint8_t target;
         uint8_t reserved[7];
+        uint32_t sourceX;
+        uint32_t sourceY;
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    struct [[gnu::packed]] BlitRequest {
+        uint8_t target;
+        uint8_t reserved[3];
+        uint32_t pitch; // of the source
+        uint64_t source;
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
     };
+
+    // requests and responses are copied to and from guest memory a QWORD at a time
+    static_assert(sizeof(GetScreenInfoResponse) == 16 && sizeof(GetModeRequest) == 16 && sizeof(GetModeResponse) == 16 && sizeof(SetModeRequest) == 16);
+    static_assert(sizeof(SetPaletteRequest) == 16 && sizeof(FillRequest) == 24 && sizeof(CopyRequest) == 32 && sizeof(BlitRequest) == 32);
 }
 
 class VideoDevice : public IODevice {
 public:
-    VideoDevice(VideoBackendType backendType, MMU& mmu);
+    VideoDevice(VideoBackendType backendType, MMU& mmu, const VideoStreamConfig& stream = {nullptr, 0});
     virtual ~VideoDevice();
 
     virtual void Init();
 
-    virtual uint8_t ReadByte(uint64_t address) override;
-    virtual uint16_t ReadWord(uint64_t address) override;
-    virtual uint32_t ReadDWord(uint64_t address) override;
-    virtual uint64_t ReadQWord(uint64_t address) override;
+    // The backend stays initialised, but goes back to the native mode
+    virtual void Reset() override;
+
+    virtual std::span<const IORegister> GetRegisters() const override;
+
+    // Print how many frames the backend presented and how much it uploaded for them
+    void PrintStats(FILE* fp);
 
-    virtual void WriteByte(uint64_t address, uint8_t data) override;
-    virtual void WriteWord(uint64_t address, uint16_t data) override;
-    virtual void WriteDWord(uint64_t address, uint32_t data) override;
-    virtual void WriteQWord(uint64_t address, uint64_t data) override;
+    // Called by the backend from its own thread
+    void FramePresented(VideoFramebuffer* framebuffer);
 
-    void HandleMemoryOperation(bool write, uint64_t address, uint8_t* buffer, uint64_t size);
+    // MUST only be called from the emulator thread
+    void RaiseFrameInterrupt();
 
 private:
+    // Register handlers. Every width accesses the whole register.
+    uint64_t ReadData();
+    uint64_t ReadStatus();
+    uint64_t ReadFrame();
+    void WriteCommand(uint64_t data);
+    void WriteData(uint64_t data);
+
     void HandleCommand();
 
+    uint64_t GetStatus() const;
+
+    // nullptr if the target doesn't exist
+    VideoFramebuffer* GetTarget(uint8_t target);
+
+    bool IsInScreen(uint64_t x, uint64_t y, uint64_t width, uint64_t height) const;
+
+    // Read a request of size bytes, which MUST be a multiple of 8
+    void ReadRequest(void* request, size_t size);
+    // Write a response of size bytes to address, size MUST be a multiple of 8
+    void WriteResponse(uint64_t address, const void* response, size_t size);
+
+    // Map a framebuffer at [start, end), taking the range away from whatever is there. Returns false if it can't be taken
+    bool AddMemoryRegion(VideoMemoryRegion*& region, uint64_t start, uint64_t end, VideoFramebuffer* framebuffer);
+    // Unmap a framebuffer and give its address range back to whatever was there before
+    void RemoveMemoryRegion(VideoMemoryRegion*& region);
+
 private:
     VideoMemoryRegion* m_memoryRegion;
+    std::atomic<VideoFramebuffer*> m_framebuffer; // the one being shown, compared against by the backend thread
+    VideoMemoryRegion* m_backMemoryRegion;
+    VideoFramebuffer* m_backFramebuffer; // the one being drawn to, if the guest set one
     VideoBackendType m_backendType;
+    VideoStreamConfig m_streamConfig;
     VideoBackend* m_backend;
+    VideoAccelerator* m_accelerator;
     MMU& m_mmu;
 
     uint64_t m_command;
@@ -117,6 +221,10 @@ private:
 
     bool m_initialised;
 
+    std::atomic_bool m_frameInterrupt;
+    std::atomic_bool m_frameInterruptPending;
+    std::atomic<uint64_t> m_frames; // presented since the last reset, only counting ones showing the last flip
+
     VideoMode m_currentMode;
     uint64_t m_currentModeIndex;
 
@@ -0,0 +1,70 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "VideoFramebuffer.hpp"
+
+#include <util.h>
+
+#include <OSSpecific/Memory.hpp>
+
+VideoFramebuffer::VideoFramebuffer(size_t size)
+    : m_size(size), m_allocatedSize(ALIGN_UP(size, OSSpecific::GetPageSize())), m_dirtyWords(DIV_ROUNDUP(DIV_ROUNDUP(size, VIDEO_DIRTY_PAGE_SIZE), 64)), m_dirty(false), m_dirtyCallback(nullptr), m_dirtyCallbackData(nullptr) {
+    m_data = static_cast<uint8_t*>(OSSpecific::AllocateZeroedCOWMemory(m_allocatedSize));
+    m_dirtyPages = new std::atomic<uint64_t>[m_dirtyWords];
+    for (uint64_t i = 0; i < m_dirtyWords; i++)
+        m_dirtyPages[i].store(0, std::memory_order_relaxed);
+}
+
+VideoFramebuffer::~VideoFramebuffer() {
+    delete[] m_dirtyPages;
+    OSSpecific::FreeSizedCOWMemory(m_data, m_allocatedSize);
+}
+
+void VideoFramebuffer::TakeDirtyRanges(std::vector<VideoDirtyRange>& ranges) {
+    ranges.clear();
+    if (!m_dirty.exchange(false, std::memory_order_acquire))
+        return;
+
+    for (uint64_t i = 0; i < m_dirtyWords; i++) {
+        uint64_t word = m_dirtyPages[i].exchange(0, std::memory_order_acquire);
+        while (word != 0) {
+            uint64_t page = i * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+            uint64_t offset = page * VIDEO_DIRTY_PAGE_SIZE;
+            uint64_t size = MIN(static_cast<uint64_t>(VIDEO_DIRTY_PAGE_SIZE), m_size - offset);
+            if (!ranges.empty() && ranges.back().offset + ranges.back().size == offset)
+                ranges.back().size += size;
+            else
+                ranges.push_back({offset, size});
+        }
+    }
+
+    // A writer that saw its page already dirty didn't make its store visible before the bit was cleared. Fencing every
+    // thread here means those stores land before the pixels are read, without a fence on every guest store.
+    if (!ranges.empty())
+        OSSpecific::ProcessMemoryBarrier();
+}
+
+void VideoFramebuffer::MarkAllDirty() {
+    MarkDirty(0, m_size);
+}
+
+void VideoFramebuffer::SetDirtyCallback(void (*callback)(void* data), void* data) {
+    m_dirtyCallback = callback;
+    m_dirtyCallbackData = data;
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _VIDEO_FRAMEBUFFER_HPP
+#define _VIDEO_FRAMEBUFFER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#define VIDEO_DIRTY_PAGE_SIZE 4096
+
+struct VideoDirtyRange {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Host memory holding the guest framebuffer. The guest writes it like RAM, and the backend reads it directly when it
+// presents a frame. Writes are tracked per page, so a frame only needs to cover what changed since the last one.
+class VideoFramebuffer {
+public:
+    explicit VideoFramebuffer(size_t size);
+    ~VideoFramebuffer();
+
+    uint8_t* GetData() { return m_data; }
+    size_t GetSize() const { return m_size; }
+
+    // Call after writing. Safe to call from any thread, and cheap once the pages are already dirty.
+    void MarkDirty(uint64_t offset, size_t size) {
+        if (size == 0)
+            return;
+        // the pixels must be stored before the dirty bits are read, see TakeDirtyRanges
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        uint64_t lastPage = (offset + size - 1) / VIDEO_DIRTY_PAGE_SIZE;
+        for (uint64_t page = offset / VIDEO_DIRTY_PAGE_SIZE; page <= lastPage; page++) {
+            std::atomic<uint64_t>& word = m_dirtyPages[page / 64];
+            uint64_t bit = 1ULL << (page % 64);
+            if ((word.load(std::memory_order_relaxed) & bit) == 0) {
+                word.fetch_or(bit, std::memory_order_relaxed);
+                if (!m_dirty.exchange(true, std::memory_order_acq_rel) && m_dirtyCallback != nullptr)
+                    m_dirtyCallback(m_dirtyCallbackData);
+            }
+        }
+    }
+
+    // Whether anything was written since the last call to TakeDirtyRanges
+    bool IsDirty() const { return m_dirty.load(std::memory_order_acquire); }
+
+    // Replace ranges with the byte ranges written since the last call, merged and in order, and start tracking again.
+    // Every write covered by a range is visible once this returns. MUST only be called from one thread at a time.
+    void TakeDirtyRanges(std::vector<VideoDirtyRange>& ranges);
+
+    // Mark everything as written, so the next frame covers the whole framebuffer
+    void MarkAllDirty();
+
+    // callback is run by the writing thread whenever the framebuffer goes from clean to dirty, so a backend can sleep
+    // until there is something to present. MUST be set before the framebuffer is written to.
+    void SetDirtyCallback(void (*callback)(void* data), void* data);
+
+private:
+    uint8_t* m_data;
+    size_t m_size;
+    size_t m_allocatedSize;
+    std::atomic<uint64_t>* m_dirtyPages; // one bit per page
+    uint64_t m_dirtyWords;
+    std::atomic_bool m_dirty;
+    void (*m_dirtyCallback)(void* data);
+    void* m_dirtyCallbackData;
+};
+
+#endif /* _VIDEO_FRAMEBUFFER_HPP */
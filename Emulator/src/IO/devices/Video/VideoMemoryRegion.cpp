@@ -18,8 +18,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "VideoMemoryRegion.hpp"
 
 #include <stdio.h>
+#include <string.h>
 
-VideoMemoryRegion::VideoMemoryRegion(uint64_t start, uint64_t end, void (*operationCallback)(bool write, uint64_t address, uint8_t* buffer, size_t size, void* data), void* data) : MemoryRegion(start, end), m_operationCallback(operationCallback), m_data(data) {
+#include <OSSpecific/Memory.hpp>
+
+VideoMemoryRegion::VideoMemoryRegion(uint64_t start, uint64_t end, VideoFramebuffer* framebuffer) : MemoryRegion(start, end), m_framebuffer(framebuffer) {
 
 }
 
@@ -28,13 +31,25 @@ VideoMemoryRegion::~VideoMemoryRegion() {
 }
 
 void VideoMemoryRegion::read(uint64_t address, uint8_t* buffer, size_t size) {
-    m_operationCallback(false, address - getStart(), buffer, size, m_data);
+    if (isInside(address, size))
+        memcpy(buffer, m_framebuffer->GetData() + (address - getStart()), size);
 }
 
 void VideoMemoryRegion::write(uint64_t address, const uint8_t* buffer, size_t size) {
-    m_operationCallback(true, address - getStart(), const_cast<uint8_t*>(buffer), size, m_data);
+    if (isInside(address, size)) {
+        memcpy(m_framebuffer->GetData() + (address - getStart()), buffer, size);
+        m_framebuffer->MarkDirty(address - getStart(), size);
+    }
+}
+
+size_t VideoMemoryRegion::getHostVirtualSize() {
+    return m_framebuffer->GetSize();
+}
+
+size_t VideoMemoryRegion::getHostResidentSize() {
+    return OSSpecific::GetResidentSize(m_framebuffer->GetData(), m_framebuffer->GetSize());
 }
 
 void VideoMemoryRegion::dump() {
     printf("VideoMemoryRegion: %lx-%lx\n", getStart(), getEnd());
-}
\ No newline at end of file
+}
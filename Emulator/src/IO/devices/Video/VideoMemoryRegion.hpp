@@ -22,19 +22,28 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <MMU/MemoryRegion.hpp>
 
+#include "VideoFramebuffer.hpp"
+
+// Maps a framebuffer into the physical address space. Guest accesses behave like RAM, apart from tracking what was
+// written. It has no host pointer for DMA, as device writes into it couldn't be tracked.
 class VideoMemoryRegion : public MemoryRegion {
 public:
-    VideoMemoryRegion(uint64_t start, uint64_t end, void (*operationCallback)(bool write, uint64_t address, uint8_t* buffer, size_t size, void* data), void* data);
+    // The framebuffer must outlive the region
+    VideoMemoryRegion(uint64_t start, uint64_t end, VideoFramebuffer* framebuffer);
     virtual ~VideoMemoryRegion();
 
     void read(uint64_t address, uint8_t* buffer, size_t size) override;
     void write(uint64_t address, const uint8_t* buffer, size_t size) override;
 
+    size_t getHostVirtualSize() override;
+    size_t getHostResidentSize() override;
+
     void dump() override;
 
+    MemoryRegionType getType() override { return MemoryRegionType::VIDEO; }
+
 private:
-    void (*m_operationCallback)(bool write, uint64_t address, uint8_t* buffer, size_t size, void* data);
-    void* m_data;
+    VideoFramebuffer* m_framebuffer;
 };
 
 #endif /* _VIDEO_MEMORY_REGION_HPP */
\ No newline at end of file
@@ -0,0 +1,121 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "VideoPixelFormat.hpp"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+namespace VideoPixelFormat {
+
+    static void ConvertIndexed(const uint8_t* source, uint32_t* destination, uint64_t width, const uint32_t* palette) {
+        // a table lookup per pixel, which SSE can't do any faster
+        for (uint64_t i = 0; i < width; i++)
+            destination[i] = palette[source[i]];
+    }
+
+    static uint32_t ExpandRGB565(uint16_t pixel) {
+        uint32_t r = pixel >> 11;
+        uint32_t g = (pixel >> 5) & 0x3F;
+        uint32_t b = pixel & 0x1F;
+        // repeat the top bits in the bottom ones, so full intensity stays full
+        return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+    }
+
+    static void ConvertRGB565(const uint8_t* source, uint32_t* destination, uint64_t width) {
+        uint64_t i = 0;
+#ifdef __SSE2__
+        const __m128i greenMask = _mm_set1_epi16(0x3F);
+        const __m128i blueMask = _mm_set1_epi16(0x1F);
+        for (; i + 8 <= width; i += 8) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 2));
+            __m128i r = _mm_srli_epi16(pixels, 11);
+            __m128i g = _mm_and_si128(_mm_srli_epi16(pixels, 5), greenMask);
+            __m128i b = _mm_and_si128(pixels, blueMask);
+            r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+            b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+            // the low half of each output pixel is green and blue, the high half is red
+            __m128i low = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_unpacklo_epi16(low, r));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 4), _mm_unpackhi_epi16(low, r));
+        }
+#endif
+        for (; i < width; i++) {
+            uint16_t pixel;
+            memcpy(&pixel, source + i * 2, sizeof(pixel));
+            destination[i] = ExpandRGB565(pixel);
+        }
+    }
+
+#ifdef __SSE2__
+    // Returns how many pixels were converted
+    [[gnu::target("ssse3")]] static uint64_t ConvertRGB888SSSE3(const uint8_t* source, uint32_t* destination, uint64_t width) {
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        uint64_t i = 0;
+        // each load is 16 bytes for 4 pixels, so stop with 6 pixels left to not read past the row
+        for (; i + 6 <= width; i += 4) {
+            __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i * 3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_shuffle_epi8(pixels, shuffle));
+        }
+        return i;
+    }
+#endif
+
+    static void ConvertRGB888(const uint8_t* source, uint32_t* destination, uint64_t width) {
+        uint64_t i = 0;
+#ifdef __SSE2__
+        static const bool hasSSSE3 = __builtin_cpu_supports("ssse3");
+        if (hasSSSE3)
+            i = ConvertRGB888SSSE3(source, destination, width);
+#endif
+        for (; i < width; i++)
+            destination[i] = source[i * 3] | source[i * 3 + 1] << 8 | source[i * 3 + 2] << 16;
+    }
+
+    void ConvertRow(const uint8_t* source, uint32_t* destination, uint64_t width, uint8_t bpp, const uint32_t* palette) {
+        switch (bpp) {
+        case 8:
+            ConvertIndexed(source, destination, width, palette);
+            break;
+        case 16:
+            ConvertRGB565(source, destination, width);
+            break;
+        case 24:
+            ConvertRGB888(source, destination, width);
+            break;
+        default:
+            memcpy(destination, source, width * 4);
+            break;
+        }
+    }
+
+    void GetDefaultPalette(uint32_t* palette) {
+        for (uint32_t i = 0; i < VIDEO_PALETTE_SIZE; i++) {
+            uint32_t r = (i >> 5) * 255 / 7;
+            uint32_t g = ((i >> 2) & 7) * 255 / 7;
+            uint32_t b = (i & 3) * 255 / 3;
+            palette[i] = r << 16 | g << 8 | b;
+        }
+    }
+
+} // namespace VideoPixelFormat
@@ -0,0 +1,37 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _VIDEO_PIXEL_FORMAT_HPP
+#define _VIDEO_PIXEL_FORMAT_HPP
+
+#include <stdint.h>
+
+#define VIDEO_PALETTE_SIZE 256
+
+namespace VideoPixelFormat {
+
+    // Convert width pixels of one row in bpp to 32 bpp, 0x00RRGGBB. source is read in place and never past the last
+    // pixel. palette is only used for 8 bpp, where each pixel is an index into it.
+    void ConvertRow(const uint8_t* source, uint32_t* destination, uint64_t width, uint8_t bpp, const uint32_t* palette);
+
+    // Fill palette with the power on palette, where an index is 3 bits of red, 3 of green and 2 of blue
+    void GetDefaultPalette(uint32_t* palette);
+
+} // namespace VideoPixelFormat
+
+#endif /* _VIDEO_PIXEL_FORMAT_HPP */
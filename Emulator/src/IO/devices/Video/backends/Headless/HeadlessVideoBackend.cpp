@@ -0,0 +1,239 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "HeadlessVideoBackend.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string_view>
+
+#include <Emulator.hpp>
+
+static void WakeBackend(void* data) {
+    static_cast<HeadlessVideoBackend*>(data)->Wake();
+}
+
+HeadlessVideoBackend::HeadlessVideoBackend(const VideoStreamConfig& stream, const VideoMode& mode)
+    : VideoBackend(mode), m_streamConfig(stream), m_format(VideoStreamFormat::PPM), m_stream(nullptr), m_frameThread(nullptr), m_lock(), m_modeChanged(true), m_pendingFlip(nullptr), m_wakeLock(), m_wakeCondition(), m_running(false), m_wake(false), m_frameWidth(0), m_frameHeight(0), m_frameHeaderSize(0), m_frame(), m_dirtyRanges(), m_damage() {
+}
+
+HeadlessVideoBackend::~HeadlessVideoBackend() {
+    if (m_frameThread != nullptr) {
+        {
+            std::lock_guard<std::mutex> guard(m_wakeLock);
+            m_running = false;
+        }
+        m_wakeCondition.notify_all();
+        m_frameThread->join();
+        delete m_frameThread;
+    }
+    if (m_stream != nullptr)
+        fclose(m_stream);
+}
+
+void HeadlessVideoBackend::Init() {
+    if (m_streamConfig.path != nullptr) {
+        std::string_view path = m_streamConfig.path;
+        m_format = path.ends_with(".y4m") ? VideoStreamFormat::Y4M : VideoStreamFormat::PPM;
+
+        m_stream = fopen(m_streamConfig.path, "wb");
+        if (m_stream == nullptr) {
+            perror("fopen");
+            Emulator::Crash("Failed to open video stream");
+        }
+
+        VideoMode mode = GetRawMode();
+        if (m_format == VideoStreamFormat::Y4M) {
+            // Y4M can't change size part way through, so every frame is the size of the native mode
+            m_frameWidth = mode.width;
+            m_frameHeight = mode.height;
+            fprintf(m_stream, "YUV4MPEG2 W%lu H%lu F%lu:1 Ip A1:1 C444\n", m_frameWidth, m_frameHeight, m_streamConfig.rate);
+        }
+    }
+
+    m_running = true;
+    m_frameThread = new std::thread(&HeadlessVideoBackend::FrameLoop, this);
+}
+
+void HeadlessVideoBackend::SetMode(VideoMode mode, VideoFramebuffer* framebuffer) {
+    if (framebuffer != nullptr)
+        framebuffer->SetDirtyCallback(WakeBackend, this);
+
+    {
+        // the frame thread holds the lock for the whole of a frame, so the old framebuffer is free once it's taken
+        std::lock_guard<std::mutex> guard(m_lock);
+        SetRawMode(mode);
+        SetFramebuffer(framebuffer);
+        m_modeChanged = true;
+        m_pendingFlip = nullptr; // it was for the old mode
+    }
+    Wake();
+}
+
+VideoMode HeadlessVideoBackend::GetMode() {
+    return GetRawMode();
+}
+
+void HeadlessVideoBackend::Flip(VideoFramebuffer* framebuffer) {
+    framebuffer->SetDirtyCallback(WakeBackend, this);
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_pendingFlip = framebuffer;
+    }
+    Wake();
+}
+
+void HeadlessVideoBackend::Wake() {
+    {
+        std::lock_guard<std::mutex> guard(m_wakeLock);
+        m_wake = true;
+    }
+    m_wakeCondition.notify_all();
+}
+
+void HeadlessVideoBackend::FrameLoop() {
+    auto next = std::chrono::steady_clock::now();
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(m_lock);
+        auto start = std::chrono::steady_clock::now();
+        if (m_modeChanged) {
+            m_modeChanged = false;
+            if (m_stream != nullptr)
+                ClearFrame();
+            if (VideoFramebuffer* framebuffer = GetFramebuffer(); framebuffer != nullptr)
+                framebuffer->MarkAllDirty();
+        }
+        if (m_pendingFlip != nullptr) {
+            SetFramebuffer(m_pendingFlip);
+            m_pendingFlip->MarkAllDirty();
+            m_pendingFlip = nullptr;
+        }
+
+        VideoFramebuffer* framebuffer = GetFramebuffer();
+        VideoMode mode = GetRawMode();
+        uint64_t bytes = 0;
+        m_damage.clear();
+        if (framebuffer != nullptr && framebuffer->IsDirty()) {
+            // the guest keeps writing meanwhile, anything it writes from here on is in the next frame
+            framebuffer->TakeDirtyRanges(m_dirtyRanges);
+            GetDamage(m_dirtyRanges, mode, m_damage);
+            for (const VideoRect& rect : m_damage) {
+                if (m_stream != nullptr)
+                    EncodeRect(rect);
+                bytes += rect.width * rect.height * (mode.bpp / 8);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        lock.unlock();
+
+        if (m_stream != nullptr) {
+            // an unchanged frame is written again, so the stream keeps its rate
+            if (!WriteFrame()) {
+                perror("fwrite");
+                printf("Failed to write video stream, no more frames will be written\n");
+                fclose(m_stream);
+                m_stream = nullptr;
+            }
+        }
+        if (m_stream != nullptr || !m_damage.empty())
+            RecordPresent(m_damage.size(), bytes, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        if (!m_damage.empty())
+            FramePresented(framebuffer);
+
+        // if the frame thread falls behind, frames are dropped rather than presented late
+        uint64_t rate = m_stream != nullptr ? m_streamConfig.rate : mode.refreshRate;
+        auto interval = std::chrono::nanoseconds(1'000'000'000 / (rate > 0 ? rate : 60));
+        next += interval;
+        auto now = std::chrono::steady_clock::now();
+        if (next < now)
+            next = now + interval - (now - next) % interval;
+
+        std::unique_lock<std::mutex> wakeLock(m_wakeLock);
+        m_wakeCondition.wait_until(wakeLock, next, [this] { return !m_running; });
+        if (m_stream == nullptr) {
+            // nothing is presented until something changes
+            m_wakeCondition.wait(wakeLock, [this] { return m_wake || !m_running; });
+            next = std::max(next, std::chrono::steady_clock::now());
+        }
+        if (!m_running)
+            return;
+        m_wake = false;
+    }
+}
+
+void HeadlessVideoBackend::EncodeRect(const VideoRect& rect) {
+    uint64_t pitch = 0;
+    const uint8_t* data = ConvertRect(rect, pitch);
+    uint64_t right = std::min(rect.x + rect.width, m_frameWidth);
+    uint64_t bottom = std::min(rect.y + rect.height, m_frameHeight);
+    uint64_t planeSize = m_frameWidth * m_frameHeight;
+    uint8_t* pixels = m_frame.data() + m_frameHeaderSize;
+    for (uint64_t y = rect.y; y < bottom; y++) {
+        const uint8_t* pixel = data + (y - rect.y) * pitch;
+        for (uint64_t x = rect.x; x < right; x++, pixel += 4) {
+            // pixels are stored as B, G, R and an unused byte
+            int32_t b = pixel[0];
+            int32_t g = pixel[1];
+            int32_t r = pixel[2];
+            uint64_t i = y * m_frameWidth + x;
+            if (m_format == VideoStreamFormat::PPM) {
+                pixels[i * 3] = r;
+                pixels[i * 3 + 1] = g;
+                pixels[i * 3 + 2] = b;
+            } else {
+                // BT.601 limited range
+                pixels[i] = static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                pixels[planeSize + i] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                pixels[planeSize * 2 + i] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+    }
+}
+
+void HeadlessVideoBackend::ClearFrame() {
+    if (m_format == VideoStreamFormat::PPM) {
+        VideoMode mode = GetRawMode();
+        m_frameWidth = mode.width;
+        m_frameHeight = mode.height;
+    }
+
+    // the header goes in front of the pixels, so each frame is written in one go
+    char header[64];
+    if (m_format == VideoStreamFormat::PPM)
+        m_frameHeaderSize = snprintf(header, sizeof(header), "P6\n%lu %lu\n255\n", m_frameWidth, m_frameHeight);
+    else
+        m_frameHeaderSize = snprintf(header, sizeof(header), "FRAME\n");
+
+    uint64_t planeSize = m_frameWidth * m_frameHeight;
+    m_frame.resize(m_frameHeaderSize + planeSize * 3);
+    memcpy(m_frame.data(), header, m_frameHeaderSize);
+    uint8_t* pixels = m_frame.data() + m_frameHeaderSize;
+    if (m_format == VideoStreamFormat::PPM) {
+        memset(pixels, 0, planeSize * 3);
+    } else {
+        // black, and anything the mode doesn't cover stays black
+        memset(pixels, 16, planeSize);
+        memset(pixels + planeSize, 128, planeSize * 2);
+    }
+}
+
+bool HeadlessVideoBackend::WriteFrame() {
+    return fwrite(m_frame.data(), 1, m_frame.size(), m_stream) == m_frame.size();
+}
@@ -0,0 +1,88 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HEADLESS_VIDEO_BACKEND_HPP
+#define _HEADLESS_VIDEO_BACKEND_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../../VideoBackend.hpp"
+
+enum class VideoStreamFormat {
+    PPM, // binary PPM images one after another, each with its own size
+    Y4M  // YUV4MPEG2 with 4:4:4 chroma, the size of the native mode
+};
+
+// Keeps the framebuffer in host memory without showing it. A frame thread presents frames at the refresh rate of the
+// mode whenever something changed, so frame callbacks work as they would with a display. If a stream is configured, it
+// instead writes a frame to the stream at a fixed rate, so the guest never waits for the encoding.
+class HeadlessVideoBackend : public VideoBackend {
+   public:
+    explicit HeadlessVideoBackend(const VideoStreamConfig& stream, const VideoMode& mode = NATIVE_VIDEO_MODE);
+    ~HeadlessVideoBackend() override;
+
+    void Init() override;
+    void SetMode(VideoMode mode, VideoFramebuffer* framebuffer) override;
+    VideoMode GetMode() override;
+    void Flip(VideoFramebuffer* framebuffer) override;
+
+    // Wake the frame thread. Safe to call from any thread.
+    void Wake();
+
+   private:
+    void FrameLoop();
+
+    // Bring the encoded frame up to date with the framebuffer. MUST be called with m_lock held.
+    void EncodeRect(const VideoRect& rect);
+    void ClearFrame();
+
+    bool WriteFrame();
+
+   private:
+    VideoStreamConfig m_streamConfig;
+    VideoStreamFormat m_format;
+    FILE* m_stream;
+    std::thread* m_frameThread;
+
+    // held by the frame thread for the whole of a frame
+    std::mutex m_lock;
+    bool m_modeChanged;
+    VideoFramebuffer* m_pendingFlip;
+
+    // never held for long, so the guest doesn't wait on a frame to wake the thread
+    std::mutex m_wakeLock;
+    std::condition_variable m_wakeCondition;
+    bool m_running;
+    bool m_wake;
+
+    // only used by the frame thread
+    uint64_t m_frameWidth;
+    uint64_t m_frameHeight;
+    uint64_t m_frameHeaderSize;
+    std::vector<uint8_t> m_frame; // header, then RGB for PPM or the Y, U and V planes for Y4M
+    std::vector<VideoDirtyRange> m_dirtyRanges;
+    std::vector<VideoRect> m_damage;
+};
+
+#endif /* _HEADLESS_VIDEO_BACKEND_HPP */
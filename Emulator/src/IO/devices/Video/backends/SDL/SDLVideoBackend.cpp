@@ -20,23 +20,63 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_events.h>
 
+#include <chrono>
+
 #include <Emulator.hpp>
 
 #include "IO/devices/Video/VideoBackend.hpp"
 
-void EventHandler(void* data) {
-    SDLVideoBackend* backend = static_cast<SDLVideoBackend*>(data);
-    backend->EnterEventLoop();
+static void WakeBackend(void* data) {
+    static_cast<SDLVideoBackend*>(data)->Wake();
 }
 
 SDLVideoBackend::SDLVideoBackend(const VideoMode& mode)
-    : VideoBackend(mode), m_window(nullptr), m_renderer(nullptr), m_texture(nullptr), m_framebuffer(nullptr), m_eventThread(nullptr), m_renderThread(nullptr), m_renderAllowed(true), m_renderRunning(false), m_framebufferDirty(false) {
+    : VideoBackend(mode), m_window(nullptr), m_renderer(nullptr), m_texture(nullptr), m_wakeEvent(0), m_vsync(false), m_exposed(false), m_nextPresent(), m_dirtyRanges(), m_damage(), m_thread(nullptr), m_lock(), m_condition(), m_ready(false), m_modePending(false), m_pendingMode(mode), m_pendingFramebuffer(nullptr), m_pendingFlip(nullptr) {
 }
 
 SDLVideoBackend::~SDLVideoBackend() {
 }
 
 void SDLVideoBackend::Init() {
+    m_thread = new std::thread(&SDLVideoBackend::ThreadLoop, this);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_condition.wait(lock, [this] { return m_ready; });
+}
+
+void SDLVideoBackend::SetMode(VideoMode mode, VideoFramebuffer* framebuffer) {
+    if (framebuffer != nullptr)
+        framebuffer->SetDirtyCallback(WakeBackend, this);
+
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_pendingMode = mode;
+    m_pendingFramebuffer = framebuffer;
+    m_modePending = true;
+    m_pendingFlip = nullptr; // it was for the old mode
+    Wake();
+    // the backend thread is the only one using the framebuffer, so once it has switched the old one is free
+    m_condition.wait(lock, [this] { return !m_modePending; });
+}
+
+void SDLVideoBackend::Flip(VideoFramebuffer* framebuffer) {
+    framebuffer->SetDirtyCallback(WakeBackend, this);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pendingFlip = framebuffer;
+    Wake();
+}
+
+VideoMode SDLVideoBackend::GetMode() {
+    return GetRawMode();
+}
+
+void SDLVideoBackend::Wake() {
+    SDL_Event event = {};
+    event.type = m_wakeEvent;
+    SDL_PushEvent(&event);
+}
+
+void SDLVideoBackend::ThreadLoop() {
     SDL_SetAppMetadata("Frost64 Emulator", "1.0-dev", "com.github.frost64-dev.frost64");
 
     if (!SDL_Init(SDL_INIT_VIDEO)) {
@@ -44,6 +84,12 @@ void SDLVideoBackend::Init() {
         exit(1);
     }
 
+    m_wakeEvent = SDL_RegisterEvents(1);
+    if (m_wakeEvent == 0) {
+        printf("Failed to register SDL event: %s\n", SDL_GetError());
+        exit(1);
+    }
+
     VideoMode mode = GetRawMode();
 
     if (!SDL_CreateWindowAndRenderer("Emulator", mode.width, mode.height, 0, &m_window, &m_renderer)) {
@@ -51,94 +97,144 @@ void SDLVideoBackend::Init() {
         exit(1);
     }
 
-    m_renderThread = new std::thread(&SDLVideoBackend::RenderLoop, this);
-    m_eventThread = new std::thread(EventHandler, this);
-}
+    // presenting then waits for the next vertical blank, which paces frames to the display
+    m_vsync = SDL_SetRenderVSync(m_renderer, 1);
 
-void SDLVideoBackend::SetMode(VideoMode mode) {
-    m_renderAllowed.store(false);
-    while (m_renderRunning.load())
-        ;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_pendingMode = mode;
+        m_pendingFramebuffer = GetFramebuffer();
+        m_modePending = true;
+        m_ready = true;
+    }
+    m_condition.notify_all();
 
-    m_renderThread->join();
-    delete m_renderThread;
+    while (true) {
+        int32_t timeout = SDL_VIDEO_IDLE_TIMEOUT;
+        VideoFramebuffer* framebuffer = GetFramebuffer();
+        if (!m_vsync && framebuffer != nullptr && framebuffer->IsDirty()) {
+            // without vsync, frames are paced to the refresh rate of the mode instead
+            auto now = std::chrono::steady_clock::now();
+            if (now < m_nextPresent)
+                timeout = static_cast<int32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(m_nextPresent - now).count()) + 1;
+            else
+                timeout = 0;
+        }
 
-    SetRawMode(mode);
+        SDL_Event event;
+        if (SDL_WaitEventTimeout(&event, timeout)) {
+            HandleEvent(event);
+            while (SDL_PollEvent(&event))
+                HandleEvent(event);
+        }
 
-    SDL_DestroyTexture(m_texture);
-    delete[] m_framebuffer;
+        bool modePending;
+        VideoFramebuffer* flip;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            modePending = m_modePending;
+            flip = m_pendingFlip;
+            m_pendingFlip = nullptr;
+        }
+        if (modePending)
+            ApplyMode();
+        if (flip != nullptr) {
+            // the texture still holds the other framebuffer, so all of the new one is uploaded
+            SetFramebuffer(flip);
+            flip->MarkAllDirty();
+        }
 
-    m_renderAllowed.store(true);
-    m_renderThread = new std::thread(&SDLVideoBackend::RenderLoop, this);
+        if (m_vsync || std::chrono::steady_clock::now() >= m_nextPresent)
+            Draw();
 
-    while (!m_renderRunning.load())
-        ;
+        if (m_exposed) {
+            // the window lost its contents, so show the last frame again
+            m_exposed = false;
+            if (m_texture != nullptr) {
+                SDL_RenderTexture(m_renderer, m_texture, nullptr, nullptr);
+                SDL_RenderPresent(m_renderer);
+            }
+        }
+    }
 }
 
-VideoMode SDLVideoBackend::GetMode() {
-    return GetRawMode();
+void SDLVideoBackend::HandleEvent(const SDL_Event& event) {
+    switch (event.type) {
+    case SDL_EVENT_QUIT:
+        Emulator::Crash("User closed window");
+    case SDL_EVENT_WINDOW_EXPOSED:
+        m_exposed = true;
+        break;
+    default:
+        break; // including wake events, which only need the loop to run
+    }
 }
 
-void SDLVideoBackend::Write(uint64_t offset, uint8_t* data, uint64_t size) {
-    memcpy(m_framebuffer + offset, data, size);
-    m_framebufferDirty.store(true);
-}
+void SDLVideoBackend::ApplyMode() {
+    VideoMode mode;
+    VideoFramebuffer* framebuffer;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        mode = m_pendingMode;
+        framebuffer = m_pendingFramebuffer;
+    }
 
-void SDLVideoBackend::Read(uint64_t offset, uint8_t* data, uint64_t size) {
-    memcpy(data, m_framebuffer + offset, size);
-}
+    SetRawMode(mode);
+    SetFramebuffer(framebuffer);
 
-void SDLVideoBackend::EnterEventLoop() {
-    while (true) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-            case SDL_EVENT_QUIT:
-                Emulator::Crash("User closed window");
-            default:
-                break;
-            }
-        }
+    SDL_DestroyTexture(m_texture);
+    m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, mode.width, mode.height);
+    if (m_texture == nullptr) {
+        printf("Failed to create texture: %s\n", SDL_GetError());
+        exit(1);
     }
-}
 
-void SDLVideoBackend::Draw() {
-    if (!m_framebufferDirty.load())
-        return;
-
-    VideoMode mode = GetRawMode();
+    SDL_SetWindowSize(m_window, mode.width, mode.height);
 
-    void* pixels;
-    int pitch;
+    // the new texture starts out empty, so the first frame covers everything
+    if (framebuffer != nullptr)
+        framebuffer->MarkAllDirty();
 
-    if (SDL_LockTexture(m_texture, nullptr, &pixels, &pitch)) {
-        memcpy(pixels, m_framebuffer, mode.width * mode.height * 4);
-        SDL_UnlockTexture(m_texture);
-        // SDL_RenderClear(m_renderer);
-        SDL_RenderTexture(m_renderer, m_texture, nullptr, nullptr);
-        SDL_RenderPresent(m_renderer);
-        m_framebufferDirty.store(false);
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_modePending = false;
     }
+    m_condition.notify_all();
 }
 
-void SDLVideoBackend::RenderLoop() {
+void SDLVideoBackend::Draw() {
+    VideoFramebuffer* framebuffer = GetFramebuffer();
+    if (framebuffer == nullptr || !framebuffer->IsDirty())
+        return;
+
+    auto start = std::chrono::steady_clock::now();
     VideoMode mode = GetRawMode();
 
-    m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, mode.width, mode.height);
-    if (m_texture == nullptr) {
-        printf("Failed to create texture: %s\n", SDL_GetError());
-        exit(1);
+    // the guest keeps writing while the frame is uploaded, anything it writes from here on is in the next frame
+    framebuffer->TakeDirtyRanges(m_dirtyRanges);
+    GetDamage(m_dirtyRanges, mode, m_damage);
+    if (m_damage.empty())
+        return;
+
+    uint64_t bytes = 0;
+    for (const VideoRect& damage : m_damage) {
+        SDL_Rect rect = {static_cast<int>(damage.x), static_cast<int>(damage.y), static_cast<int>(damage.width), static_cast<int>(damage.height)};
+        // the texture is always 32 bpp, other modes are converted first
+        uint64_t pitch = 0;
+        const uint8_t* pixels = ConvertRect(damage, pitch);
+        if (SDL_UpdateTexture(m_texture, &rect, pixels, pitch))
+            bytes += damage.width * damage.height * (mode.bpp / 8);
     }
 
-    m_framebuffer = new uint8_t[mode.width * mode.height * 4];
-    memset(m_framebuffer, 0, mode.width * mode.height * 4);
+    // the texture keeps the rest of the last frame, so it is always drawn in full
+    m_exposed = false;
+    SDL_RenderTexture(m_renderer, m_texture, nullptr, nullptr);
+    auto end = std::chrono::steady_clock::now(); // not counting the wait for vsync
+    SDL_RenderPresent(m_renderer);
+    FramePresented(framebuffer);
 
-    SDL_SetWindowSize(m_window, mode.width, mode.height);
+    if (!m_vsync && mode.refreshRate > 0)
+        m_nextPresent = start + std::chrono::nanoseconds(1'000'000'000 / mode.refreshRate);
 
-    m_renderRunning.store(true);
-    while (m_renderAllowed.load()) {
-        Draw();
-        std::this_thread::sleep_for(std::chrono::milliseconds(16)); // roughly 60fps
-    }
-    m_renderRunning.store(false);
+    RecordPresent(m_damage.size(), bytes, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
 }
@@ -20,41 +20,62 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <SDL3/SDL.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 #include "../../VideoBackend.hpp"
 
+// How long the backend thread sleeps without any event before checking for work anyway
+#define SDL_VIDEO_IDLE_TIMEOUT 1000 // in milliseconds
+
+// Every SDL call is made from one thread, which sleeps in SDL_WaitEventTimeout until there is input, a dirty
+// framebuffer or a mode change to deal with.
 class SDLVideoBackend : public VideoBackend {
    public:
     explicit SDLVideoBackend(const VideoMode& mode = NATIVE_VIDEO_MODE);
     ~SDLVideoBackend() override;
 
     void Init() override;
-    void SetMode(VideoMode mode) override;
+    void SetMode(VideoMode mode, VideoFramebuffer* framebuffer) override;
     VideoMode GetMode() override;
+    void Flip(VideoFramebuffer* framebuffer) override;
 
-    void Write(uint64_t offset, uint8_t* data, uint64_t size) override;
-    void Read(uint64_t offset, uint8_t* data, uint64_t size) override;
-
-    void EnterEventLoop();
-    void RenderLoop();
+    // Wake the backend thread. Safe to call from any thread.
+    void Wake();
 
    private:
+    void ThreadLoop();
+
+    void HandleEvent(const SDL_Event& event);
+
+    // MUST only be called from the backend thread
+    void ApplyMode();
     void Draw();
 
    private:
     SDL_Window* m_window;
     SDL_Renderer* m_renderer;
     SDL_Texture* m_texture;
-
-    uint8_t* m_framebuffer;
-
-    std::thread* m_eventThread;
-    std::thread* m_renderThread;
-
-    std::atomic_bool m_renderAllowed;
-    std::atomic_bool m_renderRunning;
-    std::atomic_bool m_framebufferDirty;
+    uint32_t m_wakeEvent;
+    bool m_vsync;
+    bool m_exposed;
+    std::chrono::steady_clock::time_point m_nextPresent; // only used without vsync
+
+    std::vector<VideoDirtyRange> m_dirtyRanges;
+    std::vector<VideoRect> m_damage;
+
+    std::thread* m_thread;
+
+    std::mutex m_lock;
+    std::condition_variable m_condition;
+    bool m_ready;
+    bool m_modePending;
+    VideoMode m_pendingMode;
+    VideoFramebuffer* m_pendingFramebuffer;
+    VideoFramebuffer* m_pendingFlip;
 };
 
-#endif /* _SDL_VIDEO_BACKEND_HPP */
\ No newline at end of file
+#endif /* _SDL_VIDEO_BACKEND_HPP */
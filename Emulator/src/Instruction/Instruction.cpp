@@ -20,6 +20,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <atomic>
 #include <Emulator.hpp>
 #include <Exceptions.hpp>
+#include <Fuzzing.hpp>
 #include <Interrupts.hpp>
 #include <IO/IOBus.hpp>
 #include <libarch/Instruction.hpp>
@@ -68,6 +69,8 @@ bool ExecuteInstruction(uint64_t IP, MMU* mmu, InstructionState& CurrentState, c
         g_ExecutionRunning.store(1);
     (void)CurrentState;
     (void)last_error;
+    if (Fuzzing::IsEnabled() && Fuzzing::OnInstruction(IP))
+        return true; // state was reset, start again from the new IP
     InstructionBuffer buffer(mmu, IP);
     uint64_t current_offset = 0;
     if (!DecodeInstruction(buffer, current_offset, &g_current_instruction))
@@ -179,6 +182,9 @@ bool ExecuteInstruction(uint64_t IP, MMU* mmu, InstructionState& CurrentState, c
     else if (argument_count == 2)
         reinterpret_cast<void (*)(Operand*, Operand*)>(ins)(&g_currentOperands[0], &g_currentOperands[1]);
 
+    if (Fuzzing::IsEnabled() && ((Opcode >> 4) & 0x07) == 1) // control flow
+        Fuzzing::RecordEdge(IP, Emulator::GetNextIP());
+
     Emulator::SyncRegisters();
 
     Emulator::SetCPU_IP(Emulator::GetNextIP());
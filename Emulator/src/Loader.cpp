@@ -0,0 +1,124 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "Loader.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libarch/Executable.hpp>
+#include <OSSpecific/File.hpp>
+
+namespace Loader {
+
+    bool LoadExecutable(FileHandle_t handle, size_t size, MMU* mmu, StandardMemoryRegion* BIOSRegion, MemoryRegion* IORegion, const Executable::Header& header) {
+        using namespace Executable;
+
+        if (header.version != EXECUTABLE_VERSION || header.headerSize != sizeof(Header)) {
+            printf("Unsupported executable version: %u\n", header.version);
+            return false;
+        }
+
+        uint64_t segmentTableSize = static_cast<uint64_t>(header.segmentCount) * sizeof(SegmentHeader);
+        if (header.segmentTableOffset > size || segmentTableSize > size - header.segmentTableOffset) {
+            printf("Executable segment table is outside the file\n");
+            return false;
+        }
+
+        SegmentHeader* segments = new SegmentHeader[header.segmentCount];
+        if (ReadFile(handle, segments, segmentTableSize, header.segmentTableOffset) != segmentTableSize) {
+            printf("Failed to read the executable segment table\n");
+            delete[] segments;
+            return false;
+        }
+
+        // The flags are checked, but not enforced, as physical memory has no permissions
+        bool entryExecutable = false;
+        for (uint32_t i = 0; i < header.segmentCount; i++) {
+            SegmentHeader& segment = segments[i];
+            bool valid = (segment.flags & ~(SF_READ | SF_WRITE | SF_EXECUTE)) == 0 && segment.reserved == 0
+                && segment.fileSize <= segment.memorySize
+                && segment.fileOffset <= size && segment.fileSize <= size - segment.fileOffset
+                && segment.address + segment.memorySize >= segment.address;
+            if (valid && segment.memorySize > 0)
+                valid = mmu->ValidateWrite(segment.address, segment.memorySize) && (segment.address + segment.memorySize <= IORegion->getStart() || segment.address >= IORegion->getEnd());
+            // a later segment would replace the pages of an earlier one
+            for (uint32_t j = 0; valid && j < i; j++)
+                valid = segment.memorySize == 0 || segments[j].memorySize == 0 || segment.address >= segments[j].address + segments[j].memorySize || segments[j].address >= segment.address + segment.memorySize;
+            if (!valid) {
+                printf("Executable segment %u is invalid\n", i);
+                delete[] segments;
+                return false;
+            }
+            if ((segment.flags & SF_EXECUTE) != 0 && header.entryPoint >= segment.address && header.entryPoint - segment.address < segment.memorySize)
+                entryExecutable = true;
+        }
+        if (!entryExecutable) {
+            printf("Executable entry point is not in an executable segment\n");
+            delete[] segments;
+            return false;
+        }
+
+        // Mapping replaces whole pages, so map first and copy afterwards so copied segments sharing a page are not lost.
+        // Zero filled space needs no work, as memory starts zeroed.
+        bool* mapped = new bool[header.segmentCount];
+        for (uint32_t i = 0; i < header.segmentCount; i++) {
+            SegmentHeader& segment = segments[i];
+            mapped[i] = segment.fileSize > 0 && BIOSRegion->mapFile(handle, segment.address, segment.fileSize, segment.fileOffset);
+        }
+
+        for (uint32_t i = 0; i < header.segmentCount; i++) {
+            SegmentHeader& segment = segments[i];
+            if (mapped[i] || segment.fileSize == 0)
+                continue;
+            uint8_t* data = new uint8_t[segment.fileSize];
+            if (ReadFile(handle, data, segment.fileSize, segment.fileOffset) != segment.fileSize) {
+                printf("Failed to read executable segment %u\n", i);
+                delete[] data;
+                delete[] mapped;
+                delete[] segments;
+                return false;
+            }
+            mmu->WriteBuffer(segment.address, data, segment.fileSize);
+            delete[] data;
+        }
+
+        delete[] mapped;
+        delete[] segments;
+        return true;
+    }
+
+    bool LoadProgram(const char* path, size_t size, MMU* mmu, StandardMemoryRegion* BIOSRegion, MemoryRegion* IORegion, uint64_t& entryPoint) {
+        // the mappings stay valid after the file is closed
+        FileHandle_t handle = OpenFile(path, true);
+
+        Executable::Header header;
+        if (size >= sizeof(header) && ReadFile(handle, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, EXECUTABLE_MAGIC, EXECUTABLE_MAGIC_SIZE) == 0) {
+            bool success = LoadExecutable(handle, size, mmu, BIOSRegion, IORegion, header);
+            CloseFile(handle);
+            entryPoint = header.entryPoint;
+            return success;
+        }
+
+        // flat image
+        BIOSRegion->mapFile(handle, BIOSRegion->getStart(), size, 0);
+        CloseFile(handle);
+        entryPoint = BIOSRegion->getStart();
+        return true;
+    }
+
+}
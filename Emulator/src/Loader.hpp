@@ -0,0 +1,35 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOADER_HPP
+#define _LOADER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <MMU/MMU.hpp>
+#include <MMU/StandardMemoryRegion.hpp>
+
+namespace Loader {
+
+    // Load a program into physical memory. Executables are loaded by segment, anything else is treated as a flat image at the start of the BIOS region.
+    // Segments that can be mapped straight from the file are, the rest are copied in. Returns false if the executable is invalid.
+    bool LoadProgram(const char* path, size_t size, MMU* mmu, StandardMemoryRegion* BIOSRegion, MemoryRegion* IORegion, uint64_t& entryPoint);
+
+}
+
+#endif /* _LOADER_HPP */
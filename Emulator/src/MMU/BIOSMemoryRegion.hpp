@@ -27,6 +27,8 @@ public:
 
     virtual void dump() override;
 
+    virtual MemoryRegionType getType() override { return MemoryRegionType::BIOS; }
+
 private:
     uint64_t m_real_size;
 };
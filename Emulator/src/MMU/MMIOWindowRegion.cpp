@@ -0,0 +1,57 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "MMIOWindowRegion.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+MMIOWindowRegion::MMIOWindowRegion(uint64_t start, uint64_t end) : MemoryRegion(start, end) {
+
+}
+
+MMIOWindowRegion::~MMIOWindowRegion() {
+
+}
+
+void MMIOWindowRegion::read(uint64_t address, uint8_t* buffer, size_t size) {
+    (void)address;
+    memset(buffer, 0, size);
+}
+
+void MMIOWindowRegion::write(uint64_t address, const uint8_t* buffer, size_t size) {
+    (void)address;
+    (void)buffer;
+    (void)size;
+}
+
+void MMIOWindowRegion::dump() {
+    printf("MMIOWindowRegion: %lx - %lx\n", getStart(), getEnd());
+}
+
+MemoryRegion* MMIOWindowRegion::split(uint64_t start, uint64_t end) {
+    if (start < getStart() || end > getEnd() || start >= end)
+        return nullptr;
+    return new MMIOWindowRegion(start, end);
+}
+
+MemoryRegion* MMIOWindowRegion::merge(MemoryRegion* next) {
+    if (next->getType() != MemoryRegionType::MMIO_WINDOW || next->getStart() != getEnd())
+        return nullptr;
+    return new MMIOWindowRegion(getStart(), next->getEnd());
+}
@@ -0,0 +1,45 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MMIO_WINDOW_REGION_HPP
+#define _MMIO_WINDOW_REGION_HPP
+
+#include <stdint.h>
+
+#include "MemoryRegion.hpp"
+
+// An address range with no memory behind it, reserved for device registers and framebuffers.
+// Reads of any part not claimed by a device return 0 and writes are ignored.
+class MMIOWindowRegion : public MemoryRegion {
+public:
+    MMIOWindowRegion(uint64_t start, uint64_t end);
+    ~MMIOWindowRegion();
+
+    virtual void read(uint64_t address, uint8_t* buffer, size_t size) override;
+    virtual void write(uint64_t address, const uint8_t* buffer, size_t size) override;
+
+    virtual void dump() override;
+
+    virtual MemoryRegionType getType() override { return MemoryRegionType::MMIO_WINDOW; }
+
+    virtual bool canSplit() override { return true; }
+    virtual MemoryRegion* split(uint64_t start, uint64_t end) override;
+    virtual MemoryRegion* merge(MemoryRegion* next) override;
+};
+
+#endif /* _MMIO_WINDOW_REGION_HPP */
@@ -17,11 +17,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "MMU.hpp"
 
+#include <string.h>
+#include <util.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "Exceptions.hpp"
 #include "MMU/MemoryRegion.hpp"
 #include "MMU/StandardMemoryRegion.hpp"
 
-MMU::MMU() {
+MMU::MMU()
+    : m_regionUsers(0), m_regionsLocked(false) {
 }
 
 MMU::~MMU() {
@@ -255,12 +262,90 @@ bool MMU::ValidateExecute(uint64_t address, size_t size) {
     return ValidateRead(address, size);
 }
 
+bool MMU::GetHostBuffers(uint64_t address, size_t size, bool write, std::vector<iovec>& buffers) {
+    if (address + size < address)
+        return false;
+
+    while (size > 0) {
+        MemoryRegion* region = FindRegion(address);
+        if (region == nullptr)
+            return false;
+        size_t chunkSize = MIN(size, region->getEnd() - address);
+        uint8_t* host = region->getHostPointer(address, chunkSize, write);
+        if (host == nullptr)
+            return false;
+
+        // regions split from the same one are usually still contiguous in host memory
+        if (!buffers.empty() && static_cast<uint8_t*>(buffers.back().iov_base) + buffers.back().iov_len == host)
+            buffers.back().iov_len += chunkSize;
+        else
+            buffers.push_back({host, chunkSize});
+
+        address += chunkSize;
+        size -= chunkSize;
+    }
+    return true;
+}
+
+bool MMU::ReadRAM(uint64_t address, uint8_t* data, size_t size) {
+    std::vector<iovec> buffers;
+    if (!GetHostBuffers(address, size, false, buffers))
+        return false;
+    for (const iovec& buffer : buffers) {
+        memcpy(data, buffer.iov_base, buffer.iov_len);
+        data += buffer.iov_len;
+    }
+    return true;
+}
+
+bool MMU::WriteRAM(uint64_t address, const uint8_t* data, size_t size) {
+    std::vector<iovec> buffers;
+    if (!GetHostBuffers(address, size, true, buffers))
+        return false;
+    for (const iovec& buffer : buffers) {
+        memcpy(buffer.iov_base, data, buffer.iov_len);
+        data += buffer.iov_len;
+    }
+    return true;
+}
+
+void MMU::ShareRegions() {
+    std::unique_lock<std::mutex> lock(m_regionLock);
+    m_regionUsersChanged.wait(lock, [this] { return !m_regionsLocked; });
+    m_regionUsers++;
+}
+
+void MMU::UnshareRegions() {
+    std::lock_guard<std::mutex> guard(m_regionLock);
+    if (--m_regionUsers == 0)
+        m_regionUsersChanged.notify_all();
+}
+
+void MMU::LockRegions() {
+    std::unique_lock<std::mutex> lock(m_regionLock);
+    m_regionUsersChanged.wait(lock, [this] { return !m_regionsLocked; });
+    m_regionsLocked = true;
+    m_regionUsersChanged.wait(lock, [this] { return m_regionUsers == 0; });
+}
+
+void MMU::UnlockRegions() {
+    {
+        std::lock_guard<std::mutex> guard(m_regionLock);
+        m_regionsLocked = false;
+    }
+    m_regionUsersChanged.notify_all();
+}
+
 void MMU::AddMemoryRegion(MemoryRegion* region) {
+    LockRegions();
     m_regions.insert(region);
+    UnlockRegions();
 }
 
 void MMU::RemoveMemoryRegion(MemoryRegion* region) {
+    LockRegions();
     m_regions.remove(region);
+    UnlockRegions();
 }
 
 void MMU::DumpMemory() const {
@@ -269,29 +354,38 @@ void MMU::DumpMemory() const {
     }
 }
 
+MemoryRegion* MMU::FindRegion(uint64_t address) const {
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region)) {
+        if (region->isInside(address, 1))
+            return region;
+    }
+    return nullptr;
+}
+
 bool MMU::RemoveRegionSegment(uint64_t start, uint64_t end) {
-    for (uint64_t i = 0; i < m_regions.getCount(); i++) {
-        if (MemoryRegion* region = m_regions.get(i); start >= region->getStart() && end <= region->getEnd()) {
+    LockRegions();
+    bool success = RemoveRegionSegmentLocked(start, end);
+    UnlockRegions();
+    return success;
+}
+
+bool MMU::RemoveRegionSegmentLocked(uint64_t start, uint64_t end) {
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region)) {
+        if (start >= region->getStart() && end <= region->getEnd()) {
             if (!region->canSplit())
                 return false;
-            uint64_t regionStart = region->getStart();
-            uint64_t regionEnd = region->getEnd();
 
-            m_regions.remove(region);
-            delete region;
+            // the new regions share the contents of the old one, so nothing is reallocated or lost
+            if (region->getStart() < start)
+                m_regions.insert(region->split(region->getStart(), start));
+            if (region->getEnd() > end)
+                m_regions.insert(region->split(end, region->getEnd()));
 
-            // check if the region starts at start
-            if (regionStart < start) {
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(regionStart, start);
-                m_regions.insert(newRegion);
-            }
-
-            // check if the region ends at end
-            if (regionEnd > end) {
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(end, regionEnd);
-                m_regions.insert(newRegion);
-            }
+            // keep the segment itself aside, so ReaddRegionSegment can put it back
+            m_hiddenRegions.insert(region->split(start, end));
 
+            m_regions.remove(region);
+            delete region;
             return true;
         }
     }
@@ -299,37 +393,113 @@ bool MMU::RemoveRegionSegment(uint64_t start, uint64_t end) {
 }
 
 bool MMU::ReaddRegionSegment(uint64_t start, uint64_t end) {
-    MemoryRegion* region = nullptr;
-    MemoryRegion* previousRegion = nullptr;
-    for (uint64_t i = 0; i < m_regions.getCount(); i++) {
-        previousRegion = region;
-        region = m_regions.get(i);
-        if (previousRegion == nullptr)
-            continue;
-        if (start >= previousRegion->getEnd() && end <= region->getStart()) {
-            if (start == previousRegion->getEnd() && end == region->getStart()) {
-                uint64_t newStart = previousRegion->getStart();
-                uint64_t newEnd = region->getEnd();
-                m_regions.remove(previousRegion);
-                m_regions.remove(region);
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(newStart, newEnd);
-                m_regions.insert(newRegion);
-            } else if (start == previousRegion->getEnd()) {
-                uint64_t newStart = previousRegion->getStart();
-                m_regions.remove(previousRegion);
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(newStart, end);
-                m_regions.insert(newRegion);
-            } else if (end == region->getStart()) {
-                uint64_t newEnd = region->getEnd();
-                m_regions.remove(region);
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(start, newEnd);
-                m_regions.insert(newRegion);
-            } else {
-                StandardMemoryRegion* newRegion = new StandardMemoryRegion(start, end);
-                m_regions.insert(newRegion);
-            }
-            return true;
+    LockRegions();
+    bool success = ReaddRegionSegmentLocked(start, end);
+    UnlockRegions();
+    return success;
+}
+
+bool MMU::ReaddRegionSegmentLocked(uint64_t start, uint64_t end) {
+    MemoryRegion* segment = nullptr;
+    for (MemoryRegion* region = m_hiddenRegions.get(0); region != nullptr; region = m_hiddenRegions.getNext(region)) {
+        if (region->getStart() == start && region->getEnd() == end) {
+            segment = region;
+            break;
         }
     }
-    return false;
+    if (segment == nullptr)
+        return false;
+
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region)) {
+        if (region->getStart() < end && region->getEnd() > start)
+            return false; // segment is still in use
+    }
+    m_hiddenRegions.remove(segment);
+
+    // merge it back with whatever is left of the region it was split from. The region list is not sorted, so look for the neighbours directly
+    MemoryRegion* region = m_regions.get(0);
+    while (region != nullptr) {
+        MemoryRegion* next = m_regions.getNext(region);
+        MemoryRegion* merged = nullptr;
+        if (region->getEnd() == segment->getStart())
+            merged = region->merge(segment);
+        else if (region->getStart() == segment->getEnd())
+            merged = segment->merge(region);
+        if (merged != nullptr) {
+            m_regions.remove(region);
+            delete region;
+            delete segment;
+            segment = merged;
+        }
+        region = next;
+    }
+    m_regions.insert(segment);
+    return true;
+}
+
+void MMU::TakeSnapshot() {
+    LockRegions();
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region))
+        region->takeSnapshot();
+    UnlockRegions();
+}
+
+void MMU::RestoreSnapshot() {
+    LockRegions();
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region))
+        region->restoreSnapshot();
+    UnlockRegions();
+}
+
+void MMU::DiscardSnapshot() {
+    LockRegions();
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region))
+        region->discardSnapshot();
+    UnlockRegions();
+}
+
+void MMU::Reset() {
+    LockRegions();
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region))
+        region->reset();
+    for (MemoryRegion* region = m_hiddenRegions.get(0); region != nullptr; region = m_hiddenRegions.getNext(region))
+        region->reset();
+    UnlockRegions();
+}
+
+void MMU::PrintMemoryStats(FILE* fp) const {
+    std::vector<MemoryRegion*> regions;
+    for (MemoryRegion* region = m_regions.get(0); region != nullptr; region = m_regions.getNext(region))
+        regions.push_back(region);
+    std::sort(regions.begin(), regions.end(), [](MemoryRegion* a, MemoryRegion* b) { return a->getStart() < b->getStart(); });
+
+    size_t totalVirtual = 0;
+    size_t totalResident = 0;
+    fprintf(fp, "Memory regions:\n");
+    fprintf(fp, "%-16s %-16s %-6s %12s %12s\n", "Start", "End", "Type", "VSZ (KiB)", "RSS (KiB)");
+    for (MemoryRegion* region : regions) {
+        size_t virtualSize = region->getHostVirtualSize();
+        size_t residentSize = region->getHostResidentSize();
+        fprintf(fp, "%016lx %016lx %-6s %12zu %12zu\n", region->getStart(), region->getEnd(), GetRegionTypeName(region->getType()), virtualSize >> 10, residentSize >> 10);
+        totalVirtual += virtualSize;
+        totalResident += residentSize;
+    }
+    fprintf(fp, "%-40s %12zu %12zu\n", "Total", totalVirtual >> 10, totalResident >> 10);
+}
+
+const char* MMU::GetRegionTypeName(MemoryRegionType type) {
+    switch (type) {
+    case MemoryRegionType::STANDARD:
+        return "RAM";
+    case MemoryRegionType::BIOS:
+        return "BIOS";
+    case MemoryRegionType::IO:
+        return "IO";
+    case MemoryRegionType::VIDEO:
+        return "VIDEO";
+    case MemoryRegionType::MMIO_WINDOW:
+        return "MMIO";
+    default:
+        return "?";
+    }
 }
@@ -20,8 +20,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
 
 #include <Data-structures/LinkedList.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
 
 #include "MemoryRegion.hpp"
 
@@ -47,16 +52,77 @@ class MMU {
     virtual bool ValidateWrite(uint64_t address, size_t size);
     virtual bool ValidateExecute(uint64_t address, size_t size);
 
+    // Append the host memory behind [address, address + size) to buffers. Returns false if any of it isn't RAM.
+    // If write is true, the caller is about to write to it.
+    bool GetHostBuffers(uint64_t address, size_t size, bool write, std::vector<iovec>& buffers);
+
+    // Copy from or to RAM. Returns false instead of raising an exception if any of it isn't RAM, so device threads can
+    // use them.
+    bool ReadRAM(uint64_t address, uint8_t* data, size_t size);
+    bool WriteRAM(uint64_t address, const uint8_t* data, size_t size);
+
+    // Threads other than the CPU thread hold the regions shared while they use guest memory, from checking an address
+    // until they are done with its host memory, so the regions can't change under them. Only the CPU thread changes
+    // them, so its own accesses don't need to. A change waits for the current users, and holds back new ones so busy
+    // devices can't starve it.
+    void ShareRegions();
+    void UnshareRegions();
+
     virtual void AddMemoryRegion(MemoryRegion* region);
     virtual void RemoveMemoryRegion(MemoryRegion* region);
 
     virtual void DumpMemory() const;
 
+    // Split [start, end) out of the region containing it, so something else can be mapped there.
+    // The segment keeps its contents and is mapped again by ReaddRegionSegment.
     virtual bool RemoveRegionSegment(uint64_t start, uint64_t end);
     virtual bool ReaddRegionSegment(uint64_t start, uint64_t end);
 
+    // Snapshot every region. The region layout must not change between taking and restoring a snapshot.
+    virtual void TakeSnapshot();
+    virtual void RestoreSnapshot();
+    virtual void DiscardSnapshot();
+
+    // Reset every region to its power on state
+    virtual void Reset();
+
+    // Print the host memory used by each region
+    void PrintMemoryStats(FILE* fp) const;
+
+    static const char* GetRegionTypeName(MemoryRegionType type);
+
+   private:
+    MemoryRegion* FindRegion(uint64_t address) const;
+
+    // The same, with the regions already held exclusively
+    bool RemoveRegionSegmentLocked(uint64_t start, uint64_t end);
+    bool ReaddRegionSegmentLocked(uint64_t start, uint64_t end);
+
+    // Hold the regions exclusively, while the region list or what is in the regions changes
+    void LockRegions();
+    void UnlockRegions();
+
    private:
     LinkedList::SimpleLinkedList<MemoryRegion> m_regions;
+    LinkedList::SimpleLinkedList<MemoryRegion> m_hiddenRegions; // segments split out by RemoveRegionSegment
+
+    std::mutex m_regionLock; // protects the two below
+    std::condition_variable m_regionUsersChanged;
+    uint64_t m_regionUsers;
+    bool m_regionsLocked;
+};
+
+// Holds the regions of an MMU shared until it is destroyed
+class SharedRegionGuard {
+   public:
+    explicit SharedRegionGuard(MMU* mmu) : m_mmu(mmu) { m_mmu->ShareRegions(); }
+    ~SharedRegionGuard() { m_mmu->UnshareRegions(); }
+
+    SharedRegionGuard(const SharedRegionGuard&) = delete;
+    SharedRegionGuard& operator=(const SharedRegionGuard&) = delete;
+
+   private:
+    MMU* m_mmu;
 };
 
 #endif /* _MMU_HPP */
\ No newline at end of file
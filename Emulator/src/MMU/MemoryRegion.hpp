@@ -21,6 +21,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdint.h>
 
+enum class MemoryRegionType {
+    STANDARD,
+    BIOS,
+    IO,
+    VIDEO,
+    MMIO_WINDOW
+};
+
 class MemoryRegion {
    public:
     MemoryRegion(uint64_t start, uint64_t end);
@@ -49,8 +57,33 @@ class MemoryRegion {
 
     virtual void dump();
 
+    virtual MemoryRegionType getType() = 0;
+
     virtual bool canSplit() { return false; }
 
+    // Create a region covering [start, end) of this region that shares its contents. Only called if canSplit returns true.
+    virtual MemoryRegion* split(uint64_t start, uint64_t end) { (void)start; (void)end; return nullptr; }
+
+    // Create a region covering this region and next, which must start where this region ends, sharing both of their contents.
+    // Returns nullptr if the regions cannot be merged.
+    virtual MemoryRegion* merge(MemoryRegion* next) { (void)next; return nullptr; }
+
+    // Host memory backing [address, address + size), for DMA. Returns nullptr if the region isn't backed by host memory.
+    // If write is true, the caller is about to write to it.
+    virtual uint8_t* getHostPointer(uint64_t address, size_t size, bool write) { (void)address; (void)size; (void)write; return nullptr; }
+
+    // Host memory used by the region, for statistics
+    virtual size_t getHostVirtualSize() { return 0; }
+    virtual size_t getHostResidentSize() { return 0; }
+
+    // Snapshot support. Regions that do not hold any state ignore these.
+    virtual void takeSnapshot() {}
+    virtual void restoreSnapshot() {}
+    virtual void discardSnapshot() {}
+
+    // Return the region to its power on state
+    virtual void reset() {}
+
    private:
     uint64_t m_start;
     uint64_t m_end;
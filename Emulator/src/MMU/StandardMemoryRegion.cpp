@@ -18,16 +18,30 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "StandardMemoryRegion.hpp"
 
 #include <string.h>
+#include <util.h>
 
 #include <OSSpecific/Memory.hpp>
 
 StandardMemoryRegion::StandardMemoryRegion(uint64_t start, uint64_t end)
-    : MemoryRegion(start, end) {
-    m_data = static_cast<uint8_t*>(OSSpecific::AllocateCOWMemory(MemoryRegion::getSize()));
+    : MemoryRegion(start, end), m_snapshotTaken(false), m_dirtyPages(nullptr) {
+    m_backing = new Backing;
+    m_backing->size = MemoryRegion::getSize();
+    m_backing->data = static_cast<uint8_t*>(OSSpecific::AllocateCOWMemory(m_backing->size));
+    m_backing->refCount = 1;
+    m_data = m_backing->data;
+}
+
+StandardMemoryRegion::StandardMemoryRegion(uint64_t start, uint64_t end, Backing* backing, uint8_t* data)
+    : MemoryRegion(start, end), m_backing(backing), m_data(data), m_snapshotTaken(false), m_dirtyPages(nullptr) {
+    m_backing->refCount++;
 }
 
 StandardMemoryRegion::~StandardMemoryRegion() {
-    OSSpecific::FreeCOWMemory(m_data);
+    discardSnapshot();
+    if (--m_backing->refCount == 0) {
+        OSSpecific::FreeSizedCOWMemory(m_backing->data, m_backing->size);
+        delete m_backing;
+    }
 }
 
 void StandardMemoryRegion::read(uint64_t address, uint8_t* buffer, size_t size) {
@@ -36,6 +50,137 @@ void StandardMemoryRegion::read(uint64_t address, uint8_t* buffer, size_t size)
 }
 
 void StandardMemoryRegion::write(uint64_t address, const uint8_t* buffer, size_t size) {
-    if (isInside(address, size))
+    if (isInside(address, size)) {
+        if (m_snapshotTaken)
+            MarkDirty(address - getStart(), size);
         memcpy(m_data + (address - getStart()), buffer, size);
+    }
+}
+
+MemoryRegion* StandardMemoryRegion::split(uint64_t start, uint64_t end) {
+    if (start < getStart() || end > getEnd() || start >= end)
+        return nullptr;
+    return new StandardMemoryRegion(start, end, m_backing, m_data + (start - getStart()));
+}
+
+MemoryRegion* StandardMemoryRegion::merge(MemoryRegion* next) {
+    // only views of the same host memory that are still contiguous in it can be merged
+    if (next->getType() != MemoryRegionType::STANDARD || next->getStart() != getEnd())
+        return nullptr;
+    StandardMemoryRegion* other = static_cast<StandardMemoryRegion*>(next);
+    if (other->m_backing != m_backing || other->m_data != m_data + GetDataSize())
+        return nullptr;
+    return new StandardMemoryRegion(getStart(), other->getEnd(), m_backing, m_data);
+}
+
+uint8_t* StandardMemoryRegion::getHostPointer(uint64_t address, size_t size, bool write) {
+    if (!isInside(address, size))
+        return nullptr;
+    if (write && m_snapshotTaken)
+        MarkDirty(address - getStart(), size);
+    return m_data + (address - getStart());
+}
+
+size_t StandardMemoryRegion::getHostVirtualSize() {
+    return GetDataSize();
+}
+
+size_t StandardMemoryRegion::getHostResidentSize() {
+    return OSSpecific::GetResidentSize(m_data, GetDataSize());
+}
+
+bool StandardMemoryRegion::mapFile(FileHandle_t handle, uint64_t address, size_t size, size_t offset) {
+    size_t pageSize = OSSpecific::GetPageSize();
+    uint8_t* data = m_data + (address - getStart());
+    if (size == 0 || !isInside(address, size) || reinterpret_cast<uint64_t>(data) % pageSize != 0 || offset % pageSize != 0)
+        return false;
+
+    MapFilePrivate(handle, data, size, offset);
+
+    // the mapping covers whole pages, so clear whatever comes after the requested range in the file
+    if (size_t tail = ALIGN_UP(size, pageSize) - size; tail > 0 && ALIGN_UP(size, pageSize) <= GetDataSize() - (address - getStart()))
+        memset(data + size, 0, tail);
+    return true;
+}
+
+void StandardMemoryRegion::takeSnapshot() {
+    discardSnapshot();
+
+    std::lock_guard<std::mutex> guard(m_dirtyLock);
+    uint64_t pageCount = DIV_ROUNDUP(GetDataSize(), SNAPSHOT_PAGE_SIZE);
+    m_dirtyPages = new std::atomic_uchar[pageCount]{};
+    m_snapshotPages.assign(pageCount, nullptr);
+    m_dirtyList.clear();
+
+    m_snapshotTaken = true;
+}
+
+void StandardMemoryRegion::restoreSnapshot() {
+    if (!m_snapshotTaken)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_dirtyLock);
+    for (uint64_t page : m_dirtyList) {
+        uint64_t offset = page * SNAPSHOT_PAGE_SIZE;
+        memcpy(m_data + offset, m_snapshotPages[page], MIN(SNAPSHOT_PAGE_SIZE, GetDataSize() - offset));
+        m_dirtyPages[page].store(0, std::memory_order_relaxed);
+    }
+    m_dirtyList.clear();
+}
+
+void StandardMemoryRegion::discardSnapshot() {
+    if (!m_snapshotTaken)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_dirtyLock);
+    m_snapshotTaken = false;
+    for (uint8_t* page : m_snapshotPages)
+        delete[] page;
+    m_snapshotPages.clear();
+    m_dirtyList.clear();
+    delete[] m_dirtyPages;
+    m_dirtyPages = nullptr;
+}
+
+void StandardMemoryRegion::reset() {
+    discardSnapshot();
+
+    // only whole host pages can be dropped, so any partial pages at the edges of a split region are zeroed by hand
+    size_t pageSize = OSSpecific::GetPageSize();
+    uint64_t start = reinterpret_cast<uint64_t>(m_data);
+    uint64_t end = start + GetDataSize();
+    uint64_t alignedStart = ALIGN_UP(start, pageSize);
+    uint64_t alignedEnd = ALIGN_DOWN(end, pageSize);
+    if (alignedStart >= alignedEnd) {
+        memset(m_data, 0, GetDataSize());
+        return;
+    }
+    memset(m_data, 0, alignedStart - start);
+    OSSpecific::ResetCOWMemory(reinterpret_cast<void*>(alignedStart), alignedEnd - alignedStart);
+    memset(reinterpret_cast<void*>(alignedEnd), 0, end - alignedEnd);
+}
+
+void StandardMemoryRegion::MarkDirty(uint64_t offset, size_t size) {
+    if (size == 0)
+        return;
+    uint64_t lastPage = (offset + size - 1) / SNAPSHOT_PAGE_SIZE;
+    for (uint64_t page = offset / SNAPSHOT_PAGE_SIZE; page <= lastPage; page++) {
+        // a page stays dirty until the snapshot is restored, so the lock is only taken for the first write to it
+        if (m_dirtyPages[page].load(std::memory_order_acquire) != 0)
+            continue;
+        std::lock_guard<std::mutex> guard(m_dirtyLock);
+        if (m_dirtyPages[page].load(std::memory_order_relaxed) != 0)
+            continue; // another thread saved it first
+        m_dirtyList.push_back(page);
+
+        // the first write to a page since the snapshot was taken, so its contents are still the snapshot contents
+        if (m_snapshotPages[page] == nullptr) {
+            uint64_t pageOffset = page * SNAPSHOT_PAGE_SIZE;
+            m_snapshotPages[page] = new uint8_t[SNAPSHOT_PAGE_SIZE];
+            memcpy(m_snapshotPages[page], m_data + pageOffset, MIN(SNAPSHOT_PAGE_SIZE, GetDataSize() - pageOffset));
+        }
+
+        // writers that find the page clean wait on the lock, so the page can't change until it has been saved
+        m_dirtyPages[page].store(1, std::memory_order_release);
+    }
 }
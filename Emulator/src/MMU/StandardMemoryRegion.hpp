@@ -20,20 +20,74 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 
+#include <atomic>
+#include <mutex>
+#include <OSSpecific/File.hpp>
+#include <vector>
+
 #include "MemoryRegion.hpp"
 
+#define SNAPSHOT_PAGE_SIZE 4096
+
 class StandardMemoryRegion : public MemoryRegion {
 public:
     StandardMemoryRegion(uint64_t start, uint64_t end);
     ~StandardMemoryRegion();
 
+    virtual MemoryRegionType getType() override { return MemoryRegionType::STANDARD; }
+
     virtual void read(uint64_t address, uint8_t* buffer, size_t size) override;
     virtual void write(uint64_t address, const uint8_t* buffer, size_t size) override;
 
     virtual bool canSplit() override { return true; }
 
+    // Split and merged regions are views of the same host memory, so nothing is copied and the contents are kept
+    virtual MemoryRegion* split(uint64_t start, uint64_t end) override;
+    virtual MemoryRegion* merge(MemoryRegion* next) override;
+
+    virtual uint8_t* getHostPointer(uint64_t address, size_t size, bool write) override;
+
+    virtual size_t getHostVirtualSize() override;
+    virtual size_t getHostResidentSize() override;
+
+    // Map part of a file copy-on-write at address, instead of copying it in. address and offset must be page aligned.
+    // The rest of the last page is zeroed. Returns false if the arguments are not suitable for mapping.
+    bool mapFile(FileHandle_t handle, uint64_t address, size_t size, size_t offset);
+
+    // Only pages written after the snapshot is taken are saved and restored. Device threads can write while the CPU
+    // runs, so the dirty set is shared between them. A restore only puts back the pages written before it, and taking
+    // or discarding a snapshot must not race with device writes.
+    virtual void takeSnapshot() override;
+    virtual void restoreSnapshot() override;
+    virtual void discardSnapshot() override;
+
+    // Zeroes the region without unmapping it. Any snapshot is discarded.
+    virtual void reset() override;
+
 private:
+    // Host memory, shared by every region split from the same original region
+    struct Backing {
+        uint8_t* data;
+        size_t size;
+        uint64_t refCount;
+    };
+
+    StandardMemoryRegion(uint64_t start, uint64_t end, Backing* backing, uint8_t* data);
+
+    // Number of bytes of host memory the region covers
+    size_t GetDataSize() { return getEnd() - getStart(); }
+
+    void MarkDirty(uint64_t offset, size_t size);
+
+private:
+    Backing* m_backing;
     uint8_t* m_data;
+
+    std::atomic_bool m_snapshotTaken;
+    std::atomic_uchar* m_dirtyPages; // one flag per page, only set once the page has been saved
+    std::mutex m_dirtyLock; // protects m_dirtyList and m_snapshotPages
+    std::vector<uint64_t> m_dirtyList;
+    std::vector<uint8_t*> m_snapshotPages; // original contents of each page, saved on first write
 };
 
-#endif /* _STANDARD_MEMORY_REGION_HPP */
\ No newline at end of file
+#endif /* _STANDARD_MEMORY_REGION_HPP */
@@ -20,10 +20,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <string.h>
 #include <util.h>
 
+#include <algorithm>
 #include <cctype>
 #include <Emulator.hpp>
+#include <Fuzzing.hpp>
+#include <MemoryMap.hpp>
+#include <string>
+#include <vector>
 
 #include "ArgsParser.hpp"
+#include "IO/devices/Storage/StorageBlockCache.hpp"
 #include "IO/devices/Video/VideoBackend.hpp"
 
 #define MAX_PROGRAM_FILE_SIZE 0x1000'0000
@@ -39,12 +45,29 @@ int main(int argc, char** argv) {
 
     g_args->AddOption('p', "program", "Program file to run", true);
     g_args->AddOption('m', "ram", "RAM size in bytes", false);
+    g_args->AddOption('M', "memory-map", "File describing the RAM banks, holes and MMIO windows. Cannot be combined with -m.", false);
+    g_args->AddOption('S', "memory-stats", "File to write the host memory used by each memory region to at exit, or \"-\" for stdout.", false);
 #ifdef ENABLE_SDL
-    g_args->AddOption('d', "display", "Display mode. Valid values are \"sdl\" or \"none\" (case insensitive).", false);
+    g_args->AddOption('d', "display", "Display mode. Valid values are \"sdl\" or \"none\" (case insensitive). With \"none\", the framebuffer is only kept in memory.", false);
 #else
-    g_args->AddOption('d', "display", "Display mode. Valid value is \"none\" (case insensitive).", false);
+    g_args->AddOption('d', "display", "Display mode. Valid value is \"none\" (case insensitive). The framebuffer is only kept in memory.", false);
 #endif
-    g_args->AddOption('D', "drive", "File to use a storage drive.", false);
+    g_args->AddOption('F', "video-stream", "File to stream the frames of a \"none\" display to, as PPM images or as Y4M if it ends with \".y4m\".", false);
+    g_args->AddOption('R', "video-rate", "Frames per second to stream. Defaults to 60.", false);
+    g_args->AddOption('D', "drive", "File to use as a storage drive, optionally followed by \",512\" or \",4096\" for the block size. Can be given more than once.", false);
+    g_args->AddOption('O', "overlay", "File to send drive writes to, so the drive itself is never modified. It is emptied whenever a drive is opened. Can be given once per drive, in the same order.", false);
+    g_args->AddOption('C', "drive-cache", "Size in bytes of a host block cache for the drive. Must be at least 64 KiB. Disabled by default.", false);
+    g_args->AddOption('w', "write-policy", "Drive cache write policy. Valid values are \"through\" (default) or \"back\". Requires a drive cache.", false);
+    g_args->AddOption('I', "direct-io", "Bypass the host page cache for raw drive images without an overlay. Valid values are \"on\" or \"off\" (default). Requires a drive cache.", false);
+    g_args->AddOption('T', "drive-stats", "File to write the drive I/O and cache stats to at exit and on SIGUSR1, or \"-\" for stdout.", false);
+    g_args->AddOption('V', "video-stats", "File to write the video present stats to at exit and on SIGUSR1, or \"-\" for stdout. Requires a display.", false);
+    g_args->AddOption('f', "fuzz", "Fuzz the program with every input in a file or directory.", false);
+    g_args->AddOption('a', "fuzz-marker", "Address at which the fuzzing snapshot is taken. Required for fuzzing.", false);
+    g_args->AddOption('i', "fuzz-input", "Physical address each fuzzing input is written to. Required for fuzzing.", false);
+    g_args->AddOption('t', "fuzz-timeout", "Maximum instructions per fuzzing input. Defaults to 1000000.", false);
+    g_args->AddOption('c', "fuzz-coverage", "File to write the fuzzing coverage map to.", false);
+    g_args->AddOption('e', "console", "Where the console goes. Valid values are \"stdio\" (default), \"file:<path>\" for output only, \"pty\" or \"unix:<path>\" to wait for a connection on a Unix socket.", false);
+    g_args->AddOption('r', "runs", "File with one drive path per line. The program is run once per drive, with a warm reset between runs.", false);
     g_args->AddOption('h', "help", "Print this help message", false);
 
     g_args->ParseArgs(argc, argv);
@@ -61,14 +84,37 @@ int main(int argc, char** argv) {
 
     std::string_view program = g_args->GetOption('p');
 
-    size_t RAM_Size;
+    std::vector<MemoryMap::Entry> memoryMap;
 
-    if (g_args->HasOption('m'))
-        RAM_Size = strtoull(g_args->GetOption('m').data(), nullptr, 0); // automatically detects base
-    else
-        RAM_Size = DEFAULT_RAM;
+    if (g_args->HasOption('M')) {
+        if (g_args->HasOption('m')) {
+            printf("A RAM size cannot be combined with a memory map.\n");
+            return 1;
+        }
+        if (!MemoryMap::LoadFile(g_args->GetOption('M').data(), memoryMap))
+            return 1;
+    } else {
+        size_t RAM_Size;
+        if (g_args->HasOption('m'))
+            RAM_Size = strtoull(g_args->GetOption('m').data(), nullptr, 0); // automatically detects base
+        else
+            RAM_Size = DEFAULT_RAM;
+        MemoryMap::CreateDefault(RAM_Size, memoryMap);
+        if (!MemoryMap::Validate(memoryMap))
+            return 1;
+    }
 
-    // open and read file
+    if (g_args->HasOption('S')) {
+        std::string_view statsPath = g_args->GetOption('S');
+        FILE* statsFile = statsPath == "-" ? stdout : fopen(statsPath.data(), "w");
+        if (statsFile == nullptr) {
+            perror("fopen");
+            return 1;
+        }
+        Emulator::EnableMemoryStats(statsFile);
+    }
+
+    // check the program file, it gets mapped into the BIOS region by the emulator
     FILE* fp = fopen(program.data(), "r");
     if (fp == nullptr) {
         perror("fopen");
@@ -93,21 +139,6 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    rc = fseek(fp, 0, SEEK_SET);
-    if (rc != 0) {
-        perror("fseek");
-        return 1;
-    }
-
-    uint8_t* data = new uint8_t[fileSize];
-
-    for (size_t i = 0; i < fileSize; i++) {
-        int c = fgetc(fp);
-        if (c == EOF)
-            break;
-        data[i] = static_cast<uint8_t>(c);
-    }
-
     fclose(fp);
 
     // get the display type
@@ -133,31 +164,217 @@ int main(int argc, char** argv) {
             ;
 #endif
         else if (display == "none")
-            displayType = VideoBackendType::NONE;
+            displayType = VideoBackendType::HEADLESS;
         else {
             printf("Invalid display type: %s\n", display.c_str());
             return 1;
         }
     }
 
-    std::string_view drive;
-    bool has_drive = g_args->HasOption('D');
-    if (has_drive)
-        drive = g_args->GetOption('D');
+    // each drive is a path, optionally followed by a comma and the block size
+    const std::vector<std::string_view>& driveOptions = g_args->GetOptions('D');
+    std::vector<std::string> drivePaths;
+    drivePaths.reserve(driveOptions.size()); // the drives point into the strings
+    std::vector<StorageDriveConfig> drives;
+    for (std::string_view option : driveOptions) {
+        uint64_t blockSize = STORAGE_BLOCK_SIZE_SMALL;
+        size_t comma = option.rfind(',');
+        if (comma != std::string_view::npos && comma + 1 < option.size() && std::all_of(option.begin() + comma + 1, option.end(), isdigit)) {
+            blockSize = strtoull(option.data() + comma + 1, nullptr, 10);
+            if (blockSize != STORAGE_BLOCK_SIZE_SMALL && blockSize != STORAGE_BLOCK_SIZE_LARGE) {
+                printf("Invalid block size for %s, it must be %u or %u.\n", option.data(), STORAGE_BLOCK_SIZE_SMALL, STORAGE_BLOCK_SIZE_LARGE);
+                return 1;
+            }
+            option = option.substr(0, comma);
+        }
+        drivePaths.emplace_back(option);
+        drives.push_back({drivePaths.back().c_str(), nullptr, blockSize});
+    }
+
+    std::vector<std::string> runs;
+    if (g_args->HasOption('r')) {
+        if (g_args->HasOption('f')) {
+            printf("Runs cannot be combined with fuzzing.\n");
+            return 1;
+        }
+
+        FILE* runsFile = fopen(g_args->GetOption('r').data(), "r");
+        if (runsFile == nullptr) {
+            perror("fopen");
+            return 1;
+        }
+
+        char* line = nullptr;
+        size_t lineSize = 0;
+        ssize_t length;
+        while ((length = getline(&line, &lineSize, runsFile)) >= 0) {
+            while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+                length--;
+            if (length > 0)
+                runs.emplace_back(line, length);
+        }
+        free(line);
+        fclose(runsFile);
+
+        if (runs.empty()) {
+            printf("Runs file is empty.\n");
+            return 1;
+        }
+
+        Emulator::SetRunList(runs);
+        // the runs take the place of the first drive, and the other drives stay attached for every run
+        drives.insert(drives.begin(), {runs[0].c_str(), nullptr, STORAGE_BLOCK_SIZE_SMALL});
+    }
+    bool has_drive = !drives.empty();
+
+    if (drives.size() > STORAGE_MAX_DRIVES) {
+        printf("At most %u drives can be attached.\n", STORAGE_MAX_DRIVES);
+        return 1;
+    }
+
+    // overlays go with the drives in order
+    const std::vector<std::string_view>& overlays = g_args->GetOptions('O');
+    if (overlays.size() > drives.size()) {
+        printf("Every overlay requires a drive.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < overlays.size(); i++) {
+        const char* overlay = overlays[i].data();
+        // the overlay is emptied when it is opened, so it must never be a drive or another overlay
+        bool isDrive = std::find_if(drives.begin(), drives.end(), [overlay](const StorageDriveConfig& drive) { return strcmp(drive.path, overlay) == 0; }) != drives.end();
+        if (isDrive || std::find(runs.begin(), runs.end(), overlay) != runs.end() || std::count(overlays.begin(), overlays.end(), overlays[i]) > 1) {
+            printf("An overlay cannot be a drive or another overlay.\n");
+            return 1;
+        }
+        drives[i].overlayPath = overlay;
+    }
+
+    StorageCacheConfig cache = {0, false, false};
+    if (g_args->HasOption('C')) {
+        if (!has_drive) {
+            printf("A drive cache requires a drive.\n");
+            return 1;
+        }
+        cache.size = strtoull(g_args->GetOption('C').data(), nullptr, 0);
+        if (cache.size < STORAGE_CACHE_BLOCK_SIZE * STORAGE_CACHE_MIN_BLOCKS) {
+            printf("The drive cache must be at least %u KiB.\n", (STORAGE_CACHE_BLOCK_SIZE * STORAGE_CACHE_MIN_BLOCKS) >> 10);
+            return 1;
+        }
+    }
+    if (g_args->HasOption('w') || g_args->HasOption('I')) {
+        if (cache.size == 0) {
+            printf("The write policy and direct I/O require a drive cache.\n");
+            return 1;
+        }
+        if (g_args->HasOption('w')) {
+            std::string_view policy = g_args->GetOption('w');
+            if (policy != "through" && policy != "back") {
+                printf("Invalid write policy: %s\n", policy.data());
+                return 1;
+            }
+            cache.writeBack = policy == "back";
+        }
+        if (g_args->HasOption('I')) {
+            std::string_view direct = g_args->GetOption('I');
+            if (direct != "on" && direct != "off") {
+                printf("Invalid direct I/O mode: %s\n", direct.data());
+                return 1;
+            }
+            cache.direct = direct == "on";
+        }
+    }
+    Emulator::SetDriveCache(cache);
+
+    if (g_args->HasOption('T')) {
+        if (!has_drive) {
+            printf("Drive stats require a drive.\n");
+            return 1;
+        }
+        std::string_view statsPath = g_args->GetOption('T');
+        FILE* statsFile = statsPath == "-" ? stdout : fopen(statsPath.data(), "w");
+        if (statsFile == nullptr) {
+            perror("fopen");
+            return 1;
+        }
+        Emulator::EnableDriveStats(statsFile);
+    }
+
+    if (g_args->HasOption('F')) {
+        if (displayType != VideoBackendType::HEADLESS) {
+            printf("Video streaming requires the \"none\" display.\n");
+            return 1;
+        }
+        VideoStreamConfig stream = {g_args->GetOption('F').data(), 60};
+        if (g_args->HasOption('R')) {
+            std::string_view rate = g_args->GetOption('R');
+            stream.rate = strtoull(rate.data(), nullptr, 10);
+            if (stream.rate == 0 || stream.rate > 1000) {
+                printf("Invalid video rate: %s\n", rate.data());
+                return 1;
+            }
+        }
+        Emulator::SetVideoStream(stream);
+    } else if (g_args->HasOption('R')) {
+        printf("A video rate requires a video stream.\n");
+        return 1;
+    }
+
+    if (g_args->HasOption('V')) {
+        if (!has_display) {
+            printf("Video stats require a display.\n");
+            return 1;
+        }
+        std::string_view statsPath = g_args->GetOption('V');
+        FILE* statsFile = statsPath == "-" ? stdout : fopen(statsPath.data(), "w");
+        if (statsFile == nullptr) {
+            perror("fopen");
+            return 1;
+        }
+        Emulator::EnableVideoStats(statsFile);
+    }
+
+    if (g_args->HasOption('e')) {
+        std::string_view console = g_args->GetOption('e');
+        ConsoleEndpointConfig endpoint = {ConsoleEndpointType::STDIO, nullptr};
+        if (console == "pty")
+            endpoint.type = ConsoleEndpointType::PTY;
+        else if (console.starts_with("file:") && console.size() > 5)
+            endpoint = {ConsoleEndpointType::FILE, console.data() + 5};
+        else if (console.starts_with("unix:") && console.size() > 5)
+            endpoint = {ConsoleEndpointType::UNIX, console.data() + 5};
+        else if (console != "stdio") {
+            printf("Invalid console: %s\n", console.data());
+            return 1;
+        }
+        Emulator::SetConsoleEndpoint(endpoint);
+    }
+
+    if (g_args->HasOption('f')) {
+        if (!g_args->HasOption('a') || !g_args->HasOption('i')) {
+            printf("Fuzzing requires a marker address and an input address.\n");
+            return 1;
+        }
+
+        Fuzzing::Config config;
+        config.corpusPath = g_args->GetOption('f').data();
+        config.markerAddress = strtoull(g_args->GetOption('a').data(), nullptr, 0);
+        config.inputAddress = strtoull(g_args->GetOption('i').data(), nullptr, 0);
+        config.timeout = g_args->HasOption('t') ? strtoull(g_args->GetOption('t').data(), nullptr, 0) : FUZZING_DEFAULT_TIMEOUT;
+        config.coveragePath = g_args->HasOption('c') ? g_args->GetOption('c').data() : nullptr;
+
+        if (!Fuzzing::Initialise(config))
+            return 1;
+    }
 
     // delete the args parser
     delete g_args;
 
     // Actually start emulator
 
-    if (int status = Emulator::Start(data, fileSize, RAM_Size, has_display, displayType, has_drive, drive.data()); status != 0) {
+    if (int status = Emulator::Start(program.data(), fileSize, memoryMap, has_display, displayType, drives); status != 0) {
         printf("Emulator failed to start: %d\n", status);
         return 1;
     }
 
-    // Cleanup
-
-    delete[] data;
-
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "MemoryMap.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <util.h>
+
+namespace MemoryMap {
+
+    void CreateDefault(size_t RAMSize, std::vector<Entry>& entries) {
+        entries.clear();
+
+        uint64_t lowEnd = MIN(static_cast<uint64_t>(RAMSize), static_cast<uint64_t>(MEMORY_MAP_LOW_LIMIT));
+        if (lowEnd > 0)
+            entries.push_back({EntryType::RAM, 0, lowEnd});
+
+        // keep the rest of the low space usable for devices, without any memory behind it
+        if (uint64_t windowStart = ALIGN_UP(lowEnd, 0x1000); windowStart < MEMORY_MAP_LOW_LIMIT)
+            entries.push_back({EntryType::MMIO, windowStart, MEMORY_MAP_LOW_LIMIT});
+
+        if (RAMSize > MEMORY_MAP_LOW_LIMIT)
+            entries.push_back({EntryType::RAM, MEMORY_MAP_HIGH_START, MEMORY_MAP_HIGH_START + (RAMSize - MEMORY_MAP_LOW_LIMIT)});
+    }
+
+    bool LoadFile(const char* path, std::vector<Entry>& entries) {
+        FILE* fp = fopen(path, "r");
+        if (fp == nullptr) {
+            perror("fopen");
+            return false;
+        }
+
+        entries.clear();
+
+        char line[256];
+        uint64_t lineNumber = 0;
+        while (fgets(line, sizeof(line), fp) != nullptr) {
+            lineNumber++;
+
+            char type[16];
+            char start[64];
+            char end[64];
+            int count = sscanf(line, " %15s %63s %63s", type, start, end);
+            if (count <= 0 || type[0] == '#')
+                continue;
+            if (count != 3) {
+                printf("Memory map line %lu: expected \"<type> <start> <end>\"\n", lineNumber);
+                fclose(fp);
+                return false;
+            }
+
+            Entry entry;
+            if (strcasecmp(type, "ram") == 0)
+                entry.type = EntryType::RAM;
+            else if (strcasecmp(type, "mmio") == 0)
+                entry.type = EntryType::MMIO;
+            else {
+                printf("Memory map line %lu: invalid type \"%s\"\n", lineNumber, type);
+                fclose(fp);
+                return false;
+            }
+
+            char* startEnd = nullptr;
+            char* endEnd = nullptr;
+            entry.start = strtoull(start, &startEnd, 0); // automatically detects base
+            entry.end = strtoull(end, &endEnd, 0);
+            if (*startEnd != '\0' || *endEnd != '\0') {
+                printf("Memory map line %lu: invalid address\n", lineNumber);
+                fclose(fp);
+                return false;
+            }
+
+            entries.push_back(entry);
+        }
+
+        fclose(fp);
+        return Validate(entries);
+    }
+
+    bool Validate(const std::vector<Entry>& entries) {
+        if (GetRAMSize(entries) == 0) {
+            printf("Memory map has no RAM\n");
+            return false;
+        }
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            const Entry& entry = entries[i];
+            if (entry.start >= entry.end) {
+                printf("Memory map entry %lx - %lx is empty\n", entry.start, entry.end);
+                return false;
+            }
+            if (entry.start < MEMORY_MAP_HIGH_START && entry.end > MEMORY_MAP_LOW_LIMIT) {
+                printf("Memory map entry %lx - %lx overlaps the BIOS or the IO bus\n", entry.start, entry.end);
+                return false;
+            }
+            for (size_t j = i + 1; j < entries.size(); j++) {
+                if (entry.start < entries[j].end && entries[j].start < entry.end) {
+                    printf("Memory map entries %lx - %lx and %lx - %lx overlap\n", entry.start, entry.end, entries[j].start, entries[j].end);
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    size_t GetRAMSize(const std::vector<Entry>& entries) {
+        size_t size = 0;
+        for (const Entry& entry : entries) {
+            if (entry.type == EntryType::RAM)
+                size += entry.end - entry.start;
+        }
+        return size;
+    }
+
+}
@@ -0,0 +1,58 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _MEMORY_MAP_HPP
+#define _MEMORY_MAP_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#define MEMORY_MAP_LOW_LIMIT 0xF000'0000 // start of the BIOS region
+#define MEMORY_MAP_HIGH_START 0x1'0000'0000 // end of the IO bus region
+
+namespace MemoryMap {
+
+    enum class EntryType {
+        RAM,
+        MMIO // no memory behind it, only used for mapping devices
+    };
+
+    struct Entry {
+        EntryType type;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // RAM from 0 up to the BIOS, an MMIO window for the rest of the space below the BIOS, and any remaining RAM from 4GiB.
+    void CreateDefault(size_t RAMSize, std::vector<Entry>& entries);
+
+    // Each line is "ram <start> <end>" or "mmio <start> <end>". Anything not listed is a hole. Lines starting with '#' are ignored.
+    // Prints the error and returns false if the file cannot be parsed or the map is invalid.
+    bool LoadFile(const char* path, std::vector<Entry>& entries);
+
+    // Entries must not overlap each other or the BIOS and IO bus regions. Prints the error and returns false if invalid.
+    bool Validate(const std::vector<Entry>& entries);
+
+    // Total size of all RAM entries
+    size_t GetRAMSize(const std::vector<Entry>& entries);
+
+}
+
+#endif /* _MEMORY_MAP_HPP */
@@ -0,0 +1,79 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _OS_SPECIFIC_CONSOLE_ENDPOINT_HPP
+#define _OS_SPECIFIC_CONSOLE_ENDPOINT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum class ConsoleEndpointType {
+    STDIO,
+    FILE, // output only, the input has already ended
+    PTY,
+    UNIX  // Unix socket, which a client connects to
+};
+
+struct ConsoleEndpointConfig {
+    ConsoleEndpointType type;
+    const char* path; // FILE and UNIX only
+};
+
+#define CONSOLE_ENDPOINT_READABLE 1
+#define CONSOLE_ENDPOINT_WRITABLE 2
+
+// The host end of the console device. Reads and writes never block, so one thread can serve both directions.
+class ConsoleEndpoint {
+public:
+    // Crashes if the endpoint can't be opened. A Unix socket endpoint waits for a client to connect.
+    explicit ConsoleEndpoint(const ConsoleEndpointConfig& config);
+    ~ConsoleEndpoint();
+
+    // Wait up to timeout milliseconds, or for ever if it is negative, until the endpoint is ready to be read or
+    // written, as asked, or Wake is called. Returns the CONSOLE_ENDPOINT_* flags that are ready.
+    int Wait(bool read, bool write, int timeout);
+
+    // Make Wait return. Safe to call from any thread.
+    void Wake();
+
+    // Returns the number of bytes read, 0 if there is no input yet, or -1 once the input has ended
+    long Read(uint8_t* buffer, size_t size);
+
+    // Returns the number of bytes written, 0 if the endpoint can't take any more yet. Output to an endpoint that has
+    // gone away is thrown away.
+    size_t Write(const uint8_t* buffer, size_t size);
+
+private:
+    struct Handle {
+        int fd;
+        bool pollable; // false for regular files and the like, which are always ready
+        uint32_t events; // what the fd is registered for, 0 if it isn't
+    };
+
+    void Register(Handle& handle, uint32_t events);
+
+    int m_epoll;
+    int m_wake;
+    Handle m_input;
+    Handle m_output; // the same fd as the input for a pty or socket, but only m_input is registered then
+    int m_ptySecondary; // kept open so the pty doesn't hang up before anything opens it
+    bool m_socket;
+    bool m_outputGone;
+};
+
+#endif /* _OS_SPECIFIC_CONSOLE_ENDPOINT_HPP */
@@ -21,17 +21,35 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stddef.h>
 
 #ifdef __unix__
+#include <sys/uio.h>
+
 typedef int FileHandle_t;
 #endif /* __unix__ */
 
-FileHandle_t OpenFile(const char* path);
+// If direct is set, the host page cache is bypassed where the file system allows it. Transfers on a direct handle
+// must use offsets, sizes and buffer addresses aligned to the device block size.
+FileHandle_t OpenFile(const char* path, bool readOnly = false, bool direct = false);
+// Create the file, or empty it if it already exists, and set its size. The contents read as zero.
+FileHandle_t CreateFile(const char* path, size_t size);
 void CloseFile(FileHandle_t handle);
 size_t GetFileSize(FileHandle_t handle);
+// Free the space used by a range of the file, which then reads as zero. File systems that can't free part of a file
+// leave the range as it is, which still counts as success. Returns false on failure.
+bool PunchHole(FileHandle_t handle, size_t offset, size_t size);
+// Wait until everything written to the file is on stable storage. Returns false on failure.
+bool SyncFile(FileHandle_t handle);
 
 size_t ReadFile(FileHandle_t handle, void* buffer, size_t size, size_t offset);
 size_t WriteFile(FileHandle_t handle, const void* buffer, size_t size, size_t offset);
 
+// Scatter/gather versions of ReadFile and WriteFile. Returns the number of bytes transferred, which is short at the end of the
+// file or on failure.
+size_t ReadFileVector(FileHandle_t handle, const iovec* buffers, size_t count, size_t offset);
+size_t WriteFileVector(FileHandle_t handle, const iovec* buffers, size_t count, size_t offset);
+
 void* MapFile(FileHandle_t handle, size_t size, size_t offset);
+// Maps a private copy-on-write view of the file over existing memory at address, which must be page aligned
+void* MapFilePrivate(FileHandle_t handle, void* address, size_t size, size_t offset);
 void UnmapFile(void* address, size_t size);
 
 
@@ -0,0 +1,240 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "../ConsoleEndpoint.hpp"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <Emulator.hpp>
+#include <string>
+
+[[noreturn]] static void CrashWithError(const char* message, const char* path = nullptr) {
+    const char* err = strerror(errno);
+    std::string str = message;
+    if (path != nullptr) {
+        str += ": ";
+        str += path;
+    }
+    str += " with error: ";
+    str += err;
+    Emulator::Crash(str.c_str());
+}
+
+// epoll refuses regular files and some devices, like /dev/null, which never block anyway
+static bool IsPollable(int epoll, int fd) {
+    if (fd < 0)
+        return false;
+    epoll_event event = {};
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+        return false;
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+    return true;
+}
+
+ConsoleEndpoint::ConsoleEndpoint(const ConsoleEndpointConfig& config)
+    : m_epoll(-1), m_wake(-1), m_input{-1, false, 0}, m_output{-1, false, 0}, m_ptySecondary(-1), m_socket(false), m_outputGone(false) {
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0)
+        CrashWithError("Failed to create the console event loop");
+    m_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wake < 0)
+        CrashWithError("Failed to create the console event loop");
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = m_wake;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event) < 0)
+        CrashWithError("Failed to create the console event loop");
+
+    switch (config.type) {
+    case ConsoleEndpointType::STDIO:
+        // stdin and stdout are shared with whatever started the emulator, so they are left blocking and only used
+        // once epoll says they are ready
+        fflush(stdout);
+        m_input.fd = STDIN_FILENO;
+        m_output.fd = STDOUT_FILENO;
+        break;
+    case ConsoleEndpointType::FILE:
+        m_output.fd = open(config.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_output.fd < 0)
+            CrashWithError("Failed to open console file", config.path);
+        break;
+    case ConsoleEndpointType::PTY: {
+        int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+            CrashWithError("Failed to create console pty");
+        const char* name = ptsname(fd);
+        if (name == nullptr)
+            CrashWithError("Failed to create console pty");
+        m_ptySecondary = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (m_ptySecondary < 0)
+            CrashWithError("Failed to open console pty", name);
+        // pass the guest's bytes through as they are, rather than as a line-buffered terminal
+        termios attributes;
+        if (tcgetattr(m_ptySecondary, &attributes) == 0) {
+            cfmakeraw(&attributes);
+            tcsetattr(m_ptySecondary, TCSANOW, &attributes);
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fprintf(stderr, "Console is on %s\n", name);
+        m_input.fd = fd;
+        m_output.fd = fd;
+        break;
+    }
+    case ConsoleEndpointType::UNIX: {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (strlen(config.path) >= sizeof(address.sun_path)) {
+            std::string str = "Console socket path is too long: ";
+            str += config.path;
+            Emulator::Crash(str.c_str());
+        }
+        strcpy(address.sun_path, config.path);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+            CrashWithError("Failed to create console socket", config.path);
+        // a socket left behind by an earlier run would stop the bind
+        struct stat info;
+        if (lstat(config.path, &info) == 0 && S_ISSOCK(info.st_mode))
+            unlink(config.path);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listener, 1) < 0)
+            CrashWithError("Failed to create console socket", config.path);
+
+        fprintf(stderr, "Waiting for a console connection on %s\n", config.path);
+        int fd;
+        do {
+            fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        } while (fd < 0 && errno == EINTR);
+        if (fd < 0)
+            CrashWithError("Failed to accept console connection", config.path);
+        // only one client is served, so nothing else can connect
+        close(listener);
+        unlink(config.path);
+
+        m_input.fd = fd;
+        m_output.fd = fd;
+        m_socket = true;
+        break;
+    }
+    }
+
+    m_input.pollable = IsPollable(m_epoll, m_input.fd);
+    m_output.pollable = IsPollable(m_epoll, m_output.fd);
+}
+
+ConsoleEndpoint::~ConsoleEndpoint() {
+    if (m_input.fd > STDERR_FILENO)
+        close(m_input.fd);
+    if (m_output.fd > STDERR_FILENO && m_output.fd != m_input.fd)
+        close(m_output.fd);
+    if (m_ptySecondary >= 0)
+        close(m_ptySecondary);
+    close(m_wake);
+    close(m_epoll);
+}
+
+int ConsoleEndpoint::Wait(bool read, bool write, int timeout) {
+    int ready = 0;
+    if (read && !m_input.pollable)
+        ready |= CONSOLE_ENDPOINT_READABLE; // reading a closed input gives its end
+    if (write && (m_outputGone || !m_output.pollable))
+        ready |= CONSOLE_ENDPOINT_WRITABLE;
+
+    bool pollRead = read && !(ready & CONSOLE_ENDPOINT_READABLE);
+    bool pollWrite = write && !(ready & CONSOLE_ENDPOINT_WRITABLE);
+    if (m_output.fd == m_input.fd) {
+        Register(m_input, (pollRead ? EPOLLIN : 0u) | (pollWrite ? EPOLLOUT : 0u));
+    } else {
+        Register(m_input, pollRead ? EPOLLIN : 0u);
+        Register(m_output, pollWrite ? EPOLLOUT : 0u);
+    }
+
+    epoll_event events[3];
+    int count = epoll_wait(m_epoll, events, 3, ready != 0 ? 0 : timeout);
+    if (count < 0) {
+        if (errno == EINTR)
+            return ready;
+        CrashWithError("Failed to wait for the console");
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.fd == m_wake) {
+            uint64_t value;
+            (void)!::read(m_wake, &value, sizeof(value));
+            continue;
+        }
+        // a hang up or error is picked up by the next read or write
+        if (events[i].data.fd == m_input.fd && pollRead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            ready |= CONSOLE_ENDPOINT_READABLE;
+        if (events[i].data.fd == m_output.fd && pollWrite && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+            ready |= CONSOLE_ENDPOINT_WRITABLE;
+    }
+    return ready;
+}
+
+void ConsoleEndpoint::Wake() {
+    uint64_t value = 1;
+    (void)!write(m_wake, &value, sizeof(value));
+}
+
+long ConsoleEndpoint::Read(uint8_t* buffer, size_t size) {
+    if (m_input.fd < 0)
+        return -1;
+    ssize_t count = read(m_input.fd, buffer, size);
+    if (count > 0)
+        return count;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return -1; // the end of the input, or the other end went away
+}
+
+size_t ConsoleEndpoint::Write(const uint8_t* buffer, size_t size) {
+    if (m_outputGone)
+        return size;
+    ssize_t count = m_socket ? send(m_output.fd, buffer, size, MSG_NOSIGNAL) : write(m_output.fd, buffer, size);
+    if (count >= 0)
+        return static_cast<size_t>(count);
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+    m_outputGone = true;
+    return size;
+}
+
+void ConsoleEndpoint::Register(Handle& handle, uint32_t events) {
+    if (!handle.pollable || handle.events == events)
+        return;
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = handle.fd;
+    // nothing stays registered when it isn't wanted, as a hang up would be reported over and over
+    int operation = handle.events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+    if (epoll_ctl(m_epoll, operation, handle.fd, &event) < 0)
+        CrashWithError("Failed to wait for the console");
+    handle.events = events;
+}
@@ -18,18 +18,29 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "../File.hpp"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <util.h>
 
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
 #include <Emulator.hpp>
 #include <string>
+#include <vector>
 
 #include "../Memory.hpp"
 
-FileHandle_t OpenFile(const char* path) {
-    int fd = open(path, O_RDWR);
+FileHandle_t OpenFile(const char* path, bool readOnly, bool direct) {
+    int flags = readOnly ? O_RDONLY : O_RDWR;
+    int fd = open(path, flags | (direct ? O_DIRECT : 0));
+    if (fd < 0 && direct && errno == EINVAL) {
+        // tmpfs and some other file systems don't support O_DIRECT
+        fprintf(stderr, "Direct I/O is not supported for %s, using buffered I/O\n", path);
+        fd = open(path, flags);
+    }
     if (fd < 0) {
         const char* err = strerror(errno);
         std::string str = "Failed to open file: ";
@@ -42,6 +53,20 @@ FileHandle_t OpenFile(const char* path) {
     return fd;
 }
 
+FileHandle_t CreateFile(const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) < 0) {
+        const char* err = strerror(errno);
+        std::string str = "Failed to create file: ";
+        str += path;
+        str += " with error: ";
+        str += err;
+        Emulator::Crash(str.c_str());
+    }
+
+    return fd;
+}
+
 void CloseFile(FileHandle_t handle) {
     close(handle);
 }
@@ -58,6 +83,22 @@ size_t GetFileSize(FileHandle_t handle) {
     return static_cast<size_t>(size);
 }
 
+bool PunchHole(FileHandle_t handle, size_t offset, size_t size) {
+    if (size == 0)
+        return true;
+    if (fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size)) < 0)
+        return errno == EOPNOTSUPP;
+    return true;
+}
+
+bool SyncFile(FileHandle_t handle) {
+    while (fdatasync(handle) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return true;
+}
+
 size_t ReadFile(FileHandle_t handle, void* buffer, size_t size, size_t offset) {
     if (off_t ret = lseek(handle, offset, SEEK_SET); ret < 0) {
         const char* err = strerror(errno);
@@ -96,6 +137,42 @@ size_t WriteFile(FileHandle_t handle, const void* buffer, size_t size, size_t of
     return static_cast<size_t>(write_size);
 }
 
+// preadv/pwritev can stop part way through, and only take IOV_MAX buffers at a time, so keep going until everything is done.
+// This runs on the storage queue workers, so an error stops the transfer and is left for the caller to report.
+static size_t TransferFileVector(FileHandle_t handle, const iovec* buffers, size_t count, size_t offset, bool write) {
+    std::vector<iovec> remaining(buffers, buffers + count);
+    size_t index = 0;
+    size_t total = 0;
+    while (index < remaining.size()) {
+        int chunk = static_cast<int>(MIN(remaining.size() - index, static_cast<size_t>(IOV_MAX)));
+        ssize_t transferred = write ? pwritev(handle, &remaining[index], chunk, offset + total) : preadv(handle, &remaining[index], chunk, offset + total);
+        if (transferred < 0 && errno == EINTR)
+            continue;
+        if (transferred <= 0)
+            break; // end of file or an error
+
+        total += transferred;
+        size_t left = static_cast<size_t>(transferred);
+        while (index < remaining.size() && left >= remaining[index].iov_len) {
+            left -= remaining[index].iov_len;
+            index++;
+        }
+        if (left > 0) {
+            remaining[index].iov_base = static_cast<uint8_t*>(remaining[index].iov_base) + left;
+            remaining[index].iov_len -= left;
+        }
+    }
+    return total;
+}
+
+size_t ReadFileVector(FileHandle_t handle, const iovec* buffers, size_t count, size_t offset) {
+    return TransferFileVector(handle, buffers, count, offset, false);
+}
+
+size_t WriteFileVector(FileHandle_t handle, const iovec* buffers, size_t count, size_t offset) {
+    return TransferFileVector(handle, buffers, count, offset, true);
+}
+
 void* MapFile(FileHandle_t handle, size_t size, size_t offset) {
     void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, offset);
     if (address == MAP_FAILED) {
@@ -108,6 +185,18 @@ void* MapFile(FileHandle_t handle, size_t size, size_t offset) {
     return address;
 }
 
+void* MapFilePrivate(FileHandle_t handle, void* address, size_t size, size_t offset) {
+    void* new_address = mmap(address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, handle, offset);
+    if (new_address == MAP_FAILED) {
+        const char* err = strerror(errno);
+        std::string str = "Failed to map file with error: ";
+        str += err;
+        Emulator::Crash(str.c_str());
+    }
+
+    return new_address;
+}
+
 void UnmapFile(void* address, size_t size) {
     if (munmap(address, size) < 0) {
         const char* err = strerror(errno);
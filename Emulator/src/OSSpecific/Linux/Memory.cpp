@@ -17,8 +17,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "../Memory.hpp"
 
+#include <linux/membarrier.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <util.h>
+
+#include <mutex>
+#include <vector>
 
 #include "Emulator.hpp"
 
@@ -52,12 +59,60 @@ namespace OSSpecific {
             return mem;
     }
 
-    void FreeCOWMemory(void* ptr) {
-        munmap(ptr, 0);
-    }
-
     void FreeSizedCOWMemory(void* ptr, size_t size) {
         munmap(ptr, size);
     }
 
+    void ResetCOWMemory(void* ptr, size_t size) {
+        if (madvise(ptr, size, MADV_DONTNEED) != 0)
+            Emulator::Crash("Failed to reset COW memory");
+    }
+
+    size_t GetPageSize() {
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    size_t GetResidentSize(void* ptr, size_t size) {
+        if (size == 0)
+            return 0;
+        size_t pageSize = GetPageSize();
+        uint64_t start = ALIGN_DOWN(reinterpret_cast<uint64_t>(ptr), pageSize);
+        uint64_t end = ALIGN_UP(reinterpret_cast<uint64_t>(ptr) + size, pageSize);
+        size_t pageCount = (end - start) / pageSize;
+        std::vector<unsigned char> pages(pageCount);
+        if (mincore(reinterpret_cast<void*>(start), end - start, pages.data()) != 0)
+            return 0;
+        size_t resident = 0;
+        for (unsigned char page : pages) {
+            if (page & 1)
+                resident++;
+        }
+        return resident * pageSize;
+    }
+
+    // Changing the protection of a page that has been written makes the kernel flush the TLB of every CPU running the
+    // process, which drains their store buffers too
+    static void ProtectionChangeBarrier() {
+        static std::mutex lock;
+        static void* page = nullptr;
+        std::lock_guard<std::mutex> guard(lock);
+        if (page == nullptr) {
+            page = mmap(nullptr, GetPageSize(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED)
+                Emulator::Crash("Failed to allocate the memory barrier page");
+        }
+        if (mprotect(page, GetPageSize(), PROT_READ | PROT_WRITE) != 0)
+            Emulator::Crash("Failed to change the memory barrier page protection");
+        *static_cast<volatile uint8_t*>(page) = 0;
+        if (mprotect(page, GetPageSize(), PROT_NONE) != 0)
+            Emulator::Crash("Failed to change the memory barrier page protection");
+    }
+
+    void ProcessMemoryBarrier() {
+        static bool registered = syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+        if (registered && syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+            return;
+        ProtectionChangeBarrier(); // kernels older than 4.14
+    }
+
 } // namespace OSSpecific
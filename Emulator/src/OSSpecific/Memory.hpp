@@ -30,8 +30,18 @@ namespace OSSpecific {
 
     void* AllocateCOWMemory(size_t size);
     void* AllocateZeroedCOWMemory(size_t size);
-    void FreeCOWMemory(void* ptr);
     void FreeSizedCOWMemory(void* ptr, size_t size);
+    // Drop the contents of COW memory, so it reads as zero again without being unmapped
+    void ResetCOWMemory(void* ptr, size_t size);
+
+    size_t GetPageSize();
+
+    // Number of bytes of the range that are currently backed by host memory, in whole pages
+    size_t GetResidentSize(void* ptr, size_t size);
+
+    // Acts as a full memory fence on every thread of the process, so stores that any thread made before its last
+    // compiler barrier are visible once it returns. Lets hot paths get away with plain loads and stores. Slow.
+    void ProcessMemoryBarrier();
 
 }
 
@@ -0,0 +1,216 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "Image.hpp"
+
+#include <string.h>
+#include <unistd.h>
+
+ImageReader::ImageReader()
+    : m_file(nullptr), m_sparse(false), m_size(0), m_fileSize(0), m_header(), m_l2Index(UINT64_MAX), m_clusterIndex(UINT64_MAX) {
+}
+
+ImageReader::~ImageReader() {
+    Close();
+}
+
+bool ImageReader::Open(const char* path) {
+    m_file = fopen(path, "rb");
+    if (m_file == nullptr)
+        return false;
+
+    fseeko(m_file, 0, SEEK_END);
+    m_fileSize = ftello(m_file);
+    fseeko(m_file, 0, SEEK_SET);
+
+    if (m_fileSize >= sizeof(m_header) && fread(&m_header, sizeof(m_header), 1, m_file) == 1 && memcmp(m_header.magic, DISK_IMAGE_MAGIC, DISK_IMAGE_MAGIC_SIZE) == 0) {
+        if (!DiskImage::ValidateHeader(m_header))
+            return false;
+        m_sparse = true;
+        m_size = m_header.size;
+        m_l1.resize(m_header.l1Count);
+        if (fseeko(m_file, m_header.l1Offset, SEEK_SET) != 0 || fread(m_l1.data(), sizeof(uint64_t), m_l1.size(), m_file) != m_l1.size())
+            return false;
+        m_l2.resize(DiskImage::GetL2EntryCount(m_header.clusterShift));
+        m_cluster.resize(1ULL << m_header.clusterShift);
+    } else {
+        // the device only uses whole blocks, so round up
+        m_sparse = false;
+        m_size = (m_fileSize + 511) & ~511ULL;
+    }
+    return true;
+}
+
+void ImageReader::Close() {
+    if (m_file != nullptr)
+        fclose(m_file);
+    m_file = nullptr;
+}
+
+bool ImageReader::Read(uint64_t offset, uint8_t* data, size_t size) {
+    if (!m_sparse) {
+        memset(data, 0, size);
+        if (offset >= m_fileSize)
+            return true;
+        size_t available = m_fileSize - offset < size ? m_fileSize - offset : size;
+        return fseeko(m_file, offset, SEEK_SET) == 0 && fread(data, 1, available, m_file) == available;
+    }
+
+    uint64_t clusterSize = 1ULL << m_header.clusterShift;
+    while (size > 0) {
+        uint64_t index = offset >> m_header.clusterShift;
+        uint64_t inner = offset & (clusterSize - 1);
+        size_t length = clusterSize - inner < size ? clusterSize - inner : size;
+        if (!LoadCluster(index))
+            return false;
+        memcpy(data, m_cluster.data() + inner, length);
+        data += length;
+        offset += length;
+        size -= length;
+    }
+    return true;
+}
+
+bool ImageReader::LoadCluster(uint64_t index) {
+    if (index == m_clusterIndex)
+        return true;
+
+    uint64_t entryCount = m_l2.size();
+    uint64_t l1Index = index / entryCount;
+    if (l1Index >= m_l1.size())
+        return false;
+    if (l1Index != m_l2Index) {
+        if (m_l1[l1Index] == 0)
+            memset(m_l2.data(), 0, m_l2.size() * sizeof(DiskImage::L2Entry));
+        else if (fseeko(m_file, m_l1[l1Index], SEEK_SET) != 0 || fread(m_l2.data(), sizeof(DiskImage::L2Entry), m_l2.size(), m_file) != m_l2.size())
+            return false;
+        m_l2Index = l1Index;
+    }
+
+    const DiskImage::L2Entry& entry = m_l2[index % entryCount];
+    m_clusterIndex = UINT64_MAX;
+    if (entry.offset == 0)
+        memset(m_cluster.data(), 0, m_cluster.size());
+    else if (entry.storedSize > m_cluster.size() || fseeko(m_file, entry.offset, SEEK_SET) != 0)
+        return false;
+    else if (entry.flags & DiskImage::L2F_COMPRESSED) {
+        m_compressed.resize(entry.storedSize);
+        if (fread(m_compressed.data(), 1, m_compressed.size(), m_file) != m_compressed.size() || !DiskImage::Decompress(m_compressed.data(), m_compressed.size(), m_cluster.data(), m_cluster.size()))
+            return false;
+    } else if (fread(m_cluster.data(), 1, m_cluster.size(), m_file) != m_cluster.size())
+        return false;
+    m_clusterIndex = index;
+    return true;
+}
+
+SparseImageWriter::SparseImageWriter()
+    : m_file(nullptr), m_header(), m_compress(false), m_fileEnd(0), m_l2Index(0), m_l2Used(false), m_allocatedCount(0), m_compressedCount(0) {
+}
+
+SparseImageWriter::~SparseImageWriter() {
+    if (m_file != nullptr)
+        fclose(m_file);
+}
+
+bool SparseImageWriter::Open(const char* path, uint64_t size, uint8_t clusterShift, bool compress) {
+    m_file = fopen(path, "wb");
+    if (m_file == nullptr)
+        return false;
+
+    uint64_t clusterCount = (size + (1ULL << clusterShift) - 1) >> clusterShift;
+    uint64_t entryCount = DiskImage::GetL2EntryCount(clusterShift);
+    memcpy(m_header.magic, DISK_IMAGE_MAGIC, DISK_IMAGE_MAGIC_SIZE);
+    m_header.version = DISK_IMAGE_VERSION;
+    m_header.headerSize = sizeof(DiskImage::Header);
+    m_header.clusterShift = clusterShift;
+    m_header.size = size;
+    m_header.l1Offset = DISK_IMAGE_ALIGNMENT;
+    m_header.l1Count = (clusterCount + entryCount - 1) / entryCount;
+
+    m_compress = compress;
+    m_l1.assign(m_header.l1Count, 0);
+    m_l2.assign(entryCount, {0, 0, 0});
+    m_compressed.resize(1ULL << clusterShift);
+    m_fileEnd = m_header.l1Offset + m_l1.size() * sizeof(uint64_t);
+    m_fileEnd = (m_fileEnd + DISK_IMAGE_ALIGNMENT - 1) & ~static_cast<uint64_t>(DISK_IMAGE_ALIGNMENT - 1);
+    return true;
+}
+
+bool SparseImageWriter::WriteCluster(uint64_t index, const uint8_t* data) {
+    uint64_t clusterSize = 1ULL << m_header.clusterShift;
+    if (index / m_l2.size() != m_l2Index) {
+        if (!FlushL2())
+            return false;
+        m_l2Index = index / m_l2.size();
+    }
+
+    bool empty = true;
+    for (uint64_t i = 0; i < clusterSize && empty; i++)
+        empty = data[i] == 0;
+    if (empty)
+        return true;
+
+    DiskImage::L2Entry& entry = m_l2[index % m_l2.size()];
+    entry = {0, static_cast<uint32_t>(clusterSize), 0};
+    // only keep the compressed version if it saves at least one block
+    if (m_compress) {
+        size_t compressedSize = DiskImage::Compress(data, clusterSize, m_compressed.data(), clusterSize - DISK_IMAGE_ALIGNMENT);
+        if (compressedSize > 0) {
+            entry.storedSize = compressedSize;
+            entry.flags = DiskImage::L2F_COMPRESSED;
+            data = m_compressed.data();
+            m_compressedCount++;
+        }
+    }
+    uint64_t offset;
+    if (!Append(data, entry.storedSize, offset))
+        return false;
+    entry.offset = offset;
+    m_l2Used = true;
+    m_allocatedCount++;
+    return true;
+}
+
+bool SparseImageWriter::Close() {
+    bool success = FlushL2();
+    success = success && fseeko(m_file, m_header.l1Offset, SEEK_SET) == 0 && fwrite(m_l1.data(), sizeof(uint64_t), m_l1.size(), m_file) == m_l1.size();
+    success = success && fseeko(m_file, 0, SEEK_SET) == 0 && fwrite(&m_header, sizeof(m_header), 1, m_file) == 1;
+    // the file must cover the last allocation, including its alignment padding
+    success = success && ftruncate(fileno(m_file), m_fileEnd) == 0;
+    success = fclose(m_file) == 0 && success;
+    m_file = nullptr;
+    return success;
+}
+
+bool SparseImageWriter::Append(const void* data, size_t size, uint64_t& offset) {
+    offset = m_fileEnd;
+    if (fseeko(m_file, offset, SEEK_SET) != 0 || fwrite(data, 1, size, m_file) != size)
+        return false;
+    m_fileEnd += (size + DISK_IMAGE_ALIGNMENT - 1) & ~static_cast<uint64_t>(DISK_IMAGE_ALIGNMENT - 1);
+    return true;
+}
+
+bool SparseImageWriter::FlushL2() {
+    if (!m_l2Used)
+        return true;
+    if (!Append(m_l2.data(), m_l2.size() * sizeof(DiskImage::L2Entry), m_l1[m_l2Index]))
+        return false;
+    m_l2.assign(m_l2.size(), {0, 0, 0});
+    m_l2Used = false;
+    return true;
+}
@@ -0,0 +1,96 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _IMAGE_HPP
+#define _IMAGE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libarch/DiskImage.hpp>
+#include <vector>
+
+// Reads a raw or sparse image
+class ImageReader {
+   public:
+    ImageReader();
+    ~ImageReader();
+
+    // Detects the format. Returns false if the file can't be opened or is an invalid sparse image.
+    bool Open(const char* path);
+    void Close();
+
+    bool IsSparse() const { return m_sparse; }
+    uint64_t GetSize() const { return m_size; }
+
+    // Read size bytes at offset. Parts of a raw image past its end read as zero.
+    bool Read(uint64_t offset, uint8_t* data, size_t size);
+
+   private:
+    bool LoadCluster(uint64_t index);
+
+   private:
+    FILE* m_file;
+    bool m_sparse;
+    uint64_t m_size;
+    uint64_t m_fileSize;
+
+    DiskImage::Header m_header;
+    std::vector<uint64_t> m_l1;
+    uint64_t m_l2Index; // index of the L2 table in m_l2, or UINT64_MAX if none is loaded
+    std::vector<DiskImage::L2Entry> m_l2;
+    uint64_t m_clusterIndex; // index of the cluster in m_cluster, or UINT64_MAX if none is loaded
+    std::vector<uint8_t> m_cluster;
+    std::vector<uint8_t> m_compressed;
+};
+
+// Writes a sparse image. Clusters must be written in order.
+class SparseImageWriter {
+   public:
+    SparseImageWriter();
+    ~SparseImageWriter();
+
+    bool Open(const char* path, uint64_t size, uint8_t clusterShift, bool compress);
+    // Clusters that are all zero aren't stored
+    bool WriteCluster(uint64_t index, const uint8_t* data);
+    // Writes the remaining tables and the header
+    bool Close();
+
+    uint64_t GetAllocatedCount() const { return m_allocatedCount; }
+    uint64_t GetCompressedCount() const { return m_compressedCount; }
+
+   private:
+    bool Append(const void* data, size_t size, uint64_t& offset);
+    bool FlushL2();
+
+   private:
+    FILE* m_file;
+    DiskImage::Header m_header;
+    bool m_compress;
+    uint64_t m_fileEnd;
+    std::vector<uint64_t> m_l1;
+    uint64_t m_l2Index;
+    std::vector<DiskImage::L2Entry> m_l2;
+    bool m_l2Used;
+    std::vector<uint8_t> m_compressed;
+    uint64_t m_allocatedCount;
+    uint64_t m_compressedCount;
+};
+
+#endif /* _IMAGE_HPP */
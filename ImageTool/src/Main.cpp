@@ -0,0 +1,175 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string_view>
+#include <vector>
+
+#include "ArgsParser.hpp"
+#include "Image.hpp"
+
+#define RAW_CHUNK_SIZE 0x10'0000
+
+ArgsParser* g_args = nullptr;
+
+static bool IsZero(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+static bool WriteSparse(ImageReader& input, const char* path, uint8_t clusterShift, bool compress) {
+    SparseImageWriter writer;
+    if (!writer.Open(path, input.GetSize(), clusterShift, compress)) {
+        printf("Error: could not open output file %s\n", path);
+        return false;
+    }
+
+    uint64_t clusterSize = 1ULL << clusterShift;
+    uint64_t clusterCount = (input.GetSize() + clusterSize - 1) >> clusterShift;
+    std::vector<uint8_t> cluster(clusterSize);
+    for (uint64_t i = 0; i < clusterCount; i++) {
+        uint64_t offset = i << clusterShift;
+        uint64_t length = input.GetSize() - offset < clusterSize ? input.GetSize() - offset : clusterSize;
+        memset(cluster.data(), 0, clusterSize);
+        if (!input.Read(offset, cluster.data(), length)) {
+            printf("Error: could not read the input image\n");
+            return false;
+        }
+        if (!writer.WriteCluster(i, cluster.data())) {
+            perror("Error: could not write to output file");
+            return false;
+        }
+    }
+
+    if (!writer.Close()) {
+        perror("Error: could not write to output file");
+        return false;
+    }
+    printf("%lu of %lu clusters allocated, %lu compressed\n", writer.GetAllocatedCount(), clusterCount, writer.GetCompressedCount());
+    return true;
+}
+
+static bool WriteRaw(ImageReader& input, const char* path) {
+    FILE* output = fopen(path, "wb");
+    if (output == nullptr) {
+        printf("Error: could not open output file %s\n", path);
+        return false;
+    }
+
+    // zero chunks are skipped, so the output is sparse where the file system allows it
+    std::vector<uint8_t> chunk(RAW_CHUNK_SIZE);
+    bool success = true;
+    for (uint64_t offset = 0; offset < input.GetSize() && success; offset += RAW_CHUNK_SIZE) {
+        size_t length = input.GetSize() - offset < RAW_CHUNK_SIZE ? input.GetSize() - offset : RAW_CHUNK_SIZE;
+        if (!input.Read(offset, chunk.data(), length)) {
+            printf("Error: could not read the input image\n");
+            fclose(output);
+            return false;
+        }
+        if (!IsZero(chunk.data(), length))
+            success = fseeko(output, offset, SEEK_SET) == 0 && fwrite(chunk.data(), 1, length, output) == length;
+    }
+    success = success && fflush(output) == 0 && ftruncate(fileno(output), input.GetSize()) == 0;
+    success = fclose(output) == 0 && success;
+    if (!success)
+        perror("Error: could not write to output file");
+    return success;
+}
+
+int main(int argc, char** argv) {
+    g_args = new ArgsParser();
+
+    g_args->AddOption('i', "input", "Input image, raw or sparse", true);
+    g_args->AddOption('o', "output", "Output image", true);
+    g_args->AddOption('f', "format", "Output format. Valid values are \"sparse\" (default) or \"raw\".", false);
+    g_args->AddOption('c', "compress", "Compress sparse clusters. Valid values are \"on\" or \"off\" (default).", false);
+    g_args->AddOption('s', "cluster-size", "Sparse cluster size in bytes. A power of 2 from 4 KiB to 2 MiB, defaults to 64 KiB.", false);
+    g_args->AddOption('h', "help", "Print this help message", false);
+
+    g_args->ParseArgs(argc, argv);
+
+    if (g_args->HasOption('h')) {
+        printf("%s", g_args->GetHelpMessage().c_str());
+        return 0;
+    }
+
+    if (!g_args->HasOption('i') || !g_args->HasOption('o')) {
+        printf("%s", g_args->GetHelpMessage().c_str());
+        return 1;
+    }
+
+    std::string_view inputPath = g_args->GetOption('i');
+    std::string_view outputPath = g_args->GetOption('o');
+    if (inputPath == outputPath) {
+        printf("Error: the input and output must be different files\n");
+        return 1;
+    }
+
+    bool sparse = true;
+    if (g_args->HasOption('f')) {
+        if (std::string_view format = g_args->GetOption('f'); format == "raw")
+            sparse = false;
+        else if (format != "sparse") {
+            printf("Error: invalid output format %s\n", format.data());
+            return 1;
+        }
+    }
+
+    bool compress = false;
+    if (g_args->HasOption('c')) {
+        if (std::string_view value = g_args->GetOption('c'); value == "on")
+            compress = true;
+        else if (value != "off") {
+            printf("Error: invalid compress value %s\n", value.data());
+            return 1;
+        }
+    }
+
+    uint8_t clusterShift = DISK_IMAGE_DEFAULT_CLUSTER_SHIFT;
+    if (g_args->HasOption('s')) {
+        uint64_t clusterSize = strtoull(g_args->GetOption('s').data(), nullptr, 0);
+        clusterShift = 0;
+        while (clusterShift < 64 && (1ULL << clusterShift) < clusterSize)
+            clusterShift++;
+        if ((1ULL << clusterShift) != clusterSize || clusterShift < DISK_IMAGE_MIN_CLUSTER_SHIFT || clusterShift > DISK_IMAGE_MAX_CLUSTER_SHIFT) {
+            printf("Error: invalid cluster size %s\n", g_args->GetOption('s').data());
+            return 1;
+        }
+    }
+
+    ImageReader input;
+    if (!input.Open(inputPath.data())) {
+        printf("Error: could not open input image %s\n", inputPath.data());
+        return 1;
+    }
+
+    bool success = sparse ? WriteSparse(input, outputPath.data(), clusterShift, compress) : WriteRaw(input, outputPath.data());
+    input.Close();
+
+    delete g_args;
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef _LIBARCH_DISK_IMAGE_HPP
+#define _LIBARCH_DISK_IMAGE_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Layout of a sparse disk image:
+- Header
+- L1 table (l1Count * uint64_t), each entry the file offset of an L2 table, or 0 if none of its clusters are allocated
+- L2 tables and clusters, in any order, each starting at a multiple of DISK_IMAGE_ALIGNMENT in the file
+
+An L2 table is one cluster of L2Entry, so it covers (clusterSize / sizeof(L2Entry)) clusters.
+Clusters without an entry read as zero and take no space in the file.
+*/
+
+#define DISK_IMAGE_MAGIC "F64DISK" // including the null terminator
+#define DISK_IMAGE_MAGIC_SIZE 8
+#define DISK_IMAGE_VERSION 1
+
+#define DISK_IMAGE_ALIGNMENT 512
+
+#define DISK_IMAGE_MIN_CLUSTER_SHIFT 12
+#define DISK_IMAGE_MAX_CLUSTER_SHIFT 21
+#define DISK_IMAGE_DEFAULT_CLUSTER_SHIFT 16
+
+namespace DiskImage {
+
+    enum L2Flags : uint32_t {
+        L2F_COMPRESSED = 1
+    };
+
+    struct [[gnu::packed]] Header {
+        char magic[DISK_IMAGE_MAGIC_SIZE];
+        uint16_t version;
+        uint16_t headerSize; // sizeof(Header)
+        uint8_t clusterShift; // the cluster size is 1 << clusterShift
+        uint8_t reserved0[3];
+        uint64_t size;        // size of the disk in bytes, a multiple of 512
+        uint64_t l1Offset;
+        uint32_t l1Count;
+        uint32_t reserved1;
+    };
+
+    struct [[gnu::packed]] L2Entry {
+        uint64_t offset;     // file offset of the cluster, 0 if it isn't allocated
+        uint32_t storedSize; // bytes used in the file, the cluster size unless the cluster is compressed
+        uint32_t flags;      // L2Flags
+    };
+
+    inline uint64_t GetL2EntryCount(uint8_t clusterShift) {
+        return (1ULL << clusterShift) / sizeof(L2Entry);
+    }
+
+    // Check the header describes an image this version can use
+    bool ValidateHeader(const Header& header);
+
+    // Compress size bytes of data into out. Returns the compressed size, or 0 if it doesn't fit in outCapacity.
+    size_t Compress(const uint8_t* data, size_t size, uint8_t* out, size_t outCapacity);
+
+    // Decompress size bytes of data into out, which must come out to exactly outSize bytes. Returns false if the data is corrupt.
+    bool Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize);
+
+}
+
+#endif /* _LIBARCH_DISK_IMAGE_HPP */
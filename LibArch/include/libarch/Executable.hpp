@@ -0,0 +1,79 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LIBARCH_EXECUTABLE_HPP
+#define _LIBARCH_EXECUTABLE_HPP
+
+#include <stdint.h>
+
+/*
+Layout of an executable:
+- Header
+- Segment table (segmentCount * SegmentHeader)
+- Symbol table (symbolCount * Symbol), optional
+- String table (stringTableSize bytes), holds the symbol names, optional
+- Segment data, each segment starting at a multiple of EXECUTABLE_SEGMENT_ALIGNMENT in the file
+*/
+
+#define EXECUTABLE_MAGIC "F64EXEC" // including the null terminator
+#define EXECUTABLE_MAGIC_SIZE 8
+#define EXECUTABLE_VERSION 1
+
+// file offsets of segment data are aligned to this so the loader can map them directly
+#define EXECUTABLE_SEGMENT_ALIGNMENT 0x1000
+
+namespace Executable {
+
+    // The loader rejects unknown flags, but doesn't enforce them, as physical memory has no permissions. Paging is the
+    // only way to get read only or non-executable memory.
+    enum SegmentFlags : uint32_t {
+        SF_READ = 1,
+        SF_WRITE = 2,
+        SF_EXECUTE = 4
+    };
+
+    struct [[gnu::packed]] Header {
+        char magic[EXECUTABLE_MAGIC_SIZE];
+        uint16_t version;
+        uint16_t headerSize; // sizeof(Header)
+        uint32_t segmentCount;
+        uint64_t entryPoint;
+        uint64_t segmentTableOffset;
+        uint64_t symbolTableOffset;
+        uint64_t stringTableOffset;
+        uint32_t symbolCount;
+        uint32_t stringTableSize;
+    };
+
+    struct [[gnu::packed]] SegmentHeader {
+        uint64_t address;    // physical address to load to
+        uint64_t fileOffset;
+        uint64_t fileSize;
+        uint64_t memorySize; // anything past fileSize is zero filled
+        uint32_t flags;      // SegmentFlags
+        uint32_t reserved;
+    };
+
+    struct [[gnu::packed]] Symbol {
+        uint64_t address;
+        uint32_t nameOffset; // into the string table
+        uint32_t nameSize;   // not including a null terminator, there isn't one
+    };
+
+}
+
+#endif /* _LIBARCH_EXECUTABLE_HPP */
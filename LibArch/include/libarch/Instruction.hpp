@@ -208,7 +208,8 @@ namespace InsEncoding {
         SUBLABEL,
         ASCII,
         ASCIIZ,
-        ALIGNMENT
+        ALIGNMENT,
+        RESERVE
     };
 
     struct RawData {
@@ -0,0 +1,166 @@
+/*
+Copyright (©) 2024  Frosty515
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "DiskImage.hpp"
+
+#include <string.h>
+
+/*
+Compressed clusters are a series of sequences. Each sequence is:
+- a token byte, the literal length in the high 4 bits and the match length - 4 in the low 4 bits
+- if either length is 15, more length bytes follow, each added on, until one is less than 255. The literal length's come first.
+- the literals
+- a 2 byte match offset, back from the current position. The last sequence stops after its literals and has no match.
+*/
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 12
+
+namespace DiskImage {
+
+    bool ValidateHeader(const Header& header) {
+        if (memcmp(header.magic, DISK_IMAGE_MAGIC, DISK_IMAGE_MAGIC_SIZE) != 0 || header.version != DISK_IMAGE_VERSION || header.headerSize != sizeof(Header))
+            return false;
+        if (header.clusterShift < DISK_IMAGE_MIN_CLUSTER_SHIFT || header.clusterShift > DISK_IMAGE_MAX_CLUSTER_SHIFT || header.size % 512 != 0)
+            return false;
+        uint64_t clusterCount = (header.size + (1ULL << header.clusterShift) - 1) >> header.clusterShift;
+        uint64_t entryCount = GetL2EntryCount(header.clusterShift);
+        return header.l1Count == (clusterCount + entryCount - 1) / entryCount;
+    }
+
+    static uint32_t Read32(const uint8_t* data) {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static bool WriteLength(uint8_t*& out, const uint8_t* outEnd, size_t length) {
+        while (length >= 255) {
+            if (out == outEnd)
+                return false;
+            *out++ = 255;
+            length -= 255;
+        }
+        if (out == outEnd)
+            return false;
+        *out++ = static_cast<uint8_t>(length);
+        return true;
+    }
+
+    // Write a sequence. matchLength is 0 for the last sequence, which has no match.
+    static bool WriteSequence(uint8_t*& out, const uint8_t* outEnd, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength) {
+        if (out == outEnd)
+            return false;
+        size_t matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+        *out++ = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15));
+        if (literalLength >= 15 && !WriteLength(out, outEnd, literalLength - 15))
+            return false;
+        if (matchLength > 0 && matchCode >= 15 && !WriteLength(out, outEnd, matchCode - 15))
+            return false;
+        if (static_cast<size_t>(outEnd - out) < literalLength)
+            return false;
+        memcpy(out, literals, literalLength);
+        out += literalLength;
+        if (matchLength == 0)
+            return true;
+        if (outEnd - out < 2)
+            return false;
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        return true;
+    }
+
+    size_t Compress(const uint8_t* data, size_t size, uint8_t* out, size_t outCapacity) {
+        int64_t table[1 << HASH_BITS];
+        for (int64_t& entry : table)
+            entry = -1;
+
+        uint8_t* outStart = out;
+        const uint8_t* outEnd = out + outCapacity;
+        size_t anchor = 0;
+        size_t position = 0;
+        while (position + MIN_MATCH <= size) {
+            uint32_t sequence = Read32(data + position);
+            uint32_t hash = (sequence * 2654435761U) >> (32 - HASH_BITS);
+            int64_t reference = table[hash];
+            table[hash] = position;
+            if (reference < 0 || position - reference > MAX_OFFSET || Read32(data + reference) != sequence) {
+                position++;
+                continue;
+            }
+
+            size_t matchLength = MIN_MATCH;
+            while (position + matchLength < size && data[reference + matchLength] == data[position + matchLength])
+                matchLength++;
+            if (!WriteSequence(out, outEnd, data + anchor, position - anchor, position - reference, matchLength))
+                return 0;
+            position += matchLength;
+            anchor = position;
+        }
+
+        if (!WriteSequence(out, outEnd, data + anchor, size - anchor, 0, 0))
+            return 0;
+        return out - outStart;
+    }
+
+    static bool ReadLength(const uint8_t*& data, const uint8_t* end, size_t& length) {
+        uint8_t value;
+        do {
+            if (data == end)
+                return false;
+            value = *data++;
+            length += value;
+        } while (value == 255);
+        return true;
+    }
+
+    bool Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t outSize) {
+        const uint8_t* end = data + size;
+        size_t position = 0;
+        while (data < end) {
+            uint8_t token = *data++;
+            size_t literalLength = token >> 4;
+            size_t matchLength = (token & 0xF) + MIN_MATCH;
+            if (literalLength == 15 && !ReadLength(data, end, literalLength))
+                return false;
+            if ((token & 0xF) == 15 && !ReadLength(data, end, matchLength))
+                return false;
+
+            if (literalLength > static_cast<size_t>(end - data) || literalLength > outSize - position)
+                return false;
+            memcpy(out + position, data, literalLength);
+            data += literalLength;
+            position += literalLength;
+            if (data == end)
+                break; // the last sequence
+
+            if (end - data < 2)
+                return false;
+            size_t offset = data[0] | (data[1] << 8);
+            data += 2;
+            if (offset == 0 || offset > position || matchLength > outSize - position)
+                return false;
+            // the match can overlap what it is writing, so copy byte by byte
+            for (size_t i = 0; i < matchLength; i++, position++)
+                out[position] = out[position - offset];
+        }
+        return position == outSize;
+    }
+
+}